@@ -144,6 +144,19 @@ enum AddressFlags {
 
 	/* The local filename is duplicated and automatically freed. */
 	STREAM_ADDR_DUPLICATE = (1<<4),
+
+	/* For capfiles, write using O_DIRECT (bypassing the page cache). The header
+	 * is padded so packets starts at a block boundary. If the filesystem does
+	 * not support O_DIRECT regular writes is used instead. Cannot be combined
+	 * with STREAM_ADDR_FLUSH or compression (stream_create fails with
+	 * EINVAL). */
+	STREAM_ADDR_DIRECT = (1<<5),
+
+	/* For capfiles, compress packets in blocks using LZ4 or Zstandard. The file
+	 * can only be read by versions supporting the method. Cannot be combined
+	 * with STREAM_ADDR_DIRECT. */
+	STREAM_ADDR_LZ4 = (1<<6),
+	STREAM_ADDR_ZSTD = (1<<7),
 };
 
 /**
@@ -0,0 +1,179 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef CAPUTILS_COLUMNS_H
+#define CAPUTILS_COLUMNS_H
+
+#include <caputils/capture.h>
+#include <stdio.h>
+
+#ifdef CAPUTILS_EXPORT
+#pragma GCC visibility push(default)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Columnar packet export.
+ *
+ * Packet headers are decoded into batches stored as one array per field
+ * (struct of arrays) which is written as-is to a column file:
+ *
+ *   file header   magic "CAPCOL\0\1", byte order marker, number of columns
+ *   schema        name, type and width of each column
+ *   batch...      number of rows followed by each column (rows * width bytes,
+ *                 padded to a multiple of 8 bytes)
+ *   end           batch with zero rows
+ *
+ * All values are stored in host byte order (the byte order marker reads as
+ * 0x01020304 when it matches) except addresses which is kept in network byte
+ * order. Each column can be read directly into an array, e.g.
+ * numpy.frombuffer(data, dtype, count=rows).
+ */
+
+enum column_id {
+	COLUMN_TS_SEC = 0,          /* uint32: timestamp (seconds) */
+	COLUMN_TS_PSEC,             /* uint64: timestamp (picoseconds) */
+	COLUMN_LEN,                 /* uint32: packet length */
+	COLUMN_CAPLEN,              /* uint32: captured length */
+	COLUMN_NIC,                 /* char[8]: capture interface */
+	COLUMN_MAMPID,              /* char[8]: measurement point */
+	COLUMN_ETHERTYPE,           /* uint16: ethernet type (following vlan tags) */
+	COLUMN_IP_PROTO,            /* uint8: IPv4 protocol (IPv6 upper-layer protocol) or 0 */
+	COLUMN_IP_SRC,              /* uint32: IPv4 source address (network byte order) or 0 */
+	COLUMN_IP_DST,              /* uint32: IPv4 destination address (network byte order) or 0 */
+	COLUMN_IP6_SRC,             /* uint8[16]: IPv6 source address or zeroes */
+	COLUMN_IP6_DST,             /* uint8[16]: IPv6 destination address or zeroes */
+	COLUMN_SRC_PORT,            /* uint16: TCP/UDP source port or 0 */
+	COLUMN_DST_PORT,            /* uint16: TCP/UDP destination port or 0 */
+	COLUMN_TCP_FLAGS,           /* uint8: TCP flags or 0 */
+	COLUMN_TCP_SEQ,             /* uint32: TCP sequence number or 0 */
+	COLUMN_CONNECTION_ID,       /* uint32: see connection_id() */
+
+	COLUMN_NUM
+};
+
+#define COLUMN_ALL ((1U << COLUMN_NUM) - 1)
+
+struct column_batch {
+	size_t num;                 /* number of rows */
+	size_t capacity;            /* max number of rows */
+
+	uint32_t* ts_sec;
+	uint64_t* ts_psec;
+	uint32_t* len;
+	uint32_t* caplen;
+	char (*nic)[8];
+	char (*mampid)[8];
+	uint16_t* ethertype;
+	uint8_t*  ip_proto;
+	uint32_t* ip_src;
+	uint32_t* ip_dst;
+	uint8_t (*ip6_src)[16];
+	uint8_t (*ip6_dst)[16];
+	uint16_t* src_port;
+	uint16_t* dst_port;
+	uint8_t*  tcp_flags;
+	uint32_t* tcp_seq;
+	uint32_t* connection_id;
+};
+
+/**
+ * Get column from name.
+ * @return Column or -1 if no such column exists.
+ */
+int column_from_string(const char* name);
+
+/**
+ * Get name of column.
+ */
+const char* column_name(enum column_id column);
+
+/**
+ * Allocate a batch holding up to capacity rows.
+ * @return 0 if successful or ENOMEM.
+ */
+int column_batch_init(struct column_batch* batch, size_t capacity);
+void column_batch_free(struct column_batch* batch);
+
+/**
+ * Decode packet headers (using header_walk) and append a row to batch. The
+ * connection_id column is not set, see column_batch_connection_id.
+ *
+ * @return 0 if successful or ENOSPC if the batch is full.
+ */
+int column_batch_add(struct column_batch* batch, const cap_head* cp);
+
+/**
+ * Set connection_id for all rows in batch. The connection state is shared
+ * with connection_id() so batches must be passed in packet order (but they
+ * may be decoded in any order, e.g. in parallel).
+ */
+void column_batch_connection_id(struct column_batch* batch);
+
+/**
+ * Write file header and schema for columns.
+ *
+ * @param columns Bitmask of columns (1 << COLUMN_x) to write.
+ * @return 0 if successful or errno.
+ */
+int column_write_header(FILE* fp, unsigned int columns);
+
+/**
+ * Write all rows in batch (if the batch is non-empty).
+ * @return 0 if successful or errno.
+ */
+int column_write_batch(FILE* fp, const struct column_batch* batch, unsigned int columns);
+
+/**
+ * Write end marker.
+ * @return 0 if successful or errno.
+ */
+int column_write_end(FILE* fp);
+
+/**
+ * Read file header and schema.
+ *
+ * @param columns Set to bitmask of columns present in file.
+ * @return 0 if successful or error code.
+ */
+int column_read_header(FILE* fp, unsigned int* columns);
+
+/**
+ * Read next batch. The batch is grown if needed. Columns not present in the
+ * file are left unchanged.
+ *
+ * @return 0 if successful, -1 at end or error code.
+ */
+int column_read_batch(FILE* fp, struct column_batch* batch, unsigned int columns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef CAPUTILS_EXPORT
+#pragma GCC visibility pop
+#endif
+
+#endif /* CAPUTILS_COLUMNS_H */
@@ -50,6 +50,9 @@ extern "C" {
 
 typedef char CI_handle_t[8];
 
+struct prefix_set;
+struct packet_meta;
+
 enum FilterOffset {
 	OFFSET_DST_PORT = 0,
 	OFFSET_SRC_PORT,
@@ -69,6 +72,8 @@ enum FilterOffset {
 	/* Local filters (these is not used by MArCd, can be reordered) */
 	OFFSET_FRAME_MAX_DT,
 	OFFSET_FRAME_NUM,
+	OFFSET_IP_SRC_SET,
+	OFFSET_IP_DST_SET,
 };
 
 enum FilterBitmask {
@@ -94,8 +99,13 @@ enum FilterBitmask {
 	/* local filters */
 	FILTER_FRAME_MAX_DT = (1<<OFFSET_FRAME_MAX_DT),
 	FILTER_FRAME_NUM = (1<<OFFSET_FRAME_NUM),
+	FILTER_IP_SRC_SET = (1<<OFFSET_IP_SRC_SET),
+	FILTER_IP_DST_SET = (1<<OFFSET_IP_DST_SET),
 };
 
+/* maximum length of a compiled filter program (one op per test plus terminator) */
+#define FILTER_PROGRAM_MAX 24
+
 enum FilterMode {
 	FILTER_UNKNOWN = 0,
 	FILTER_AND,
@@ -150,6 +160,8 @@ struct filter {
 	/* local filters */
 	timepico frame_max_dt;             /* reject all packets after a interarrival-time is higher than specified, no more packets will be matched */
 	struct frame_num_node* frame_num;  /* reject packets based on frame number (useful to manually select packets to keep or discard) */
+	struct prefix_set* ip_src_set;     /* IP source must match any prefix in set (longest-prefix lookup) */
+	struct prefix_set* ip_dst_set;     /* IP destination must match any prefix in set */
 
 	/* BFP filter (if supported) */
 	struct bpf_insn* bpf_insn;
@@ -160,6 +172,11 @@ struct filter {
 	int frame_counter;                 /* Incrementing number for each frame */
 	timepico frame_last_ts;            /* timestamp of the previous packet */
 
+	/* compiled filter (see filter_compile) */
+	uint32_t program_index;            /* index the program was compiled for */
+	enum FilterMode program_mode;      /* mode the program was compiled for */
+	uint8_t program[FILTER_PROGRAM_MAX]; /* FilterOffset of each test in evaluation order */
+
 	/* destination */
 	uint32_t consumer;                 /* Destination Consumer */
 	uint32_t caplen;                   /* Amount of data to capture. */
@@ -239,6 +256,27 @@ void filter_endtime_set(struct filter* filter, const timepico t);
 void filter_frame_dt_set(struct filter* filter, const timepico t);
 void filter_frame_num_set(struct filter* filter, const char* str);
 
+/**
+ * Load a set of IPv4 prefixes from file (one "ADDR[/MASK]" per line, # starts a
+ * comment). Packets match if the address is covered by any prefix in the set.
+ * Invalid lines are ignored with a warning. Sets are local filters and are not
+ * included by filter_pack.
+ * @return 0 if successful or errno on errors.
+ */
+int filter_src_ip_set_load(struct filter* filter, const char* filename);
+int filter_dst_ip_set_load(struct filter* filter, const char* filename);
+
+/**
+ * Compile the filter into an ordered sequence of tests. Only the tests selected
+ * by index are evaluated, cheapest first, and evaluation stops as soon as the
+ * result is known. Headers are only parsed if a test needs them.
+ *
+ * Called by filter_from_argv and filter_unpack. filter_match recompiles
+ * automatically if index or mode has changed since so calling this is only
+ * needed to avoid the check on the first packet.
+ */
+void filter_compile(struct filter* filter);
+
 /**
  * Display a representation of the filter.
  */
@@ -252,8 +290,73 @@ void filter_print(const struct filter* filter, FILE* fp, int verbose);
  */
 int filter_match(struct filter* filter, const void* pkt, struct cap_header* head);
 
+/**
+ * Same as filter_match but using headers pre-classified by
+ * packet_meta_classify (see caputils/packet.h) instead of parsing them again.
+ * @param i Index of packet in meta.
+ */
+int filter_match_meta(struct filter* filter, const struct packet_meta* meta, size_t i);
+
+/**
+ * Get the time window packets must be within to match, i.e. what the stream
+ * can be limited to using stream_seek_time and stream_stop_time before
+ * filtering. Only possible if the start/end time is required for a match and
+ * the filter does not depend on preceding packets (frame number and frame dt).
+ * @return Bitmask of FILTER_START_TIME and FILTER_END_TIME telling which of
+ *         start and end was set.
+ */
+int filter_time_window(const struct filter* filter, timepico* start, timepico* end);
+
 int filter_close(struct filter* filter);
 
+/**
+ * Filter set: matches a packet against multiple filters in one pass. Headers
+ * are parsed once and filters are indexed by exact-match fields (ports,
+ * ip_proto and eth_type) so only candidate filters are evaluated.
+ *
+ * Filters are not copied and must remain valid while added to the set. Filters
+ * using local state (frame number and frame interarrival-time) are evaluated
+ * for every packet so their state is kept.
+ */
+struct filter_set;
+
+/**
+ * Allocate a new empty filter set.
+ * @return 0 if successful or errno on errors.
+ */
+int filter_set_init(struct filter_set** set);
+
+/**
+ * Release the set (the filters themselves are not released).
+ */
+void filter_set_free(struct filter_set* set);
+
+/**
+ * Add filter to set. filter_id is used as bit index in the match bitmap.
+ * @return 0 if successful, EEXIST if a filter with the same filter_id is
+ *         already added.
+ */
+int filter_set_add(struct filter_set* set, struct filter* filter);
+
+/**
+ * Remove filter from set.
+ * @return 0 if successful, ENOENT if there is no such filter.
+ */
+int filter_set_remove(struct filter_set* set, uint32_t filter_id);
+
+/**
+ * Number of 32-bit words required for the bitmap passed to filter_set_match.
+ */
+size_t filter_set_bitmap_size(const struct filter_set* set);
+
+/**
+ * Match a packet against all filters in the set.
+ * @param bitmap Bitmap of filter_set_bitmap_size() words. Bit N (word N/32,
+ *        bit N%32) is set if the filter with filter_id N matches.
+ * @return Number of matching filters.
+ */
+int filter_set_match(struct filter_set* set, const void* pkt, struct cap_header* head, uint32_t* bitmap);
+
 void filter_pack(struct filter* src, struct filter_packed* dst);
 void filter_unpack(struct filter_packed* src, struct filter* dst);
 
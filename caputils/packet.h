@@ -135,6 +135,16 @@ typedef unsigned int connection_id_t;
  * id (out-of-order within a CI, packets being out-of-order due to
  * arriving at different times to multiple CI is fine but reading
  * randomized packets from trace will not work.)
+ *
+ * Connections are identified by the IPv4 or IPv6 5-tuple (TCP or UDP). A
+ * connection ends when a new SYN is seen. Optionally it also ends when it has
+ * been idle for longer than the idle timeout or when the closed timeout has
+ * passed after RST or FIN in both directions (see connection_id_set_timeout).
+ * Timeouts are based on packet timestamps and disabled by default.
+ *
+ * Connections are tracked per thread, i.e. ids from different threads are
+ * independent and each thread may process its own stream. The state of a
+ * thread is released when it exits.
  */
 connection_id_t connection_id(const struct cap_header* cp);
 
@@ -143,6 +153,87 @@ connection_id_t connection_id(const struct cap_header* cp);
  */
 enum { CONNECTION_ID_NONE = 0, };
 
+/**
+ * Pre-classified packet headers.
+ *
+ * packet_meta_classify parses the ethernet, vlan, IPv4 and transport headers
+ * of a batch of packets once and stores the result as a struct of arrays
+ * (index i describes cp[i]). The *_meta functions take the parsed metadata
+ * instead of reparsing the headers.
+ */
+#define PACKET_META_MAX 64
+
+enum PacketMetaFlags {
+	PACKET_META_VLAN  = (1<<0),  /* packet is vlan tagged */
+	PACKET_META_IPV4  = (1<<1),  /* packet is IPv4, l3_offset and ip_* are valid */
+	PACKET_META_PORTS = (1<<2),  /* packet is TCP or UDP, l4_offset and ports are valid */
+};
+
+struct packet_meta {
+	size_t num;                                /* number of packets in batch */
+	const cap_head* cp[PACKET_META_MAX];
+	uint16_t flags[PACKET_META_MAX];           /* PacketMetaFlags */
+	uint16_t h_proto[PACKET_META_MAX];         /* ethernet type (following vlan tag if present) */
+	uint16_t l3_offset[PACKET_META_MAX];       /* offset of network header from cp->payload */
+	uint16_t l4_offset[PACKET_META_MAX];       /* offset of transport header from cp->payload */
+	uint8_t  ip_proto[PACKET_META_MAX];
+	uint32_t ip_src[PACKET_META_MAX];          /* network byte order */
+	uint32_t ip_dst[PACKET_META_MAX];          /* network byte order */
+	uint16_t src_port[PACKET_META_MAX];        /* host byte order */
+	uint16_t dst_port[PACKET_META_MAX];        /* host byte order */
+};
+
+/**
+ * Classify a batch of packets.
+ *
+ * @param cp Packets to classify, e.g. as returned by stream_read_batch.
+ * @param num Number of packets, at most PACKET_META_MAX packets is classified.
+ * @return Number of packets classified.
+ */
+size_t packet_meta_classify(struct packet_meta* meta, cap_head* const* cp, size_t num);
+
+/**
+ * Same as payload_size but using pre-classified headers.
+ */
+size_t payload_size_meta(enum Level level, const struct packet_meta* meta, size_t i);
+
+/**
+ * Same as connection_id but using pre-classified headers.
+ */
+connection_id_t connection_id_meta(const struct packet_meta* meta, size_t i);
+
+/**
+ * Same as connection_id but using already decoded IPv4 and transport fields.
+ *
+ * @param src Source address (network byte order).
+ * @param dst Destination address (network byte order).
+ * @param proto IP protocol.
+ * @param sport Source port (host byte order).
+ * @param dport Destination port (host byte order).
+ * @param flags TCP flags or 0 if not TCP.
+ * @param seq TCP sequence number (host byte order) or 0 if not TCP.
+ * @param ts Packet timestamp (seconds).
+ */
+connection_id_t connection_id_ipv4(uint32_t src, uint32_t dst, uint8_t proto, uint16_t sport, uint16_t dport, uint8_t flags, uint32_t seq, uint32_t ts);
+
+/**
+ * Same as connection_id_ipv4 but with IPv6 addresses (16 bytes each).
+ */
+connection_id_t connection_id_ipv6(const void* src, const void* dst, uint8_t proto, uint16_t sport, uint16_t dport, uint8_t flags, uint32_t seq, uint32_t ts);
+
+/**
+ * Set connection timeouts in seconds, 0 disables the timeout.
+ *
+ * @param idle Connections without any packets for this long are ended [default: 0].
+ * @param closed Connections are ended this long after RST or FIN in both directions [default: 0].
+ */
+void connection_id_set_timeout(unsigned int idle, unsigned int closed);
+
+/**
+ * Forget all connections (of the calling thread), ids start from 1 again.
+ */
+void connection_id_reset(void);
+
 #ifdef __cplusplus
 }
 #endif
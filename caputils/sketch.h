@@ -0,0 +1,151 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef CAPUTILS_SKETCH_H
+#define CAPUTILS_SKETCH_H
+
+#ifdef CAPUTILS_EXPORT
+#pragma GCC visibility push(default)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Streaming sketches using a fixed amount of memory regardless of the number
+ * of values added. Sketches with the same parameters can be merged, e.g. to
+ * combine sketches computed over different files or by different threads.
+ */
+
+/**
+ * Quantile sketch (DDSketch).
+ *
+ * Positive values are counted in logarithmic bins so any quantile is
+ * estimated with a bounded relative error. The number of bins is fixed and
+ * when the range of values is too wide the lowest bins are collapsed, i.e.
+ * only the accuracy of the lowest quantiles is lost. Values less than or
+ * equal to zero is counted separately (and estimated as zero).
+ */
+struct quantile_sketch {
+	double gamma;               /* bin ratio, (1 + accuracy) / (1 - accuracy) */
+	double log_gamma;
+	uint64_t* bin;
+	size_t num_bins;            /* number of bins allocated */
+	int32_t offset;             /* key of bin[0] */
+	int32_t lo, hi;             /* lowest and highest key in use (if count > zero) */
+	double last_value;          /* key of last value added (values often repeats) */
+	int32_t last_key;
+
+	uint64_t zero;              /* number of values <= 0 */
+	uint64_t count;             /* total number of values */
+	double min, max;
+	double sum;
+};
+
+/**
+ * @param accuracy Relative accuracy, e.g. 0.01 for 1%.
+ * @param num_bins Number of bins (memory usage is 8 bytes per bin). 2048 bins
+ *                 at 1% covers more than 17 orders of magnitude.
+ * @return 0 if successful, EINVAL or ENOMEM.
+ */
+int quantile_sketch_init(struct quantile_sketch* sketch, double accuracy, size_t num_bins);
+void quantile_sketch_free(struct quantile_sketch* sketch);
+
+/**
+ * Remove all values.
+ */
+void quantile_sketch_reset(struct quantile_sketch* sketch);
+
+void quantile_sketch_add(struct quantile_sketch* sketch, double value);
+
+/**
+ * Estimate quantile.
+ * @param q Quantile between 0 and 1, e.g. 0.5 for median.
+ * @return Estimated value or 0 if sketch is empty.
+ */
+double quantile_sketch_quantile(const struct quantile_sketch* sketch, double q);
+
+/**
+ * Add all values from src to dst.
+ * @return 0 if successful or EINVAL if the sketches uses different parameters.
+ */
+int quantile_sketch_merge(struct quantile_sketch* dst, const struct quantile_sketch* src);
+
+/**
+ * Cardinality sketch (HyperLogLog).
+ *
+ * Estimates the number of distinct values with a standard error of about
+ * 1.04 / sqrt(2^precision) using 2^precision bytes.
+ */
+struct cardinality_sketch {
+	unsigned int precision;
+	uint8_t* reg;               /* 2^precision registers */
+};
+
+/**
+ * @param precision Between 4 and 18, e.g. 14 for 16 KiB and 0.8% error.
+ * @return 0 if successful, EINVAL or ENOMEM.
+ */
+int cardinality_sketch_init(struct cardinality_sketch* sketch, unsigned int precision);
+void cardinality_sketch_free(struct cardinality_sketch* sketch);
+
+/**
+ * Remove all values.
+ */
+void cardinality_sketch_reset(struct cardinality_sketch* sketch);
+
+/**
+ * Add value (size bytes), it is hashed using sketch_hash.
+ */
+void cardinality_sketch_add(struct cardinality_sketch* sketch, const void* value, size_t size);
+
+/**
+ * Add value already hashed (must be a well-mixed 64-bit hash).
+ */
+void cardinality_sketch_add_hash(struct cardinality_sketch* sketch, uint64_t hash);
+
+/**
+ * Estimate number of distinct values.
+ */
+uint64_t cardinality_sketch_count(const struct cardinality_sketch* sketch);
+
+/**
+ * Add all values from src to dst.
+ * @return 0 if successful or EINVAL if the sketches uses different precision.
+ */
+int cardinality_sketch_merge(struct cardinality_sketch* dst, const struct cardinality_sketch* src);
+
+/**
+ * 64-bit hash suitable for cardinality sketches.
+ */
+uint64_t sketch_hash(const void* data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef CAPUTILS_EXPORT
+#pragma GCC visibility pop
+#endif
+
+#endif /* CAPUTILS_SKETCH_H */
@@ -58,6 +58,45 @@ typedef struct stream_stat stream_stat_t;
  */
 int stream_open(stream_t* stptr, const stream_addr_t* addr, const char* iface, size_t buffer_size);
 
+/**
+ * Open multiple streams sharing the load of one ethernet stream (using
+ * PACKET_FANOUT). Frames are distributed per destination address so each
+ * sequence domain (i.e. MP) is always handled by the same stream and ordering
+ * is preserved. Each stream is meant to be read by a separate thread, the
+ * streams are fully independent (own buffers, sequence numbers and stats).
+ * Use stream_add on each stream to add additional addresses.
+ *
+ * @param stptr Array of num stream handles.
+ * @param num Number of streams to open.
+ * @param addr Stream address to open (must be an ethernet address).
+ * @param iface Interface to listen on.
+ * @param buffer_size Buffer size in bytes (per stream), use 0 for default.
+ * @return 0 if successful or error code on errors (use caputils_error_string
+ *         to get description). ERROR_NOT_IMPLEMENTED if fanout is not supported.
+ */
+int stream_open_fanout(stream_t* stptr, size_t num, const stream_addr_t* addr, const char* iface, size_t buffer_size);
+
+/**
+ * Open a capfile as multiple streams each reading a disjoint range of the
+ * file, together covering all packets in file order (i.e. concatenating the
+ * output of stream 0, 1, .. yields the same sequence as a single stream). Each
+ * stream is meant to be read by a separate thread.
+ *
+ * The file is split into ranges of equal size which starts at the nearest
+ * following packet, located using the capfile index (see capindex) if present
+ * or else by scanning for a chain of plausible packet headers. Packet counters
+ * in the stream stats only include packets within the range.
+ *
+ * @param stptr Array of at least num stream handles.
+ * @param num Number of ranges wanted, set to the number of streams opened
+ *            which may be fewer if the file is small.
+ * @param addr Stream address to open (must be a capfile).
+ * @param buffer_size Buffer size in bytes (per stream), use 0 for default.
+ * @return 0 if successful or error code on errors (use caputils_error_string
+ *         to get description).
+ */
+int stream_open_split(stream_t* stptr, size_t* num, const stream_addr_t* addr, size_t buffer_size);
+
 /**
  * Create a new stream.
  */
@@ -163,6 +202,24 @@ int stream_copy(stream_t st, const struct cap_header* head);
  */
 int stream_read(stream_t st, cap_head** header, struct filter* filter, struct timeval* timeout);
 
+/**
+ * Read up to max matching frames from a stream in one call.
+ *
+ * The first frame is read as with stream_read (i.e. it may block according to
+ * timeout) and the remaining frames are taken from what already is buffered,
+ * so it will never block longer than stream_read would. All returned pointers
+ * remains valid until the next read from the stream.
+ *
+ * @param st Stream to read from.
+ * @param header Array of (at least) max elements to store frame headers in.
+ * @param max Maximum number of frames to read.
+ * @param count Returns the number of frames stored in header.
+ * @param filter If non-null, match frames against filter.
+ * @param timeout See select(2) for description of timeout.
+ * @return Same as stream_read. count is always zero on errors.
+ */
+int stream_read_batch(stream_t st, cap_head** header, size_t max, size_t* count, struct filter* filter, struct timeval* timeout);
+
 /**
  * Read packets until stream ends or interrupted. Apply callback on captured
  * packet.
@@ -194,6 +251,47 @@ int stream_peek(stream_t st, cap_head** header, struct filter* filter);
  */
 int stream_flush(stream_t st);
 
+/**
+ * Set durability policy for output streams (capfiles). Instead of syncing
+ * every write (see STREAM_ADDR_FLUSH) the data is synced to disk once at least
+ * bytes has been written or msec milliseconds has passed since the last sync,
+ * whichever comes first. Zero disables the respective limit (default is no
+ * explicit syncing at all).
+ * @return Zero if successful, ERROR_NOT_IMPLEMENTED if the stream does not
+ *         support it.
+ */
+int stream_set_sync_policy(stream_t st, size_t bytes, unsigned int msec);
+
+/**
+ * Skip forward to the first packet which may have a timestamp at or after t
+ * using the capfile index (see stream_index_build). If the trace is not
+ * sorted packets older than t may still follow so filtering is still needed.
+ * Never seeks backwards and any buffered packets are discarded. Skipped
+ * packets are included in the read counter (see stream_get_stat).
+ * @return Zero if successful, ENOENT if no index is available (including
+ *         streams which aren't capfiles) or another error if the index is
+ *         invalid. On errors the stream position is unchanged.
+ */
+int stream_seek_time(stream_t st, const timepico t);
+
+/**
+ * Stop reading (i.e. end of stream) as soon as all remaining packets are at
+ * or after t using the capfile index. Stops at an index entry so packets at or
+ * after t may still be returned.
+ * @return Same as stream_seek_time.
+ */
+int stream_stop_time(stream_t st, const timepico t);
+
+/**
+ * Build timestamp index for capfile, stored as FILENAME.idx. An entry is added
+ * every packets packets or seconds seconds, whichever comes first. The index
+ * is ignored if the capfile is later modified.
+ * @param packets Packets between entries, zero for default (1024).
+ * @param seconds Seconds between entries, zero for default (1).
+ * @return Zero if successful or an error code.
+ */
+int stream_index_build(const char* filename, unsigned int packets, unsigned int seconds);
+
 #ifdef __cplusplus
 }
 #endif
@@ -57,6 +57,16 @@ const char* hexdump_address(const struct ether_addr* addr);
  */
 int eth_aton(struct ether_addr* dst, const char* addr);
 
+/**
+ * Parse a non-negative decimal integer, e.g. a numeric command-line argument.
+ * Signs, trailing characters and values above max are rejected.
+ * @param max Largest accepted value.
+ * @param value Set to the parsed value if successful.
+ * @return Zero if successful, EINVAL if str is not a number or ERANGE if it is
+ *         larger than max.
+ */
+int parse_unsigned(const char* str, unsigned long max, unsigned long* value);
+
 struct ethertype {
 	const char* name;
 	uint16_t value;
@@ -0,0 +1,118 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2015 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * Compile with:
+ * gcc -Wall -pthread example/05-fanout.c $(pkg-config libcap_utils-0.7 --libs) -o 05-fanout
+ */
+
+#include "caputils/caputils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#define MAX_WORKERS 16
+
+struct worker {
+	pthread_t thread;
+	stream_t stream;
+	unsigned long packets;
+};
+
+static volatile int running = 1;
+
+static void handle_sigint(int signum){
+	running = 0;
+}
+
+static void* worker_main(void* ptr){
+	struct worker* worker = (struct worker*)ptr;
+
+	while ( running ){
+		cap_head* cp;
+		struct timeval timeout = {1, 0};
+
+		/* each worker reads from its own stream so no locking is needed */
+		int ret = stream_read(worker->stream, &cp, NULL, &timeout);
+		if ( ret == EAGAIN ){
+			continue;
+		} else if ( ret != 0 ){
+			fprintf(stderr, "stream_read() returned 0x%08X: %s\n", ret, caputils_error_string(ret));
+			break;
+		}
+
+		worker->packets++;
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv){
+	int ret;
+
+	/* validate arguments */
+	if ( argc != 4 ){
+		fprintf(stderr, "usage: %s IFACE ADDRESS WORKERS\n", argv[0]);
+		return 1;
+	}
+
+	const char* iface = argv[1];
+	const int num = atoi(argv[3]);
+	if ( num < 1 || num > MAX_WORKERS ){
+		fprintf(stderr, "WORKERS must be 1-%d\n", MAX_WORKERS);
+		return 1;
+	}
+
+	/* load ethernet address */
+	stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+	if ( (ret=stream_addr_str(&addr, argv[2], 0)) != 0 ){
+		fprintf(stderr, "%s: %s\n", argv[2], caputils_error_string(ret));
+		return 1;
+	}
+
+	/* open one stream per worker, frames are distributed across them */
+	stream_t stream[MAX_WORKERS];
+	if ( (ret=stream_open_fanout(stream, num, &addr, iface, 0)) != 0 ){
+		fprintf(stderr, "%s: %s\n", argv[2], caputils_error_string(ret));
+		return 1;
+	}
+
+	signal(SIGINT, handle_sigint);
+
+	struct worker worker[MAX_WORKERS];
+	for ( int i = 0; i < num; i++ ){
+		worker[i].stream = stream[i];
+		worker[i].packets = 0;
+		pthread_create(&worker[i].thread, NULL, worker_main, &worker[i]);
+	}
+
+	/* wait for all workers and show how the load was distributed */
+	for ( int i = 0; i < num; i++ ){
+		pthread_join(worker[i].thread, NULL);
+
+		const stream_stat_t* stat = stream_get_stat(stream[i]);
+		fprintf(stdout, "worker %d: %lu packets (%"PRIu64" received)\n", i, worker[i].packets, stat->recv);
+		stream_close(stream[i]);
+	}
+
+	return 0;
+}
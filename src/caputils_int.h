@@ -59,7 +59,32 @@ enum {
 
 	ERROR_NOT_IMPLEMENTED, /* should not normally be used but during the transition period it is useful */
 
+	/* errors related to capfile index */
+	ERROR_CAPFILE_INDEX_INVALID,
+
+	/* errors related to compressed capfiles */
+	ERROR_CAPFILE_CODEC,
+
+	/* errors related to column files */
+	ERROR_COLUMNS_INVALID,
+
 	ERROR_LAST
 };
 
+/* IPv6 header layout (avoids depending on netinet/ip6.h) */
+#define IPV6_HEADER_SIZE 40
+#define IPV6_NEXT_OFFSET 6
+#define IPV6_SRC_OFFSET  8
+#define IPV6_DST_OFFSET  24
+
+/**
+ * Locate the upper-layer header of an IPv6 packet, skipping hop-by-hop,
+ * routing and destination options headers.
+ *
+ * @param ip6 IPv6 header.
+ * @param proto Set to the protocol of the upper-layer header.
+ * @return Pointer to upper-layer header or NULL if truncated or fragmented.
+ */
+const char* ipv6_payload(const struct cap_header* cp, const char* ip6, uint8_t* proto);
+
 #endif /* CAPUTILS_INT_H */
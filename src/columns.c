@@ -0,0 +1,396 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "caputils/caputils.h"
+#include "caputils/columns.h"
+#include "caputils/packet.h"
+#include "caputils_int.h"
+#include "src/format/format.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+static const char column_magic[8] = {'C', 'A', 'P', 'C', 'O', 'L', 0, 1};
+static const uint32_t column_byte_order = 0x01020304;
+
+struct column_file_header {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t num_columns;
+} __attribute__((packed));
+
+struct column_schema {
+	char name[16];
+	uint8_t type;                /* 'u': unsigned integer, 's': fixed-size string, 'b': bytes */
+	uint8_t width;               /* bytes per row */
+	uint8_t reserved[6];
+} __attribute__((packed));
+
+struct column_desc {
+	const char* name;
+	char type;
+	unsigned int width;
+	size_t member;               /* offset of array in struct column_batch */
+};
+
+#define COLUMN(name, type, field) {name, type, sizeof(*((struct column_batch*)0)->field), offsetof(struct column_batch, field)}
+
+/* must be in the same order as enum column_id */
+static const struct column_desc column_desc[COLUMN_NUM] = {
+	COLUMN("ts_sec",        'u', ts_sec),
+	COLUMN("ts_psec",       'u', ts_psec),
+	COLUMN("len",           'u', len),
+	COLUMN("caplen",        'u', caplen),
+	COLUMN("nic",           's', nic),
+	COLUMN("mampid",        's', mampid),
+	COLUMN("ethertype",     'u', ethertype),
+	COLUMN("ip_proto",      'u', ip_proto),
+	COLUMN("ip_src",        'u', ip_src),
+	COLUMN("ip_dst",        'u', ip_dst),
+	COLUMN("ip6_src",       'b', ip6_src),
+	COLUMN("ip6_dst",       'b', ip6_dst),
+	COLUMN("src_port",      'u', src_port),
+	COLUMN("dst_port",      'u', dst_port),
+	COLUMN("tcp_flags",     'u', tcp_flags),
+	COLUMN("tcp_seq",       'u', tcp_seq),
+	COLUMN("connection_id", 'u', connection_id),
+};
+
+/* columns are padded so each starts at an 8 byte boundary */
+#define COLUMN_ALIGN 8
+
+static void** column_data(struct column_batch* batch, unsigned int column){
+	return (void**)((char*)batch + column_desc[column].member);
+}
+
+static const void* column_cdata(const struct column_batch* batch, unsigned int column){
+	return *(void* const*)((const char*)batch + column_desc[column].member);
+}
+
+int column_from_string(const char* name){
+	for ( unsigned int i = 0; i < COLUMN_NUM; i++ ){
+		if ( strcmp(name, column_desc[i].name) == 0 ){
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char* column_name(enum column_id column){
+	if ( column >= COLUMN_NUM ){
+		return NULL;
+	}
+	return column_desc[column].name;
+}
+
+static int column_batch_resize(struct column_batch* batch, size_t capacity){
+	for ( unsigned int i = 0; i < COLUMN_NUM; i++ ){
+		void** data = column_data(batch, i);
+		void* tmp = realloc(*data, capacity * column_desc[i].width);
+		if ( !tmp ){
+			return ENOMEM;
+		}
+		*data = tmp;
+	}
+	batch->capacity = capacity;
+	return 0;
+}
+
+int column_batch_init(struct column_batch* batch, size_t capacity){
+	memset(batch, 0, sizeof(struct column_batch));
+	if ( column_batch_resize(batch, capacity) != 0 ){
+		column_batch_free(batch);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+void column_batch_free(struct column_batch* batch){
+	for ( unsigned int i = 0; i < COLUMN_NUM; i++ ){
+		void** data = column_data(batch, i);
+		free(*data);
+		*data = NULL;
+	}
+	batch->num = 0;
+	batch->capacity = 0;
+}
+
+static inline uint16_t load_be16(const char* ptr){
+	uint16_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return ntohs(v);
+}
+
+static inline uint32_t load_be32(const char* ptr){
+	uint32_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return ntohl(v);
+}
+
+/**
+ * Decode transport fields. Fields are read the same way as connection_id()
+ * does so connection ids match.
+ */
+static void decode_transport(struct column_batch* batch, size_t i, const cap_head* cp, uint8_t proto, const char* l4){
+	const char* end = cp->payload + cp->caplen;
+
+	batch->ip_proto[i] = proto;
+	if ( !(proto == IPPROTO_TCP || proto == IPPROTO_UDP) || l4 + 4 > end ){
+		return;
+	}
+
+	batch->src_port[i] = load_be16(l4);
+	batch->dst_port[i] = load_be16(l4 + 2);
+	batch->connection_id[i] = 1; /* marks row as having a connection, see column_batch_connection_id */
+
+	if ( proto == IPPROTO_TCP && l4 + 14 <= end ){
+		batch->tcp_seq[i] = load_be32(l4 + 4);
+		batch->tcp_flags[i] = (uint8_t)l4[13];
+	}
+}
+
+static void decode_ipv4(struct column_batch* batch, size_t i, const cap_head* cp, const struct ip* ip){
+	batch->ip_src[i] = ip->ip_src.s_addr;
+	batch->ip_dst[i] = ip->ip_dst.s_addr;
+	decode_transport(batch, i, cp, ip->ip_p, (const char*)ip + 4*ip->ip_hl);
+}
+
+static void decode_ipv6(struct column_batch* batch, size_t i, const cap_head* cp, const char* ip6){
+	if ( limited_caplen(cp, ip6, IPV6_HEADER_SIZE) ){
+		return;
+	}
+
+	memcpy(batch->ip6_src[i], ip6 + IPV6_SRC_OFFSET, sizeof(batch->ip6_src[i]));
+	memcpy(batch->ip6_dst[i], ip6 + IPV6_DST_OFFSET, sizeof(batch->ip6_dst[i]));
+
+	uint8_t proto;
+	const char* l4 = ipv6_payload(cp, ip6, &proto);
+	if ( l4 ){
+		decode_transport(batch, i, cp, proto, l4);
+	}
+}
+
+int column_batch_add(struct column_batch* batch, const cap_head* cp){
+	if ( batch->num == batch->capacity ){
+		return ENOSPC;
+	}
+
+	const size_t i = batch->num++;
+	batch->ts_sec[i] = cp->ts.tv_sec;
+	batch->ts_psec[i] = cp->ts.tv_psec;
+	batch->len[i] = cp->len;
+	batch->caplen[i] = cp->caplen;
+	memcpy(batch->nic[i], cp->nic, sizeof(batch->nic[i]));
+	memcpy(batch->mampid[i], cp->mampid, sizeof(batch->mampid[i]));
+	batch->ethertype[i] = 0;
+	batch->ip_proto[i] = 0;
+	batch->ip_src[i] = 0;
+	batch->ip_dst[i] = 0;
+	batch->src_port[i] = 0;
+	batch->dst_port[i] = 0;
+	memset(batch->ip6_src[i], 0, sizeof(batch->ip6_src[i]));
+	memset(batch->ip6_dst[i], 0, sizeof(batch->ip6_dst[i]));
+	batch->tcp_flags[i] = 0;
+	batch->tcp_seq[i] = 0;
+	batch->connection_id[i] = CONNECTION_ID_NONE;
+
+	/* walk link layer headers until the network layer is found, only IPv4 and
+	 * IPv6 directly following ethernet or vlan is decoded (tunneled packets
+	 * are identified by the outermost header). The transport header is read
+	 * directly as all fields needed are at fixed offsets. */
+	struct header_chunk header;
+	header_init(&header, cp, 0);
+	enum caputils_protocol_type prev = PROTOCOL_UNKNOWN;
+	while ( header_walk(&header) && !header.truncated ){
+		const enum caputils_protocol_type type = header.protocol->type;
+		if ( type == PROTOCOL_ETHERNET ){
+			batch->ethertype[i] = load_be16(header.ptr + 12);
+		} else if ( type == PROTOCOL_VLAN ){
+			batch->ethertype[i] = load_be16(header.ptr + 2);
+		} else {
+			if ( prev == PROTOCOL_ETHERNET || prev == PROTOCOL_VLAN ){
+				if ( type == PROTOCOL_IPV4 ){
+					decode_ipv4(batch, i, cp, header.ip);
+				} else if ( type == PROTOCOL_IPV6 ){
+					decode_ipv6(batch, i, cp, header.ptr);
+				}
+			}
+			break;
+		}
+		prev = type;
+	}
+
+	return 0;
+}
+
+void column_batch_connection_id(struct column_batch* batch){
+	for ( size_t i = 0; i < batch->num; i++ ){
+		if ( batch->connection_id[i] == CONNECTION_ID_NONE ){
+			continue;
+		}
+
+		if ( batch->ethertype[i] == ETHERTYPE_IPV6 ){
+			batch->connection_id[i] = connection_id_ipv6(batch->ip6_src[i], batch->ip6_dst[i], batch->ip_proto[i], batch->src_port[i], batch->dst_port[i], batch->tcp_flags[i], batch->tcp_seq[i], batch->ts_sec[i]);
+		} else {
+			batch->connection_id[i] = connection_id_ipv4(batch->ip_src[i], batch->ip_dst[i], batch->ip_proto[i], batch->src_port[i], batch->dst_port[i], batch->tcp_flags[i], batch->tcp_seq[i], batch->ts_sec[i]);
+		}
+	}
+}
+
+static unsigned int column_count(unsigned int columns){
+	unsigned int n = 0;
+	for ( unsigned int i = 0; i < COLUMN_NUM; i++ ){
+		if ( columns & (1U << i) ) n++;
+	}
+	return n;
+}
+
+static size_t column_padding(size_t bytes){
+	return (COLUMN_ALIGN - bytes % COLUMN_ALIGN) % COLUMN_ALIGN;
+}
+
+int column_write_header(FILE* fp, unsigned int columns){
+	struct column_file_header header;
+	memcpy(header.magic, column_magic, sizeof(column_magic));
+	header.byte_order = column_byte_order;
+	header.num_columns = column_count(columns & COLUMN_ALL);
+	if ( fwrite(&header, sizeof(header), 1, fp) != 1 ){
+		return errno;
+	}
+
+	for ( unsigned int i = 0; i < COLUMN_NUM; i++ ){
+		if ( !(columns & (1U << i)) ) continue;
+
+		struct column_schema schema;
+		memset(&schema, 0, sizeof(schema));
+		/* zero-padded, not necessarily terminated if the name fills the field */
+		memcpy(schema.name, column_desc[i].name, strnlen(column_desc[i].name, sizeof(schema.name)));
+		schema.type = column_desc[i].type;
+		schema.width = column_desc[i].width;
+		if ( fwrite(&schema, sizeof(schema), 1, fp) != 1 ){
+			return errno;
+		}
+	}
+
+	return 0;
+}
+
+int column_write_batch(FILE* fp, const struct column_batch* batch, unsigned int columns){
+	static const char zero[COLUMN_ALIGN] = {0,};
+
+	if ( batch->num == 0 ){
+		return 0;
+	}
+
+	const uint64_t rows = batch->num;
+	if ( fwrite(&rows, sizeof(rows), 1, fp) != 1 ){
+		return errno;
+	}
+
+	for ( unsigned int i = 0; i < COLUMN_NUM; i++ ){
+		if ( !(columns & (1U << i)) ) continue;
+
+		const size_t bytes = batch->num * column_desc[i].width;
+		const size_t padding = column_padding(bytes);
+		if ( fwrite(column_cdata(batch, i), 1, bytes, fp) != bytes ||
+		     fwrite(zero, 1, padding, fp) != padding ){
+			return errno;
+		}
+	}
+
+	return 0;
+}
+
+int column_write_end(FILE* fp){
+	const uint64_t rows = 0;
+	if ( fwrite(&rows, sizeof(rows), 1, fp) != 1 ){
+		return errno;
+	}
+	return 0;
+}
+
+int column_read_header(FILE* fp, unsigned int* columns){
+	struct column_file_header header;
+	if ( fread(&header, sizeof(header), 1, fp) != 1 ||
+	     memcmp(header.magic, column_magic, sizeof(column_magic)) != 0 ||
+	     header.byte_order != column_byte_order ||
+	     header.num_columns > COLUMN_NUM ){
+		return ferror(fp) ? errno : ERROR_COLUMNS_INVALID;
+	}
+
+	/* columns are always stored in the order of enum column_id */
+	*columns = 0;
+	int prev = -1;
+	for ( unsigned int n = 0; n < header.num_columns; n++ ){
+		struct column_schema schema;
+		if ( fread(&schema, sizeof(schema), 1, fp) != 1 ){
+			return ferror(fp) ? errno : ERROR_COLUMNS_INVALID;
+		}
+		schema.name[sizeof(schema.name)-1] = 0;
+
+		const int i = column_from_string(schema.name);
+		if ( i <= prev || schema.type != column_desc[i].type || schema.width != column_desc[i].width ){
+			return ERROR_COLUMNS_INVALID;
+		}
+
+		*columns |= 1U << i;
+		prev = i;
+	}
+
+	return 0;
+}
+
+int column_read_batch(FILE* fp, struct column_batch* batch, unsigned int columns){
+	uint64_t rows;
+	if ( fread(&rows, sizeof(rows), 1, fp) != 1 ){
+		return ferror(fp) ? errno : ERROR_COLUMNS_INVALID;
+	}
+
+	if ( rows == 0 ){
+		return -1;
+	}
+
+	if ( rows > batch->capacity ){
+		int ret;
+		if ( (ret=column_batch_resize(batch, rows)) != 0 ){
+			return ret;
+		}
+	}
+
+	for ( unsigned int i = 0; i < COLUMN_NUM; i++ ){
+		if ( !(columns & (1U << i)) ) continue;
+
+		const size_t bytes = rows * column_desc[i].width;
+		char padding[COLUMN_ALIGN];
+		if ( fread(*column_data(batch, i), 1, bytes, fp) != bytes ||
+		     fread(padding, 1, column_padding(bytes), fp) != column_padding(bytes) ){
+			return ferror(fp) ? errno : ERROR_COLUMNS_INVALID;
+		}
+	}
+
+	batch->num = rows;
+	return 0;
+}
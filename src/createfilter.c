@@ -24,6 +24,7 @@
 #include "caputils/caputils.h"
 #include "caputils/picotime.h"
 #include "caputils_int.h"
+#include "filter.h"
 
 #include <unistd.h>
 #include <ctype.h>
@@ -77,6 +78,8 @@ static struct option options[]= {
 	/* local-only filters */
 	{"frame-max-dt", required_argument, 0, FILTER_FRAME_MAX_DT},
 	{"frame-num",    required_argument, 0, FILTER_FRAME_NUM},
+	{"ip.src-set",   required_argument, 0, FILTER_IP_SRC_SET},
+	{"ip.dst-set",   required_argument, 0, FILTER_IP_DST_SET},
 
 	{"bpf",       required_argument, 0, PARAM_BPF | PARAM_BIT},
 	{0, 0, 0, 0}
@@ -197,6 +200,71 @@ static int parse_inet_addr(const char* str, struct in_addr* addr, struct in_addr
 	return 1;
 }
 
+/**
+ * Load IPv4 prefixes from file, one ADDR[/MASK] per line. Empty lines and
+ * comments (#) are ignored and invalid lines are ignored with a warning.
+ * Replaces any previous set in dst.
+ * @return 0 if successful or errno on errors.
+ */
+static int load_prefix_set(struct prefix_set** dst, const char* filename, const char* flag){
+	FILE* fp = fopen(filename, "r");
+	if ( !fp ){
+		return errno;
+	}
+
+	struct prefix_set* set = prefix_set_alloc(filename);
+	if ( !set ){
+		fclose(fp);
+		return ENOMEM;
+	}
+
+	char line[256];
+	int lineno = 0;
+	int ret = 0;
+	while ( ret == 0 && fgets(line, sizeof(line), fp) ){
+		lineno++;
+
+		/* strip comments and surrounding whitespace */
+		char* comment = strchr(line, '#');
+		if ( comment ){
+			*comment = 0;
+		}
+		char* begin = line;
+		while ( isspace(*begin) ) begin++;
+		char* end = begin + strlen(begin);
+		while ( end > begin && isspace(end[-1]) ) *--end = 0;
+		if ( *begin == 0 ){
+			continue;
+		}
+
+		struct in_addr addr;
+		struct in_addr mask;
+		if ( !parse_inet_addr(begin, &addr, &mask, flag) ){
+			continue;
+		}
+
+		/* only prefixes can be stored, i.e. mask must be contiguous */
+		const uint32_t host_mask = ntohl(mask.s_addr);
+		if ( (~host_mask & (~host_mask + 1)) != 0 ){
+			fprintf(stderr, "%s:%d: non-contiguous mask passed to --%s: %s. Ignoring\n", filename, lineno, flag, begin);
+			continue;
+		}
+
+		ret = prefix_set_add(set, ntohl(addr.s_addr), __builtin_popcount(host_mask));
+	}
+
+	fclose(fp);
+
+	if ( ret != 0 ){
+		prefix_set_free(set);
+		return ret;
+	}
+
+	prefix_set_free(*dst);
+	*dst = set;
+	return 0;
+}
+
 static int parse_port(const char* src, uint16_t* port, uint16_t* mask, const char* flag){
 	*mask = 0xFFFF;
 
@@ -429,6 +497,10 @@ void filter_from_argv_usage(){
 	       "      --ip.proto=STRING         Filter on ip protocol (TCP, UDP, ICMP).\n"
 	       "      --ip.src=ADDR[/MASK]      Filter on source ip address, dotted decimal.\n"
 	       "      --ip.dst=ADDR[/MASK]      Filter on destination ip address, dotted decimal.\n"
+	       "      --ip.src-set=FILE         Filter on source ip address matching any prefix\n"
+	       "                                (ADDR[/MASK], one per line) listed in FILE.\n"
+	       "      --ip.dst-set=FILE         Filter on destination ip address matching any\n"
+	       "                                prefix listed in FILE.\n"
 	       "      --tp.sport=PORT[/MASK]    Filter on source portnumber.\n"
 	       "      --tp.dport=PORT[/MASK]    Filter on destination portnumber.\n"
 	       "      --tp.port=PORT[/MASK]     Filter or source or destination portnumber (if\n"
@@ -615,6 +687,16 @@ int filter_from_argv(int* argcptr, char** argv, struct filter* filter){
 			parse_frame_range(optarg, filter);
 			break;
 
+		case FILTER_IP_SRC_SET:
+		case FILTER_IP_DST_SET:
+			if ( (ret=load_prefix_set(bitmask == FILTER_IP_SRC_SET ? &filter->ip_src_set : &filter->ip_dst_set, optarg, options[index].name)) != 0 ){
+				if ( filter_from_argv_opterr ){
+					fprintf(stderr, "%s: failed to load --%s `%s': %s\n", argv[0], options[index].name, optarg, strerror(ret));
+				}
+				continue;
+			}
+			break;
+
 		default:
 			fprintf(stderr, "op: %d\n", op);
 		}
@@ -627,6 +709,8 @@ int filter_from_argv(int* argcptr, char** argv, struct filter* filter){
 	opterr = opterr_save;
 	optind = optind_save;
 
+	filter_compile(filter);
+
 	/* save argc */
 	*argcptr = argc;
 	return ret;
@@ -649,6 +733,11 @@ int filter_close(struct filter* filter){
 		cur = next;
 	}
 
+	prefix_set_free(filter->ip_src_set);
+	prefix_set_free(filter->ip_dst_set);
+	filter->ip_src_set = NULL;
+	filter->ip_dst_set = NULL;
+
 	return 0;
 }
 
@@ -727,6 +816,22 @@ void filter_dst_ip_aton(struct filter* filter, const char* str){
 	parse_inet_addr(str, &filter->ip_dst, &filter->ip_dst_mask, "ip.dst");
 }
 
+int filter_src_ip_set_load(struct filter* filter, const char* filename){
+	const int ret = load_prefix_set(&filter->ip_src_set, filename, "ip.src-set");
+	if ( ret == 0 ){
+		filter->index |= FILTER_IP_SRC_SET;
+	}
+	return ret;
+}
+
+int filter_dst_ip_set_load(struct filter* filter, const char* filename){
+	const int ret = load_prefix_set(&filter->ip_dst_set, filename, "ip.dst-set");
+	if ( ret == 0 ){
+		filter->index |= FILTER_IP_DST_SET;
+	}
+	return ret;
+}
+
 void filter_mampid_set(struct filter* filter, const char* mampid){
 	filter->index |= FILTER_MAMPID;
 	strncpy(filter->mampid, mampid, 8);
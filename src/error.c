@@ -40,6 +40,12 @@ static const char* errstr[ERROR_LAST - ERROR_FIRST] = {
 	/* ERROR_BUFFER_MULTIPLE */   "buffer size must be a multiple of MTU",
 
 	/* ERROR_NOT_IMPLEMENTED */   "feature not implemented.",
+
+	/* ERROR_CAPFILE_INDEX_INVALID */ "capfile index is invalid or does not match capfile.",
+
+	/* ERROR_CAPFILE_CODEC */   "capfile compression method not supported by this build.",
+
+	/* ERROR_COLUMNS_INVALID */ "not a valid column file or file is truncated.",
 };
 
 const char* caputils_error_string(int code){
@@ -24,6 +24,7 @@
 #include "caputils/filter.h"
 #include "caputils/packet.h"
 #include "caputils_int.h"
+#include "filter.h"
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -51,14 +52,12 @@
  * Match ethernet address.
  */
 static int matchEth(const struct ether_addr* desired, const struct ether_addr* mask, const uint8_t net[ETH_ALEN]){
-	for ( int i=0; i < ETH_ALEN; i++ ){
-		uint8_t t = (net[i] & mask->ether_addr_octet[i]);
-		if( t != desired->ether_addr_octet[i] ){
-			return 0;
-		}
-	}
-
-	return 1;
+	/* compare all octets at once */
+	uint64_t d = 0, m = 0, n = 0;
+	memcpy(&d, desired, ETH_ALEN);
+	memcpy(&m, mask, ETH_ALEN);
+	memcpy(&n, net, ETH_ALEN);
+	return (n & m) == d;
 }
 
 static const struct ether_vlan_header* find_ether_vlan_header(const struct ethhdr* ether, uint16_t* h_proto){
@@ -71,8 +70,8 @@ static const struct ether_vlan_header* find_ether_vlan_header(const struct ethhd
 }
 
 static const void* find_ipproto_header(const void* pkt, const struct ethhdr* ether, const struct ip* ip){
-	const size_t vlan_offset = ntohs(ether->h_proto) == 0x8100 ? 4 : 0; /* vlan tag is 4 octets */
-	return pkt + sizeof(struct ethhdr) + vlan_offset + 4*(ip->ip_hl);
+	/* ip is located by find_ipv4_header so any vlan tags are already accounted for */
+	return (const char*)ip + 4*(ip->ip_hl);
 }
 
 const struct tcphdr* find_tcp_header(const void* pkt, const struct ethhdr* ether, const struct ip* ip, uint16_t* src, uint16_t* dst){
@@ -132,6 +131,14 @@ int FILTER filter_ip_dst(const struct filter* filter, const struct ip* ip){
 	return (filter->index & FILTER_IP_DST) && (ip && (ip->ip_dst.s_addr & filter->ip_dst_mask.s_addr) == filter->ip_dst.s_addr);
 }
 
+int FILTER filter_ip_src_set(const struct filter* filter, const struct ip* ip){
+	return (filter->index & FILTER_IP_SRC_SET) && (ip && filter->ip_src_set && prefix_set_lookup(filter->ip_src_set, ntohl(ip->ip_src.s_addr)));
+}
+
+int FILTER filter_ip_dst_set(const struct filter* filter, const struct ip* ip){
+	return (filter->index & FILTER_IP_DST_SET) && (ip && filter->ip_dst_set && prefix_set_lookup(filter->ip_dst_set, ntohl(ip->ip_dst.s_addr)));
+}
+
 int FILTER filter_src_port(const struct filter* filter, uint16_t port){
 	return (filter->index & FILTER_SRC_PORT) && (filter->src_port == (port & filter->src_port_mask));
 }
@@ -189,46 +196,150 @@ int filter_frame_num(const struct filter* filter){
 	return 1;
 }
 
-static int filter_core(const struct filter* filter, const void* pkt, struct cap_header* head){
-	const struct ethhdr* ether = (const struct ethhdr*)pkt;
-	uint16_t h_proto = ntohs(ether->h_proto); /* may be overwritten by find_ether_vlan_header */
-	uint16_t src_port = 0; /* set by find_{tcp,udp}_header */
-	uint16_t dst_port = 0; /* set by find_{tcp,udp}_header */
-
-	const struct ether_vlan_header* vlan = find_ether_vlan_header(ether, &h_proto);
-	const struct ip* ip = find_ipv4_header(ether, NULL);
-	find_tcp_header(pkt, ether, ip, &src_port, &dst_port);
-	find_udp_header(pkt, ether, ip, &src_port, &dst_port);
-
-	unsigned int match = 0;
-
-	/* base tests */
-	match |= filter_dst_port(filter, dst_port)       << OFFSET_DST_PORT;    /* Transport dest port */
-	match |= filter_src_port(filter, src_port)       << OFFSET_SRC_PORT;    /* Transport source port */
-	match |= filter_ip_dst(filter, ip)               << OFFSET_IP_DST;      /* IP destination address */
-	match |= filter_ip_src(filter, ip)               << OFFSET_IP_SRC;      /* IP source address */
-	match |= filter_ip_proto(filter, ip)             << OFFSET_IP_PROTO;    /* IP protocol */
-	match |= filter_eth_dst(filter, ether)           << OFFSET_ETH_DST;     /* Ethernet destination */
-	match |= filter_eth_src(filter, ether)           << OFFSET_ETH_SRC;     /* Ethernet source */
-	match |= filter_h_proto(filter, h_proto)         << OFFSET_ETH_TYPE;    /* Ethernet type */
-	match |= filter_vlan_tci(filter, vlan)           << OFFSET_VLAN;        /* VLAN TCI (Tag Control Information) */
-	match |= filter_iface(filter, head->nic)         << OFFSET_IFACE;       /* Capture Interface (iface) */
-
-	/* 0.7 extensions */
-	match |= filter_mampid(filter, head->mampid)     << OFFSET_MAMPID;      /* MAMPid */
-	match |= filter_end_time(filter, &head->ts)      << OFFSET_END_TIME;    /* End time vs packet timestamp */
-	match |= filter_start_time(filter, &head->ts)    << OFFSET_START_TIME;  /* Start time vs packet timestamp */
-	match |= filter_port(filter, src_port, dst_port) << OFFSET_PORT;        /* Transport source or dest port */
-
-	/* local tests */
-	match |= filter_frame_dt(filter, head->ts)       << OFFSET_FRAME_MAX_DT;
-	match |= filter_frame_num(filter)                << OFFSET_FRAME_NUM;
-
-	switch ( filter->mode ){
-	case FILTER_AND: return match == filter->index;
-	case FILTER_OR:  return match > 0;
+/**
+ * Order in which tests are evaluated: tests only using the capture header
+ * first, followed by tests requiring the ethernet, ip and transport headers.
+ */
+static const enum FilterOffset test_order[] = {
+	OFFSET_FRAME_NUM,
+	OFFSET_FRAME_MAX_DT,
+	OFFSET_START_TIME,
+	OFFSET_END_TIME,
+	OFFSET_MAMPID,
+	OFFSET_IFACE,
+	OFFSET_ETH_TYPE,
+	OFFSET_ETH_DST,
+	OFFSET_ETH_SRC,
+	OFFSET_VLAN,
+	OFFSET_IP_PROTO,
+	OFFSET_IP_SRC,
+	OFFSET_IP_DST,
+	OFFSET_IP_SRC_SET,
+	OFFSET_IP_DST_SET,
+	OFFSET_DST_PORT,
+	OFFSET_SRC_PORT,
+	OFFSET_PORT,
+};
+
+#define PROGRAM_END   0xff /* end of program */
+#define PROGRAM_FALSE 0xfe /* never matches (AND filter with unknown tests) */
+
+void filter_compile(struct filter* filter){
+	const size_t num_tests = sizeof(test_order) / sizeof(test_order[0]);
+	uint32_t known = 0;
+	uint8_t* op = filter->program;
+
+	for ( size_t i = 0; i < num_tests; i++ ){
+		const uint32_t bit = 1 << test_order[i];
+		known |= bit;
+		if ( filter->index & bit ){
+			*op++ = test_order[i];
+		}
+	}
+
+	/* when all tests must match a test which cannot be performed never matches */
+	if ( filter->mode == FILTER_AND && (filter->index & ~known) ){
+		op = filter->program;
+		*op++ = PROGRAM_FALSE;
+	}
+
+	*op = PROGRAM_END;
+	filter->program_index = filter->index;
+	filter->program_mode = filter->mode;
+}
+
+void filter_context_init(struct filter_context* cx, const void* pkt, const struct cap_header* head){
+	memset(cx, 0, sizeof(struct filter_context));
+	cx->pkt = pkt;
+	cx->ether = (const struct ethhdr*)pkt;
+	cx->head = head;
+}
+
+void filter_context_meta(struct filter_context* cx, const struct packet_meta* meta, size_t i){
+	const struct cap_header* head = meta->cp[i];
+	const uint16_t flags = meta->flags[i];
+	filter_context_init(cx, head->payload, head);
+
+	cx->h_proto = meta->h_proto[i];
+	cx->vlan = (flags & PACKET_META_VLAN) ? (const struct ether_vlan_header*)cx->pkt : NULL;
+	cx->have_vlan = 1;
+
+	cx->ip = (flags & PACKET_META_IPV4) ? (const struct ip*)(head->payload + meta->l3_offset[i]) : NULL;
+	cx->have_ip = 1;
+
+	cx->src_port = meta->src_port[i];
+	cx->dst_port = meta->dst_port[i];
+	cx->have_ports = 1;
+}
+
+void filter_context_vlan(struct filter_context* cx){
+	if ( cx->have_vlan ) return;
+	cx->h_proto = ntohs(cx->ether->h_proto); /* may be overwritten by find_ether_vlan_header */
+	cx->vlan = find_ether_vlan_header(cx->ether, &cx->h_proto);
+	cx->have_vlan = 1;
+}
+
+const struct ip* filter_context_ip(struct filter_context* cx){
+	if ( !cx->have_ip ){
+		cx->ip = find_ipv4_header(cx->ether, NULL);
+		cx->have_ip = 1;
+	}
+	return cx->ip;
+}
+
+void filter_context_ports(struct filter_context* cx){
+	if ( cx->have_ports ) return;
+	const struct ip* ip = filter_context_ip(cx);
+	cx->src_port = 0; /* set by find_{tcp,udp}_header */
+	cx->dst_port = 0; /* set by find_{tcp,udp}_header */
+	find_tcp_header(cx->pkt, cx->ether, ip, &cx->src_port, &cx->dst_port);
+	find_udp_header(cx->pkt, cx->ether, ip, &cx->src_port, &cx->dst_port);
+	cx->have_ports = 1;
+}
+
+static int filter_test(const struct filter* filter, enum FilterOffset test, struct filter_context* cx){
+	switch ( test ){
+	case OFFSET_DST_PORT:     filter_context_ports(cx); return filter_dst_port(filter, cx->dst_port);       /* Transport dest port */
+	case OFFSET_SRC_PORT:     filter_context_ports(cx); return filter_src_port(filter, cx->src_port);       /* Transport source port */
+	case OFFSET_PORT:         filter_context_ports(cx); return filter_port(filter, cx->src_port, cx->dst_port); /* Transport source or dest port */
+	case OFFSET_IP_DST:       return filter_ip_dst(filter, filter_context_ip(cx));                         /* IP destination address */
+	case OFFSET_IP_SRC:       return filter_ip_src(filter, filter_context_ip(cx));                         /* IP source address */
+	case OFFSET_IP_SRC_SET:   return filter_ip_src_set(filter, filter_context_ip(cx));                     /* IP source in prefix set */
+	case OFFSET_IP_DST_SET:   return filter_ip_dst_set(filter, filter_context_ip(cx));                     /* IP destination in prefix set */
+	case OFFSET_IP_PROTO:     return filter_ip_proto(filter, filter_context_ip(cx));                       /* IP protocol */
+	case OFFSET_ETH_DST:      return filter_eth_dst(filter, cx->ether);                           /* Ethernet destination */
+	case OFFSET_ETH_SRC:      return filter_eth_src(filter, cx->ether);                           /* Ethernet source */
+	case OFFSET_ETH_TYPE:     filter_context_vlan(cx); return filter_h_proto(filter, cx->h_proto);         /* Ethernet type */
+	case OFFSET_VLAN:         filter_context_vlan(cx); return filter_vlan_tci(filter, cx->vlan);           /* VLAN TCI (Tag Control Information) */
+	case OFFSET_IFACE:        return filter_iface(filter, cx->head->nic);                         /* Capture Interface (iface) */
+	case OFFSET_MAMPID:       return filter_mampid(filter, cx->head->mampid);                     /* MAMPid */
+	case OFFSET_END_TIME:     return filter_end_time(filter, &cx->head->ts);                      /* End time vs packet timestamp */
+	case OFFSET_START_TIME:   return filter_start_time(filter, &cx->head->ts);                    /* Start time vs packet timestamp */
+	case OFFSET_FRAME_MAX_DT: return filter_frame_dt(filter, cx->head->ts);
+	case OFFSET_FRAME_NUM:    return filter_frame_num(filter);
+	}
+	return 0;
+}
+
+static int filter_core(const struct filter* filter, struct filter_context* cx){
+	/* AND stops at the first failed test, OR at the first successful test */
+	int stop_on;
+	switch ( filter->program_mode ){
+	case FILTER_AND: stop_on = 0; break;
+	case FILTER_OR:  stop_on = 1; break;
 	default: fprintf(stderr, "invalid filter mode\n"); abort();
 	}
+
+	for ( const uint8_t* op = filter->program; *op != PROGRAM_END; op++ ){
+		if ( *op == PROGRAM_FALSE ){
+			return 0;
+		}
+		if ( (filter_test(filter, (enum FilterOffset)*op, cx) != 0) == stop_on ){
+			return stop_on;
+		}
+	}
+
+	return !stop_on;
 }
 
 int filter_match(struct filter* filter, const void* pkt, struct cap_header* head){
@@ -236,13 +347,52 @@ int filter_match(struct filter* filter, const void* pkt, struct cap_header* head
 	assert(pkt);
 	assert(head);
 
+	struct filter_context cx;
+	filter_context_init(&cx, pkt, head);
+	return filter_match_context(filter, &cx);
+}
+
+int filter_match_meta(struct filter* filter, const struct packet_meta* meta, size_t i){
+	assert(filter);
+	assert(meta);
+	assert(i < meta->num);
+
+	struct filter_context cx;
+	filter_context_meta(&cx, meta, i);
+	return filter_match_context(filter, &cx);
+}
+
+int filter_time_window(const struct filter* filter, timepico* start, timepico* end){
+	/* frame filters depend on all preceding packets */
+	if ( filter->index & (FILTER_FRAME_NUM | FILTER_FRAME_MAX_DT) ){
+		return 0;
+	}
+
+	/* with OR only a single test is required */
+	const uint32_t required = filter->mode == FILTER_AND ? filter->index : (filter->index & (filter->index - 1)) == 0 ? filter->index : 0;
+	const int window = required & (FILTER_START_TIME | FILTER_END_TIME);
+
+	if ( window & FILTER_START_TIME ) *start = filter->starttime;
+	if ( window & FILTER_END_TIME ) *end = filter->endtime;
+	return window;
+}
+
+int filter_match_context(struct filter* filter, struct filter_context* cx){
+	const void* pkt = cx->pkt;
+	const struct cap_header* head = cx->head;
+
+	/* recompile if filter has been modified since */
+	if ( filter->program_index != filter->index || filter->program_mode != filter->mode ){
+		filter_compile(filter);
+	}
+
 	/* exceptions for first packet */
 	if ( filter->first ){
 		filter->frame_last_ts = head->ts;
 		filter->first = 0;
 	}
 
-	const int core_match = filter->index == 0 || filter_core(filter, pkt, head);
+	const int core_match = filter->index == 0 || filter_core(filter, cx);
 	const int bpf_match = filter->bpf_insn == NULL || bpf_filter(filter->bpf_insn, pkt, head->len, head->caplen);
 	const int match = core_match && bpf_match;
 
@@ -331,6 +481,18 @@ void filter_print(const struct filter* filter, FILE* fp, int verbose){
 		fprintf(fp, "\tIP_DST        : NULL\n");
 	}
 
+	if ( filter->index & FILTER_IP_SRC_SET ){
+		fprintf(fp, "\tIP_SRC_SET    : %s (%zd prefixes)\n", prefix_set_name(filter->ip_src_set), prefix_set_size(filter->ip_src_set));
+	} else if ( verbose ) {
+		fprintf(fp, "\tIP_SRC_SET    : NULL\n");
+	}
+
+	if ( filter->index & FILTER_IP_DST_SET ){
+		fprintf(fp, "\tIP_DST_SET    : %s (%zd prefixes)\n", prefix_set_name(filter->ip_dst_set), prefix_set_size(filter->ip_dst_set));
+	} else if ( verbose ) {
+		fprintf(fp, "\tIP_DST_SET    : NULL\n");
+	}
+
 	if ( filter->index & FILTER_PORT ){
 		fprintf(fp, "\tPORT (s or d) : %d (MASK: 0x%04X)\n", filter->port, filter->port_mask);
 	} else if ( verbose ) {
@@ -358,7 +520,7 @@ void filter_print(const struct filter* filter, FILE* fp, int verbose){
 
 void filter_pack(struct filter* src, struct filter_packed* dst){
 	dst->filter_id	= htonl(src->filter_id);
-	dst->index		= htonl(src->index);
+	dst->index		= htonl(src->index & ~(FILTER_IP_SRC_SET | FILTER_IP_DST_SET)); /* prefix sets cannot be transmitted */
 	dst->vlan_tci		= htons(src->vlan_tci);
 	dst->eth_type		= htons(src->eth_type);
 	dst->ip_proto		= src->ip_proto;
@@ -448,4 +610,8 @@ void filter_unpack(struct filter_packed* src, struct filter* dst){
 
 	/* fill defaults for local filters */
 	dst->frame_num = NULL;
+	dst->ip_src_set = NULL;
+	dst->ip_dst_set = NULL;
+
+	filter_compile(dst);
 }
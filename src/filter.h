@@ -0,0 +1,95 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef CAPUTILS_INT_FILTER_H
+#define CAPUTILS_INT_FILTER_H
+
+#include <caputils/filter.h>
+#include <netinet/ip.h>
+#include <net/ethernet.h>
+
+/**
+ * Packet being matched. Headers are parsed the first time a test needs them
+ * so they can be shared when matching multiple filters against the same
+ * packet.
+ */
+struct filter_context {
+	const void* pkt;
+	const struct ethhdr* ether;
+	const struct cap_header* head;
+
+	int have_vlan;
+	uint16_t h_proto;
+	const struct ether_vlan_header* vlan;
+
+	int have_ip;
+	const struct ip* ip;
+
+	int have_ports;
+	uint16_t src_port;
+	uint16_t dst_port;
+};
+
+void filter_context_init(struct filter_context* cx, const void* pkt, const struct cap_header* head);
+
+/**
+ * Initialize context from headers pre-classified by packet_meta_classify.
+ */
+void filter_context_meta(struct filter_context* cx, const struct packet_meta* meta, size_t i);
+
+/**
+ * Parse ethernet type and vlan header (h_proto and vlan).
+ */
+void filter_context_vlan(struct filter_context* cx);
+
+/**
+ * Parse IPv4 header, returns NULL if the packet isn't IPv4.
+ */
+const struct ip* filter_context_ip(struct filter_context* cx);
+
+/**
+ * Parse transport ports (src_port and dst_port), ports are 0 unless TCP or UDP.
+ */
+void filter_context_ports(struct filter_context* cx);
+
+/**
+ * Same as filter_match but using a (possibly already parsed) context.
+ */
+int filter_match_context(struct filter* filter, struct filter_context* cx);
+
+/**
+ * IPv4 prefix set (see prefix_set.c). Addresses are in host byte order.
+ */
+struct prefix_set* prefix_set_alloc(const char* name);
+void prefix_set_free(struct prefix_set* set);
+const char* prefix_set_name(const struct prefix_set* set);
+size_t prefix_set_size(const struct prefix_set* set);
+
+/**
+ * Add prefix addr/len to set.
+ * @return 0 if successful or errno on errors.
+ */
+int prefix_set_add(struct prefix_set* set, uint32_t addr, unsigned int len);
+
+/**
+ * @return non-zero if addr is covered by any prefix in the set.
+ */
+int prefix_set_lookup(const struct prefix_set* set, uint32_t addr) __attribute__((pure));
+
+#endif /* CAPUTILS_INT_FILTER_H */
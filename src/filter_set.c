@@ -0,0 +1,303 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "caputils/filter.h"
+#include "filter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define INITIAL_BUCKETS 64
+
+/**
+ * Field a filter is indexed by. Only AND filters with an exact match (full
+ * mask) on one of these fields can be indexed, all other filters are
+ * evaluated for every packet.
+ */
+enum SetKey {
+	KEY_DST_PORT = 0,
+	KEY_SRC_PORT,
+	KEY_IP_PROTO,
+	KEY_ETH_TYPE,
+	KEY_MAX,
+	KEY_NONE = KEY_MAX,
+};
+
+struct set_entry {
+	struct filter* filter;
+	enum SetKey key;
+	uint16_t value;
+	struct set_entry* next;    /* next entry in same bucket (or wildcard list) */
+};
+
+struct filter_set {
+	struct set_entry* wildcard;   /* filters evaluated for every packet */
+	struct set_entry** bucket;    /* indexed filters, hashed on key and value */
+	size_t num_buckets;           /* always power of two */
+	size_t num_indexed;
+	size_t num_key[KEY_MAX];      /* number of filters indexed per key, lookup is skipped when zero */
+	uint32_t max_id;
+	size_t num_filters;
+};
+
+static enum SetKey select_key(const struct filter* filter, uint16_t* value){
+	/* OR filters may match on any field */
+	if ( filter->mode != FILTER_AND ){
+		return KEY_NONE;
+	}
+
+	/* filters with local state must see all packets */
+	if ( (filter->index & (FILTER_FRAME_NUM | FILTER_FRAME_MAX_DT)) || filter->frame_num ){
+		return KEY_NONE;
+	}
+
+	/* ordered by selectivity */
+	if ( (filter->index & FILTER_DST_PORT) && filter->dst_port_mask == 0xffff ){
+		*value = filter->dst_port;
+		return KEY_DST_PORT;
+	}
+	if ( (filter->index & FILTER_SRC_PORT) && filter->src_port_mask == 0xffff ){
+		*value = filter->src_port;
+		return KEY_SRC_PORT;
+	}
+	if ( filter->index & FILTER_IP_PROTO ){
+		*value = filter->ip_proto;
+		return KEY_IP_PROTO;
+	}
+	if ( (filter->index & FILTER_ETH_TYPE) && filter->eth_type_mask == 0xffff ){
+		*value = filter->eth_type;
+		return KEY_ETH_TYPE;
+	}
+
+	return KEY_NONE;
+}
+
+static size_t hash(const struct filter_set* set, enum SetKey key, uint16_t value){
+	const uint32_t h = (((uint32_t)key << 16) | value) * 2654435761U;
+	return (h >> 12) & (set->num_buckets - 1);
+}
+
+static void rehash(struct filter_set* set, size_t num_buckets){
+	struct set_entry** old = set->bucket;
+	const size_t old_num = set->num_buckets;
+
+	/* keep current table if allocation fails, it only gets longer chains */
+	struct set_entry** bucket = calloc(num_buckets, sizeof(struct set_entry*));
+	if ( !bucket ){
+		return;
+	}
+
+	set->bucket = bucket;
+	set->num_buckets = num_buckets;
+
+	for ( size_t i = 0; i < old_num; i++ ){
+		struct set_entry* cur = old[i];
+		while ( cur ){
+			struct set_entry* next = cur->next;
+			struct set_entry** head = &set->bucket[hash(set, cur->key, cur->value)];
+			cur->next = *head;
+			*head = cur;
+			cur = next;
+		}
+	}
+
+	free(old);
+}
+
+/**
+ * Find pointer to the link referencing the entry with given filter_id.
+ */
+static struct set_entry** find_entry(struct filter_set* set, uint32_t filter_id){
+	struct set_entry** cur = &set->wildcard;
+	while ( *cur ){
+		if ( (*cur)->filter->filter_id == filter_id ) return cur;
+		cur = &(*cur)->next;
+	}
+
+	for ( size_t i = 0; i < set->num_buckets; i++ ){
+		cur = &set->bucket[i];
+		while ( *cur ){
+			if ( (*cur)->filter->filter_id == filter_id ) return cur;
+			cur = &(*cur)->next;
+		}
+	}
+
+	return NULL;
+}
+
+int filter_set_init(struct filter_set** setptr){
+	if ( !setptr ){
+		return EINVAL;
+	}
+
+	struct filter_set* set = calloc(1, sizeof(struct filter_set));
+	if ( !set ){
+		return errno;
+	}
+
+	set->num_buckets = INITIAL_BUCKETS;
+	if ( !(set->bucket = calloc(set->num_buckets, sizeof(struct set_entry*))) ){
+		free(set);
+		return errno;
+	}
+
+	*setptr = set;
+	return 0;
+}
+
+static void free_list(struct set_entry* cur){
+	while ( cur ){
+		struct set_entry* next = cur->next;
+		free(cur);
+		cur = next;
+	}
+}
+
+void filter_set_free(struct filter_set* set){
+	if ( !set ) return;
+
+	free_list(set->wildcard);
+	for ( size_t i = 0; i < set->num_buckets; i++ ){
+		free_list(set->bucket[i]);
+	}
+	free(set->bucket);
+	free(set);
+}
+
+int filter_set_add(struct filter_set* set, struct filter* filter){
+	if ( !(set && filter) ){
+		return EINVAL;
+	}
+
+	if ( find_entry(set, filter->filter_id) ){
+		return EEXIST;
+	}
+
+	struct set_entry* entry = malloc(sizeof(struct set_entry));
+	if ( !entry ){
+		return errno;
+	}
+
+	filter_compile(filter);
+	entry->filter = filter;
+	entry->value = 0;
+	entry->key = select_key(filter, &entry->value);
+
+	if ( entry->key == KEY_NONE ){
+		entry->next = set->wildcard;
+		set->wildcard = entry;
+	} else {
+		if ( set->num_indexed >= set->num_buckets ){
+			rehash(set, set->num_buckets * 2);
+		}
+		struct set_entry** head = &set->bucket[hash(set, entry->key, entry->value)];
+		entry->next = *head;
+		*head = entry;
+		set->num_indexed++;
+		set->num_key[entry->key]++;
+	}
+
+	if ( set->num_filters == 0 || filter->filter_id > set->max_id ){
+		set->max_id = filter->filter_id;
+	}
+	set->num_filters++;
+
+	return 0;
+}
+
+int filter_set_remove(struct filter_set* set, uint32_t filter_id){
+	if ( !set ){
+		return EINVAL;
+	}
+
+	struct set_entry** link = find_entry(set, filter_id);
+	if ( !link ){
+		return ENOENT;
+	}
+
+	struct set_entry* entry = *link;
+	*link = entry->next;
+	if ( entry->key != KEY_NONE ){
+		set->num_indexed--;
+		set->num_key[entry->key]--;
+	}
+	set->num_filters--;
+	free(entry);
+
+	/* max_id is kept so bitmaps already allocated by the caller remain large enough */
+	return 0;
+}
+
+size_t filter_set_bitmap_size(const struct filter_set* set){
+	return set->num_filters > 0 ? set->max_id / 32 + 1 : 1;
+}
+
+static int match_entry(struct set_entry* entry, struct filter_context* cx, uint32_t* bitmap){
+	if ( !filter_match_context(entry->filter, cx) ){
+		return 0;
+	}
+
+	const uint32_t id = entry->filter->filter_id;
+	bitmap[id / 32] |= 1U << (id % 32);
+	return 1;
+}
+
+static int match_key(struct filter_set* set, enum SetKey key, uint16_t value, struct filter_context* cx, uint32_t* bitmap){
+	int matches = 0;
+	for ( struct set_entry* cur = set->bucket[hash(set, key, value)]; cur; cur = cur->next ){
+		if ( cur->key != key || cur->value != value ) continue;
+		matches += match_entry(cur, cx, bitmap);
+	}
+	return matches;
+}
+
+int filter_set_match(struct filter_set* set, const void* pkt, struct cap_header* head, uint32_t* bitmap){
+	memset(bitmap, 0, filter_set_bitmap_size(set) * sizeof(uint32_t));
+
+	struct filter_context cx;
+	filter_context_init(&cx, pkt, head);
+
+	int matches = 0;
+	for ( struct set_entry* cur = set->wildcard; cur; cur = cur->next ){
+		matches += match_entry(cur, &cx, bitmap);
+	}
+
+	/* indexed filters: only the filters with the same value as the packet are candidates */
+	if ( set->num_key[KEY_DST_PORT] || set->num_key[KEY_SRC_PORT] ){
+		filter_context_ports(&cx);
+		if ( set->num_key[KEY_DST_PORT] ) matches += match_key(set, KEY_DST_PORT, cx.dst_port, &cx, bitmap);
+		if ( set->num_key[KEY_SRC_PORT] ) matches += match_key(set, KEY_SRC_PORT, cx.src_port, &cx, bitmap);
+	}
+
+	if ( set->num_key[KEY_IP_PROTO] ){
+		const struct ip* ip = filter_context_ip(&cx);
+		if ( ip ) matches += match_key(set, KEY_IP_PROTO, ip->ip_p, &cx, bitmap);
+	}
+
+	if ( set->num_key[KEY_ETH_TYPE] ){
+		filter_context_vlan(&cx);
+		matches += match_key(set, KEY_ETH_TYPE, cx.h_proto, &cx, bitmap);
+	}
+
+	return matches;
+}
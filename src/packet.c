@@ -24,6 +24,7 @@
 #include "caputils/packet.h"
 #include "caputils/caputils.h"
 #include "src/format/format.h"
+#include "caputils_int.h"
 
 #include <stdio.h>
 #include <strings.h>
@@ -149,6 +150,14 @@ size_t payload_size(enum Level level, const cap_head* caphead){
 	}
 }
 
+size_t payload_size_meta(enum Level level, const struct packet_meta* meta, size_t i){
+	if ( level < LEVEL_NETWORK || !(meta->flags[i] & PACKET_META_IPV4) ){
+		return payload_size(level, meta->cp[i]);
+	}
+
+	return payload_ip(level, (const struct ip*)(meta->cp[i]->payload + meta->l3_offset[i]));
+}
+
 size_t layer_size(enum Level level, const cap_head* caphead){
 	/* layer size at physical is not supported, traces does not include necessary data */
 	if ( level == LEVEL_INVALID || level == LEVEL_PHYSICAL ){
@@ -219,6 +228,36 @@ struct ip* find_ipv4_headerRW(struct ethhdr* ether, char** ptr){
 	return (struct ip*)(ref + offset);
 }
 
+const char* ipv6_payload(const struct cap_header* cp, const char* ip6, uint8_t* proto){
+	const char* ptr = ip6 + IPV6_HEADER_SIZE;
+	uint8_t next = (uint8_t)ip6[IPV6_NEXT_OFFSET];
+
+	for (;;){
+		switch ( next ){
+		case IPPROTO_HOPOPTS:
+		case IPPROTO_ROUTING:
+		case IPPROTO_DSTOPTS:
+			/* extension header: next header, length in 8 octets (not including first 8) */
+			if ( limited_caplen(cp, ptr, 2) ){
+				return NULL;
+			}
+			next = (uint8_t)ptr[0];
+			ptr += 8 * ((uint8_t)ptr[1] + 1);
+			continue;
+
+		case IPPROTO_FRAGMENT:
+			return NULL;
+
+		default:
+			if ( limited_caplen(cp, ptr, 0) ){
+				return NULL;
+			}
+			*proto = next;
+			return ptr;
+		}
+	}
+}
+
 static int next_payload(struct header_chunk* header){
 	/* stop processing if protocol doesn't define next_payload */
 	if ( !header->protocol->next_payload ){
@@ -4,178 +4,390 @@
 
 #include "caputils/packet.h"
 #include "caputils/caputils.h"
+#include "src/caputils_int.h"
 #include "src/format/format.h"
-#include "src/slist.h"
+#include "src/slab.h"
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 
-struct entry {
-	enum caputils_protocol_type protocol;
-	int finished;
-
-	union {
-		struct {
-			int src;
-			int dst;
-			int sport;
-			int dport;
-		} ip;
-	};
+/**
+ * Connections are tracked in an open-addressing hash table (linear probing)
+ * keyed on the 5-tuple. The key is canonicalized (lowest endpoint first) so
+ * both directions map to the same entry. Slots only hold the hash and the
+ * index of the entry in a slab so probing stays within a few cache lines and
+ * entries never move when the pool grows.
+ *
+ * If enabled (see connection_id_set_timeout) entries are expired, based on
+ * packet timestamps, when idle for too long or shortly after the connection is
+ * closed by RST or FIN in both directions. A packet matching an expired entry
+ * starts a new connection. Expired entries are removed when the table needs to
+ * grow so memory is bounded by the number of active connections rather than
+ * the total number of connections. Timeouts are disabled by default so ids
+ * only change on a new SYN.
+ *
+ * The table is kept per thread so each thread (e.g. each capinfo worker)
+ * tracks the connections of its own stream. It is released when the thread
+ * exits (or by connection_id_reset).
+ */
+
+#define FLOW_TABLE_MIN 1024          /* initial number of slots (power of two) */
+#define FLOW_POOL_CHUNK 4096         /* entries per slab chunk */
+
+enum FlowState {
+	FLOW_FIN_A = (1<<0),               /* FIN sent from first endpoint */
+	FLOW_FIN_B = (1<<1),               /* FIN sent from second endpoint */
+	FLOW_RST   = (1<<2),               /* RST sent from either endpoint */
+};
+
+struct flow_key {
+	uint32_t addr[2][4];               /* endpoints, lowest first (IPv4 only uses first word) */
+	uint16_t port[2];
+	uint8_t proto;
+	uint8_t family;
+	uint8_t reserved[2];               /* must be zero (key is compared and hashed as bytes) */
 };
 
-struct state {
-	int seq; /* sequence number of initializing packet */
-	struct entry* entry;
-	struct state* sibling;
+/* key is hashed as 64-bit words */
+typedef char flow_key_size_check[sizeof(struct flow_key) % sizeof(uint64_t) == 0 ? 1 : -1];
 
+struct flow {
+	struct flow_key key;
+	uint32_t hash;
 	connection_id_t id;
+	uint32_t seq;                      /* sequence number of initializing packet */
+	uint32_t last;                     /* timestamp of last packet */
+	uint8_t state;                     /* FlowState */
+};
+
+struct slot {
+	uint32_t hash;
+	uint32_t flow;                     /* index in pool (slab) or 0 if slot is empty */
 };
 
+static __thread struct slot* slots = NULL;
+static __thread size_t num_slots = 0;
+static __thread size_t num_used = 0;   /* number of occupied slots */
+
+static __thread struct slab pool;
+static __thread int pool_initialized = 0;
+
+static pthread_key_t cleanup_key;
+static pthread_once_t cleanup_once = PTHREAD_ONCE_INIT;
+
+static __thread connection_id_t counter = 0;
+static __thread uint32_t now = 0;      /* latest timestamp seen */
+static unsigned int idle_timeout = 0;   /* seconds, 0 disables */
+static unsigned int closed_timeout = 0; /* seconds, 0 disables */
+
+static inline uint16_t load_be16(const char* ptr){
+	uint16_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return ntohs(v);
+}
+
+static inline uint32_t load_be32(const char* ptr){
+	uint32_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return ntohl(v);
+}
+
+static uint32_t flow_hash(const struct flow_key* key){
+	uint64_t word[sizeof(struct flow_key) / sizeof(uint64_t)];
+	memcpy(word, key, sizeof(struct flow_key));
+
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	for ( unsigned int i = 0; i < sizeof(word) / sizeof(uint64_t); i++ ){
+		h = (h ^ word[i]) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 29;
+	return (uint32_t)h;
+}
+
 /**
- * States are stored in N buckets.
- *
- * Which bucket depends on the packet but both directions must yield the same
- * bucket, e.g. (src^dst%N)
+ * Fill canonical key.
+ * @return Non-zero if the packet is sent from the second endpoint.
  */
-#define bucket_count 256
-static struct simple_list list[bucket_count];
-
-static int initialized = 0;
-static int counter = 0;
+static int flow_key_init(struct flow_key* key, uint8_t family, const void* src, const void* dst, size_t addrlen, uint8_t proto, uint16_t sport, uint16_t dport){
+	const int cmp = memcmp(src, dst, addrlen);
+	const int reverse = cmp > 0 || (cmp == 0 && sport > dport);
+
+	memset(key, 0, sizeof(struct flow_key));
+	memcpy(key->addr[reverse], src, addrlen);
+	memcpy(key->addr[!reverse], dst, addrlen);
+	key->port[reverse] = sport;
+	key->port[!reverse] = dport;
+	key->proto = proto;
+	key->family = family;
+
+	return reverse;
+}
 
-static struct state* entry_put(struct simple_list* bucket, const struct entry* entry, connection_id_t id){
-	/* allocate new entry (key) */
-	void* key = malloc(sizeof(struct entry));
-	memcpy(key, entry, sizeof(struct entry));
+static int flow_closed(const struct flow* flow){
+	return (flow->state & FLOW_RST) || (flow->state & (FLOW_FIN_A | FLOW_FIN_B)) == (FLOW_FIN_A | FLOW_FIN_B);
+}
 
-	/* initialize new state */
-	struct state* state = slist_put(bucket, key);
-	memset(state, 0, sizeof(struct state));
-	state->entry = key;
-	state->id = id;
+static int flow_expired(const struct flow* flow, uint32_t ts){
+	const unsigned int timeout = flow_closed(flow) ? closed_timeout : idle_timeout;
+	return timeout > 0 && ts > flow->last && ts - flow->last > timeout;
+}
 
-	return state;
+static struct flow* flow_get(uint32_t index){
+	return (struct flow*)slab_get(&pool, index);
 }
 
-static void ipv4_forward(struct entry* entry, const struct ip* ip, int sport, int dport){
-	entry->protocol = PROTOCOL_IPV4;
-	entry->finished = 0;
-	entry->ip.src = ip->ip_src.s_addr;
-	entry->ip.dst = ip->ip_dst.s_addr;
-	entry->ip.sport = sport;
-	entry->ip.dport = dport;
+static void slot_insert(struct slot* table, size_t size, uint32_t hash, uint32_t index){
+	const size_t mask = size - 1;
+	size_t i = hash & mask;
+	while ( table[i].flow ){
+		i = (i + 1) & mask;
+	}
+	table[i].hash = hash;
+	table[i].flow = index;
 }
 
-static void ipv4_backward(struct entry* entry, const struct ip* ip, int sport, int dport){
-	entry->protocol = PROTOCOL_IPV4;
-	entry->finished = 0;
-	entry->ip.src = ip->ip_dst.s_addr;
-	entry->ip.dst = ip->ip_src.s_addr;
-	entry->ip.sport = dport;
-	entry->ip.dport = sport;
+static void thread_cleanup(void* arg){
+	connection_id_reset();
 }
 
-static int connection_id_cmp(const void* cur, const void* key){
-	return memcmp(cur, key, sizeof(struct entry));
+static void create_cleanup_key(void){
+	pthread_key_create(&cleanup_key, thread_cleanup);
 }
 
-static int ipv4_connection_id(const struct cap_header* cp, const struct ip* ip, struct entry entry[2]){
-	uint16_t sport = 0;
-	uint16_t dport = 0;
-	const void* tcp = find_tcp_header(cp->payload, cp->ethhdr, ip, &sport, &dport);
-	const void* udp = find_udp_header(cp->payload, cp->ethhdr, ip, &sport, &dport);
+/**
+ * Remove expired entries and rebuild the slots, doubling the size unless
+ * enough entries was removed.
+ */
+static int flow_table_rehash(){
+	if ( !pool_initialized ){
+		slab_init(&pool, sizeof(struct flow), FLOW_POOL_CHUNK);
+		pool_initialized = 1;
+
+		/* the key value is only used to trigger the destructor on thread exit */
+		pthread_once(&cleanup_once, create_cleanup_key);
+		pthread_setspecific(cleanup_key, &pool);
+	}
+
+	size_t live = 0;
+	for ( size_t i = 0; i < num_slots; i++ ){
+		if ( slots[i].flow && !flow_expired(flow_get(slots[i].flow), now) ){
+			live++;
+		}
+	}
 
-	if ( tcp || udp ){
-		ipv4_forward (&entry[0], ip, sport, dport);
-		ipv4_backward(&entry[1], ip, sport, dport);
-		return 1;
-	} else {
+	size_t size = num_slots ? num_slots : FLOW_TABLE_MIN;
+	if ( live > size / 4 ){
+		size *= 2;
+	}
+
+	struct slot* table = calloc(size, sizeof(struct slot));
+	if ( !table ){
 		return 0;
 	}
-}
 
-static unsigned int ipv4_bucket_select(const struct ip* ip){
-	return (ip->ip_src.s_addr ^ ip->ip_dst.s_addr) % bucket_count;
+	for ( size_t i = 0; i < num_slots; i++ ){
+		const uint32_t index = slots[i].flow;
+		if ( !index ) continue;
+		if ( flow_expired(flow_get(index), now) ){
+			slab_release(&pool, index);
+			continue;
+		}
+		slot_insert(table, size, slots[i].hash, index);
+	}
+
+	free(slots);
+	slots = table;
+	num_slots = size;
+	num_used = live;
+	return 1;
 }
 
-static struct state* connection_id_tcp_syn(struct simple_list* bucket, const struct cap_header* cp, struct state* state){
-	const struct ip* ip = find_ipv4_header(cp->ethhdr, NULL);
-	if ( !ip ) return state;
+static connection_id_t flow_lookup(const struct flow_key* key, int reverse, uint8_t flags, uint32_t seq, uint32_t ts){
+	if ( ts > now ){
+		now = ts;
+	}
+
+	/* keep load factor below 1/2 */
+	if ( 2 * (num_used + 1) > num_slots && !flow_table_rehash() ){
+		return CONNECTION_ID_NONE;
+	}
+
+	const uint32_t hash = flow_hash(key);
+	const size_t mask = num_slots - 1;
+	size_t i = hash & mask;
+	for ( ; slots[i].flow; i = (i + 1) & mask ){
+		if ( slots[i].hash != hash ) continue;
+
+		struct flow* flow = flow_get(slots[i].flow);
+		if ( memcmp(&flow->key, key, sizeof(struct flow_key)) != 0 ) continue;
+
+		/* new SYN (not a retransmission of the initializing packet) or an
+		 * expired connection reusing the same tuple is a new connection */
+		const int syn = (flags & (TH_SYN | TH_ACK)) == TH_SYN;
+		if ( (syn && flow->seq != seq) || flow_expired(flow, ts) ){
+			flow->id = ++counter;
+			flow->seq = seq;
+			flow->state = 0;
+		}
 
-	const struct tcphdr* tcp = find_tcp_header(cp->payload, cp->ethhdr, ip, NULL, NULL);
-	if ( !(tcp && tcp->syn && !tcp->ack) ) return state;
+		if ( ts > flow->last ){
+			flow->last = ts;
+		}
+		if ( flags & TH_RST ){
+			flow->state |= FLOW_RST;
+		}
+		if ( flags & TH_FIN ){
+			flow->state |= reverse ? FLOW_FIN_B : FLOW_FIN_A;
+		}
 
-	/* state changes already made by this packet, dont redo it */
-	if ( state->seq == (int)tcp->seq ){
-		return state;
+		return flow->id;
 	}
 
-	/* new SYN detected, assume new connection */
-	const connection_id_t id = ++counter;
-	struct state* new[2] = {
-		entry_put(bucket, state->entry, id),
-		entry_put(bucket, state->sibling->entry, id),
-	};
+	/* new connection */
+	const uint32_t index = slab_alloc(&pool);
+	if ( !index ){
+		return CONNECTION_ID_NONE;
+	}
 
-	/* setup new connection */
-	for ( unsigned int i = 0; i < 2; i++ ){
-		new[i]->seq = tcp->seq;
-		new[i]->sibling = new[1-i];
+	struct flow* flow = flow_get(index);
+	flow->key = *key;
+	flow->hash = hash;
+	flow->id = ++counter;
+	flow->seq = seq;
+	flow->last = ts;
+	flow->state = 0;
+	if ( flags & TH_RST ){
+		flow->state |= FLOW_RST;
 	}
+	if ( flags & TH_FIN ){
+		flow->state |= reverse ? FLOW_FIN_B : FLOW_FIN_A;
+	}
+
+	slots[i].hash = hash;
+	slots[i].flow = index;
+	num_used++;
+
+	return flow->id;
+}
+
+connection_id_t connection_id_ipv4(uint32_t src, uint32_t dst, uint8_t proto, uint16_t sport, uint16_t dport, uint8_t flags, uint32_t seq, uint32_t ts){
+	struct flow_key key;
+	const int reverse = flow_key_init(&key, 4, &src, &dst, sizeof(uint32_t), proto, sport, dport);
+	return flow_lookup(&key, reverse, flags, seq, ts);
+}
 
-	/* close the old connection */
-	state->entry->finished = 1;
-	state->sibling->entry->finished = 1;
+connection_id_t connection_id_ipv6(const void* src, const void* dst, uint8_t proto, uint16_t sport, uint16_t dport, uint8_t flags, uint32_t seq, uint32_t ts){
+	struct flow_key key;
+	const int reverse = flow_key_init(&key, 6, src, dst, 16, proto, sport, dport);
+	return flow_lookup(&key, reverse, flags, seq, ts);
+}
 
-	return new[0];
+void connection_id_set_timeout(unsigned int idle, unsigned int closed){
+	idle_timeout = idle;
+	closed_timeout = closed;
 }
 
-static connection_id_t connection_id_search(struct simple_list* bucket, const struct cap_header* cp, struct entry entry[2]){
-	/* search both forward and backward entries for existing connection */
-	struct state* state = slist_find(bucket, &entry[0], connection_id_cmp);
-	if ( state ){
-		state = connection_id_tcp_syn(bucket, cp, state);
-		return state->id;
+void connection_id_reset(void){
+	free(slots);
+	slots = NULL;
+	num_slots = num_used = 0;
+	if ( pool_initialized ){
+		slab_free(&pool);
+		pool_initialized = 0;
 	}
+	counter = 0;
+	now = 0;
+}
 
-	const int id = ++counter;
+/**
+ * Read ports, flags and sequence number from transport header (if not
+ * truncated) and get id.
+ */
+static connection_id_t transport_connection_id(const struct cap_header* cp, int family, const void* src, const void* dst, uint8_t proto, const char* l4){
+	if ( !(proto == IPPROTO_TCP || proto == IPPROTO_UDP) || limited_caplen(cp, l4, 4) ){
+		return CONNECTION_ID_NONE;
+	}
+
+	const uint16_t sport = load_be16(l4);
+	const uint16_t dport = load_be16(l4 + 2);
+	uint8_t flags = 0;
+	uint32_t seq = 0;
+	if ( proto == IPPROTO_TCP && !limited_caplen(cp, l4, 14) ){
+		seq = load_be32(l4 + 4);
+		flags = (uint8_t)l4[13];
+	}
 
-	/* create new entry for this connection */
-	struct state* new[2] = {0,};
-	for ( unsigned int i = 0; i < 2; i++ ){
-		new[i] = entry_put(bucket, &entry[i], id);
+	if ( family == 4 ){
+		uint32_t a, b;
+		memcpy(&a, src, sizeof(uint32_t));
+		memcpy(&b, dst, sizeof(uint32_t));
+		return connection_id_ipv4(a, b, proto, sport, dport, flags, seq, cp->ts.tv_sec);
+	} else {
+		return connection_id_ipv6(src, dst, proto, sport, dport, flags, seq, cp->ts.tv_sec);
+	}
+}
 
-		/* try to get a sequence number */
-		const struct ip* ip = find_ipv4_header(cp->ethhdr, NULL);
-		const struct tcphdr* tcp = find_tcp_header(cp->payload, cp->ethhdr, ip, NULL, NULL);
-		new[i]->seq = tcp ? tcp->seq : 0;
+/**
+ * Locate IPv6 header following ethernet and vlan headers.
+ */
+static const char* find_ipv6(const struct cap_header* cp){
+	if ( limited_caplen(cp, cp->payload, sizeof(struct ethhdr)) ){
+		return NULL;
 	}
 
-	/* set siblings for connection closing and new handshakes */
-	for ( unsigned int i = 0; i < 2; i++ ){
-		new[i]->sibling = new[1-i];
+	const char* ptr = cp->payload + sizeof(struct ethhdr);
+	uint16_t proto = ntohs(cp->ethhdr->h_proto);
+	while ( proto == ETHERTYPE_VLAN && !limited_caplen(cp, ptr, 4) ){
+		proto = load_be16(ptr + 2);
+		ptr += 4;
 	}
 
-	return id;
+	return proto == ETHERTYPE_IPV6 && !limited_caplen(cp, ptr, IPV6_HEADER_SIZE) ? ptr : NULL;
 }
 
 connection_id_t connection_id(const struct cap_header* cp){
-	if ( !initialized ){
-		for ( unsigned int i = 0; i < bucket_count; i++ ){
-			slist_init(&list[i], sizeof(void*), sizeof(struct state), 32);
+	/* IPv4 */
+	const char* l4 = NULL;
+	const struct ip* ip = find_ipv4_header(cp->ethhdr, &l4);
+	if ( ip ){
+		if ( limited_caplen(cp, ip, sizeof(struct ip)) ){
+			return CONNECTION_ID_NONE;
 		}
-		initialized = 1;
+		return transport_connection_id(cp, 4, &ip->ip_src, &ip->ip_dst, ip->ip_p, l4);
 	}
 
-	struct entry entry[2];
-
-	/* IPv4 */
-	const struct ip* ip = find_ipv4_header(cp->ethhdr, NULL);
-	if ( ip && ipv4_connection_id(cp, ip, entry) ){
-		const unsigned int bucket = ipv4_bucket_select(ip);
-		return connection_id_search(&list[bucket], cp, entry);
+	/* IPv6 */
+	const char* ip6 = find_ipv6(cp);
+	if ( ip6 ){
+		uint8_t proto;
+		if ( !(l4 = ipv6_payload(cp, ip6, &proto)) ){
+			return CONNECTION_ID_NONE;
+		}
+		return transport_connection_id(cp, 6, ip6 + IPV6_SRC_OFFSET, ip6 + IPV6_DST_OFFSET, proto, l4);
 	}
 
 	return CONNECTION_ID_NONE;
 }
+
+connection_id_t connection_id_meta(const struct packet_meta* meta, size_t i){
+	const cap_head* cp = meta->cp[i];
+
+	/* IPv6 (or anything else) is not classified */
+	if ( !(meta->flags[i] & PACKET_META_IPV4) ){
+		return connection_id(cp);
+	}
+
+	const struct ip* ip = (const struct ip*)(cp->payload + meta->l3_offset[i]);
+	if ( !(meta->flags[i] & PACKET_META_PORTS) || limited_caplen(cp, ip, sizeof(struct ip)) ){
+		return CONNECTION_ID_NONE;
+	}
+
+	return transport_connection_id(cp, 4, &ip->ip_src, &ip->ip_dst, meta->ip_proto[i], cp->payload + meta->l4_offset[i]);
+}
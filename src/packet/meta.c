@@ -0,0 +1,176 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "caputils/packet.h"
+#include "caputils/caputils.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+/**
+ * Classification is split into gather steps (loading header fields from each
+ * packet into arrays, inherently scalar) and classification steps operating
+ * on whole arrays. The latter uses GCC vector extensions so it is compiled to
+ * SSE2 (or plain scalar code on other architectures) and, where the toolchain
+ * supports function multiversioning, an additional AVX2 clone selected at
+ * load-time.
+ */
+
+#define LANES 16
+typedef uint16_t vec_u16 __attribute__((vector_size(LANES * sizeof(uint16_t))));
+
+#if defined(__x86_64__) && defined(__GLIBC__) && defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 6
+#define MULTIVERSION __attribute__((target_clones("avx2", "default")))
+#else
+#define MULTIVERSION
+#endif
+
+static inline uint16_t load_be16(const char* ptr){
+	uint16_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return ntohs(v);
+}
+
+/**
+ * Link layer: resolve vlan tag and network header offset.
+ */
+static void MULTIVERSION classify_link(const uint16_t* type, const uint16_t* inner, uint16_t* h_proto, uint16_t* l3_offset, uint16_t* flags, size_t n){
+	for ( size_t i = 0; i < n; i += LANES ){
+		vec_u16 t, in;
+		memcpy(&t, &type[i], sizeof(t));
+		memcpy(&in, &inner[i], sizeof(in));
+
+		const vec_u16 vlan = (vec_u16)(t == ETHERTYPE_VLAN);
+		const vec_u16 proto = (vlan & in) | (~vlan & t);
+		const vec_u16 ipv4 = (vec_u16)(proto == ETHERTYPE_IP);
+		const vec_u16 offset = sizeof(struct ethhdr) + (vlan & 4);
+		const vec_u16 f = (vlan & PACKET_META_VLAN) | (ipv4 & PACKET_META_IPV4);
+
+		memcpy(&h_proto[i], &proto, sizeof(proto));
+		memcpy(&l3_offset[i], &offset, sizeof(offset));
+		memcpy(&flags[i], &f, sizeof(f));
+	}
+}
+
+/**
+ * Network layer: transport header offset and whether ports are present.
+ */
+static void MULTIVERSION classify_network(const uint16_t* l3_offset, const uint16_t* ihl, const uint16_t* proto, uint16_t* l4_offset, uint16_t* flags, size_t n){
+	for ( size_t i = 0; i < n; i += LANES ){
+		vec_u16 f, p, l3, hl;
+		memcpy(&f, &flags[i], sizeof(f));
+		memcpy(&p, &proto[i], sizeof(p));
+		memcpy(&l3, &l3_offset[i], sizeof(l3));
+		memcpy(&hl, &ihl[i], sizeof(hl));
+
+		const vec_u16 ipv4 = (vec_u16)((f & PACKET_META_IPV4) != 0);
+		const vec_u16 ports = ipv4 & (vec_u16)((p == IPPROTO_TCP) | (p == IPPROTO_UDP));
+		const vec_u16 offset = ipv4 & (l3 + (hl << 2));
+		f |= ports & PACKET_META_PORTS;
+
+		memcpy(&l4_offset[i], &offset, sizeof(offset));
+		memcpy(&flags[i], &f, sizeof(f));
+	}
+}
+
+size_t packet_meta_classify(struct packet_meta* meta, cap_head* const* cp, size_t num){
+	if ( num > PACKET_META_MAX ){
+		num = PACKET_META_MAX;
+	}
+
+	/* round up to whole vectors, remaining lanes are zeroed and ignored */
+	const size_t n = (num + LANES - 1) & ~(size_t)(LANES - 1);
+	uint16_t type[PACKET_META_MAX];
+	uint16_t inner[PACKET_META_MAX];
+	uint16_t ihl[PACKET_META_MAX];
+	uint16_t proto[PACKET_META_MAX];
+
+	meta->num = num;
+
+	/* gather ethernet type (and type following a vlan tag), fields past caplen
+	 * are treated as zero so truncated frames are never classified as ip */
+	for ( size_t i = 0; i < num; i++ ){
+		const char* pkt = cp[i]->payload;
+		const uint32_t caplen = cp[i]->caplen;
+		meta->cp[i] = cp[i];
+		type[i] = caplen >= sizeof(struct ethhdr) ? load_be16(pkt + 12) : 0;
+		inner[i] = type[i] == ETHERTYPE_VLAN && caplen >= sizeof(struct ether_vlan_header) ? load_be16(pkt + 16) : 0;
+	}
+	memset(&type[num], 0, (n - num) * sizeof(uint16_t));
+	memset(&inner[num], 0, (n - num) * sizeof(uint16_t));
+
+	classify_link(type, inner, meta->h_proto, meta->l3_offset, meta->flags, n);
+
+	/* gather ip header fields */
+	for ( size_t i = 0; i < num; i++ ){
+		/* stacked vlan tags are rare, locate ip header the slow way */
+		if ( meta->h_proto[i] == ETHERTYPE_VLAN ){
+			const struct ip* ip = find_ipv4_header(cp[i]->ethhdr, NULL);
+			if ( ip ){
+				meta->l3_offset[i] = (const char*)ip - cp[i]->payload;
+				meta->flags[i] |= PACKET_META_IPV4;
+			}
+		}
+
+		/* ip header must be fully captured */
+		if ( cp[i]->caplen < (uint32_t)meta->l3_offset[i] + sizeof(struct ip) ){
+			meta->flags[i] &= ~PACKET_META_IPV4;
+		}
+
+		if ( !(meta->flags[i] & PACKET_META_IPV4) ){
+			ihl[i] = proto[i] = 0;
+			meta->ip_proto[i] = 0;
+			meta->ip_src[i] = meta->ip_dst[i] = 0;
+			continue;
+		}
+
+		const struct ip* ip = (const struct ip*)(cp[i]->payload + meta->l3_offset[i]);
+		ihl[i] = ip->ip_hl;
+		proto[i] = meta->ip_proto[i] = ip->ip_p;
+		meta->ip_src[i] = ip->ip_src.s_addr;
+		meta->ip_dst[i] = ip->ip_dst.s_addr;
+	}
+	memset(&ihl[num], 0, (n - num) * sizeof(uint16_t));
+	memset(&proto[num], 0, (n - num) * sizeof(uint16_t));
+
+	classify_network(meta->l3_offset, ihl, proto, meta->l4_offset, meta->flags, n);
+
+	/* gather ports (same offset for both tcp and udp) */
+	for ( size_t i = 0; i < num; i++ ){
+		if ( cp[i]->caplen < (uint32_t)meta->l4_offset[i] + 4 ){
+			meta->flags[i] &= ~PACKET_META_PORTS;
+		}
+
+		if ( !(meta->flags[i] & PACKET_META_PORTS) ){
+			meta->src_port[i] = meta->dst_port[i] = 0;
+			continue;
+		}
+
+		const char* l4 = cp[i]->payload + meta->l4_offset[i];
+		meta->src_port[i] = load_be16(l4);
+		meta->dst_port[i] = load_be16(l4 + 2);
+	}
+
+	return num;
+}
@@ -0,0 +1,179 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "filter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/**
+ * IPv4 prefix set stored as a three level (16-8-8) multibit trie. Each
+ * level-1 and level-2 entry is either NONE, FULL (the whole range is covered
+ * by a prefix) or the index (+2) of the next level chunk. The last level is a
+ * 256-bit bitmap. A lookup is at most three memory accesses and memory only
+ * grows with the number of /16 and /24 ranges containing longer prefixes.
+ */
+
+#define ENTRY_NONE 0
+#define ENTRY_FULL 1
+#define ENTRY_CHUNK 2 /* first chunk index */
+
+struct prefix_set {
+	uint32_t level1[1<<16];           /* indexed by bits 31-16 */
+	uint32_t (*level2)[256];          /* indexed by bits 15-8 */
+	uint32_t (*level3)[8];            /* bitmap indexed by bits 7-0 */
+	size_t num_level2;
+	size_t num_level3;
+	size_t num_prefixes;
+	char* name;
+};
+
+struct prefix_set* prefix_set_alloc(const char* name){
+	struct prefix_set* set = calloc(1, sizeof(struct prefix_set));
+	if ( set && name ){
+		set->name = strdup(name);
+	}
+	return set;
+}
+
+void prefix_set_free(struct prefix_set* set){
+	if ( !set ) return;
+	free(set->level2);
+	free(set->level3);
+	free(set->name);
+	free(set);
+}
+
+const char* prefix_set_name(const struct prefix_set* set){
+	return set->name;
+}
+
+size_t prefix_set_size(const struct prefix_set* set){
+	return set->num_prefixes;
+}
+
+/**
+ * Grow array if n is a power of two (i.e. capacity is doubled when full).
+ */
+static int grow(void** ptr, size_t n, size_t element_size){
+	if ( n == 0 || (n & (n - 1)) == 0 ){
+		void* tmp = realloc(*ptr, (n ? n * 2 : 16) * element_size);
+		if ( !tmp ) return ENOMEM;
+		*ptr = tmp;
+	}
+	return 0;
+}
+
+static int alloc_level2(struct prefix_set* set, uint32_t* entry){
+	int ret;
+	if ( (ret=grow((void**)&set->level2, set->num_level2, sizeof(*set->level2))) != 0 ){
+		return ret;
+	}
+	memset(set->level2[set->num_level2], 0, sizeof(*set->level2));
+	*entry = ENTRY_CHUNK + set->num_level2++;
+	return 0;
+}
+
+static int alloc_level3(struct prefix_set* set, uint32_t* entry){
+	int ret;
+	if ( (ret=grow((void**)&set->level3, set->num_level3, sizeof(*set->level3))) != 0 ){
+		return ret;
+	}
+	memset(set->level3[set->num_level3], 0, sizeof(*set->level3));
+	*entry = ENTRY_CHUNK + set->num_level3++;
+	return 0;
+}
+
+int prefix_set_add(struct prefix_set* set, uint32_t addr, unsigned int len){
+	if ( len > 32 ){
+		return EINVAL;
+	}
+
+	addr &= len ? ~(uint32_t)0 << (32 - len) : 0;
+	set->num_prefixes++;
+
+	/* covers one or more whole /16 */
+	if ( len <= 16 ){
+		const uint32_t first = addr >> 16;
+		const uint32_t n = 1 << (16 - len);
+		for ( uint32_t i = 0; i < n; i++ ){
+			set->level1[first + i] = ENTRY_FULL;
+		}
+		return 0;
+	}
+
+	int ret;
+	const uint32_t i1 = addr >> 16;
+	if ( set->level1[i1] == ENTRY_FULL ){
+		return 0;
+	}
+	if ( set->level1[i1] == ENTRY_NONE && (ret=alloc_level2(set, &set->level1[i1])) != 0 ){
+		return ret;
+	}
+	uint32_t* chunk2 = set->level2[set->level1[i1] - ENTRY_CHUNK];
+
+	/* covers one or more whole /24 */
+	if ( len <= 24 ){
+		const uint32_t first = (addr >> 8) & 0xff;
+		const uint32_t n = 1 << (24 - len);
+		for ( uint32_t i = 0; i < n; i++ ){
+			chunk2[first + i] = ENTRY_FULL;
+		}
+		return 0;
+	}
+
+	const uint32_t i2 = (addr >> 8) & 0xff;
+	if ( chunk2[i2] == ENTRY_FULL ){
+		return 0;
+	}
+	if ( chunk2[i2] == ENTRY_NONE ){
+		uint32_t entry;
+		if ( (ret=alloc_level3(set, &entry)) != 0 ){
+			return ret;
+		}
+		chunk2[i2] = entry;
+	}
+	uint32_t* bitmap = set->level3[chunk2[i2] - ENTRY_CHUNK];
+
+	const uint32_t first = addr & 0xff;
+	const uint32_t n = 1 << (32 - len);
+	for ( uint32_t i = first; i < first + n; i++ ){
+		bitmap[i >> 5] |= 1U << (i & 31);
+	}
+
+	return 0;
+}
+
+int prefix_set_lookup(const struct prefix_set* set, uint32_t addr){
+	uint32_t entry = set->level1[addr >> 16];
+	if ( entry < ENTRY_CHUNK ){
+		return entry;
+	}
+
+	entry = set->level2[entry - ENTRY_CHUNK][(addr >> 8) & 0xff];
+	if ( entry < ENTRY_CHUNK ){
+		return entry;
+	}
+
+	return (set->level3[entry - ENTRY_CHUNK][(addr & 0xff) >> 5] >> (addr & 31)) & 1;
+}
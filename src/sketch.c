@@ -0,0 +1,301 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "caputils/sketch.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+int quantile_sketch_init(struct quantile_sketch* sketch, double accuracy, size_t num_bins){
+	if ( !(accuracy > 0.0 && accuracy < 1.0) || num_bins == 0 || num_bins > INT32_MAX / 2 ){
+		return EINVAL;
+	}
+
+	sketch->gamma = (1.0 + accuracy) / (1.0 - accuracy);
+	sketch->log_gamma = log(sketch->gamma);
+	sketch->num_bins = num_bins;
+	if ( !(sketch->bin = malloc(num_bins * sizeof(uint64_t))) ){
+		return ENOMEM;
+	}
+
+	quantile_sketch_reset(sketch);
+	return 0;
+}
+
+void quantile_sketch_free(struct quantile_sketch* sketch){
+	free(sketch->bin);
+	sketch->bin = NULL;
+}
+
+void quantile_sketch_reset(struct quantile_sketch* sketch){
+	memset(sketch->bin, 0, sketch->num_bins * sizeof(uint64_t));
+	sketch->offset = 0;
+	sketch->lo = sketch->hi = 0;
+	sketch->zero = 0;
+	sketch->count = 0;
+	sketch->min = sketch->max = 0.0;
+	sketch->sum = 0.0;
+	sketch->last_value = 0.0;          /* never used as key */
+	sketch->last_key = 0;
+}
+
+/**
+ * Move window so bin[0] holds new_offset. When moving upwards the bins
+ * falling below the window are collapsed into the lowest bin.
+ */
+static void quantile_sketch_shift(struct quantile_sketch* sketch, int32_t new_offset){
+	const size_t n = sketch->num_bins;
+
+	if ( new_offset > sketch->offset ){
+		const size_t delta = (size_t)(new_offset - sketch->offset);
+		const size_t keep = delta < n ? n - delta : 0;
+		uint64_t collapsed = 0;
+		for ( size_t i = 0; i < n - keep; i++ ){
+			collapsed += sketch->bin[i];
+		}
+		memmove(sketch->bin, sketch->bin + (n - keep), keep * sizeof(uint64_t));
+		memset(sketch->bin + keep, 0, (n - keep) * sizeof(uint64_t));
+		sketch->bin[0] += collapsed;
+		if ( sketch->lo < new_offset ){
+			sketch->lo = new_offset;
+		}
+	} else if ( new_offset < sketch->offset ){
+		/* caller ensures no bins falls out above the window */
+		const size_t delta = (size_t)(sketch->offset - new_offset);
+		memmove(sketch->bin + delta, sketch->bin, (n - delta) * sizeof(uint64_t));
+		memset(sketch->bin, 0, delta * sizeof(uint64_t));
+	}
+
+	sketch->offset = new_offset;
+}
+
+static void quantile_sketch_add_key(struct quantile_sketch* sketch, int32_t key, uint64_t count){
+	const int32_t n = (int32_t)sketch->num_bins;
+
+	if ( sketch->count == sketch->zero ){
+		/* first positive value, center window around it */
+		memset(sketch->bin, 0, sketch->num_bins * sizeof(uint64_t));
+		sketch->offset = key - n / 2;
+		sketch->lo = sketch->hi = key;
+	} else if ( key < sketch->offset ){
+		/* extend window downwards as long as the highest bin fits */
+		const int32_t lowest = sketch->hi - n + 1;
+		quantile_sketch_shift(sketch, key > lowest ? key : lowest);
+	} else if ( key >= sketch->offset + n ){
+		quantile_sketch_shift(sketch, key - n + 1);
+	}
+
+	/* values below the window is collapsed into the lowest bin */
+	if ( key < sketch->offset ){
+		key = sketch->offset;
+	}
+
+	sketch->bin[key - sketch->offset] += count;
+	if ( key < sketch->lo ) sketch->lo = key;
+	if ( key > sketch->hi ) sketch->hi = key;
+	sketch->count += count;
+}
+
+void quantile_sketch_add(struct quantile_sketch* sketch, double value){
+	if ( sketch->count == 0 || value < sketch->min ) sketch->min = value;
+	if ( sketch->count == 0 || value > sketch->max ) sketch->max = value;
+	sketch->sum += value;
+
+	if ( !(value > 0.0) ){
+		sketch->zero++;
+		sketch->count++;
+		return;
+	}
+
+	if ( value != sketch->last_value ){
+		sketch->last_value = value;
+		sketch->last_key = (int32_t)ceil(log(value) / sketch->log_gamma);
+	}
+	quantile_sketch_add_key(sketch, sketch->last_key, 1);
+}
+
+double quantile_sketch_quantile(const struct quantile_sketch* sketch, double q){
+	if ( sketch->count == 0 ){
+		return 0.0;
+	}
+	if ( q <= 0.0 ) return sketch->min;
+	if ( q >= 1.0 ) return sketch->max;
+
+	const double rank = q * (double)(sketch->count - 1);
+	uint64_t seen = sketch->zero;
+	if ( rank < (double)seen ){
+		return sketch->min < 0.0 ? sketch->min : 0.0;
+	}
+
+	for ( int32_t key = sketch->lo; key <= sketch->hi; key++ ){
+		seen += sketch->bin[key - sketch->offset];
+		if ( rank < (double)seen ){
+			/* midpoint (in relative terms) of the bin */
+			const double value = 2.0 * pow(sketch->gamma, key) / (sketch->gamma + 1.0);
+			if ( value < sketch->min ) return sketch->min;
+			if ( value > sketch->max ) return sketch->max;
+			return value;
+		}
+	}
+
+	return sketch->max;
+}
+
+int quantile_sketch_merge(struct quantile_sketch* dst, const struct quantile_sketch* src){
+	if ( dst->gamma != src->gamma || dst->num_bins != src->num_bins ){
+		return EINVAL;
+	}
+	if ( src->count == 0 ){
+		return 0;
+	}
+
+	if ( dst->count == 0 || src->min < dst->min ) dst->min = src->min;
+	if ( dst->count == 0 || src->max > dst->max ) dst->max = src->max;
+	dst->sum += src->sum;
+	dst->zero += src->zero;
+	dst->count += src->zero;
+
+	if ( src->count > src->zero ){
+		/* highest first so the window only moves down while merging */
+		for ( int32_t key = src->hi; key >= src->lo; key-- ){
+			const uint64_t count = src->bin[key - src->offset];
+			if ( count > 0 ){
+				quantile_sketch_add_key(dst, key, count);
+			}
+		}
+	}
+
+	return 0;
+}
+
+int cardinality_sketch_init(struct cardinality_sketch* sketch, unsigned int precision){
+	if ( precision < 4 || precision > 18 ){
+		return EINVAL;
+	}
+
+	sketch->precision = precision;
+	if ( !(sketch->reg = calloc((size_t)1 << precision, 1)) ){
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+void cardinality_sketch_free(struct cardinality_sketch* sketch){
+	free(sketch->reg);
+	sketch->reg = NULL;
+}
+
+void cardinality_sketch_reset(struct cardinality_sketch* sketch){
+	memset(sketch->reg, 0, (size_t)1 << sketch->precision);
+}
+
+void cardinality_sketch_add_hash(struct cardinality_sketch* sketch, uint64_t hash){
+	const unsigned int p = sketch->precision;
+	const size_t index = hash >> (64 - p);
+
+	/* position of first set bit in the remaining bits (guard bit limits it) */
+	const uint64_t w = (hash << p) | ((uint64_t)1 << (p - 1));
+	const uint8_t rank = (uint8_t)(__builtin_clzll(w) + 1);
+
+	if ( rank > sketch->reg[index] ){
+		sketch->reg[index] = rank;
+	}
+}
+
+void cardinality_sketch_add(struct cardinality_sketch* sketch, const void* value, size_t size){
+	cardinality_sketch_add_hash(sketch, sketch_hash(value, size));
+}
+
+uint64_t cardinality_sketch_count(const struct cardinality_sketch* sketch){
+	const size_t m = (size_t)1 << sketch->precision;
+
+	double sum = 0.0;
+	size_t zeros = 0;
+	for ( size_t i = 0; i < m; i++ ){
+		sum += ldexp(1.0, -(int)sketch->reg[i]);
+		zeros += sketch->reg[i] == 0;
+	}
+
+	double alpha;
+	switch ( m ){
+	case 16: alpha = 0.673; break;
+	case 32: alpha = 0.697; break;
+	case 64: alpha = 0.709; break;
+	default: alpha = 0.7213 / (1.0 + 1.079 / (double)m);
+	}
+
+	double estimate = alpha * (double)m * (double)m / sum;
+
+	/* small range correction (linear counting) */
+	if ( estimate <= 2.5 * (double)m && zeros > 0 ){
+		estimate = (double)m * log((double)m / (double)zeros);
+	}
+
+	return (uint64_t)(estimate + 0.5);
+}
+
+int cardinality_sketch_merge(struct cardinality_sketch* dst, const struct cardinality_sketch* src){
+	if ( dst->precision != src->precision ){
+		return EINVAL;
+	}
+
+	const size_t m = (size_t)1 << dst->precision;
+	for ( size_t i = 0; i < m; i++ ){
+		if ( src->reg[i] > dst->reg[i] ){
+			dst->reg[i] = src->reg[i];
+		}
+	}
+
+	return 0;
+}
+
+static inline uint64_t fmix64(uint64_t h){
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t sketch_hash(const void* data, size_t size){
+	const unsigned char* ptr = (const unsigned char*)data;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)size * 0x87c37b91114253d5ULL);
+
+	while ( size >= sizeof(uint64_t) ){
+		uint64_t word;
+		memcpy(&word, ptr, sizeof(word));
+		h = fmix64(h ^ word) + 0x9e3779b97f4a7c15ULL;
+		ptr += sizeof(uint64_t);
+		size -= sizeof(uint64_t);
+	}
+
+	/* byte loop is inlined unlike a variable-sized memcpy */
+	uint64_t tail = 0;
+	for ( size_t i = 0; i < size; i++ ){
+		tail |= (uint64_t)ptr[i] << (8 * i);
+	}
+	return fmix64(h ^ tail);
+}
@@ -0,0 +1,133 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef NVALGRIND
+#include <valgrind/memcheck.h>
+#endif
+
+#ifndef NVALGRIND
+static const size_t gutter = 4;
+#else
+static const size_t gutter = 0;
+#endif
+
+void slab_init(struct slab* slab, size_t object_size, size_t chunk_size){
+	slab->chunk = NULL;
+	slab->num_chunks = 0;
+	slab->shift = 0;
+	slab->object_size = object_size;
+	slab->size = 0;
+	slab->free = 0;
+
+	/* released objects holds the free list link */
+	if ( object_size < sizeof(uint32_t) ){
+		object_size = sizeof(uint32_t);
+	}
+	slab->stride = object_size + gutter;
+
+	while ( ((size_t)1 << slab->shift) < chunk_size ){
+		slab->shift++;
+	}
+
+#ifndef NVALGRIND
+	VALGRIND_CREATE_MEMPOOL(slab, 0, 0);
+#endif
+}
+
+void slab_free(struct slab* slab){
+#ifndef NVALGRIND
+	VALGRIND_DESTROY_MEMPOOL(slab);
+#endif
+
+	for ( size_t i = 0; i < slab->num_chunks; i++ ){
+		free(slab->chunk[i]);
+	}
+	free(slab->chunk);
+	slab->chunk = NULL;
+	slab->num_chunks = 0;
+	slab->size = 0;
+	slab->free = 0;
+}
+
+void slab_reset(struct slab* slab){
+#ifndef NVALGRIND
+	VALGRIND_DESTROY_MEMPOOL(slab);
+	VALGRIND_CREATE_MEMPOOL(slab, 0, 0);
+	for ( size_t i = 0; i < slab->num_chunks; i++ ){
+		VALGRIND_MAKE_MEM_NOACCESS(slab->chunk[i], slab->stride << slab->shift);
+	}
+#endif
+
+	slab->size = 0;
+	slab->free = 0;
+}
+
+static int slab_grow(struct slab* slab){
+	char** tmp = realloc(slab->chunk, (slab->num_chunks + 1) * sizeof(char*));
+	if ( !tmp ){
+		return 0;
+	}
+	slab->chunk = tmp;
+
+	char* chunk = malloc(slab->stride << slab->shift);
+	if ( !chunk ){
+		return 0;
+	}
+
+#ifndef NVALGRIND
+	VALGRIND_MAKE_MEM_NOACCESS(chunk, slab->stride << slab->shift);
+#endif
+
+	slab->chunk[slab->num_chunks++] = chunk;
+	return 1;
+}
+
+int slab_reserve(struct slab* slab, size_t n){
+	while ( slab_capacity(slab) < n ){
+		if ( !slab_grow(slab) ){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+uint32_t slab_alloc(struct slab* slab){
+	uint32_t index;
+	if ( slab->free ){
+		index = slab->free;
+		void* ptr = slab_get(slab, index);
+#ifndef NVALGRIND
+		VALGRIND_MEMPOOL_ALLOC(slab, ptr, slab->object_size);
+		VALGRIND_MAKE_MEM_DEFINED(ptr, sizeof(uint32_t));
+#endif
+		memcpy(&slab->free, ptr, sizeof(uint32_t));
+		return index;
+	}
+
+	if ( slab->size == UINT32_MAX || (slab->size == slab_capacity(slab) && !slab_grow(slab)) ){
+		return 0;
+	}
+
+	index = ++slab->size;
+
+#ifndef NVALGRIND
+	VALGRIND_MEMPOOL_ALLOC(slab, slab_get(slab, index), slab->object_size);
+#endif
+
+	return index;
+}
+
+void slab_release(struct slab* slab, uint32_t index){
+	void* ptr = slab_get(slab, index);
+	memcpy(ptr, &slab->free, sizeof(uint32_t));
+	slab->free = index;
+
+#ifndef NVALGRIND
+	VALGRIND_MEMPOOL_FREE(slab, ptr);
+#endif
+}
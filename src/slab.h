@@ -0,0 +1,89 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Slab allocator for fixed-size objects.
+ *
+ * Objects are carved from chunks holding a power-of-two number of objects.
+ * Growing only adds chunks so objects never move (pointers stay valid) and
+ * an object is located from its index with a shift and a mask. Released
+ * objects are reused through a free list and slab_reset releases all objects
+ * at once while keeping the chunks for the next use.
+ *
+ * Objects are identified by index starting at 1 so 0 can be used to mean "no
+ * object".
+ */
+
+struct slab {
+	char** chunk;
+	size_t num_chunks;    /* chunks allocated */
+	size_t shift;         /* log2(objects per chunk) */
+	size_t stride;        /* bytes per object (including gutter) */
+	size_t object_size;   /* sizeof(object) */
+	uint32_t size;        /* indices handed out (1..size) */
+	uint32_t free;        /* head of free list or 0 */
+};
+
+/**
+ * @param object_size Size of each object. Objects are not padded so the size
+ *                    should be a multiple of the required alignment.
+ * @param chunk_size Objects per chunk (rounded up to a power of two).
+ */
+void slab_init(struct slab* slab, size_t object_size, size_t chunk_size);
+
+/**
+ * Release all chunks.
+ */
+void slab_free(struct slab* slab);
+
+/**
+ * Release all objects but keep the chunks allocated.
+ */
+void slab_reset(struct slab* slab);
+
+/**
+ * Allocate chunks until at least n objects fits.
+ * @return Non-zero if successful.
+ */
+int slab_reserve(struct slab* slab, size_t n);
+
+/**
+ * Allocate an object (uninitialized).
+ * @return Index of object or 0 if out of memory.
+ */
+uint32_t slab_alloc(struct slab* slab);
+
+/**
+ * Return an object to the slab. The index may be returned by a later
+ * slab_alloc.
+ */
+void slab_release(struct slab* slab, uint32_t index);
+
+/**
+ * Number of objects which fits in the allocated chunks.
+ */
+static inline size_t slab_capacity(const struct slab* slab){
+	return slab->num_chunks << slab->shift;
+}
+
+/**
+ * Get object by index.
+ */
+static inline void* slab_get(const struct slab* slab, uint32_t index){
+	const size_t pos = index - 1;
+	const size_t mask = ((size_t)1 << slab->shift) - 1;
+	return slab->chunk[pos >> slab->shift] + (pos & mask) * slab->stride;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SLAB_H */
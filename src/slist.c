@@ -3,92 +3,150 @@
 #endif
 
 #include "slist.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-#ifndef NVALGRIND
-#include <valgrind/memcheck.h>
-#endif
-
-#ifndef NVALGRIND
-static const size_t gutter = 4;
-#else
-static const size_t gutter = 0;
-#endif
+#define INDEX_MIN 64
 
 void slist_init(struct simple_list* slist, size_t key_size, size_t element_size, size_t initial_size){
-	slist->key   = NULL;
-	slist->value = NULL;
+	slist->index = NULL;
+	slist->index_size = 0;
 	slist->size = 0;
 	slist->capacity = 0;
 	slist->key_size = key_size;
 	slist->element_size = element_size;
-	slist_alloc(slist, initial_size);
 
-#ifndef NVALGRIND
-	VALGRIND_CREATE_MEMPOOL(slist->value, 0, 0);
-#endif
+	/* small chunks would make growth expensive */
+	const size_t chunk_size = initial_size > 16 ? initial_size : 16;
+	slab_init(&slist->key, key_size, chunk_size);
+	slab_init(&slist->value, element_size, chunk_size);
+	slist_alloc(slist, initial_size);
 }
 
 void slist_alloc(struct simple_list* slist, size_t growth){
-	const size_t delta = slist->element_size + gutter;
-	slist->capacity += growth;
-	slist->key   = realloc(slist->key,   slist->key_size * slist->capacity);
-	slist->value = realloc(slist->value, delta * slist->capacity);
-
-#ifndef NVALGRIND
-	VALGRIND_MAKE_MEM_NOACCESS(slist->value, delta * slist->capacity);
-#endif
+	slab_reserve(&slist->key, slist->size + growth);
+	slab_reserve(&slist->value, slist->size + growth);
+	slist->capacity = slab_capacity(&slist->value);
 }
 
 void slist_clear(struct simple_list* slist){
-	for ( unsigned int i = 0; i < slist->size; i++ ){
-		free(slist->key[i]);
+	slab_reset(&slist->key);
+	slab_reset(&slist->value);
+	if ( slist->index ){
+		memset(slist->index, 0, slist->index_size * sizeof(uint32_t));
 	}
 	slist->size = 0;
 }
 
 void slist_free(struct simple_list* slist){
-#ifndef NVALGRIND
-	VALGRIND_DESTROY_MEMPOOL(slist->value);
-#endif
-
-	slist_clear(slist);
-	free(slist->key);
-	free(slist->value);
+	slab_free(&slist->key);
+	slab_free(&slist->value);
+	free(slist->index);
+	slist->index = NULL;
+	slist->index_size = 0;
+	slist->size = 0;
 	slist->capacity = 0;
 }
 
 void* slist_get(const struct simple_list* slist, unsigned int index){
-	const size_t delta = slist->element_size + gutter;
-	const size_t offset = delta * index;
-	return ((char *)slist->value) + offset;
+	return slab_get(&slist->value, index + 1);
+}
+
+const void* slist_key(const struct simple_list* slist, unsigned int index){
+	return slab_get(&slist->key, index + 1);
+}
+
+static size_t hash_key(const void* key, size_t size){
+	const unsigned char* ptr = (const unsigned char*)key;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+	while ( size >= sizeof(uint64_t) ){
+		uint64_t word;
+		memcpy(&word, ptr, sizeof(word));
+		h = (h ^ word) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+		ptr += sizeof(uint64_t);
+		size -= sizeof(uint64_t);
+	}
+	while ( size-- ){
+		h = (h ^ *ptr++) * 0x100000001b3ULL;
+	}
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 29;
+	return (size_t)h;
+}
+
+/**
+ * Rebuild hash index with twice as many slots.
+ */
+static int index_grow(struct simple_list* slist){
+	const size_t size = slist->index_size ? 2 * slist->index_size : INDEX_MIN;
+	uint32_t* index = calloc(size, sizeof(uint32_t));
+	if ( !index ){
+		return 0;
+	}
+
+	for ( size_t i = 0; i < slist->size; i++ ){
+		size_t slot = hash_key(slist_key(slist, i), slist->key_size) & (size - 1);
+		while ( index[slot] ){
+			slot = (slot + 1) & (size - 1);
+		}
+		index[slot] = i + 1;
+	}
+
+	free(slist->index);
+	slist->index = index;
+	slist->index_size = size;
+	return 1;
 }
 
 void* slist_find(const struct simple_list* slist, const void* key, slist_cmp cmp){
+	if ( !cmp ){
+		if ( !slist->index ){
+			return NULL;
+		}
+		const size_t mask = slist->index_size - 1;
+		for ( size_t slot = hash_key(key, slist->key_size) & mask; slist->index[slot]; slot = (slot + 1) & mask ){
+			const unsigned int i = slist->index[slot] - 1;
+			if ( memcmp(slist_key(slist, i), key, slist->key_size) == 0 ){
+				return slist_get(slist, i);
+			}
+		}
+		return NULL;
+	}
+
 	for ( unsigned int i = 0; i < slist->size; i++ ){
-		if ( cmp(slist->key[i], key) == 0 ){
+		if ( cmp(slist_key(slist, i), key) == 0 ){
 			return slist_get(slist, i);
 		}
 	}
 	return NULL;
 }
 
-void* slist_put(struct simple_list* slist, void* key){
-	if ( slist->size == slist->capacity ){
-		slist_alloc(slist, /* growth = */ slist->capacity);
+void* slist_put(struct simple_list* slist, const void* key){
+	/* keep load factor of hash index below 1/2 */
+	if ( 2 * (slist->size + 1) > slist->index_size && !index_grow(slist) ){
+		return NULL;
 	}
 
-	unsigned int index = slist->size;
-	slist->key[index] = key;
-	slist->size++;
-	void* ptr = slist_get(slist, index);
+	const uint32_t k = slab_alloc(&slist->key);
+	const uint32_t v = k ? slab_alloc(&slist->value) : 0;
+	if ( !v ){
+		if ( k ) slab_release(&slist->key, k);
+		return NULL;
+	}
 
-#ifndef NVALGRIND
-	VALGRIND_MEMPOOL_ALLOC(slist->value, ptr, slist->element_size);
-#endif
+	memcpy(slab_get(&slist->key, k), key, slist->key_size);
+
+	const size_t mask = slist->index_size - 1;
+	size_t slot = hash_key(key, slist->key_size) & mask;
+	while ( slist->index[slot] ){
+		slot = (slot + 1) & mask;
+	}
+	slist->index[slot] = ++slist->size;
 
-	return ptr;
+	slist->capacity = slab_capacity(&slist->value);
+	return slab_get(&slist->value, v);
 }
 
 int slist_strcmp(const void* cur, const void* key){
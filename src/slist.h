@@ -5,6 +5,7 @@
 extern "C" {
 #endif
 
+#include "slab.h"
 #include <stddef.h>
 
 /**
@@ -12,14 +13,19 @@ extern "C" {
  *
  * Insertion is O(1)
  * Lookup by index is O(1)
- * Lookup by key is O(N)
+ * Lookup by key is O(1) if keys are compared bytewise (hashed) and O(N) with
+ * a custom comparator.
  *
- * Usable for small-ish datasets only.
+ * Keys and values are stored inline in slabs (keys are copied on insertion)
+ * so elements never move and slist_clear releases everything at once while
+ * keeping the memory for reuse.
  */
 
 struct simple_list {
-	void** key;
-	char* value;
+	struct slab key;
+	struct slab value;
+	uint32_t* index;     /* hash index (open addressing), element index + 1 or 0 if empty */
+	size_t index_size;   /* slots in hash index (power of two) */
 
 	size_t size;         /* slots in use */
 	size_t capacity;     /* slots available */
@@ -39,19 +45,25 @@ void slist_free(struct simple_list* slist);
 
 /**
  * Lookup element by index.
- * Indices may change during modifications of the array.
  */
 void* slist_get(const struct simple_list* slist, unsigned int index);
 
 /**
- * Lookup element by key.
+ * Lookup key by index.
+ */
+const void* slist_key(const struct simple_list* slist, unsigned int index);
+
+/**
+ * Lookup element by key. If cmp is NULL keys are compared bytewise using the
+ * hash index.
  */
 void* slist_find(const struct simple_list* slist, const void* key, slist_cmp cmp);
 
 /**
- * Insert new element.
+ * Insert new element. key_size bytes are copied from key.
+ * @return Pointer to element or NULL if out of memory.
  */
-void* slist_put(struct simple_list* slist, void* key);
+void* slist_put(struct simple_list* slist, const void* key);
 
 /**
  * Adapter for strcmp.
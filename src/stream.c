@@ -60,6 +60,7 @@ int stream_alloc(struct stream** stptr, enum protocol_t protocol, size_t size, s
 	st->readPos = 0;
 	st->writePos = 0;
 	st->flushed = 0;
+	st->mapped = 0;
 	st->num_addresses = 0;
 	st->if_mtu = mtu;
 	st->if_loopback = 0;
@@ -74,6 +75,7 @@ int stream_alloc(struct stream** stptr, enum protocol_t protocol, size_t size, s
 	st->destroy = NULL;
 	st->write = NULL;
 	st->read = NULL;
+	st->read_batch = NULL;
 	st->flush = NULL;
 
 	/* reset memory */
@@ -218,6 +220,43 @@ int stream_open(stream_t* stptr, const stream_addr_t* dest, const char* iface, s
 	return ret;
 }
 
+int stream_open_fanout(stream_t* stptr, size_t num, const stream_addr_t* dest, const char* iface, size_t buffer_size){
+	if ( num == 0 || stream_addr_type(dest) != STREAM_ADDR_ETHERNET ){
+		return EINVAL;
+	}
+
+#ifdef HAVE_PFRING
+	return ERROR_NOT_IMPLEMENTED;
+#else
+	int ret;
+	if ( (ret=stream_ethernet_open_fanout(stptr, num, &dest->ether_addr, iface, buffer_size)) != 0 ){
+		return ret;
+	}
+
+	for ( size_t i = 0; i < num; i++ ){
+		stptr[i]->addr = *dest;
+	}
+	return 0;
+#endif
+}
+
+int stream_open_split(stream_t* stptr, size_t* num, const stream_addr_t* dest, size_t buffer_size){
+	if ( *num == 0 || stream_addr_type(dest) != STREAM_ADDR_CAPFILE ){
+		return EINVAL;
+	}
+
+	const char* filename = stream_addr_have_flag(dest, STREAM_ADDR_LOCAL) ? dest->local_filename : dest->filename;
+	int ret;
+	if ( (ret=stream_file_open_split(stptr, num, filename, buffer_size)) != 0 ){
+		return ret;
+	}
+
+	for ( size_t i = 0; i < *num; i++ ){
+		stptr[i]->addr = *dest;
+	}
+	return 0;
+}
+
 int stream_create(stream_t* stptr, const stream_addr_t* dest, const char* nic, const char* mpid, const char* comment){
 	const char* filename;
 	int flags = stream_addr_flags(dest);
@@ -357,11 +396,40 @@ int stream_copy(stream_t st, const struct cap_header* head){
 	return stream_write(st, head, sizeof(struct cap_header) + head->caplen);
 }
 
+/**
+ * Fill buffer for memory-mapped streams. The data is already present in the
+ * buffer so instead of copying the callback only advances the write position
+ * (i.e. how much of the mapping is exposed to the reader).
+ */
+static int fill_buffer_mapped(stream_t st, struct timeval* timeout){
+	/* don't advance unless the next packet is incomplete */
+	const size_t bytes = st->writePos - st->readPos;
+	const struct cap_header* cp = (const struct cap_header*)(st->buffer + st->readPos);
+	if ( bytes >= sizeof(struct cap_header) && bytes >= sizeof(struct cap_header) + cp->caplen ){
+		return 0;
+	}
+
+	char* dst = st->buffer + st->writePos;
+	int ret = st->fill_buffer(st, timeout, dst, st->buffer_size - st->writePos);
+	if ( ret > 0 ){
+		st->writePos += ret;
+		return 0;
+	} else if ( ret < 0 ){
+		return errno;
+	} else {
+		return -1;
+	}
+}
+
 static int fill_buffer(stream_t st, struct timeval* timeout){
 	if ( st->flushed==1 ){
 		return -1;
 	}
 
+	if ( st->mapped ){
+		return fill_buffer_mapped(st, timeout);
+	}
+
 	/**
 	 *                                  available
 	 *                                 +-----+
@@ -494,6 +562,65 @@ int stream_read(struct stream *st, cap_head** data, struct filter *my_Filter, st
 	return 0;
 }
 
+int stream_read_batch(stream_t st, cap_head** header, size_t max, size_t* count, struct filter* filter, struct timeval* timeout){
+	*count = 0;
+	if ( max == 0 ){
+		return 0;
+	}
+
+	if ( st->read_batch ){
+		return st->read_batch(st, header, max, count, filter, timeout);
+	}
+
+	/* first packet is read as usual (handles timeouts, filling buffer etc) */
+	int ret;
+	if ( (ret=stream_read(st, &header[0], filter, timeout)) != 0 ){
+		return ret;
+	}
+
+	/* stream lacks batch support */
+	if ( st->read ){
+		*count = 1;
+		return 0;
+	}
+
+	/* Take the remaining packets from what is already buffered. The buffer must
+	 * not be refilled here as that could move the packets already returned (it
+	 * is only safe for mapped buffers as they never move data). */
+	size_t n = 1;
+	size_t pos = st->readPos;
+	uint64_t read = 0;
+	while ( n < max ){
+		const size_t bytes = st->writePos - pos;
+		struct cap_header* cp = (struct cap_header*)(st->buffer + pos);
+		if ( bytes < sizeof(struct cap_header) || bytes < sizeof(struct cap_header) + cp->caplen ){
+			struct timeval zero = {0,0};
+			st->readPos = pos;
+			if ( st->mapped && fill_buffer(st, &zero) == 0 ){
+				continue;
+			}
+			break;
+		}
+
+		pos += sizeof(struct cap_header) + cp->caplen;
+		read++;
+
+		if ( filter && !filter_match(filter, cp->payload, cp) ){
+			continue;
+		}
+
+		header[n++] = cp;
+	}
+
+	st->readPos = pos;
+	st->stat.read += read;
+	st->stat.matched += n - 1;
+	st->stat.buffer_usage = st->writePos - st->readPos;
+
+	*count = n;
+	return 0;
+}
+
 int stream_read_cb(stream_t st, stream_read_callback_t callback, struct filter* filter, const struct timeval* timeout){
 	/* A short timeout is used to allow the application to "breathe", i.e
 	 * terminate if SIGINT was received. */
@@ -685,6 +812,27 @@ int stream_flush(stream_t st){
 	return 0;
 }
 
+int stream_set_sync_policy(stream_t st, size_t bytes, unsigned int msec){
+	if ( st->type != PROTOCOL_LOCAL_FILE ){
+		return ERROR_NOT_IMPLEMENTED;
+	}
+	return stream_file_set_sync_policy(st, bytes, msec);
+}
+
+int stream_seek_time(stream_t st, const timepico t){
+	if ( st->type != PROTOCOL_LOCAL_FILE ){
+		return ENOENT; /* no index */
+	}
+	return stream_file_seek_time(st, t);
+}
+
+int stream_stop_time(stream_t st, const timepico t){
+	if ( st->type != PROTOCOL_LOCAL_FILE ){
+		return ENOENT; /* no index */
+	}
+	return stream_file_stop_time(st, t);
+}
+
 /**
  * Calculate the number of bytes to expected from this frame.
  */
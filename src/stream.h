@@ -52,6 +52,8 @@ typedef int (*write_callback)(struct stream* st, const void* data, size_t size);
 
 typedef int (*read_callback)(struct stream* st, cap_head** header, const struct filter* filter, struct timeval* timeout);
 
+typedef int (*read_batch_callback)(struct stream* st, cap_head** header, size_t max, size_t* count, struct filter* filter, struct timeval* timeout);
+
 typedef int (*flush_callback)(struct stream* st);
 
 // Stream structure, used to manage different types of streams
@@ -67,9 +69,10 @@ struct stream {
 	char* buffer;
 	size_t buffer_size;                   // Total size of the buffer
 	unsigned long expSeqnr;               // Expected sequence number
-	unsigned int writePos;                // Write position
-	unsigned int readPos;                 // Read position
+	size_t writePos;                      // Write position
+	size_t readPos;                       // Read position
 	int flushed;                          // Indicate that we got a flush signal.
+	int mapped;                           // Buffer is mapped directly from the source, fill_buffer only moves writePos.
 	unsigned int num_addresses;           // Number of addresses associated with stream
 	size_t if_mtu;                        // Interface MTU (size of the largest measurement frame we may receive on this interface)
 	int if_loopback;                      // Set to non-zero if the stream is a loopback interface.
@@ -82,6 +85,7 @@ struct stream {
 	destroy_callback destroy;
 	write_callback write;
 	read_callback read;
+	read_batch_callback read_batch;       // Optional, only used together with read.
 	flush_callback flush;
 };
 
@@ -104,6 +108,7 @@ long stream_pfring_create(struct stream** stptr, const struct ether_addr* addres
 long stream_pfring_add(struct stream* st, const struct ether_addr* addr);
 #else
 long stream_ethernet_open(struct stream** stptr, const struct ether_addr* address, const char* iface, size_t buffer_size);
+long stream_ethernet_open_fanout(struct stream** stptr, size_t num, const struct ether_addr* address, const char* iface, size_t buffer_size);
 long stream_ethernet_create(struct stream** stptr, const struct ether_addr* address, const char* iface, const char* mpid, const char* comment, int flags);
 long stream_ethernet_add(struct stream* st, const struct ether_addr* addr);
 #endif
@@ -118,6 +123,152 @@ int stream_file_open(struct stream** stptr, FILE* fp, const char* filename, size
  */
 int stream_file_create(struct stream** stptr, FILE* fp, const char* filename, const char* mpid, const char* comment, int flags);
 
+/**
+ * Set durability policy for file streams (see stream_set_sync_policy).
+ */
+int stream_file_set_sync_policy(struct stream* st, size_t bytes, unsigned int msec);
+
+/**
+ * Seek file stream using the capfile index (see stream_seek_time).
+ */
+int stream_file_seek_time(struct stream* st, const timepico t);
+
+/**
+ * Limit file stream using the capfile index (see stream_stop_time).
+ */
+int stream_file_stop_time(struct stream* st, const timepico t);
+
+/**
+ * Restrict file stream to packets in [begin, end) where both are file offsets
+ * at packet boundaries. Cannot seek backwards.
+ */
+int stream_file_range(struct stream* st, off_t begin, off_t end);
+
+/**
+ * Test if file stream is a compressed capfile.
+ */
+int stream_file_compressed(const struct stream* st);
+
+/**
+ * Open capfile as multiple streams over disjoint ranges (see stream_open_split).
+ */
+int stream_file_open_split(struct stream** stptr, size_t* num, const char* filename, size_t buffer_size);
+
+/**
+ * Capfile index entry (see stream_index.c for file format).
+ */
+struct index_entry {
+	uint64_t offset;        /* file offset of packet */
+	uint64_t packet;        /* packet number (first packet is 0) */
+	timepico ts;            /* timestamp of packet */
+	timepico before;        /* latest timestamp of all preceding packets */
+	timepico after;         /* earliest timestamp of this and all following packets */
+} __attribute__((packed));
+
+/**
+ * Find index entry for time t.
+ *
+ * If stop is zero it finds the entry to seek to for packets at or after t, i.e.
+ * all packets preceding the entry are older than t. Otherwise it finds the
+ * first entry where all remaining packets are at or after t.
+ *
+ * @return Zero if successful, ENOENT if capfile has no index (or no entry
+ *         satisfies stop) or ERROR_CAPFILE_INDEX_INVALID if the index is
+ *         invalid or older than the capfile.
+ */
+int stream_index_lookup(const char* filename, const timepico t, int stop, struct index_entry* entry);
+
+/**
+ * Find the first index entry at or after file offset.
+ * @return Same as stream_index_lookup, ENOENT if no entry follows offset.
+ */
+int stream_index_offset(const char* filename, uint64_t offset, struct index_entry* entry);
+
+/**
+ * Same as stream_index_lookup and stream_index_offset but for num_entries
+ * entries stored at base in fd.
+ */
+int stream_index_search(int fd, off_t base, uint64_t num_entries, const timepico t, int stop, struct index_entry* entry);
+int stream_index_search_offset(int fd, off_t base, uint64_t num_entries, uint64_t offset, struct index_entry* entry);
+
+/**
+ * Complete the after field of entries (initially set to the earliest timestamp
+ * of the packets covered by each entry only).
+ */
+void stream_index_finalize(struct index_entry* entry, size_t num_entries);
+
+/**
+ * Compressed capfiles (see stream_compress.c for file format).
+ */
+enum capfile_codec {
+	CAPFILE_CODEC_NONE = 0,
+	CAPFILE_CODEC_LZ4 = 1,
+	CAPFILE_CODEC_ZSTD = 2,
+};
+
+struct block_writer;
+struct block_reader;
+
+/**
+ * Test if codec is supported by this build.
+ */
+int capfile_codec_supported(enum capfile_codec codec);
+
+/**
+ * Compresses packets into blocks passed to write.
+ * @param offset File offset of the first block.
+ */
+int block_writer_new(struct block_writer** bw, enum capfile_codec codec, off_t offset, write_callback write, struct stream* st);
+int block_writer_write(struct block_writer* bw, const void* data, size_t size);
+
+/**
+ * Write all complete packets as a (possibly short) block. Nothing is written
+ * unless enough data is buffered to avoid emitting tiny blocks.
+ */
+int block_writer_flush(struct block_writer* bw);
+
+/**
+ * Write remaining data followed by the block index and release the writer.
+ */
+int block_writer_close(struct block_writer* bw);
+
+/**
+ * Decompresses blocks from fp, starting at offset (fp must be positioned
+ * there). The next block is decoded by a separate thread while the current is
+ * consumed.
+ */
+int block_reader_new(struct block_reader** br, enum capfile_codec codec, FILE* fp, off_t offset);
+void block_reader_free(struct block_reader* br);
+
+/**
+ * Same semantics as fill_buffer_callback.
+ */
+int block_reader_read(struct block_reader* br, char* dst, size_t max);
+
+/**
+ * File offset of the block currently being read.
+ */
+off_t block_reader_position(const struct block_reader* br);
+
+/**
+ * Continue reading from the block at offset (must be a block boundary).
+ */
+int block_reader_seek(struct block_reader* br, off_t offset);
+
+/**
+ * End the stream at the block at offset.
+ */
+void block_reader_limit(struct block_reader* br, off_t offset);
+
+/**
+ * Same as stream_index_search and stream_index_search_offset using the block
+ * index stored in the file.
+ * @return ENOENT if the file has no block index (e.g. not seekable or
+ *         truncated).
+ */
+int block_reader_search(struct block_reader* br, const timepico t, int stop, struct index_entry* entry);
+int block_reader_search_offset(struct block_reader* br, uint64_t offset, struct index_entry* entry);
+
 /**
  * Test if the received number of bytes is valid for this MA frame.
  */
@@ -26,6 +26,9 @@
 #include "caputils/filter.h"
 #include <errno.h>
 
+/* maximum number of frames to read at once using read_frames */
+#define MAX_READ_FRAMES 32
+
 size_t stream_frame_buffer_size(size_t num_frames, size_t mtu){
 	return num_frames * mtu + sizeof(char*) * num_frames;
 }
@@ -34,6 +37,7 @@ void stream_frame_init(struct stream_frame_buffer* fb, read_frame_callback cb, c
 	const size_t frame_offset = sizeof(char*) * num_frames;
 
 	fb->read_frame = cb;
+	fb->read_frames = NULL;
 	fb->frame = (char**)src;
 	fb->frame_size = frame_size;
 	fb->num_frames = num_frames;
@@ -47,38 +51,52 @@ void stream_frame_init(struct stream_frame_buffer* fb, read_frame_callback cb, c
 	}
 }
 
-static int read_frame(stream_t st, struct stream_frame_buffer* fb, struct timeval* timeout){
-	if ( !fb->read_frame(st, fb->frame[st->writePos], timeout) ){
+/**
+ * Fill as many free frames as possible (using read_frames).
+ */
+static int read_frames(stream_t st, struct stream_frame_buffer* fb, struct timeval* timeout){
+	/* frames from readPos up to writePos is in use (unless buffer is empty) */
+	const size_t n = fb->num_frames;
+	size_t available = fb->read_ptr ? (st->readPos + n - st->writePos) % n : n;
+	if ( available == 0 ){
 		return 0;
+	} else if ( available > MAX_READ_FRAMES ){
+		available = MAX_READ_FRAMES;
 	}
 
-	/* increment write position */
-	st->writePos = (st->writePos+1) % fb->num_frames;
-	return 1;
-}
+	char* dst[MAX_READ_FRAMES];
+	for ( size_t i = 0; i < available; i++ ){
+		dst[i] = fb->frame[(st->writePos + i) % n];
+	}
 
-int stream_frame_buffer_read(stream_t st, struct stream_frame_buffer* fb, struct cap_header** header, struct filter* filter, struct timeval* timeout){
-	/* I heard ext is a pretty cool guy, uses goto and doesn't afraid of anything */
-	retry:
+	const int frames = fb->read_frames(st, dst, available, timeout);
+	if ( frames <= 0 ){
+		return 0;
+	}
 
-	/* empty buffer */
-	if ( !fb->read_ptr ){
-		if ( !read_frame(st, fb, timeout) ){
-			return EAGAIN;
-		}
+	st->writePos = (st->writePos + frames) % n;
+	return 1;
+}
 
-		char* frame = fb->frame[st->readPos];
-		struct sendhead* sh = (struct sendhead*)(frame + fb->header_offset);
-		fb->read_ptr = frame + fb->header_offset + sizeof(struct sendhead);
-		fb->num_packets = ntohl(sh->nopkts);
+static int read_frame(stream_t st, struct stream_frame_buffer* fb, struct timeval* timeout){
+	if ( fb->read_frames ){
+		return read_frames(st, fb, timeout);
 	}
 
-	/* always read if there is space available */
-	if ( st->writePos != st->readPos ){
-		struct timeval tv = {0,0}; /* dont read with a timeout as we don't want to introduce delays here */
-		read_frame(st, fb, &tv);
+	if ( !fb->read_frame(st, fb->frame[st->writePos], timeout) ){
+		return 0;
 	}
 
+	/* increment write position */
+	st->writePos = (st->writePos+1) % fb->num_frames;
+	return 1;
+}
+
+/**
+ * Pop the next packet from the current frame and move to the next frame if
+ * needed. Requires read_ptr to be set.
+ */
+static struct cap_header* next_packet(stream_t st, struct stream_frame_buffer* fb){
 	/* no packets available */
 	if ( fb->num_packets == 0 ){
 		fprintf(stderr, "stream_frame_buffer_read: st->num_packets is 0 but st->read_ptr is set\n");
@@ -104,7 +122,33 @@ int stream_frame_buffer_read(stream_t st, struct stream_frame_buffer* fb, struct
 		}
 	}
 
+	return cp;
+}
+
+int stream_frame_buffer_read(stream_t st, struct stream_frame_buffer* fb, struct cap_header** header, struct filter* filter, struct timeval* timeout){
+	/* I heard ext is a pretty cool guy, uses goto and doesn't afraid of anything */
+	retry:
+
+	/* empty buffer */
+	if ( !fb->read_ptr ){
+		if ( !read_frame(st, fb, timeout) ){
+			return EAGAIN;
+		}
+
+		char* frame = fb->frame[st->readPos];
+		struct sendhead* sh = (struct sendhead*)(frame + fb->header_offset);
+		fb->read_ptr = frame + fb->header_offset + sizeof(struct sendhead);
+		fb->num_packets = ntohl(sh->nopkts);
+	}
+
+	/* always read if there is space available */
+	if ( st->writePos != st->readPos ){
+		struct timeval tv = {0,0}; /* dont read with a timeout as we don't want to introduce delays here */
+		read_frame(st, fb, &tv);
+	}
+
 	/* set next packet and advance the read pointer */
+	struct cap_header* cp = next_packet(st, fb);
 	*header = cp;
 	st->stat.read++;
 	st->stat.buffer_usage = 0;
@@ -116,3 +160,28 @@ int stream_frame_buffer_read(stream_t st, struct stream_frame_buffer* fb, struct
 	st->stat.matched++;
 	return 0;
 }
+
+int stream_frame_buffer_read_batch(stream_t st, struct stream_frame_buffer* fb, struct cap_header** header, size_t max, size_t* count, struct filter* filter, struct timeval* timeout){
+	int ret;
+	if ( (ret=stream_frame_buffer_read(st, fb, &header[0], filter, timeout)) != 0 ){
+		return ret;
+	}
+
+	/* continue with the frames already in the buffer, no new frames are read as
+	 * they could overwrite frames holding packets already returned. */
+	size_t n = 1;
+	while ( n < max && fb->read_ptr ){
+		struct cap_header* cp = next_packet(st, fb);
+		st->stat.read++;
+
+		if ( filter && !filter_match(filter, cp->payload, cp) ){
+			continue;
+		}
+
+		st->stat.matched++;
+		header[n++] = cp;
+	}
+
+	*count = n;
+	return 0;
+}
@@ -57,8 +57,16 @@ extern "C" {
 
 typedef int (*read_frame_callback)(stream_t st, char* dst, struct timeval* timeout);
 
+/**
+ * Read multiple frames at once.
+ * @param dst Array of max frames (which may not be consecutive in memory).
+ * @return Number of frames read (written to the first N elements of dst).
+ */
+typedef int (*read_frames_callback)(stream_t st, char** dst, size_t max, struct timeval* timeout);
+
 struct stream_frame_buffer {
 	read_frame_callback read_frame;  /* Read next frame */
+	read_frames_callback read_frames;/* Optional, read multiple frames (preferred over read_frame if set) */
 	size_t frame_size;               /* Number of bytes in one frame */
 	size_t num_frames;               /* How many frames that buffer can hold */
 	size_t num_packets;              /* How many packets is left in current frame */
@@ -85,6 +93,11 @@ void stream_frame_init(struct stream_frame_buffer* buf, read_frame_callback cb,
  */
 int stream_frame_buffer_read(stream_t st, struct stream_frame_buffer* fb, struct cap_header** cp, struct filter* filter, struct timeval* timeout);
 
+/**
+ * Read up to max packets from the buffer (see stream_read_batch).
+ */
+int stream_frame_buffer_read_batch(stream_t st, struct stream_frame_buffer* fb, struct cap_header** cp, size_t max, size_t* count, struct filter* filter, struct timeval* timeout);
+
 #ifdef __cplusplus
 }
 #endif
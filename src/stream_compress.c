@@ -0,0 +1,679 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "caputils/caputils.h"
+#include "caputils_int.h"
+#include "stream.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/**
+ * Compressed capfiles.
+ *
+ * The file header announces the codec using a header extension, the packets
+ * (i.e. what normally follows the comment) are stored in blocks which can be
+ * decompressed independently:
+ *
+ *   [block header][data] [block header][data] ... [index block][footer]
+ *
+ * Each block holds only whole packets (at least BLOCK_SIZE bytes unless it is
+ * the last or was flushed, flushing never emits blocks smaller than
+ * BLOCK_MIN_FLUSH so periodic flushes does not bloat the index) and is stored uncompressed if compression does not
+ * reduce the size. The index block holds one struct index_entry per block
+ * (same semantics as the capindex sidecar) and the footer locates the index so
+ * it can be found from the end of the file. A file without index (e.g. if the
+ * writer crashed) can still be read sequentially.
+ */
+
+#define BLOCK_SIZE (1024*1024)
+#define BLOCK_MIN_FLUSH (64*1024)
+#define BLOCK_MAX_SIZE (64*1024*1024)
+#define ZSTD_LEVEL 3
+
+enum block_flags {
+	BLOCK_STORED = (1<<0),  /* data is not compressed */
+	BLOCK_INDEX = (1<<1),   /* block index, no more packets follows */
+};
+
+struct block_header {
+	uint32_t size;          /* bytes following the header */
+	uint32_t raw_size;      /* bytes after decompression */
+	uint32_t num_packets;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct block_footer {
+	uint64_t index_offset;  /* file offset of first index entry */
+	uint64_t num_entries;
+	char magic[8];
+} __attribute__((packed));
+
+static const char footer_magic[8] = {'C', 'A', 'P', 'B', 'I', 'D', 'X', 1};
+
+int capfile_codec_supported(enum capfile_codec codec){
+	switch ( codec ){
+	case CAPFILE_CODEC_NONE:
+		return 1;
+#ifdef HAVE_LZ4
+	case CAPFILE_CODEC_LZ4:
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case CAPFILE_CODEC_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Ensure buffer can hold at least size bytes.
+ */
+static int reserve(char** buf, size_t* capacity, size_t size){
+	if ( size <= *capacity ){
+		return 0;
+	}
+
+	char* tmp = realloc(*buf, size);
+	if ( !tmp ){
+		return ENOMEM;
+	}
+	*buf = tmp;
+	*capacity = size;
+	return 0;
+}
+
+struct block_writer {
+	enum capfile_codec codec;
+	write_callback write;
+	struct stream* st;
+	off_t offset;                 /* file offset of next block */
+
+	/* raw data for current block, only packets before parsed are complete */
+	char* raw;
+	size_t used;
+	size_t parsed;
+	size_t capacity;
+
+	char* zbuf;
+	size_t zcapacity;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx* cctx;
+#endif
+
+	/* current block */
+	uint32_t num_packets;
+	timepico first;
+	timepico min;
+	timepico max;
+
+	uint64_t packet;              /* packets in previous blocks */
+	timepico before;              /* latest timestamp in previous blocks */
+	struct index_entry* index;
+	size_t num_entries;
+	size_t max_entries;
+};
+
+static size_t compress_bound(const struct block_writer* bw, size_t size){
+	switch ( bw->codec ){
+#ifdef HAVE_LZ4
+	case CAPFILE_CODEC_LZ4:
+		return LZ4_compressBound(size);
+#endif
+#ifdef HAVE_ZSTD
+	case CAPFILE_CODEC_ZSTD:
+		return ZSTD_compressBound(size);
+#endif
+	default:
+		return size;
+	}
+}
+
+/**
+ * @return Compressed size or zero if it could not be compressed.
+ */
+static size_t compress_block(struct block_writer* bw, size_t size){
+	switch ( bw->codec ){
+#ifdef HAVE_LZ4
+	case CAPFILE_CODEC_LZ4:
+		return LZ4_compress_default(bw->raw, bw->zbuf, size, bw->zcapacity);
+#endif
+#ifdef HAVE_ZSTD
+	case CAPFILE_CODEC_ZSTD: {
+		const size_t ret = ZSTD_compressCCtx(bw->cctx, bw->zbuf, bw->zcapacity, bw->raw, size, ZSTD_LEVEL);
+		return ZSTD_isError(ret) ? 0 : ret;
+	}
+#endif
+	default:
+		return 0;
+	}
+}
+
+int block_writer_new(struct block_writer** bwptr, enum capfile_codec codec, off_t offset, write_callback write, struct stream* st){
+	if ( codec == CAPFILE_CODEC_NONE || !capfile_codec_supported(codec) ){
+		return ERROR_CAPFILE_CODEC;
+	}
+
+	struct block_writer* bw = calloc(1, sizeof(struct block_writer));
+	if ( !bw ){
+		return ENOMEM;
+	}
+
+	bw->codec = codec;
+	bw->write = write;
+	bw->st = st;
+	bw->offset = offset;
+
+#ifdef HAVE_ZSTD
+	if ( codec == CAPFILE_CODEC_ZSTD && !(bw->cctx=ZSTD_createCCtx()) ){
+		free(bw);
+		return ENOMEM;
+	}
+#endif
+
+	if ( reserve(&bw->raw, &bw->capacity, 2 * BLOCK_SIZE) != 0 ||
+	     reserve(&bw->zbuf, &bw->zcapacity, compress_bound(bw, 2 * BLOCK_SIZE)) != 0 ){
+		free(bw->raw);
+		free(bw->zbuf);
+		free(bw);
+		return ENOMEM;
+	}
+
+	*bwptr = bw;
+	return 0;
+}
+
+/**
+ * Compress and write the first size bytes of the raw buffer as a block.
+ */
+static int emit_block(struct block_writer* bw, size_t size){
+	int ret;
+	if ( size == 0 ){
+		return 0;
+	}
+
+	if ( (ret=reserve(&bw->zbuf, &bw->zcapacity, compress_bound(bw, size))) != 0 ){
+		return ret;
+	}
+
+	struct block_header head = {0, size, bw->num_packets, 0};
+	const char* data = bw->zbuf;
+	head.size = compress_block(bw, size);
+	if ( head.size == 0 || head.size >= size ){
+		head.size = size;
+		head.flags = BLOCK_STORED;
+		data = bw->raw;
+	}
+
+	/* index entry for block */
+	if ( bw->num_packets > 0 ){
+		if ( bw->num_entries == bw->max_entries ){
+			bw->max_entries = bw->max_entries ? 2 * bw->max_entries : 1024;
+			struct index_entry* tmp = realloc(bw->index, bw->max_entries * sizeof(struct index_entry));
+			if ( !tmp ){
+				return ENOMEM;
+			}
+			bw->index = tmp;
+		}
+
+		struct index_entry* cur = &bw->index[bw->num_entries++];
+		cur->offset = bw->offset;
+		cur->packet = bw->packet;
+		cur->ts = bw->first;
+		cur->before = bw->before;
+		cur->after = bw->min;
+
+		if ( timecmp(&bw->max, &bw->before) > 0 ){
+			bw->before = bw->max;
+		}
+	}
+
+	if ( (ret=bw->write(bw->st, &head, sizeof(struct block_header))) != 0 ||
+	     (ret=bw->write(bw->st, data, head.size)) != 0 ){
+		return ret;
+	}
+
+	bw->offset += sizeof(struct block_header) + head.size;
+	bw->packet += bw->num_packets;
+	bw->num_packets = 0;
+
+	/* keep trailing partial packet */
+	memmove(bw->raw, bw->raw + size, bw->used - size);
+	bw->used -= size;
+	bw->parsed = bw->parsed > size ? bw->parsed - size : 0;
+
+	return 0;
+}
+
+int block_writer_write(struct block_writer* bw, const void* data, size_t size){
+	int ret;
+	if ( (ret=reserve(&bw->raw, &bw->capacity, bw->used + size)) != 0 ){
+		return ret;
+	}
+	memcpy(bw->raw + bw->used, data, size);
+	bw->used += size;
+
+	/* blocks must end at packet boundaries */
+	while ( bw->used - bw->parsed >= sizeof(struct cap_header) ){
+		const struct cap_header* cp = (const struct cap_header*)(bw->raw + bw->parsed);
+		const size_t bytes = sizeof(struct cap_header) + cp->caplen;
+		if ( bw->used - bw->parsed < bytes ){
+			break;
+		}
+
+		if ( bw->num_packets++ == 0 ){
+			bw->first = bw->min = bw->max = cp->ts;
+		} else if ( timecmp(&cp->ts, &bw->min) < 0 ){
+			bw->min = cp->ts;
+		} else if ( timecmp(&cp->ts, &bw->max) > 0 ){
+			bw->max = cp->ts;
+		}
+		bw->parsed += bytes;
+	}
+
+	if ( bw->parsed >= BLOCK_SIZE ){
+		return emit_block(bw, bw->parsed);
+	}
+
+	return 0;
+}
+
+int block_writer_flush(struct block_writer* bw){
+	if ( bw->parsed < BLOCK_MIN_FLUSH ){
+		return 0;
+	}
+	return emit_block(bw, bw->parsed);
+}
+
+int block_writer_close(struct block_writer* bw){
+	/* trailing partial packet is written as-is */
+	int ret = emit_block(bw, bw->used);
+
+	if ( ret == 0 ){
+		stream_index_finalize(bw->index, bw->num_entries);
+
+		const size_t size = bw->num_entries * sizeof(struct index_entry);
+		const struct block_header head = {size, 0, 0, BLOCK_INDEX};
+		struct block_footer footer;
+		footer.index_offset = bw->offset + sizeof(struct block_header);
+		footer.num_entries = bw->num_entries;
+		memcpy(footer.magic, footer_magic, sizeof(footer_magic));
+
+		if ( (ret=bw->write(bw->st, &head, sizeof(struct block_header))) == 0 && size > 0 ){
+			ret = bw->write(bw->st, bw->index, size);
+		}
+		if ( ret == 0 ){
+			ret = bw->write(bw->st, &footer, sizeof(struct block_footer));
+		}
+	}
+
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(bw->cctx);
+#endif
+	free(bw->index);
+	free(bw->raw);
+	free(bw->zbuf);
+	free(bw);
+	return ret;
+}
+
+enum block_state {
+	BLOCK_EMPTY,
+	BLOCK_READY,
+	BLOCK_END,
+	BLOCK_ERROR,
+};
+
+struct block {
+	enum block_state state;
+	int error;
+	char* data;
+	size_t size;
+	size_t capacity;
+	off_t offset;                 /* file offset of block */
+	off_t next;                   /* file offset of following block */
+};
+
+struct block_reader {
+	enum capfile_codec codec;
+	FILE* fp;
+
+	/* decoder thread fills slot[tail] while slot[head] is consumed */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;
+	int stop;
+	struct block slot[2];
+	unsigned int head;
+	unsigned int tail;
+	off_t limit;                  /* zero if unlimited */
+
+	/* decoder thread only */
+	off_t offset;                 /* file offset of next block */
+	char* zbuf;
+	size_t zcapacity;
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx* dctx;
+#endif
+
+	/* consumer only */
+	size_t pos;                   /* read position in slot[head] */
+	off_t position;               /* offset of block being consumed */
+
+	/* block index (loaded on first use), negative if missing */
+	int have_index;
+	off_t index_offset;
+	uint64_t num_entries;
+};
+
+static int decompress_block(struct block_reader* br, struct block* blk, size_t size){
+	switch ( br->codec ){
+#ifdef HAVE_LZ4
+	case CAPFILE_CODEC_LZ4:
+		return LZ4_decompress_safe(br->zbuf, blk->data, size, blk->size) == (int)blk->size ? 0 : ERROR_CAPFILE_INVALID;
+#endif
+#ifdef HAVE_ZSTD
+	case CAPFILE_CODEC_ZSTD:
+		return ZSTD_decompressDCtx(br->dctx, blk->data, blk->size, br->zbuf, size) == blk->size ? 0 : ERROR_CAPFILE_INVALID;
+#endif
+	default:
+		return ERROR_CAPFILE_CODEC;
+	}
+}
+
+/**
+ * Read and decompress the next block.
+ */
+static enum block_state decode_block(struct block_reader* br, struct block* blk){
+	struct block_header head;
+	const size_t bytes = fread(&head, 1, sizeof(struct block_header), br->fp);
+	if ( bytes == 0 && feof(br->fp) ){
+		return BLOCK_END;
+	} else if ( bytes < sizeof(struct block_header) ){
+		blk->error = ferror(br->fp) ? errno : ERROR_CAPFILE_TRUNCATED;
+		return BLOCK_ERROR;
+	}
+
+	if ( head.flags & BLOCK_INDEX ){
+		return BLOCK_END;
+	}
+
+	if ( head.size > BLOCK_MAX_SIZE || head.raw_size > BLOCK_MAX_SIZE ||
+	     ((head.flags & BLOCK_STORED) && head.size != head.raw_size) ){
+		blk->error = ERROR_CAPFILE_INVALID;
+		return BLOCK_ERROR;
+	}
+
+	if ( (blk->error=reserve(&blk->data, &blk->capacity, head.raw_size)) != 0 ||
+	     (!(head.flags & BLOCK_STORED) && (blk->error=reserve(&br->zbuf, &br->zcapacity, head.size)) != 0) ){
+		return BLOCK_ERROR;
+	}
+
+	char* dst = (head.flags & BLOCK_STORED) ? blk->data : br->zbuf;
+	if ( fread(dst, 1, head.size, br->fp) < head.size ){
+		blk->error = ferror(br->fp) ? errno : ERROR_CAPFILE_TRUNCATED;
+		return BLOCK_ERROR;
+	}
+
+	blk->size = head.raw_size;
+	if ( !(head.flags & BLOCK_STORED) && (blk->error=decompress_block(br, blk, head.size)) != 0 ){
+		return BLOCK_ERROR;
+	}
+
+	blk->offset = br->offset;
+	br->offset += sizeof(struct block_header) + head.size;
+	blk->next = br->offset;
+	return BLOCK_READY;
+}
+
+static void* block_reader_thread(void* ptr){
+	struct block_reader* br = (struct block_reader*)ptr;
+
+	pthread_mutex_lock(&br->mutex);
+	while ( !br->stop ){
+		struct block* blk = &br->slot[br->tail];
+		if ( blk->state != BLOCK_EMPTY ){
+			pthread_cond_wait(&br->cond, &br->mutex);
+			continue;
+		}
+
+		/* don't read past the limit */
+		const int end = br->limit > 0 && br->offset >= br->limit;
+		pthread_mutex_unlock(&br->mutex);
+
+		const enum block_state state = end ? BLOCK_END : decode_block(br, blk);
+
+		pthread_mutex_lock(&br->mutex);
+		blk->state = state;
+		br->tail ^= 1;
+		pthread_cond_broadcast(&br->cond);
+		if ( state != BLOCK_READY ){
+			break;
+		}
+	}
+	pthread_mutex_unlock(&br->mutex);
+
+	return NULL;
+}
+
+static int block_reader_start(struct block_reader* br){
+	br->stop = 0;
+	br->head = 0;
+	br->tail = 0;
+	br->pos = 0;
+	br->slot[0].state = BLOCK_EMPTY;
+	br->slot[1].state = BLOCK_EMPTY;
+
+	int ret;
+	if ( (ret=pthread_create(&br->thread, NULL, block_reader_thread, br)) != 0 ){
+		return ret;
+	}
+	br->running = 1;
+	return 0;
+}
+
+static void block_reader_stop(struct block_reader* br){
+	if ( !br->running ){
+		return;
+	}
+
+	pthread_mutex_lock(&br->mutex);
+	br->stop = 1;
+	pthread_cond_broadcast(&br->cond);
+	pthread_mutex_unlock(&br->mutex);
+
+	pthread_join(br->thread, NULL);
+	br->running = 0;
+}
+
+int block_reader_new(struct block_reader** brptr, enum capfile_codec codec, FILE* fp, off_t offset){
+	if ( codec == CAPFILE_CODEC_NONE || !capfile_codec_supported(codec) ){
+		return ERROR_CAPFILE_CODEC;
+	}
+
+	struct block_reader* br = calloc(1, sizeof(struct block_reader));
+	if ( !br ){
+		return ENOMEM;
+	}
+
+	br->codec = codec;
+	br->fp = fp;
+	br->offset = offset;
+	br->position = offset;
+	pthread_mutex_init(&br->mutex, NULL);
+	pthread_cond_init(&br->cond, NULL);
+
+#ifdef HAVE_ZSTD
+	if ( codec == CAPFILE_CODEC_ZSTD && !(br->dctx=ZSTD_createDCtx()) ){
+		block_reader_free(br);
+		return ENOMEM;
+	}
+#endif
+
+	int ret;
+	if ( (ret=block_reader_start(br)) != 0 ){
+		block_reader_free(br);
+		return ret;
+	}
+
+	*brptr = br;
+	return 0;
+}
+
+void block_reader_free(struct block_reader* br){
+	block_reader_stop(br);
+	pthread_mutex_destroy(&br->mutex);
+	pthread_cond_destroy(&br->cond);
+#ifdef HAVE_ZSTD
+	ZSTD_freeDCtx(br->dctx);
+#endif
+	free(br->slot[0].data);
+	free(br->slot[1].data);
+	free(br->zbuf);
+	free(br);
+}
+
+int block_reader_read(struct block_reader* br, char* dst, size_t max){
+	for (;;){
+		struct block* blk = &br->slot[br->head];
+
+		pthread_mutex_lock(&br->mutex);
+		while ( blk->state == BLOCK_EMPTY ){
+			pthread_cond_wait(&br->cond, &br->mutex);
+		}
+		const enum block_state state = blk->state;
+		const off_t limit = br->limit;
+		pthread_mutex_unlock(&br->mutex);
+
+		if ( state == BLOCK_END ){
+			return 0;
+		} else if ( state == BLOCK_ERROR ){
+			errno = blk->error;
+			return -1;
+		} else if ( limit > 0 && blk->offset >= limit ){
+			return 0;
+		}
+
+		const size_t left = blk->size - br->pos;
+		const size_t bytes = left < max ? left : max;
+		memcpy(dst, blk->data + br->pos, bytes);
+		br->pos += bytes;
+		br->position = blk->offset;
+
+		/* release block to decoder */
+		if ( br->pos == blk->size ){
+			pthread_mutex_lock(&br->mutex);
+			blk->state = BLOCK_EMPTY;
+			br->head ^= 1;
+			br->pos = 0;
+			br->position = blk->next;
+			pthread_cond_broadcast(&br->cond);
+			pthread_mutex_unlock(&br->mutex);
+		}
+
+		if ( bytes > 0 ){
+			return bytes;
+		}
+	}
+}
+
+off_t block_reader_position(const struct block_reader* br){
+	return br->position;
+}
+
+int block_reader_seek(struct block_reader* br, off_t offset){
+	block_reader_stop(br);
+
+	if ( fseeko(br->fp, offset, SEEK_SET) != 0 ){
+		return errno;
+	}
+
+	br->offset = offset;
+	br->position = offset;
+	return block_reader_start(br);
+}
+
+void block_reader_limit(struct block_reader* br, off_t offset){
+	pthread_mutex_lock(&br->mutex);
+	if ( br->limit == 0 || offset < br->limit ){
+		br->limit = offset;
+	}
+	pthread_mutex_unlock(&br->mutex);
+}
+
+/**
+ * Locate block index using the footer.
+ */
+static int load_index(struct block_reader* br){
+	if ( br->have_index ){
+		return br->have_index > 0 ? 0 : ENOENT;
+	}
+
+	const int fd = fileno(br->fp);
+	struct stat sb;
+	struct block_footer footer;
+	br->have_index = -1;
+
+	if ( fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size < (off_t)sizeof(struct block_footer) ||
+	     pread(fd, &footer, sizeof(struct block_footer), sb.st_size - sizeof(struct block_footer)) != sizeof(struct block_footer) ||
+	     memcmp(footer.magic, footer_magic, sizeof(footer_magic)) != 0 ||
+	     footer.index_offset + footer.num_entries * sizeof(struct index_entry) + sizeof(struct block_footer) != (uint64_t)sb.st_size ){
+		return ENOENT;
+	}
+
+	br->have_index = 1;
+	br->index_offset = footer.index_offset;
+	br->num_entries = footer.num_entries;
+	return 0;
+}
+
+int block_reader_search(struct block_reader* br, const timepico t, int stop, struct index_entry* entry){
+	int ret;
+	if ( (ret=load_index(br)) != 0 ){
+		return ret;
+	}
+	return stream_index_search(fileno(br->fp), br->index_offset, br->num_entries, t, stop, entry);
+}
+
+int block_reader_search_offset(struct block_reader* br, uint64_t offset, struct index_entry* entry){
+	int ret;
+	if ( (ret=load_index(br)) != 0 ){
+		return ret;
+	}
+	return stream_index_search_offset(fileno(br->fp), br->index_offset, br->num_entries, offset, entry);
+}
@@ -31,14 +31,46 @@
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <net/if.h>
 #include <arpa/inet.h>
 
 #define MAX_ADDRESS 100
 
+/* TP_STATUS_BLK_TMO was introduced together with TPACKET_V3 (which is an enum) */
+#ifdef TP_STATUS_BLK_TMO
+#define HAVE_TPACKET_V3 1
+#endif
+
+#define RING_BLOCK_SIZE (1<<20)
+#define RING_FRAME_SIZE (1<<11)
+#define RING_MIN_BLOCKS 8
+#define RING_BLOCK_TIMEOUT 10 /* ms until a partially filled block is handed to userspace */
+
+/**
+ * Receive ring (PACKET_RX_RING using TPACKET_V3) shared with the kernel. The
+ * kernel fills whole blocks with frames, each block is walked in place and
+ * handed back once all packets in it has been consumed.
+ */
+struct stream_ring {
+	char* map;                       /* NULL if ring isn't used */
+	size_t map_size;
+	size_t block_size;
+	size_t num_blocks;
+	size_t cur;                      /* current block index */
+	struct tpacket_block_desc* block;/* current block or NULL if it has to be fetched */
+	size_t frames_left;              /* frames left in current block */
+	struct tpacket3_hdr* next;       /* next frame in current block */
+	char* read_ptr;                  /* next packet in current frame */
+	size_t num_packets;              /* packets left in current frame */
+};
+
 struct stream_ethernet {
 	struct stream base;
 	int socket;
@@ -47,6 +79,7 @@ struct stream_ethernet {
 	struct sockaddr_ll sll;
 	struct ether_addr address[MAX_ADDRESS];
 	long unsigned int seqnum[MAX_ADDRESS];
+	struct stream_ring ring;
 
 	struct stream_frame_buffer fb;
 	char* frame[0];
@@ -77,6 +110,66 @@ static int match_ma_pkt(const struct stream_ethernet* st, const struct ethhdr* e
 	return match;
 }
 
+/**
+ * Validate a received frame and update sequence numbers and stats.
+ * @return 1 if the frame should be used, 0 if it should be ignored and -1 if
+ *         the stream cannot continue.
+ */
+static int accept_frame(struct stream_ethernet* st, const char* frame, size_t bytes){
+	/* Setup pointers */
+	const struct ethhdr* eh = (const struct ethhdr*)frame;
+	const struct sendhead* sh = (const struct sendhead*)(frame + sizeof(struct ethhdr));
+
+	/* Check if it is a valid packet and if it was destinationed here */
+	int match;
+	if ( (match=match_ma_pkt(st, eh)) == -1 ){
+		return 0;
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "got measurement frame with %d capture packets [BU: %3.2f%%]\n", ntohl(sh->nopkts), 0.0f);
+	fprintf(stderr, "  address: %s (%d)\n", hexdump_address(&st->address[match]), match);
+#endif
+
+	/* validate frame */
+	if ( !valid_framesize(bytes, sh) ){
+		/* error message already shown */
+		return 0;
+	}
+
+	/* increase packet count */
+	st->base.stat.recv += ntohl(sh->nopkts);
+
+	/* if no sequencenr is set some additional checks are made.
+	 * they will also run when the sequence number wraps, but that ok since the
+	 * sequence number will match in that case anyway. */
+	if ( st->seqnum[match] == 0 ){
+		/* read stream version */
+		struct file_header_t FH;
+		FH.version.major=ntohs(sh->version.major);
+		FH.version.minor=ntohs(sh->version.minor);
+
+		/* ensure we can read this version */
+		if ( !is_valid_version(&FH) ){
+			perror("invalid stream version");
+			return -1;
+		}
+
+		/* this is set last, as we want to wait until a packet with valid version
+		 * arrives before proceeding. */
+		st->seqnum[match] = ntohl(sh->sequencenr);
+	}
+	match_inc_seqnr(&st->base, &st->seqnum[match], sh);
+
+	/* This indicates a flush from the sender.. */
+	if( ntohl(sh->flags) & SENDER_FLUSH ){
+		fprintf(stderr, "Sender terminated.\n");
+		st->base.flushed=1;
+	}
+
+	return 1;
+}
+
 static int stream_ethernet_read_frame(struct stream_ethernet* st, char* dst, struct timeval* timeout){
 	assert(st);
 	assert(dst);
@@ -100,68 +193,189 @@ static int stream_ethernet_read_frame(struct stream_ethernet* st, char* dst, str
 			break;
 		}
 
-		/* Setup pointers */
-		const struct ethhdr* eh = (const struct ethhdr*)dst;
-		const struct sendhead* sh = (const struct sendhead*)(dst + sizeof(struct ethhdr));
+		switch ( accept_frame(st, dst, bytes) ){
+		case 1: return 1;
+		case 0: continue;
+		default: return 0;
+		}
+	} while (1);
+
+	return 0;
+}
+
+#ifdef HAVE_TPACKET_V3
+/**
+ * Move to the next accepted frame in the ring.
+ * @param retire If non-zero, fully consumed blocks are handed back to the
+ *               kernel and new blocks may be waited for. If zero it only
+ *               continues within the current block.
+ * @return 0 if a frame is available, EAGAIN on timeout (or end of block if not
+ *         retiring) and other errors.
+ */
+static int ring_next_frame(struct stream_ethernet* st, int retire, struct timeval* timeout){
+	struct stream_ring* ring = &st->ring;
+
+	while ( ring->num_packets == 0 ){
+		/* fetch next block */
+		if ( ring->frames_left == 0 ){
+			if ( !retire ){
+				return EAGAIN;
+			}
+
+			/* all packets from current block has been consumed by the user */
+			if ( ring->block ){
+				ring->block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+				ring->block = NULL;
+				ring->cur = (ring->cur + 1) % ring->num_blocks;
+			}
+
+			struct tpacket_block_desc* block = (struct tpacket_block_desc*)(ring->map + ring->cur * ring->block_size);
+			if ( (block->hdr.bh1.block_status & TP_STATUS_USER) == 0 ){
+				struct pollfd pfd = {st->socket, POLLIN | POLLERR, 0};
+				const int ms = timeout ? (timeout->tv_sec * 1000 + timeout->tv_usec / 1000) : -1;
+				const int ret = poll(&pfd, 1, ms);
+				if ( ret < 0 ){
+					return errno;
+				} else if ( ret == 0 ){
+					return EAGAIN;
+				}
+
+				/* data might have been written to the socket error queue only */
+				if ( (block->hdr.bh1.block_status & TP_STATUS_USER) == 0 ){
+					return EAGAIN;
+				}
+			}
 
-		/* Check if it is a valid packet and if it was destinationed here */
-		int match;
-		if ( (match=match_ma_pkt(st, eh)) == -1 ){
+			ring->block = block;
+			ring->frames_left = block->hdr.bh1.num_pkts;
+			ring->next = (struct tpacket3_hdr*)((char*)block + block->hdr.bh1.offset_to_first_pkt);
 			continue;
 		}
 
-#ifdef DEBUG
-		fprintf(stderr, "got measurement frame with %d capture packets [BU: %3.2f%%]\n", ntohl(sh->nopkts), 0.0f);
-		fprintf(stderr, "  address: %s (%d)\n", hexdump_address(&st->address[match]), match);
-#endif
+		/* next frame in block */
+		struct tpacket3_hdr* tp = ring->next;
+		ring->frames_left--;
+		ring->next = (struct tpacket3_hdr*)((char*)tp + tp->tp_next_offset);
 
-		/* validate frame */
-		if ( !valid_framesize(bytes, sh) ){
-			/* error message already shown */
-			continue;
+		char* frame = (char*)tp + tp->tp_mac;
+		switch ( accept_frame(st, frame, tp->tp_snaplen) ){
+		case 1:
+			ring->read_ptr = frame + sizeof(struct ethhdr) + sizeof(struct sendhead);
+			ring->num_packets = ntohl(((const struct sendhead*)(frame + sizeof(struct ethhdr)))->nopkts);
+			break;
+		case 0:
+			break;
+		default:
+			return EINVAL;
 		}
+	}
 
-		/* increase packet count */
-		st->base.stat.recv += ntohl(sh->nopkts);
-
-		/* if no sequencenr is set some additional checks are made.
-		 * they will also run when the sequence number wraps, but that ok since the
-		 * sequence number will match in that case anyway. */
-		if ( st->seqnum[match] == 0 ){
-			/* read stream version */
-			struct file_header_t FH;
-			FH.version.major=ntohs(sh->version.major);
-			FH.version.minor=ntohs(sh->version.minor);
-
-			/* ensure we can read this version */
-			if ( !is_valid_version(&FH) ){
-				perror("invalid stream version");
-				break;
-			}
+	return 0;
+}
+
+static struct cap_header* ring_next_packet(struct stream_ring* ring){
+	struct cap_header* cp = (struct cap_header*)ring->read_ptr;
+	ring->read_ptr += sizeof(struct cap_header) + cp->caplen;
+	ring->num_packets--;
+	return cp;
+}
 
-			/* this is set last, as we want to wait until a packet with valid version
-			 * arrives before proceeding. */
-			st->seqnum[match] = ntohl(sh->sequencenr);
+static int stream_ethernet_ring_read(struct stream_ethernet* st, cap_head** header, struct filter* filter, struct timeval* timeout){
+	int ret;
+
+	do {
+		if ( (ret=ring_next_frame(st, 1, timeout)) != 0 ){
+			return ret;
 		}
-		match_inc_seqnr(&st->base, &st->seqnum[match], sh);
 
-		/* This indicates a flush from the sender.. */
-		if( ntohl(sh->flags) & SENDER_FLUSH ){
-			fprintf(stderr, "Sender terminated.\n");
-			st->base.flushed=1;
+		*header = ring_next_packet(&st->ring);
+		st->base.stat.read++;
+	} while ( filter && !filter_match(filter, (*header)->payload, *header) );
+
+	st->base.stat.matched++;
+	return 0;
+}
+
+static int stream_ethernet_ring_read_batch(struct stream_ethernet* st, cap_head** header, size_t max, size_t* count, struct filter* filter, struct timeval* timeout){
+	int ret;
+	if ( (ret=stream_ethernet_ring_read(st, &header[0], filter, timeout)) != 0 ){
+		return ret;
+	}
+
+	/* continue within the current block only, it must not be retired until the
+	 * next call as the returned packets refers to it */
+	size_t n = 1;
+	while ( n < max && ring_next_frame(st, 0, NULL) == 0 ){
+		struct cap_header* cp = ring_next_packet(&st->ring);
+		st->base.stat.read++;
+
+		if ( filter && !filter_match(filter, cp->payload, cp) ){
+			continue;
 		}
 
-		return 1;
+		st->base.stat.matched++;
+		header[n++] = cp;
+	}
 
-	} while (1);
+	*count = n;
+	return 0;
+}
+
+/**
+ * Setup a TPACKET_V3 receive ring.
+ * @return Non-zero if the ring could not be setup (regular recvfrom is used).
+ */
+static int stream_ethernet_ring_init(struct stream_ethernet* st, size_t buffer_size){
+	struct stream_ring* ring = &st->ring;
+	int version = TPACKET_V3;
+	if ( setsockopt(st->socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0 ){
+		return errno;
+	}
+
+	size_t num_blocks = buffer_size / RING_BLOCK_SIZE;
+	if ( num_blocks < RING_MIN_BLOCKS ){
+		num_blocks = RING_MIN_BLOCKS;
+	}
+
+	struct tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RING_BLOCK_SIZE;
+	req.tp_block_nr = num_blocks;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * num_blocks;
+	req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT;
+	if ( setsockopt(st->socket, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0 ){
+		return errno;
+	}
+
+	const size_t map_size = (size_t)req.tp_block_size * req.tp_block_nr;
+	char* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, st->socket, 0);
+	if ( map == MAP_FAILED ){
+		map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, st->socket, 0);
+	}
+	if ( map == MAP_FAILED ){
+		return errno;
+	}
+
+	memset(ring, 0, sizeof(struct stream_ring));
+	ring->map = map;
+	ring->map_size = map_size;
+	ring->block_size = req.tp_block_size;
+	ring->num_blocks = req.tp_block_nr;
+	st->base.stat.buffer_size = map_size;
 
 	return 0;
 }
+#endif /* HAVE_TPACKET_V3 */
 
 int stream_ethernet_read(struct stream_ethernet* st, cap_head** cp, struct filter* filter, struct timeval* timeout){
 	return stream_frame_buffer_read(&st->base, &st->fb, cp, filter, timeout);
 }
 
+static int stream_ethernet_read_batch(struct stream_ethernet* st, cap_head** cp, size_t max, size_t* count, struct filter* filter, struct timeval* timeout){
+	return stream_frame_buffer_read_batch(&st->base, &st->fb, cp, max, count, filter, timeout);
+}
+
 static long stream_ethernet_write(struct stream_ethernet* st, const void* data, size_t size){
 	const size_t payload_size = size - sizeof(struct ethhdr);
 	if ( payload_size > st->base.if_mtu ){
@@ -267,6 +481,7 @@ static int stream_ethernet_init(struct stream** stptr, const struct ether_addr*
 	}
 
 	st->fb.header_offset = sizeof(struct ethhdr);
+	st->ring.map = NULL;
 	st->if_index = ifstat.if_index;
 	st->base.if_loopback = ifstat.if_loopback;
 	memset(st->seqnum, 0, sizeof(long unsigned int) * MAX_ADDRESS);
@@ -292,6 +507,10 @@ static int stream_ethernet_init(struct stream** stptr, const struct ether_addr*
 }
 
 static long destroy(struct stream_ethernet* st){
+	if ( st->ring.map ){
+		munmap(st->ring.map, st->ring.map_size);
+	}
+	close(st->socket);
 	free(st->base.comment);
 	free(st);
 	return 0;
@@ -335,6 +554,75 @@ long stream_ethernet_open(struct stream** stptr, const struct ether_addr* addr,
 	st->base.destroy = (destroy_callback)destroy;
 	st->base.write = NULL;
 	st->base.read = (read_callback)stream_ethernet_read;
+	st->base.read_batch = (read_batch_callback)stream_ethernet_read_batch;
+
+#ifdef HAVE_TPACKET_V3
+	/* use a ring shared with the kernel instead of copying each frame using
+	 * recvfrom (if supported) */
+	if ( stream_ethernet_ring_init(st, buffer_size) == 0 ){
+		st->base.read = (read_callback)stream_ethernet_ring_read;
+		st->base.read_batch = (read_batch_callback)stream_ethernet_ring_read_batch;
+	}
+#endif
+
+	return 0;
+}
+
+/**
+ * Join socket to fanout group. Frames are distributed using a BPF program
+ * hashing the destination address (i.e. the sequence domain) so all frames for
+ * one address always ends up at the same socket.
+ */
+static int join_fanout(struct stream_ethernet* st, int group, size_t num, int first){
+#if defined(PACKET_FANOUT) && defined(PACKET_FANOUT_CBPF)
+	const int arg = group | (PACKET_FANOUT_CBPF << 16);
+	if ( setsockopt(st->socket, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) != 0 ){
+		return errno == EINVAL ? ERROR_NOT_IMPLEMENTED : errno;
+	}
+
+	/* the program is shared by the group so only the first socket sets it */
+	if ( first ){
+		struct sock_filter code[] = {
+			BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_LL_OFF + 2), /* last 4 bytes of destination address */
+			BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num),
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		};
+		struct sock_fprog prog = {sizeof(code) / sizeof(struct sock_filter), code};
+		if ( setsockopt(st->socket, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog)) != 0 ){
+			return errno;
+		}
+	}
 
 	return 0;
+#else
+	return ERROR_NOT_IMPLEMENTED;
+#endif
+}
+
+long stream_ethernet_open_fanout(struct stream** stptr, size_t num, const struct ether_addr* addr, const char* iface, size_t buffer_size){
+	static unsigned int counter = 0;
+	const int group = (getpid() + counter++) & 0xffff;
+	long ret = 0;
+
+	size_t opened;
+	for ( opened = 0; opened < num; opened++ ){
+		if ( (ret=stream_ethernet_open(&stptr[opened], addr, iface, buffer_size)) != 0 ){
+			break;
+		}
+
+		/* opened successfully so it must be closed even if joining fails */
+		if ( (ret=join_fanout((struct stream_ethernet*)stptr[opened], group, num, opened == 0)) != 0 ){
+			opened++;
+			break;
+		}
+	}
+
+	if ( ret != 0 ){
+		for ( size_t j = 0; j < opened; j++ ){
+			stream_close(stptr[j]);
+			stptr[j] = NULL;
+		}
+	}
+
+	return ret;
 }
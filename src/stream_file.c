@@ -24,15 +24,35 @@
 #include "caputils/caputils.h"
 #include "caputils_int.h"
 #include "stream.h"
+#include <aio.h>
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* amount of mapped data exposed (and prefetched) at once */
+#define MMAP_WINDOW_SIZE (4*1024*1024)
+
+/* size of each buffer used by asynchronous writes (must be a multiple of
+ * ASYNC_BUFFER_ALIGN which in turn must satisfy O_DIRECT requirements) */
+#define ASYNC_BUFFER_SIZE (4*1024*1024)
+#define ASYNC_BUFFER_ALIGN 4096
+
+/* resynchronizing to a packet boundary when splitting a capfile requires this
+ * many consecutive valid headers (or ending exactly at the end of file) */
+#define RESYNC_NUM_HEADERS 8
+#define RESYNC_MAX_LEN (256*1024)
 
 enum extension_type {
 	HEADER_EXT_NONE = 0,
 	HEADER_EXT_PADDING = 1,
+	HEADER_EXT_COMPRESSION = 2,
 };
 
 struct file_extension {
@@ -40,10 +60,51 @@ struct file_extension {
 	uint16_t next_offset; /* sizeof(header) + sizeof(data) */
 };
 
+/* data for HEADER_EXT_COMPRESSION */
+struct compression_extension {
+	uint32_t codec;       /* enum capfile_codec */
+	uint32_t reserved;
+};
+
+struct write_buffer {
+	char* data;
+	size_t used;
+	struct aiocb cb;
+	int pending;     /* set if cb is queued */
+};
+
 struct stream_file {
 	struct stream base;
 	FILE* file;
 	int force_flush; /* force stream to be flushed on every write */
+
+	/* asynchronous writing: one buffer is filled while the other is written */
+	int async;
+	int direct;                   /* O_DIRECT, only aligned blocks may be written */
+	off_t offset;                 /* file offset of next write */
+	struct write_buffer wbuf[2];
+	struct write_buffer* cur;     /* buffer currently being filled */
+
+	/* durability policy (zero means disabled) */
+	size_t sync_bytes;
+	unsigned int sync_msec;
+	size_t unsynced;              /* bytes written since last sync */
+	struct timespec last_sync;
+	struct aiocb sync_cb;
+	int sync_pending;
+
+	/* filename (NULL if opened from FILE), used to locate the index */
+	char* filename;
+	off_t limit;     /* stop reading at this offset (zero if unlimited) */
+
+	/* memory-mapped reading */
+	char* map;       /* start of mapping (NULL if not mapped) */
+	size_t map_size;
+	size_t released; /* offset (in buffer) up to which pages has been released */
+
+	/* compressed capfiles (NULL if not compressed) */
+	struct block_writer* writer;
+	struct block_reader* reader;
 };
 
 static int stream_file_fillbuffer(struct stream_file* st, struct timeval* timeout, char* dst, size_t max){
@@ -51,6 +112,16 @@ static int stream_file_fillbuffer(struct stream_file* st, struct timeval* timeou
 	assert(st->file);
 	assert(st->base.buffer_size);
 
+	if ( st->limit > 0 ){
+		const off_t pos = ftello(st->file);
+		if ( pos >= st->limit ){
+			return 0;
+		}
+		if ( (off_t)max > st->limit - pos ){
+			max = st->limit - pos;
+		}
+	}
+
 	size_t readBytes = fread(dst, 1, max, st->file);
 
 	/* check if an error occured, EOF is not considered an error. */
@@ -61,6 +132,205 @@ static int stream_file_fillbuffer(struct stream_file* st, struct timeval* timeou
 	return readBytes;
 }
 
+static int stream_file_fillbuffer_compressed(struct stream_file* st, struct timeval* timeout, char* dst, size_t max){
+	return block_reader_read(st->reader, dst, max);
+}
+
+/**
+ * Data is already present in the mapping so nothing is copied, it only exposes
+ * the next window of the file, hints the kernel to prefetch the window after
+ * that and releases the pages which has been consumed.
+ */
+static int stream_file_fillbuffer_mmap(struct stream_file* st, struct timeval* timeout, char* dst, size_t max){
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	const size_t bytes = max < MMAP_WINDOW_SIZE ? max : MMAP_WINDOW_SIZE;
+
+	/* prefetch next window */
+	const size_t offset = (dst + bytes) - st->map;
+	if ( offset < st->map_size ){
+		const size_t aligned = offset & ~(page_size - 1);
+		const size_t left = st->map_size - aligned;
+		madvise(st->map + aligned, left < MMAP_WINDOW_SIZE ? left : MMAP_WINDOW_SIZE, MADV_WILLNEED);
+	}
+
+	/* release pages up to the current packet (the caller may have written to
+	 * them, e.g. truncating caplen, so they would otherwise linger as private
+	 * anonymous pages) */
+	const size_t consumed = ((st->base.buffer + st->base.readPos) - st->map) & ~(page_size - 1);
+	if ( consumed > st->released ){
+		madvise(st->map + st->released, consumed - st->released, MADV_DONTNEED);
+		st->released = consumed;
+	}
+
+	return bytes;
+}
+
+/**
+ * Write all data at the given offset, retrying on short writes.
+ */
+static int write_all(int fd, const char* data, size_t size, off_t offset){
+	while ( size > 0 ){
+		ssize_t bytes = pwrite(fd, data, size, offset);
+		if ( bytes < 0 ){
+			if ( errno == EINTR ) continue;
+			return errno;
+		} else if ( bytes == 0 ){
+			return ENOSPC;
+		}
+
+		data += bytes;
+		size -= bytes;
+		offset += bytes;
+	}
+	return 0;
+}
+
+/**
+ * Block until a queued buffer has been written (no-op if nothing is queued).
+ */
+static int wait_buffer(struct write_buffer* buf){
+	if ( !buf->pending ){
+		return 0;
+	}
+
+	const struct aiocb* list[1] = {&buf->cb};
+	int ret;
+	while ( (ret=aio_error(&buf->cb)) == EINPROGRESS ){
+		aio_suspend(list, 1, NULL);
+	}
+
+	buf->pending = 0;
+	const ssize_t bytes = aio_return(&buf->cb);
+	if ( ret != 0 ){
+		return ret;
+	}
+
+	/* complete short writes synchronously */
+	const size_t done = bytes;
+	return write_all(buf->cb.aio_fildes, buf->data + done, buf->cb.aio_nbytes - done, buf->cb.aio_offset + done);
+}
+
+/**
+ * Queue the current buffer for writing and switch to the other buffer, waiting
+ * for it if it still has not been written.
+ *
+ * For O_DIRECT only whole blocks can be written so the trailing partial block is
+ * moved to the next buffer (and written later). If pad is set the partial block
+ * is written as well (padded with zeroes) but still kept, the file is
+ * truncated to the proper size later by stream_file_drain.
+ */
+static int submit_buffer(struct stream_file* st, int pad){
+	struct write_buffer* buf = st->cur;
+	if ( buf->used == 0 ){
+		return 0;
+	}
+
+	size_t bytes = buf->used;
+	size_t tail = 0;
+	if ( st->direct ){
+		tail = buf->used % ASYNC_BUFFER_ALIGN;
+		bytes = buf->used - tail;
+		if ( pad && tail > 0 ){
+			memset(buf->data + buf->used, 0, ASYNC_BUFFER_ALIGN - tail);
+			bytes += ASYNC_BUFFER_ALIGN;
+		}
+		if ( bytes == 0 ){
+			return 0;
+		}
+	}
+
+	memset(&buf->cb, 0, sizeof(struct aiocb));
+	buf->cb.aio_fildes = fileno(st->file);
+	buf->cb.aio_buf = buf->data;
+	buf->cb.aio_nbytes = bytes;
+	buf->cb.aio_offset = st->offset;
+
+	if ( aio_write(&buf->cb) == 0 ){
+		buf->pending = 1;
+	} else {
+		/* could not queue request, fall back to a blocking write */
+		int ret;
+		if ( (ret=write_all(buf->cb.aio_fildes, buf->data, bytes, st->offset)) != 0 ){
+			return ret;
+		}
+	}
+
+	const size_t written = buf->used - tail;
+	st->offset += written;
+	st->unsynced += written;
+	buf->used = 0;
+
+	st->cur = (buf == &st->wbuf[0]) ? &st->wbuf[1] : &st->wbuf[0];
+	int ret = wait_buffer(st->cur);
+
+	/* the source buffer may still be in flight but it is only read from */
+	memcpy(st->cur->data, buf->data + written, tail);
+	st->cur->used = tail;
+
+	return ret;
+}
+
+static unsigned long elapsed_msec(const struct timespec* a, const struct timespec* b){
+	return (b->tv_sec - a->tv_sec) * 1000 + (b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
+/**
+ * Sync data to disk if the durability policy says so. For asynchronous
+ * streams the sync is queued as well and skipped if the previous sync has not
+ * yet completed.
+ */
+static int stream_file_sync_policy(struct stream_file* st){
+	if ( !(st->sync_bytes || st->sync_msec) ){
+		return 0;
+	}
+
+	const size_t pending = st->unsynced + (st->async ? st->cur->used : 0);
+	if ( pending == 0 ){
+		return 0;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const int by_size = st->sync_bytes && pending >= st->sync_bytes;
+	const int by_time = st->sync_msec && elapsed_msec(&st->last_sync, &now) >= st->sync_msec;
+	if ( !(by_size || by_time) ){
+		return 0;
+	}
+
+	int ret;
+	if ( st->async ){
+		if ( st->sync_pending ){
+			if ( (ret=aio_error(&st->sync_cb)) == EINPROGRESS ){
+				return 0;
+			}
+			aio_return(&st->sync_cb);
+			st->sync_pending = 0;
+			if ( ret != 0 ){
+				return ret;
+			}
+		}
+
+		if ( (ret=submit_buffer(st, 0)) != 0 ){
+			return ret;
+		}
+
+		memset(&st->sync_cb, 0, sizeof(struct aiocb));
+		st->sync_cb.aio_fildes = fileno(st->file);
+		if ( aio_fsync(O_DSYNC, &st->sync_cb) == 0 ){
+			st->sync_pending = 1;
+		} else {
+			fdatasync(st->sync_cb.aio_fildes);
+		}
+	} else {
+		fflush(st->file);
+		fdatasync(fileno(st->file));
+	}
+
+	st->unsynced = 0;
+	st->last_sync = now;
+	return 0;
+}
+
 static int stream_file_write(struct stream_file* st, const void* data, size_t size){
 	assert(st);
 	assert(data);
@@ -78,10 +348,199 @@ static int stream_file_write(struct stream_file* st, const void* data, size_t si
 		}
 	}
 
+	st->unsynced += size;
+
 	/* make sure the data is flushed */
 	if ( __builtin_expect(st->force_flush,0) ){
 		fflush(st->file);
 		fsync(fileno(st->file));
+		return 0;
+	}
+
+	return stream_file_sync_policy(st);
+}
+
+static int stream_file_write_async(struct stream_file* st, const void* data, size_t size){
+	assert(st);
+	assert(data);
+	assert(size > 0);
+
+	const char* src = (const char*)data;
+	while ( size > 0 ){
+		size_t space = ASYNC_BUFFER_SIZE - st->cur->used;
+		if ( space == 0 ){
+			int ret;
+			if ( (ret=submit_buffer(st, 0)) != 0 ){
+				return ret;
+			}
+			space = ASYNC_BUFFER_SIZE - st->cur->used;
+		}
+
+		const size_t bytes = size < space ? size : space;
+		memcpy(st->cur->data + st->cur->used, src, bytes);
+		st->cur->used += bytes;
+		src += bytes;
+		size -= bytes;
+	}
+
+	return stream_file_sync_policy(st);
+}
+
+/**
+ * Packets are compressed in blocks which are passed on to the regular write
+ * callback (synchronous or asynchronous).
+ */
+static int stream_file_write_compressed(struct stream_file* st, const void* data, size_t size){
+	return block_writer_write(st->writer, data, size);
+}
+
+/**
+ * Write everything buffered and wait for all outstanding requests.
+ */
+static int stream_file_drain(struct stream_file* st){
+	int ret = submit_buffer(st, 1);
+	for ( int i = 0; i < 2; i++ ){
+		int tmp = wait_buffer(&st->wbuf[i]);
+		if ( ret == 0 ) ret = tmp;
+	}
+
+	/* remove padding from the last block */
+	if ( st->direct && ftruncate(fileno(st->file), st->offset + st->cur->used) != 0 && ret == 0 ){
+		ret = errno;
+	}
+
+	if ( st->sync_pending ){
+		const struct aiocb* list[1] = {&st->sync_cb};
+		while ( aio_error(&st->sync_cb) == EINPROGRESS ){
+			aio_suspend(list, 1, NULL);
+		}
+		aio_return(&st->sync_cb);
+		st->sync_pending = 0;
+	}
+
+	return ret;
+}
+
+static int alloc_write_buffers(struct stream_file* st){
+	for ( int i = 0; i < 2; i++ ){
+		if ( posix_memalign((void**)&st->wbuf[i].data, ASYNC_BUFFER_ALIGN, ASYNC_BUFFER_SIZE) != 0 ){
+			free(st->wbuf[0].data);
+			st->wbuf[0].data = NULL;
+			return ENOMEM;
+		}
+		st->wbuf[i].used = 0;
+		st->wbuf[i].pending = 0;
+	}
+
+	st->cur = &st->wbuf[0];
+	return 0;
+}
+
+/**
+ * Enable asynchronous writing if possible. Only regular files (not opened in
+ * append mode) can be used as writes are issued using explicit offsets.
+ */
+static void stream_file_async_init(struct stream_file* st){
+	const int fd = fileno(st->file);
+	struct stat sb;
+
+	if ( fflush(st->file) != 0 || fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || (fcntl(fd, F_GETFL) & O_APPEND) ){
+		return;
+	}
+
+	const off_t offset = ftello(st->file);
+	if ( offset < 0 || alloc_write_buffers(st) != 0 ){
+		return;
+	}
+
+	st->async = 1;
+	st->offset = offset;
+}
+
+/**
+ * Open file for writing using O_DIRECT.
+ * @return NULL if the file could not be opened (e.g. O_DIRECT not supported).
+ */
+static FILE* open_direct(const char* filename){
+	const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+	if ( fd == -1 ){
+		return NULL;
+	}
+
+	FILE* fp = fdopen(fd, "wb");
+	if ( !fp ){
+		close(fd);
+	}
+	return fp;
+}
+
+/**
+ * Setup O_DIRECT writing. Instead of writing the file header directly it is
+ * placed in the first write buffer, padded using an extension header so the
+ * first packet starts at a block boundary.
+ */
+static int stream_file_direct_init(struct stream_file* st){
+	struct file_header_t* fh = &st->base.FH;
+	const size_t min_size = sizeof(struct file_header_t) + 2 * sizeof(struct file_extension) + fh->comment_size;
+	const size_t size = (min_size + ASYNC_BUFFER_ALIGN - 1) & ~(size_t)(ASYNC_BUFFER_ALIGN - 1);
+
+	int ret;
+	if ( (ret=alloc_write_buffers(st)) != 0 ){
+		return ret;
+	}
+
+	st->async = 1;
+	st->direct = 1;
+	st->offset = 0;
+
+	/* layout: file header, padding extension, end extension, comment. The
+	 * header offset and extension size are 16 bits (and the header must fit in
+	 * the first buffer). */
+	const size_t header_offset = size - fh->comment_size;
+	const size_t padding_size = header_offset - sizeof(struct file_header_t) - sizeof(struct file_extension);
+	if ( size > ASYNC_BUFFER_SIZE || header_offset > UINT16_MAX || padding_size > UINT16_MAX ){
+		return EINVAL;
+	}
+	fh->header_offset = header_offset;
+	const struct file_extension padding = {HEADER_EXT_PADDING, padding_size};
+	const struct file_extension end = {HEADER_EXT_NONE, sizeof(struct file_extension)};
+
+	char* dst = st->cur->data;
+	memset(dst, 0, size);
+	memcpy(dst, fh, sizeof(struct file_header_t));
+	memcpy(dst + sizeof(struct file_header_t), &padding, sizeof(struct file_extension));
+	memcpy(dst + sizeof(struct file_header_t) + padding.next_offset, &end, sizeof(struct file_extension));
+	memcpy(dst + fh->header_offset, st->base.comment, fh->comment_size);
+	st->cur->used = size;
+
+	return 0;
+}
+
+int stream_file_set_sync_policy(struct stream* stt, size_t bytes, unsigned int msec){
+	struct stream_file* st = (struct stream_file*)stt;
+	st->sync_bytes = bytes;
+	st->sync_msec = msec;
+	clock_gettime(CLOCK_MONOTONIC, &st->last_sync);
+	return 0;
+}
+
+/**
+ * Move to offset (from start of file). Pipes cannot seek so the data is read
+ * and discarded instead (only forward).
+ * @param cur Current offset.
+ */
+static int seek_to(FILE* fp, size_t cur, size_t offset){
+	if ( fseek(fp, offset, SEEK_SET) == 0 ){
+		return 0;
+	}
+
+	char buf[512];
+	while ( cur < offset ){
+		const size_t bytes = offset - cur < sizeof(buf) ? offset - cur : sizeof(buf);
+		if ( fread(buf, 1, bytes, fp) != bytes ){
+			return ERROR_CAPFILE_TRUNCATED;
+		}
+		cur += bytes;
 	}
 
 	return 0;
@@ -114,23 +573,379 @@ static int need_fclose(const struct stream_file* st){
 }
 
 static long stream_file_destroy(struct stream_file* st){
+	long ret = 0;
+
 	if ( stream_addr_have_flag(&st->base.addr, STREAM_ADDR_UNLINK) ){
 		unlink(st->base.addr.local_filename);
 	}
 
+	/* final block, block index and footer */
+	if ( st->writer ){
+		ret = block_writer_close(st->writer);
+	}
+	if ( st->reader ){
+		block_reader_free(st->reader);
+	}
+
+	if ( st->async ){
+		const int tmp = stream_file_drain(st);
+		if ( ret == 0 ) ret = tmp;
+		if ( st->sync_bytes || st->sync_msec ){
+			fdatasync(fileno(st->file));
+		}
+		free(st->wbuf[0].data);
+		free(st->wbuf[1].data);
+	}
+
 	if ( need_fclose(st) ){
-		fclose(st->file);
+		if ( fclose(st->file) != 0 && ret == 0 ){
+			ret = errno;
+		}
+	}
+
+	if ( st->map ){
+		munmap(st->map, st->map_size);
 	}
 
+	free(st->filename);
 	free(st->base.comment);
 	free(st);
-	return 0;
+	return ret;
 }
 
 static int stream_file_flush(struct stream_file* st){
+	int ret;
+	if ( st->writer && (ret=block_writer_flush(st->writer)) != 0 ){
+		return ret;
+	}
+
+	if ( st->async ){
+		return stream_file_drain(st);
+	}
 	return fflush(st->file);
 }
 
+/**
+ * Try to map the rest of the file directly into memory instead of copying it
+ * through the stream buffer. Only regular files can be mapped, pipes, fifos etc
+ * will continue to use fread.
+ * @return Non-zero if the file could not be mapped.
+ */
+static int stream_file_mmap(struct stream_file* st){
+	const int fd = fileno(st->file);
+	const long offset = ftell(st->file);
+	struct stat sb;
+
+	if ( fd == -1 || offset < 0 || fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size < offset ){
+		return 1;
+	}
+
+	/* The mapping is private (copy-on-write) as consumers are allowed to modify
+	 * the packets returned by stream_read (e.g. capfilter truncating caplen). */
+	char* map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if ( map == MAP_FAILED ){
+		return 1;
+	}
+
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+	st->map = map;
+	st->map_size = sb.st_size;
+	st->released = 0;
+	st->base.mapped = 1;
+	st->base.buffer = map + offset;
+	st->base.buffer_size = sb.st_size - offset;
+	st->base.stat.buffer_size = st->base.buffer_size;
+	st->base.readPos = 0;
+	st->base.writePos = 0;
+
+	return 0;
+}
+
+/**
+ * File offset of the next packet to be read.
+ */
+static off_t stream_file_position(struct stream_file* st){
+	if ( st->reader ){
+		return block_reader_position(st->reader);
+	}
+	if ( st->map ){
+		return (st->base.buffer + st->base.readPos) - st->map;
+	}
+	return ftello(st->file) - (off_t)(st->base.writePos - st->base.readPos);
+}
+
+/**
+ * Move read position forward to offset (must be at a packet boundary).
+ */
+static int stream_file_seek(struct stream_file* st, off_t offset){
+	int ret;
+	if ( st->reader ){
+		if ( (ret=block_reader_seek(st->reader, offset)) != 0 ){
+			return ret;
+		}
+		st->base.readPos = 0;
+		st->base.writePos = 0;
+	} else if ( st->map ){
+		/* readPos is relative to where the buffer starts in the mapping */
+		const size_t pos = offset - (st->base.buffer - st->map);
+		st->base.readPos = pos;
+		st->base.writePos = pos;
+	} else {
+		if ( fseeko(st->file, offset, SEEK_SET) != 0 ){
+			return errno;
+		}
+		st->base.readPos = 0;
+		st->base.writePos = 0;
+	}
+
+	st->base.stat.buffer_usage = 0;
+	return 0;
+}
+
+/**
+ * End the stream at offset (must be at a packet boundary).
+ */
+static void stream_file_limit(struct stream_file* st, off_t offset){
+	if ( st->reader ){
+		block_reader_limit(st->reader, offset);
+	} else if ( st->map ){
+		/* hide the rest of the mapping, already exposed data is kept only up to
+		 * the current packet */
+		const size_t start = st->base.buffer - st->map;
+		size_t end = (size_t)offset > start ? offset - start : 0;
+		if ( end < st->base.readPos ) end = st->base.readPos;
+		if ( end < st->base.buffer_size ){
+			st->base.buffer_size = end;
+			st->base.stat.buffer_size = end;
+		}
+		if ( end < st->base.writePos ){
+			st->base.writePos = end;
+		}
+	} else if ( st->limit == 0 || offset < st->limit ){
+		st->limit = offset;
+	}
+}
+
+/**
+ * Find index entry using the block index for compressed capfiles or else the
+ * capindex sidecar (see stream_index_lookup).
+ */
+static int stream_file_lookup(struct stream_file* st, const timepico t, int stop, struct index_entry* entry){
+	if ( st->reader ){
+		return block_reader_search(st->reader, t, stop, entry);
+	}
+	if ( !st->filename ){
+		return ENOENT;
+	}
+	return stream_index_lookup(st->filename, t, stop, entry);
+}
+
+int stream_file_seek_time(struct stream* stt, const timepico t){
+	struct stream_file* st = (struct stream_file*)stt;
+	struct index_entry entry;
+	int ret;
+	if ( (ret=stream_file_lookup(st, t, 0, &entry)) != 0 ){
+		return ret;
+	}
+
+	/* never seek backwards */
+	const off_t cur = stream_file_position(st);
+	if ( cur < 0 || (off_t)entry.offset <= cur ){
+		return 0;
+	}
+
+	/* sanity check: the indexed packet must be found at the offset (the block
+	 * index is stored in the file itself so it always matches) */
+	struct cap_header head;
+	if ( !st->reader && (pread(fileno(st->file), &head, sizeof(head), entry.offset) != sizeof(head) || timecmp(&head.ts, &entry.ts) != 0) ){
+		return ERROR_CAPFILE_INDEX_INVALID;
+	}
+
+	if ( (ret=stream_file_seek(st, entry.offset)) != 0 ){
+		return ret;
+	}
+
+	st->base.stat.read = entry.packet;
+	return 0;
+}
+
+int stream_file_stop_time(struct stream* stt, const timepico t){
+	struct stream_file* st = (struct stream_file*)stt;
+	struct index_entry entry;
+	int ret;
+	if ( (ret=stream_file_lookup(st, t, 1, &entry)) != 0 ){
+		return ret;
+	}
+
+	stream_file_limit(st, entry.offset);
+	return 0;
+}
+
+int stream_file_compressed(const struct stream* stt){
+	const struct stream_file* st = (const struct stream_file*)stt;
+	return st->reader || st->writer;
+}
+
+int stream_file_range(struct stream* stt, off_t begin, off_t end){
+	struct stream_file* st = (struct stream_file*)stt;
+	const off_t cur = stream_file_position(st);
+	int ret;
+
+	if ( cur < 0 || begin < cur || end < begin ){
+		return EINVAL;
+	}
+	if ( begin > cur && (ret=stream_file_seek(st, begin)) != 0 ){
+		return ret;
+	}
+
+	stream_file_limit(st, end);
+	return 0;
+}
+
+/**
+ * Test if a plausible packet header is found at offset: caplen must not exceed
+ * len, the picosecond part must be valid and nic must be a printable string.
+ */
+static int valid_header(const char* map, off_t offset){
+	struct cap_header cp;
+	memcpy(&cp, map + offset, sizeof(struct cap_header));
+
+	if ( cp.caplen > cp.len || cp.len > RESYNC_MAX_LEN || cp.ts.tv_psec >= PICODIVIDER ){
+		return 0;
+	}
+
+	if ( !isgraph((unsigned char)cp.nic[0]) ){
+		return 0;
+	}
+	for ( int i = 1; i < CAPHEAD_NICLEN && cp.nic[i]; i++ ){
+		if ( !isprint((unsigned char)cp.nic[i]) ) return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Find the first packet boundary at or after offset by scanning for a chain
+ * of valid headers.
+ * @return Offset of packet or end if none was found.
+ */
+static off_t resync(const char* map, off_t offset, off_t end){
+	for ( ; offset < end; offset++ ){
+		off_t cur = offset;
+		int n;
+		for ( n = 0; n < RESYNC_NUM_HEADERS && cur < end; n++ ){
+			if ( cur + (off_t)sizeof(struct cap_header) > end || !valid_header(map, cur) ){
+				break;
+			}
+			const struct cap_header* cp = (const struct cap_header*)(map + cur);
+			cur += sizeof(struct cap_header) + cp->caplen;
+		}
+
+		/* chain must be long enough or end exactly at the end of file */
+		if ( (n == RESYNC_NUM_HEADERS && cur <= end) || cur == end ){
+			return offset;
+		}
+	}
+	return end;
+}
+
+/**
+ * Find packet boundary at or after offset, using the capfile index if present
+ * or else by resynchronizing on packet headers.
+ */
+static int split_offset(struct stream_file* st, char** map, off_t size, off_t offset, off_t* result){
+	const int fd = fileno(st->file);
+	struct index_entry entry;
+
+	/* compressed capfiles can only be split at blocks */
+	if ( st->reader ){
+		*result = block_reader_search_offset(st->reader, offset, &entry) == 0 ? (off_t)entry.offset : size;
+		return 0;
+	}
+
+	/* the indexed packet must be found at the offset */
+	struct cap_header head;
+	if ( stream_index_offset(st->filename, offset, &entry) == 0 &&
+	     pread(fd, &head, sizeof(head), entry.offset) == sizeof(head) && timecmp(&head.ts, &entry.ts) == 0 ){
+		*result = entry.offset;
+		return 0;
+	}
+
+	if ( !*map ){
+		void* tmp = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if ( tmp == MAP_FAILED ){
+			return errno;
+		}
+		*map = tmp;
+	}
+
+	*result = resync(*map, offset, size);
+	return 0;
+}
+
+int stream_file_open_split(struct stream** stptr, size_t* num, const char* filename, size_t buffer_size){
+	const size_t n = *num;
+	int ret;
+
+	if ( (ret=stream_file_open(&stptr[0], NULL, filename, buffer_size)) != 0 ){
+		return ret;
+	}
+
+	struct stream_file* first = (struct stream_file*)stptr[0];
+	const off_t begin = stream_file_position(first);
+	struct stat sb;
+	if ( begin < 0 || fstat(fileno(first->file), &sb) != 0 || !S_ISREG(sb.st_mode) ){
+		stream_close(stptr[0]);
+		return EINVAL;
+	}
+
+	/* boundaries between ranges, adjacent ranges may resync to the same packet
+	 * in which case they are merged */
+	off_t* offset = malloc((n + 1) * sizeof(off_t));
+	if ( !offset ){
+		stream_close(stptr[0]);
+		return ENOMEM;
+	}
+	char* map = NULL;
+	size_t k = 0;
+	offset[k++] = begin;
+	for ( size_t i = 1; i < n && ret == 0; i++ ){
+		const off_t target = begin + (sb.st_size - begin) * i / n;
+		off_t cur = 0;
+		if ( target <= offset[k-1] ) continue;
+		if ( (ret=split_offset(first, &map, sb.st_size, target, &cur)) == 0 && cur > offset[k-1] && cur < sb.st_size ){
+			offset[k++] = cur;
+		}
+	}
+	offset[k] = sb.st_size;
+
+	if ( map ){
+		munmap(map, sb.st_size);
+	}
+
+	/* open one stream per range (the first is already open) */
+	size_t opened = 1;
+	for ( size_t i = 0; i < k && ret == 0; i++ ){
+		if ( i > 0 && (ret=stream_file_open(&stptr[i], NULL, filename, buffer_size)) != 0 ){
+			break;
+		}
+		opened = i + 1;
+		ret = stream_file_range(stptr[i], offset[i], offset[i+1]);
+	}
+	free(offset);
+
+	if ( ret != 0 ){
+		for ( size_t i = 0; i < opened; i++ ){
+			stream_close(stptr[i]);
+		}
+		return ret;
+	}
+
+	*num = k;
+	return 0;
+}
+
 /**
  * Initialize file stream.
  * @return Non-zero on error (see errno(3) for descriptions).
@@ -171,6 +986,16 @@ int stream_file_open(struct stream** stptr, FILE* fp, const char* filename, size
 	st->base.num_addresses = 1;
 	st->file = fp;
 	st->force_flush = 0;
+	st->async = 0;
+	st->sync_bytes = 0;
+	st->sync_msec = 0;
+	st->sync_pending = 0;
+	st->filename = filename ? strdup(filename) : NULL;
+	st->limit = 0;
+	st->map = NULL;
+	st->map_size = 0;
+	st->writer = NULL;
+	st->reader = NULL;
 
 	/* load stream file header */
 	size_t bytes = fread(fhptr, 1, sizeof(struct file_header_t), st->file);
@@ -203,6 +1028,8 @@ int stream_file_open(struct stream** stptr, FILE* fp, const char* filename, size
 	}
 
 	/* read extension headers */
+	size_t offset = sizeof(struct file_header_t);
+	enum capfile_codec codec = CAPFILE_CODEC_NONE;
 	const int have_extensions = fhptr->header_offset > 216;
 	if ( have_extensions ){
 		do {
@@ -210,35 +1037,55 @@ int stream_file_open(struct stream** stptr, FILE* fp, const char* filename, size
 			if ( fread(&ext, sizeof(struct file_extension), 1, st->file) != 1 ){
 				return ERROR_CAPFILE_TRUNCATED;
 			}
+			offset += sizeof(struct file_extension);
 
 			if ( ext.type == HEADER_EXT_NONE ){
 				/* last extension header */
 				break;
 			}
 
+			/* test for invalid offset size (possibly malformed files) */
+			const size_t min_size = sizeof(struct file_extension);
+			const size_t max_size = fhptr->header_offset;
+			if ( ext.next_offset < min_size || ext.next_offset > max_size ){
+				return ERROR_CAPFILE_INVALID;
+			}
+			const size_t next = offset + ext.next_offset - sizeof(struct file_extension);
+
 			switch ( ext.type ){
 			case HEADER_EXT_PADDING:
 				/* padding only, just skip bytes */
 				break;
 
-			default:
-				/* unrecognized extension header, ignored */
+			case HEADER_EXT_COMPRESSION: {
+				struct compression_extension comp;
+				if ( ext.next_offset < min_size + sizeof(struct compression_extension) ){
+					return ERROR_CAPFILE_INVALID;
+				}
+				if ( fread(&comp, sizeof(struct compression_extension), 1, st->file) != 1 ){
+					return ERROR_CAPFILE_TRUNCATED;
+				}
+				offset += sizeof(struct compression_extension);
+				codec = comp.codec;
 				break;
 			}
 
-			/* test for invalid offset size (possibly malformed files) */
-			const size_t min_size = sizeof(struct file_extension);
-			const size_t max_size = fhptr->header_offset;
-			if ( ext.next_offset < min_size || ext.next_offset > max_size ){
-				return ERROR_CAPFILE_INVALID;
+			default:
+				/* unrecognized extension header, ignored */
+				break;
 			}
 
 			/* move to next */
-			fseek(st->file, ext.next_offset - sizeof(struct file_extension), SEEK_CUR);
+			if ( (ret=seek_to(st->file, offset, next)) != 0 ){
+				return ret;
+			}
+			offset = next;
 		} while (1);
 	}
 
-	fseek(st->file, fhptr->header_offset, SEEK_SET);
+	if ( (ret=seek_to(st->file, offset, fhptr->header_offset)) != 0 ){
+		return ret;
+	}
 
 	/* read comment */
 	st->base.comment = (char*)malloc(fhptr->comment_size+1);
@@ -248,7 +1095,10 @@ int stream_file_open(struct stream** stptr, FILE* fp, const char* filename, size
 	}
 	st->base.comment[i] = 0; /* the null-terminator might not be included in file */
 
-	if ( !is_valid_version(fhptr) ){ /* is_valid_version has side-effects */
+	/* compressed capfiles uses the next minor version so older versions refuses
+	 * to read them */
+	const int compressed_version = codec != CAPFILE_CODEC_NONE && fhptr->version.major == VERSION_MAJOR && fhptr->version.minor == VERSION_MINOR + 1;
+	if ( !compressed_version && !is_valid_version(fhptr) ){ /* is_valid_version has side-effects */
 		return EINVAL;
 	}
 
@@ -258,6 +1108,20 @@ int stream_file_open(struct stream** stptr, FILE* fp, const char* filename, size
 	st->base.write = (write_callback)stream_file_write;
 	st->base.flush = (flush_callback)stream_file_flush;
 
+	/* packets are decompressed by the block reader */
+	if ( codec != CAPFILE_CODEC_NONE ){
+		if ( (ret=block_reader_new(&st->reader, codec, st->file, fhptr->header_offset + fhptr->comment_size)) != 0 ){
+			return ret;
+		}
+		st->base.fill_buffer = (fill_buffer_callback)stream_file_fillbuffer_compressed;
+		return 0;
+	}
+
+	/* use zero-copy reads when possible */
+	if ( stream_file_mmap(st) == 0 ){
+		st->base.fill_buffer = (fill_buffer_callback)stream_file_fillbuffer_mmap;
+	}
+
 	return 0;
 }
 
@@ -265,15 +1129,44 @@ int stream_file_create(struct stream** stptr, FILE* fp, const char* filename, co
 	assert(stptr);
 	*stptr = NULL;
 	int ret = 0;
+	const int own_file = !fp;
+	int direct = 0;
 
 	/* validate that filename is set */
 	if ( !(filename||fp) ){
 		return ENOENT;
 	}
 
+	enum capfile_codec codec = CAPFILE_CODEC_NONE;
+	if ( flags & STREAM_ADDR_LZ4 ){
+		codec = CAPFILE_CODEC_LZ4;
+	} else if ( flags & STREAM_ADDR_ZSTD ){
+		codec = CAPFILE_CODEC_ZSTD;
+	}
+	if ( !capfile_codec_supported(codec) ){
+		return ERROR_CAPFILE_CODEC;
+	}
+
+	/* O_DIRECT only writes whole aligned buffers so it can neither flush each
+	 * write nor be used for compressed blocks */
+	if ( (flags & STREAM_ADDR_DIRECT) && ((flags & STREAM_ADDR_FLUSH) || codec != CAPFILE_CODEC_NONE) ){
+		return EINVAL;
+	}
+
+	/* comment_size is 16 bits */
+	if ( comment && strlen(comment) > UINT16_MAX ){
+		return EINVAL;
+	}
+
 	/* try to open the file */
 	if ( !fp ){
-		fp = fopen(filename, "wb");
+		if ( (flags & STREAM_ADDR_DIRECT) && codec == CAPFILE_CODEC_NONE ){
+			fp = open_direct(filename);
+			direct = fp != NULL;
+		}
+		if ( !fp ){
+			fp = fopen(filename, "wb");
+		}
 		if( !fp ){
 			return errno;
 		}
@@ -285,14 +1178,27 @@ int stream_file_create(struct stream** stptr, FILE* fp, const char* filename, co
 	}
 
 	/* Initialize the structure */
+	struct stream_file* st = NULL;
 	if ( (ret = stream_alloc(stptr, PROTOCOL_LOCAL_FILE, sizeof(struct stream_file), 0, BUFSIZ) != 0) ){
-		return ret;
+		goto error;
 	}
 
-	struct stream_file* st = (struct stream_file*)*stptr;
+	st = (struct stream_file*)*stptr;
 
 	st->file = fp;
 	st->force_flush = flags & STREAM_ADDR_FLUSH;
+	st->async = 0;
+	st->direct = 0;
+	st->unsynced = 0;
+	st->sync_bytes = 0;
+	st->sync_msec = 0;
+	st->sync_pending = 0;
+	st->filename = NULL;
+	st->limit = 0;
+	st->map = NULL;
+	st->map_size = 0;
+	st->writer = NULL;
+	st->reader = NULL;
 
 	st->base.num_addresses = 1;
 	st->base.comment = strdup(comment);
@@ -303,12 +1209,37 @@ int stream_file_create(struct stream** stptr, FILE* fp, const char* filename, co
 	st->base.FH.comment_size = strlen(comment);
 	strncpy(st->base.FH.mpid, mpid, 200);
 
-	if ( fwrite(&st->base.FH, 1, sizeof(struct file_header_t), st->file) < sizeof(struct file_header_t) ){
-		return EIO;
+	/* announce compression using an extension header */
+	const struct file_extension comp_ext = {HEADER_EXT_COMPRESSION, sizeof(struct file_extension) + sizeof(struct compression_extension)};
+	const struct compression_extension comp = {codec, 0};
+	const struct file_extension end = {HEADER_EXT_NONE, sizeof(struct file_extension)};
+	if ( codec != CAPFILE_CODEC_NONE ){
+		st->base.FH.version.minor = VERSION_MINOR + 1;
+		st->base.FH.header_offset += comp_ext.next_offset + end.next_offset;
 	}
 
-	if ( fwrite(comment, 1, strlen(comment), st->file) < strlen(comment) ){
-		return EIO;
+	if ( direct ){
+		if ( (ret=stream_file_direct_init(st)) != 0 ){
+			goto error;
+		}
+	} else {
+		if ( fwrite(&st->base.FH, 1, sizeof(struct file_header_t), st->file) < sizeof(struct file_header_t) ){
+			ret = EIO;
+			goto error;
+		}
+
+		if ( codec != CAPFILE_CODEC_NONE && (
+			     fwrite(&comp_ext, sizeof(struct file_extension), 1, st->file) != 1 ||
+			     fwrite(&comp, sizeof(struct compression_extension), 1, st->file) != 1 ||
+			     fwrite(&end, sizeof(struct file_extension), 1, st->file) != 1) ){
+			ret = EIO;
+			goto error;
+		}
+
+		if ( fwrite(comment, 1, strlen(comment), st->file) < strlen(comment) ){
+			ret = EIO;
+			goto error;
+		}
 	}
 
 	/* add callbacks */
@@ -317,5 +1248,40 @@ int stream_file_create(struct stream** stptr, FILE* fp, const char* filename, co
 	st->base.write = (write_callback)stream_file_write;
 	st->base.flush = (flush_callback)stream_file_flush;
 
+	/* Write asynchronously unless the user wants every write to be flushed. The
+	 * FILE is not used for writing afterwards so it is only done when the file
+	 * was opened here, a user-supplied FILE may still be in use by the caller. */
+	if ( own_file && !(st->force_flush || direct) ){
+		stream_file_async_init(st);
+	}
+	if ( st->async ){
+		st->base.write = (write_callback)stream_file_write_async;
+	}
+
+	/* compress before passing data to the regular write callback */
+	if ( codec != CAPFILE_CODEC_NONE ){
+		const off_t offset = st->base.FH.header_offset + st->base.FH.comment_size;
+		if ( (ret=block_writer_new(&st->writer, codec, offset, st->base.write, &st->base)) != 0 ){
+			goto error;
+		}
+		st->base.write = (write_callback)stream_file_write_compressed;
+	}
+
 	return 0;
+
+	error:
+	/* nothing has been submitted for writing yet so the buffers can be released
+	 * directly, the partially written file is removed if it was created here */
+	if ( st ){
+		free(st->wbuf[0].data);
+		free(st->wbuf[1].data);
+		free(st->base.comment);
+		free(st);
+		*stptr = NULL;
+	}
+	if ( own_file ){
+		fclose(fp);
+		unlink(filename);
+	}
+	return ret;
 }
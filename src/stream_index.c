@@ -0,0 +1,304 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "caputils/caputils.h"
+#include "caputils_int.h"
+#include "stream.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Timestamp index for capfiles, stored next to the capfile as FILENAME.idx.
+ *
+ * The index is a header followed by entries sorted by file offset. An entry is
+ * added every N packets or T seconds (whichever comes first) and records the
+ * offset and timestamp of that packet together with the latest timestamp of
+ * all packets preceding it and the earliest timestamp of all packets from the
+ * entry and onwards. Both are non-decreasing even if the trace is not sorted
+ * so they can be binary searched: all packets before an entry with before < t
+ * are older than t and can be skipped, and all packets from an entry with
+ * after >= t are at or after t.
+ */
+
+static const char index_magic[8] = {'C', 'A', 'P', 'I', 'D', 'X', 0, 1};
+
+struct index_header {
+	char magic[8];
+	uint64_t file_size;     /* size of capfile when index was built */
+	uint64_t num_entries;
+} __attribute__((packed));
+
+#define INDEX_DEFAULT_PACKETS 1024
+#define INDEX_DEFAULT_SECONDS 1
+
+static void index_filename(char* dst, size_t size, const char* filename){
+	snprintf(dst, size, "%s.idx", filename);
+}
+
+static int read_entry(int fd, off_t base, uint64_t i, struct index_entry* entry){
+	const off_t offset = base + i * sizeof(struct index_entry);
+	const ssize_t bytes = pread(fd, entry, sizeof(struct index_entry), offset);
+	if ( bytes < 0 ){
+		return errno;
+	}
+	return bytes == sizeof(struct index_entry) ? 0 : ERROR_CAPFILE_INDEX_INVALID;
+}
+
+/**
+ * Open and validate index for filename.
+ * @return Zero if successful (fd and header is set).
+ */
+static int index_open(const char* filename, int* fd, struct index_header* header){
+	char path[PATH_MAX];
+	index_filename(path, sizeof(path), filename);
+
+	*fd = open(path, O_RDONLY);
+	if ( *fd == -1 ){
+		return errno;
+	}
+
+	/* index must be newer than the capfile and cover all of it */
+	struct stat capfile;
+	struct stat index;
+	if ( stat(filename, &capfile) != 0 || fstat(*fd, &index) != 0 ||
+	     index.st_mtime < capfile.st_mtime ||
+	     pread(*fd, header, sizeof(struct index_header), 0) != sizeof(struct index_header) ||
+	     memcmp(header->magic, index_magic, sizeof(index_magic)) != 0 ||
+	     header->file_size != (uint64_t)capfile.st_size ){
+		close(*fd);
+		return ERROR_CAPFILE_INDEX_INVALID;
+	}
+
+	/* empty trace, nothing to seek to */
+	if ( header->num_entries == 0 ){
+		close(*fd);
+		return ENOENT;
+	}
+
+	return 0;
+}
+
+int stream_index_search(int fd, off_t base, uint64_t num_entries, const timepico t, int stop, struct index_entry* entry){
+	if ( num_entries == 0 ){
+		return ENOENT;
+	}
+
+	/* find the first entry where the predicate holds (before >= t or after >=
+	 * t), both are non-decreasing */
+	uint64_t lower = 0;
+	uint64_t upper = num_entries;
+	int ret;
+	while ( lower < upper ){
+		const uint64_t mid = lower + (upper - lower) / 2;
+		if ( (ret=read_entry(fd, base, mid, entry)) != 0 ){
+			return ret;
+		}
+		const timepico* key = stop ? &entry->after : &entry->before;
+		if ( timecmp(key, &t) < 0 ){
+			lower = mid + 1;
+		} else {
+			upper = mid;
+		}
+	}
+
+	if ( stop ){
+		/* stop at first entry where all remaining packets are at or after t */
+		return lower < num_entries ? read_entry(fd, base, lower, entry) : ENOENT;
+	} else {
+		/* seek to last entry where all preceding packets are older than t (the
+		 * first entry always qualifies) */
+		return read_entry(fd, base, lower > 0 ? lower - 1 : 0, entry);
+	}
+}
+
+int stream_index_search_offset(int fd, off_t base, uint64_t num_entries, uint64_t offset, struct index_entry* entry){
+	/* entries are sorted by offset */
+	uint64_t lower = 0;
+	uint64_t upper = num_entries;
+	int ret;
+	while ( lower < upper ){
+		const uint64_t mid = lower + (upper - lower) / 2;
+		if ( (ret=read_entry(fd, base, mid, entry)) != 0 ){
+			return ret;
+		}
+		if ( entry->offset < offset ){
+			lower = mid + 1;
+		} else {
+			upper = mid;
+		}
+	}
+
+	return lower < num_entries ? read_entry(fd, base, lower, entry) : ENOENT;
+}
+
+int stream_index_lookup(const char* filename, const timepico t, int stop, struct index_entry* entry){
+	struct index_header header;
+	int fd;
+	int ret;
+	if ( (ret=index_open(filename, &fd, &header)) != 0 ){
+		return ret;
+	}
+
+	ret = stream_index_search(fd, sizeof(struct index_header), header.num_entries, t, stop, entry);
+	close(fd);
+	return ret;
+}
+
+int stream_index_offset(const char* filename, uint64_t offset, struct index_entry* entry){
+	struct index_header header;
+	int fd;
+	int ret;
+	if ( (ret=index_open(filename, &fd, &header)) != 0 ){
+		return ret;
+	}
+
+	ret = stream_index_search_offset(fd, sizeof(struct index_header), header.num_entries, offset, entry);
+	close(fd);
+	return ret;
+}
+
+void stream_index_finalize(struct index_entry* entry, size_t num_entries){
+	/* include all following entries in after */
+	for ( size_t i = num_entries; i > 1; i-- ){
+		if ( timecmp(&entry[i-1].after, &entry[i-2].after) < 0 ){
+			entry[i-2].after = entry[i-1].after;
+		}
+	}
+}
+
+int stream_index_build(const char* filename, unsigned int packets, unsigned int seconds){
+	if ( packets == 0 ) packets = INDEX_DEFAULT_PACKETS;
+	if ( seconds == 0 ) seconds = INDEX_DEFAULT_SECONDS;
+
+	struct stream* st;
+	int ret;
+	if ( (ret=stream_file_open(&st, NULL, filename, 0)) != 0 ){
+		return ret;
+	}
+
+	/* compressed capfiles has a block index already */
+	if ( stream_file_compressed(st) ){
+		stream_close(st);
+		return EINVAL;
+	}
+
+	struct index_entry* entry = NULL;
+	size_t num_entries = 0;
+	size_t max_entries = 0;
+
+	uint64_t offset = st->FH.header_offset + st->FH.comment_size;
+	uint64_t n = 0;
+	uint64_t since = 0;          /* packets since last entry */
+	uint32_t entry_sec = 0;      /* timestamp (seconds) of last entry */
+	timepico before = {0, 0};
+
+	cap_head* cp;
+	while ( (ret=stream_read(st, &cp, NULL, NULL)) == 0 ){
+		if ( num_entries == 0 || since >= packets || cp->ts.tv_sec >= entry_sec + seconds ){
+			if ( num_entries == max_entries ){
+				max_entries = max_entries ? 2 * max_entries : 1024;
+				struct index_entry* tmp = realloc(entry, max_entries * sizeof(struct index_entry));
+				if ( !tmp ){
+					ret = ENOMEM;
+					break;
+				}
+				entry = tmp;
+			}
+
+			struct index_entry* cur = &entry[num_entries++];
+			cur->offset = offset;
+			cur->packet = n;
+			cur->ts = cp->ts;
+			cur->before = before;
+			cur->after = cp->ts;
+			entry_sec = cp->ts.tv_sec;
+			since = 0;
+		}
+
+		/* after is the earliest timestamp within the entry for now */
+		struct index_entry* cur = &entry[num_entries - 1];
+		if ( timecmp(&cp->ts, &cur->after) < 0 ){
+			cur->after = cp->ts;
+		}
+
+		if ( timecmp(&cp->ts, &before) > 0 ){
+			before = cp->ts;
+		}
+
+		offset += sizeof(struct cap_header) + cp->caplen;
+		since++;
+		n++;
+	}
+	stream_close(st);
+
+	/* -1 means EOF */
+	if ( ret != -1 ){
+		free(entry);
+		return ret;
+	}
+	ret = 0;
+
+	stream_index_finalize(entry, num_entries);
+
+	/* write to temporary file first so readers never see a partial index */
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 4];
+	index_filename(path, sizeof(path), filename);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	struct stat sb;
+	FILE* fp = NULL;
+	if ( stat(filename, &sb) != 0 || !(fp=fopen(tmp, "wb")) ){
+		free(entry);
+		return errno;
+	}
+
+	struct index_header header;
+	memcpy(header.magic, index_magic, sizeof(index_magic));
+	header.file_size = sb.st_size;
+	header.num_entries = num_entries;
+
+	if ( fwrite(&header, sizeof(header), 1, fp) != 1 ||
+	     fwrite(entry, sizeof(struct index_entry), num_entries, fp) != num_entries ){
+		ret = errno;
+	}
+	if ( fclose(fp) != 0 && ret == 0 ){
+		ret = errno;
+	}
+	free(entry);
+
+	if ( ret == 0 && rename(tmp, path) != 0 ){
+		ret = errno;
+	}
+	if ( ret != 0 ){
+		unlink(tmp);
+	}
+
+	return ret;
+}
@@ -38,6 +38,10 @@
 #include <unistd.h>
 
 #define MAX_ADDRESS 100
+#define ADDRESS_HASH_SIZE 256 /* must be a power of two larger than MAX_ADDRESS */
+
+/* maximum number of datagrams to receive per syscall */
+#define MAX_READ_FRAMES 32
 
 struct stream_udp {
 	struct stream base;
@@ -45,6 +49,7 @@ struct stream_udp {
 	int if_index;
 	struct in_addr address[MAX_ADDRESS];
 	unsigned int seqnum[MAX_ADDRESS];
+	unsigned char address_hash[ADDRESS_HASH_SIZE]; /* index+1 into address, 0 if empty */
 
 	struct stream_frame_buffer fb;
 	char* frame[0];
@@ -56,13 +61,19 @@ static int __attribute__((pure)) is_multicast(struct in_addr addr){
 	return (addr.s_addr & mask) == prefix;
 }
 
+static unsigned int address_hash(struct in_addr addr){
+	const uint32_t x = addr.s_addr * 2654435761U; /* knuth multiplicative hash */
+	return (x >> 16) & (ADDRESS_HASH_SIZE - 1);
+}
+
 /**
  * Test if a MA packet is valid and matches our expected destinations
  * Returns the matching address index or -1 for invalid packets.
  */
-static int match_ma_pkt(const struct stream_udp* st, const struct in_addr src){
-	for ( unsigned int i = 0; i < st->base.num_addresses; i++ ){
-		if ( src.s_addr == st->address[i].s_addr ) return i;
+static int match_ma_pkt(const struct stream_udp* st, const struct in_addr addr){
+	for ( unsigned int i = address_hash(addr); st->address_hash[i]; i = (i + 1) & (ADDRESS_HASH_SIZE - 1) ){
+		const int index = st->address_hash[i] - 1;
+		if ( addr.s_addr == st->address[index].s_addr ) return index;
 	}
 
 	return -1; /* ethernet stream did not match any of our expected */
@@ -72,6 +83,10 @@ static int stream_udp_read(struct stream_udp* st, cap_head** cp, struct filter*
 	return stream_frame_buffer_read(&st->base, &st->fb, cp, filter, timeout);
 }
 
+static int stream_udp_read_batch(struct stream_udp* st, cap_head** cp, size_t max, size_t* count, struct filter* filter, struct timeval* timeout){
+	return stream_frame_buffer_read_batch(&st->base, &st->fb, cp, max, count, filter, timeout);
+}
+
 static int stream_udp_write(struct stream_udp* st, const void* data, size_t size){
 	if ( size > st->base.if_mtu ){
 		fprintf(stderr, "packet is larger (%zd) than MTU (%zd), ignoring\n", size, st->base.if_mtu);
@@ -83,7 +98,11 @@ static int stream_udp_write(struct stream_udp* st, const void* data, size_t size
 	return 0;
 }
 
-static int stream_udp_read_frame(struct stream_udp* st, char* dst, struct timeval* timeout){
+/**
+ * Receive up to max datagrams using a single recvmmsg call (after waiting for
+ * the socket to become readable).
+ */
+static int stream_udp_read_frames(struct stream_udp* st, char** dst, size_t max, struct timeval* timeout){
 	assert(st);
 
 	fd_set fds;
@@ -95,28 +114,71 @@ static int stream_udp_read_frame(struct stream_udp* st, char* dst, struct timeva
 		return 0;
 	}
 
-	struct sockaddr_in src;
-	socklen_t addrlen = sizeof(struct sockaddr_in);
-	ssize_t bytes = recvfrom(st->socket, dst, st->base.if_mtu, 0, &src, &addrlen);
-	if ( bytes < 0 ){ /* error occurred */
-		perror("Cannot receive UDP data.");
-		return 0;
-	} else if ( bytes == 0 ){ /* proper shutdown */
-		perror("Connection closed by client.");
-		return 0;
+	if ( max > MAX_READ_FRAMES ){
+		max = MAX_READ_FRAMES;
 	}
 
-	/* Check if it is a valid packet and if it was destinationed here */
-	int match;
-	if ( (match=match_ma_pkt(st, src.sin_addr)) == -1 ){
-		return EAGAIN;
+	struct mmsghdr msg[MAX_READ_FRAMES];
+	struct iovec iov[MAX_READ_FRAMES];
+	char control[MAX_READ_FRAMES][CMSG_SPACE(sizeof(struct in_pktinfo))];
+	memset(msg, 0, sizeof(struct mmsghdr) * max);
+	for ( size_t i = 0; i < max; i++ ){
+		iov[i].iov_base = dst[i];
+		iov[i].iov_len = st->base.if_mtu;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		msg[i].msg_hdr.msg_control = control[i];
+		msg[i].msg_hdr.msg_controllen = sizeof(control[i]);
+	}
+
+	const int frames = recvmmsg(st->socket, msg, max, MSG_DONTWAIT, NULL);
+	if ( frames < 0 ){ /* error occurred */
+		if ( errno != EAGAIN && errno != EWOULDBLOCK ){
+			perror("Cannot receive UDP data.");
+		}
+		return 0;
 	}
 
+	/* Check if the frames were destinationed here. Frames sent to other groups
+	 * (but same port) are discarded and the rest is moved to fill the gaps. */
+	int accepted = 0;
+	for ( int i = 0; i < frames; i++ ){
+		if ( msg[i].msg_len == 0 ){ /* proper shutdown */
+			perror("Connection closed by client.");
+			break;
+		}
+
+		if ( st->base.num_addresses > 0 ){
+			struct cmsghdr* cmsg;
+			int match = 0;
+			for ( cmsg = CMSG_FIRSTHDR(&msg[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msg[i].msg_hdr, cmsg) ){
+				if ( cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO ){
+					const struct in_pktinfo* info = (const struct in_pktinfo*)CMSG_DATA(cmsg);
+					match = match_ma_pkt(st, info->ipi_addr) != -1;
+					break;
+				}
+			}
+			if ( cmsg && !match ){
+				continue;
+			}
+		}
+
+		if ( accepted != i ){
+			memcpy(dst[accepted], dst[i], msg[i].msg_len);
+		}
+		accepted++;
+
 #ifdef DEBUG
-	fprintf(stderr, "got measurement frame with %d capture packets [BU: %3.2f%%]\n", ntohl(sh->nopkts), 0.0f);
+		const struct sendhead* sh = (const struct sendhead*)dst[accepted-1];
+		fprintf(stderr, "got measurement frame with %d capture packets [BU: %3.2f%%]\n", ntohl(sh->nopkts), 0.0f);
 #endif
+	}
+
+	return accepted;
+}
 
-	return 1;
+static int stream_udp_read_frame(struct stream_udp* st, char* dst, struct timeval* timeout){
+	return stream_udp_read_frames(st, &dst, 1, timeout);
 }
 
 int stream_udp_add(stream_t stt, const struct in_addr addr){
@@ -134,6 +196,13 @@ int stream_udp_add(stream_t stt, const struct in_addr addr){
 	/* store parsed address */
 	st->address[st->base.num_addresses] = addr;
 
+	/* index address for matching */
+	unsigned int i = address_hash(addr);
+	while ( st->address_hash[i] ){
+		i = (i + 1) & (ADDRESS_HASH_SIZE - 1);
+	}
+	st->address_hash[i] = st->base.num_addresses + 1;
+
 	/* setup multicast address */
 	struct ip_mreqn mcast;
 	mcast.imr_multiaddr = addr;
@@ -178,11 +247,16 @@ static int stream_udp_init(stream_t* stptr, size_t mtu){
 	}
 	struct stream_udp* st = (struct stream_udp*)*stptr;
 	stream_frame_init(&st->fb, (read_frame_callback)stream_udp_read_frame, (char*)st->frame, num_frames, mtu);
+	st->fb.read_frames = (read_frames_callback)stream_udp_read_frames;
 
 	st->socket = fd;
 	st->if_index = 0;
 	st->base.if_mtu = mtu;
 	memset(st->seqnum, 0, sizeof(unsigned int) * MAX_ADDRESS);
+	memset(st->address_hash, 0, sizeof(st->address_hash));
+
+	/* request destination address so frames can be matched against the groups */
+	setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(int));
 
 	return 0;
 }
@@ -281,6 +355,7 @@ int stream_udp_open(stream_t* stptr, const struct sockaddr_in* addr, const char*
 	/* callbacks */
 	st->base.destroy = (destroy_callback)stream_udp_destroy;
 	st->base.read = (read_callback)stream_udp_read;
+	st->base.read_batch = (read_batch_callback)stream_udp_read_batch;
 
 	return 0;
 }
@@ -26,6 +26,7 @@
 #include "vcs.h"
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 
 int eth_aton(struct ether_addr* dst, const char* addr){
@@ -59,6 +60,20 @@ const char* hexdump_address(const struct ether_addr* address){
 	return hexdump_address_r(address, buf);
 }
 
+int parse_unsigned(const char* str, unsigned long max, unsigned long* value){
+	char* end;
+	errno = 0;
+	const unsigned long tmp = strtoul(str, &end, 10);
+	if ( str[strspn(str, " \t")] == '-' || end == str || *end != 0 ){
+		return EINVAL;
+	}
+	if ( errno == ERANGE || tmp > max ){
+		return ERANGE;
+	}
+	*value = tmp;
+	return 0;
+}
+
 const char* caputils_version(caputils_version_t* version){
 	int features = 0
 #ifdef HAVE_PFRING
@@ -1,4 +1,5 @@
 #include <caputils/filter.h>
+#include <caputils/utils.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -44,6 +45,7 @@ class AddressTest: public CppUnit::TestFixture {
 	CPPUNIT_TEST( test_prefix_fifo     );
 	CPPUNIT_TEST( test_prefix_invalid  );
 	CPPUNIT_TEST( test_ntoa_fifo       );
+	CPPUNIT_TEST( test_parse_unsigned  );
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -178,6 +180,22 @@ public:
 		CPPUNIT_ASSERT_EQUAL(std::string(sample), std::string(stream_addr_ntoa(&addr)));
 	}
 
+	void test_parse_unsigned(){
+		unsigned long value = 7;
+		CPPUNIT_ASSERT_ERROR(0, parse_unsigned("0", 10, &value));
+		CPPUNIT_ASSERT_EQUAL(0UL, value);
+		CPPUNIT_ASSERT_ERROR(0, parse_unsigned("10", 10, &value));
+		CPPUNIT_ASSERT_EQUAL(10UL, value);
+		CPPUNIT_ASSERT_ERROR(ERANGE, parse_unsigned("11", 10, &value));
+		CPPUNIT_ASSERT_ERROR(ERANGE, parse_unsigned("99999999999999999999999", (unsigned long)-1, &value));
+		CPPUNIT_ASSERT_ERROR(EINVAL, parse_unsigned("-1", 10, &value));
+		CPPUNIT_ASSERT_ERROR(EINVAL, parse_unsigned(" -1", 10, &value));
+		CPPUNIT_ASSERT_ERROR(EINVAL, parse_unsigned("", 10, &value));
+		CPPUNIT_ASSERT_ERROR(EINVAL, parse_unsigned("abc", 10, &value));
+		CPPUNIT_ASSERT_ERROR(EINVAL, parse_unsigned("5x", 10, &value));
+		CPPUNIT_ASSERT_EQUAL(10UL, value);
+	}
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(AddressTest);
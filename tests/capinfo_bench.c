@@ -0,0 +1,187 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * Measures capinfo time and peak memory against the number of locations
+ * (mpid and CI pairs). Synthetic traces of 54-byte TCP packets are generated
+ * with packets spread round-robin over all locations and capinfo is run on
+ * each of them, and finally on two of them using --threads and --total. Run
+ * using `make bench` or `tests/capinfo_bench [PACKETS [CAPINFO]]` to compare
+ * against another build.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "caputils/caputils.h"
+#include "caputils/stream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define PACKET_SIZE 54 /* ethernet + ip + tcp */
+
+struct config {
+	unsigned int mpids;
+	unsigned int cis;
+	unsigned long packets;
+};
+
+static char dir[] = "/tmp/capinfo_bench.XXXXXX";
+
+static void generate(const char* filename, const struct config* cfg){
+	char buf[sizeof(struct cap_header) + PACKET_SIZE] = {0,};
+	struct cap_header* cp = (struct cap_header*)buf;
+	char* pkt = cp->payload;
+	cp->len = PACKET_SIZE;
+	cp->caplen = PACKET_SIZE;
+
+	/* ethernet, IPv4 and TCP headers, addresses and ports are set per packet */
+	pkt[12] = 0x08;
+	pkt[13] = 0x00;
+	pkt[14] = 0x45;
+	pkt[17] = PACKET_SIZE - 14;
+	pkt[22] = 64;
+	pkt[23] = 6;
+	pkt[46] = 0x50;
+	pkt[47] = 0x10;
+
+	stream_t st;
+	stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+	stream_addr_str(&addr, filename, 0);
+
+	int ret;
+	if ( (ret=stream_create(&st, &addr, NULL, "bench", "capinfo benchmark")) != 0 ){
+		fprintf(stderr, "stream_create() failed: %s\n", caputils_error_string(ret));
+		exit(1);
+	}
+
+	const unsigned int locations = cfg->mpids * cfg->cis;
+	for ( unsigned long i = 0; i < cfg->packets; i++ ){
+		const unsigned int location = i % locations;
+		char name[16];
+		snprintf(name, sizeof(name), "mp%04u", location / cfg->cis);
+		memcpy(cp->mampid, name, sizeof(cp->mampid));
+		snprintf(name, sizeof(name), "d%02u", location % cfg->cis);
+		memcpy(cp->nic, name, sizeof(cp->nic));
+
+		/* one microsecond between packets */
+		cp->ts.tv_sec = 1000000000 + i / 1000000;
+		cp->ts.tv_psec = (i % 1000000) * 1000000ULL;
+
+		const uint32_t src = htonl(0x0a000000 | (i % 4096));
+		const uint32_t dst = htonl(0x0a100000 | (i % 256));
+		const uint16_t sport = htons(1024 + i % 50000);
+		const uint16_t dport = htons(80);
+		memcpy(pkt + 26, &src, 4);
+		memcpy(pkt + 30, &dst, 4);
+		memcpy(pkt + 34, &sport, 2);
+		memcpy(pkt + 36, &dport, 2);
+
+		if ( (ret=stream_write(st, buf, sizeof(buf))) != 0 ){
+			fprintf(stderr, "stream_write() failed: %s\n", caputils_error_string(ret));
+			exit(1);
+		}
+	}
+
+	stream_close(st);
+}
+
+/**
+ * Run capinfo with output discarded.
+ * @param maxrss Peak resident memory (KiB) of capinfo.
+ * @return Wall time in seconds.
+ */
+static double run(char* const argv[], long* maxrss){
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	fflush(stdout);
+	const pid_t pid = fork();
+	if ( pid == 0 ){
+		if ( !freopen("/dev/null", "w", stdout) ){
+			_exit(1);
+		}
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(1);
+	}
+
+	int status;
+	struct rusage usage;
+	if ( pid < 0 || wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ){
+		fprintf(stderr, "%s failed\n", argv[0]);
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*maxrss = usage.ru_maxrss;
+	return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+int main(int argc, char* argv[]){
+	const unsigned long packets = argc > 1 ? strtoul(argv[1], NULL, 10) : 500000;
+	char* capinfo = argc > 2 ? argv[2] : "./capinfo";
+
+	const struct config config[] = {
+		{  1, 1, packets},
+		{ 20, 4, packets},
+		{100, 4, packets},
+	};
+	const unsigned int num_config = sizeof(config) / sizeof(config[0]);
+	char filename[num_config][64];
+
+	if ( !mkdtemp(dir) ){
+		perror("mkdtemp");
+		return 1;
+	}
+
+	printf("%5s %4s %9s %10s %10s %8s\n", "mpids", "CIs", "locations", "packets", "seconds", "RSS (MB)");
+	for ( unsigned int i = 0; i < num_config; i++ ){
+		const struct config* cfg = &config[i];
+		snprintf(filename[i], sizeof(filename[i]), "%s/%03ux%u.cap", dir, cfg->mpids, cfg->cis);
+		generate(filename[i], cfg);
+
+		char* cmd[] = {capinfo, filename[i], NULL};
+		long maxrss;
+		const double sec = run(cmd, &maxrss);
+		printf("%5u %4u %9u %10lu %10.3f %8.1f\n", cfg->mpids, cfg->cis, cfg->mpids * cfg->cis, cfg->packets, sec, maxrss / 1024.0);
+		fflush(stdout);
+	}
+
+	/* the two largest traces in parallel and merged */
+	{
+		char* cmd[] = {capinfo, "--threads=2", "--total", filename[num_config-2], filename[num_config-1], NULL};
+		long maxrss;
+		const double sec = run(cmd, &maxrss);
+		printf("%-20s %10lu %10.3f %8.1f\n", "-t 2 -T (last two)", 2 * packets, sec, maxrss / 1024.0);
+	}
+
+	for ( unsigned int i = 0; i < num_config; i++ ){
+		unlink(filename[i]);
+	}
+	rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * Measures capmerge throughput against the number of input files. The same
+ * number of packets is split over 1, 2, 4, .. files with interleaved
+ * timestamps so each merged packet comes from a different file than the
+ * previous one. Run using `make bench`.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "caputils/caputils.h"
+#include "caputils/stream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_FILES 256
+#define PACKET_SIZE 64
+
+static char dir[] = "/tmp/capmerge_bench.XXXXXX";
+
+static void generate(unsigned int files, unsigned long packets){
+	stream_t st[files];
+	char buf[sizeof(struct cap_header) + PACKET_SIZE] = {0,};
+	struct cap_header* cp = (struct cap_header*)buf;
+	strncpy(cp->nic, "bench", CAPHEAD_NICLEN);
+	strncpy(cp->mampid, "bench", 8);
+	cp->len = PACKET_SIZE;
+	cp->caplen = PACKET_SIZE;
+
+	for ( unsigned int i = 0; i < files; i++ ){
+		char filename[64];
+		snprintf(filename, sizeof(filename), "%s/%03u.cap", dir, i);
+
+		stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+		stream_addr_str(&addr, filename, 0);
+
+		int ret;
+		if ( (ret=stream_create(&st[i], &addr, NULL, "bench", "capmerge benchmark")) != 0 ){
+			fprintf(stderr, "stream_create() failed: %s\n", caputils_error_string(ret));
+			exit(1);
+		}
+	}
+
+	/* one microsecond between packets, round-robin over files */
+	for ( unsigned long i = 0; i < packets; i++ ){
+		cp->ts.tv_sec = 1000000000 + i / 1000000;
+		cp->ts.tv_psec = (i % 1000000) * 1000000ULL;
+		stream_write(st[i % files], buf, sizeof(buf));
+	}
+
+	for ( unsigned int i = 0; i < files; i++ ){
+		stream_close(st[i]);
+	}
+}
+
+static void cleanup(unsigned int files){
+	for ( unsigned int i = 0; i < files; i++ ){
+		char filename[64];
+		snprintf(filename, sizeof(filename), "%s/%03u.cap", dir, i);
+		unlink(filename);
+	}
+}
+
+static double merge(unsigned int files){
+	/* command: ./capmerge -q -o /dev/null DIR/000.cap DIR/001.cap .. */
+	const size_t size = 64 + files * (strlen(dir) + 10);
+	char* cmd = malloc(size);
+	int n = snprintf(cmd, size, "./capmerge -q -o /dev/null");
+	for ( unsigned int i = 0; i < files; i++ ){
+		n += snprintf(cmd + n, size - n, " %s/%03u.cap", dir, i);
+	}
+
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	const int ret = system(cmd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(cmd);
+
+	if ( ret != 0 ){
+		fprintf(stderr, "capmerge failed with %d\n", ret);
+		exit(1);
+	}
+
+	return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+int main(int argc, const char* argv[]){
+	const unsigned long packets = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+	if ( !mkdtemp(dir) ){
+		perror("mkdtemp");
+		return 1;
+	}
+
+	printf("%5s %10s %10s %12s\n", "files", "packets", "seconds", "packets/s");
+	for ( unsigned int files = 1; files <= MAX_FILES; files *= 2 ){
+		generate(files, packets);
+		const double sec = merge(files);
+		printf("%5u %10lu %10.3f %12.0f\n", files, packets, sec, packets / sec);
+		fflush(stdout);
+		cleanup(files);
+	}
+
+	rmdir(dir);
+	return 0;
+}
@@ -5,9 +5,13 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <net/ethernet.h>
 
 extern "C" {
 int filter_iface(const struct filter* filter, const char* iface);
@@ -18,6 +22,7 @@ int filter_eth_dst(const struct filter* filter, const struct ethhdr* ether);
 int filter_ip_proto(const struct filter* filter, const struct ip* ip);
 int filter_ip_src(const struct filter* filter, const struct ip* ip);
 int filter_ip_dst(const struct filter* filter, const struct ip* ip);
+int filter_ip_src_set(const struct filter* filter, const struct ip* ip);
 int filter_src_port(const struct filter* filter, uint16_t port);
 int filter_dst_port(const struct filter* filter, uint16_t port);
 int filter_port(const struct filter* filter, uint16_t src, uint16_t dst);
@@ -46,8 +51,37 @@ class Test: public CppUnit::TestFixture {
 	CPPUNIT_TEST(test_end_time);
 	CPPUNIT_TEST(test_frame_dt);
 	CPPUNIT_TEST(test_frame_num);
+	CPPUNIT_TEST(test_match_and);
+	CPPUNIT_TEST(test_match_or);
+	CPPUNIT_TEST(test_compile);
+	CPPUNIT_TEST(test_set);
+	CPPUNIT_TEST(test_prefix_set);
 	CPPUNIT_TEST_SUITE_END();
 
+	struct {
+		struct cap_header cp;
+		struct ether_header eth;
+		struct ip ip;
+		struct udphdr udp;
+	} __attribute__((packed)) pkt;
+
+	void setUp(){
+		memset(&pkt, 0, sizeof(pkt));
+		pkt.cp.caplen = pkt.cp.len = sizeof(pkt) - sizeof(struct cap_header);
+		pkt.eth.ether_type = htons(ETHERTYPE_IP);
+		pkt.ip.ip_v = 4;
+		pkt.ip.ip_hl = 5;
+		pkt.ip.ip_p = IPPROTO_UDP;
+		pkt.ip.ip_src.s_addr = inet_addr("10.0.0.1");
+		pkt.ip.ip_dst.s_addr = inet_addr("10.0.0.2");
+		pkt.udp.source = htons(1234);
+		pkt.udp.dest = htons(80);
+	}
+
+	int match(struct filter* filter){
+		return filter_match(filter, &pkt.eth, &pkt.cp);
+	}
+
 	void test_ci(){
 		struct filter filter;
 		filter_ci_set(&filter, "d01"); CPPUNIT_ASSERT_MESSAGE("[1] d01 == d01",  filter_iface(&filter, "d01"));
@@ -260,6 +294,165 @@ class Test: public CppUnit::TestFixture {
 		filter.frame_counter = 3; CPPUNIT_ASSERT_MESSAGE("Frame 3",  filter_frame_num(&filter));
 		filter.frame_counter = 4; CPPUNIT_ASSERT_MESSAGE("Frame 4", !filter_frame_num(&filter));
 	}
+
+	void test_match_and(){
+		struct filter filter;
+		filter_init(&filter);
+		filter_ip_proto_aton(&filter, "udp");
+		filter_dst_port_set(&filter, 80, 0xffff);
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[1] udp && 80", 1, match(&filter));
+
+		filter_src_ip_aton(&filter, "10.0.1.0/24");
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[2] udp && 80 && 10.0.1.0/24", 0, match(&filter));
+
+		filter_src_ip_aton(&filter, "10.0.0.0/24");
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[3] udp && 80 && 10.0.0.0/24", 1, match(&filter));
+
+		filter_eth_type_set(&filter, "arp");
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[4] arp && ...", 0, match(&filter));
+		filter_close(&filter);
+	}
+
+	void test_match_or(){
+		struct filter filter;
+		filter_init(&filter);
+		filter.mode = FILTER_OR;
+		filter_ip_proto_aton(&filter, "tcp");
+		filter_dst_port_set(&filter, 22, 0xffff);
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[1] tcp || 22", 0, match(&filter));
+
+		filter_tp_port_set(&filter, 1234, 0xffff);
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[2] tcp || 22 || 1234", 1, match(&filter));
+
+		filter.mode = FILTER_AND;
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[3] tcp && 22 && 1234", 0, match(&filter));
+		filter_close(&filter);
+	}
+
+	void test_compile(){
+		struct filter filter;
+		filter_init(&filter);
+		filter_dst_port_set(&filter, 80, 0xffff);
+		filter_mampid_set(&filter, "foo");
+		filter_eth_type_set(&filter, "ip");
+		filter_compile(&filter);
+
+		/* only selected tests, cheapest first */
+		CPPUNIT_ASSERT_EQUAL((int)OFFSET_MAMPID,   (int)filter.program[0]);
+		CPPUNIT_ASSERT_EQUAL((int)OFFSET_ETH_TYPE, (int)filter.program[1]);
+		CPPUNIT_ASSERT_EQUAL((int)OFFSET_DST_PORT, (int)filter.program[2]);
+		CPPUNIT_ASSERT_EQUAL(0xff,                 (int)filter.program[3]);
+
+		/* unknown test in AND mode never matches */
+		filter.index = FILTER_DST_PORT | (1<<20);
+		CPPUNIT_ASSERT_EQUAL(0, match(&filter));
+		filter.mode = FILTER_OR;
+		CPPUNIT_ASSERT_EQUAL(1, match(&filter));
+		filter_close(&filter);
+	}
+
+	void test_set(){
+		static const char* rules[][3] = {
+			{"--ip.proto=udp", NULL},                            /* indexed on ip_proto */
+			{"--tp.dport=80", "--ip.proto=udp"},                 /* indexed on dst port */
+			{"--tp.dport=22", NULL},                             /* indexed on dst port, no match */
+			{"--eth.type=arp", NULL},                            /* indexed on eth_type, no match */
+			{"--filter-mode=or", "--ip.proto=tcp", "--tp.port=1234"}, /* not indexed */
+			{"--ip.src=10.0.0.0/8", NULL},                       /* not indexed */
+			{"--tp.sport=1234/0xff00", NULL},                    /* masked, not indexed */
+		};
+		static const size_t num_rules = sizeof(rules) / sizeof(rules[0]);
+		struct filter filter[num_rules];
+		struct filter_set* set;
+
+		CPPUNIT_ASSERT_EQUAL(0, filter_set_init(&set));
+		int expected = 0;
+		for ( unsigned int i = 0; i < num_rules; i++ ){
+			char* arg[4] = {strdup("test"), NULL, NULL, NULL}; /* parsing modifies arguments */
+			int argc = 1;
+			while ( argc < 4 && rules[i][argc-1] ){
+				arg[argc] = strdup(rules[i][argc-1]);
+				argc++;
+			}
+			char* argv[4] = {arg[0], arg[1], arg[2], arg[3]}; /* reordered by filter_from_argv */
+			CPPUNIT_ASSERT_EQUAL(0, filter_from_argv(&argc, argv, &filter[i]));
+			for ( int j = 0; j < 4; j++ ) free(arg[j]);
+			filter[i].filter_id = i * 7; /* spread over multiple words */
+			CPPUNIT_ASSERT_EQUAL(0, filter_set_add(set, &filter[i]));
+			expected += filter_match(&filter[i], &pkt.eth, &pkt.cp);
+		}
+		CPPUNIT_ASSERT_EQUAL(EEXIST, filter_set_add(set, &filter[0]));
+		CPPUNIT_ASSERT_EQUAL((size_t)2, filter_set_bitmap_size(set));
+
+		uint32_t bitmap[2];
+		CPPUNIT_ASSERT_EQUAL(expected, filter_set_match(set, &pkt.eth, &pkt.cp, bitmap));
+		for ( unsigned int i = 0; i < num_rules; i++ ){
+			const uint32_t id = filter[i].filter_id;
+			const int bit = (bitmap[id / 32] >> (id % 32)) & 1;
+			CPPUNIT_ASSERT_EQUAL_MESSAGE(rules[i][0], filter_match(&filter[i], &pkt.eth, &pkt.cp), bit);
+		}
+
+		CPPUNIT_ASSERT_EQUAL(0, filter_set_remove(set, filter[1].filter_id));
+		CPPUNIT_ASSERT_EQUAL(ENOENT, filter_set_remove(set, filter[1].filter_id));
+		CPPUNIT_ASSERT_EQUAL(expected - 1, filter_set_match(set, &pkt.eth, &pkt.cp, bitmap));
+
+		filter_set_free(set);
+		for ( unsigned int i = 0; i < num_rules; i++ ){
+			filter_close(&filter[i]);
+		}
+	}
+
+	int in_src_set(const struct filter* filter, const char* addr){
+		struct ip ip;
+		ip.ip_src.s_addr = inet_addr(addr);
+		return filter_ip_src_set(filter, &ip);
+	}
+
+	void test_prefix_set(){
+		char filename[] = "/tmp/caputils-prefix-XXXXXX";
+		int fd = mkstemp(filename);
+		CPPUNIT_ASSERT(fd >= 0);
+		FILE* fp = fdopen(fd, "w");
+		fprintf(fp,
+		        "# comment\n"
+		        "\n"
+		        "192.168.0.0/16\n"
+		        "  10.0.16.0/20  # trailing comment\n"
+		        "10.0.0.0/255.255.255.240\n"
+		        "172.16.0.1\n"
+		        "10.1.0.0/255.0.255.0\n"  /* non-contiguous, ignored */
+		        "garbage\n");          /* ignored */
+		fclose(fp);
+
+		struct filter filter;
+		filter_init(&filter);
+		CPPUNIT_ASSERT_EQUAL(ENOENT, filter_src_ip_set_load(&filter, "/nonexistent/prefixes"));
+		CPPUNIT_ASSERT_EQUAL(0, filter_src_ip_set_load(&filter, filename));
+		unlink(filename);
+
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[1] 192.168.44.1",  1, in_src_set(&filter, "192.168.44.1"));
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[2] 192.169.0.1",   0, in_src_set(&filter, "192.169.0.1"));
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[3] 10.0.16.1",     1, in_src_set(&filter, "10.0.16.1"));
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[4] 10.0.31.255",   1, in_src_set(&filter, "10.0.31.255"));
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[5] 10.0.32.0",     0, in_src_set(&filter, "10.0.32.0"));
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[6] 10.0.0.15",     1, in_src_set(&filter, "10.0.0.15"));
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[7] 10.0.0.16",     0, in_src_set(&filter, "10.0.0.16"));
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[8] 172.16.0.1",    1, in_src_set(&filter, "172.16.0.1"));
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[9] 172.16.0.2",    0, in_src_set(&filter, "172.16.0.2"));
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[10] 10.1.0.1",     0, in_src_set(&filter, "10.1.0.1"));
+
+		filter_ip_proto_aton(&filter, "udp");
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[11] udp && 10.0.0.1 in set", 1, match(&filter));
+		pkt.ip.ip_src.s_addr = inet_addr("10.0.0.16");
+		CPPUNIT_ASSERT_EQUAL_MESSAGE("[12] udp && 10.0.0.16 in set", 0, match(&filter));
+
+		/* sets are local and not transmitted */
+		struct filter_packed packed;
+		filter_pack(&filter, &packed);
+		CPPUNIT_ASSERT_EQUAL((uint32_t)FILTER_IP_PROTO, ntohl(packed.index));
+
+		filter_close(&filter);
+	}
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(Test);
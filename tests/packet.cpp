@@ -1,7 +1,13 @@
 #include "test.hpp"
 
 #include <caputils/packet.h>
+#include <caputils/columns.h>
 #include "src/format/format.h"
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 class Test: public CppUnit::TestFixture {
 	CPPUNIT_TEST_SUITE(Test);
@@ -16,6 +22,10 @@ class Test: public CppUnit::TestFixture {
 	CPPUNIT_TEST(test_payload_network);
 	CPPUNIT_TEST(test_payload_transport);
 	CPPUNIT_TEST(test_limited_caplen);
+	CPPUNIT_TEST(test_meta);
+	CPPUNIT_TEST(test_meta_truncated);
+	CPPUNIT_TEST(test_connection_id);
+	CPPUNIT_TEST(test_columns);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -84,6 +94,147 @@ public:
 		CPPUNIT_ASSERT_MESSAGE("cp.payload[ 2] <- 3 bytes",  limited_caplen(&cp, cp.payload+2, 3));
 		CPPUNIT_ASSERT_MESSAGE("cp.payload[-1] <- 1 bytes",  limited_caplen(&cp, cp.payload-1, 1));
 	}
+
+	void test_meta(){
+		/* same packet twice, second one is vlan tagged */
+		char buffer[sizeof(struct cap_header) + DATA_SIZE + 4];
+		cap_head* tagged = (cap_head*)buffer;
+		memcpy(tagged, caphead, sizeof(struct cap_header) + 12);
+		const uint8_t tag[4] = {0x81, 0x00, 0x00, 0x0a};
+		memcpy(tagged->payload + 12, tag, 4);
+		memcpy(tagged->payload + 16, caphead->payload + 12, caphead->caplen - 12);
+		tagged->caplen += 4;
+		tagged->len += 4;
+
+		cap_head* cp[2] = {const_cast<cap_head*>(caphead), tagged};
+		struct packet_meta meta;
+		CPPUNIT_ASSERT_EQUAL((size_t)2, packet_meta_classify(&meta, cp, 2));
+
+		for ( unsigned int i = 0; i < 2; i++ ){
+			CPPUNIT_ASSERT_EQUAL((uint16_t)(PACKET_META_IPV4 | PACKET_META_PORTS | (i ? PACKET_META_VLAN : 0)), meta.flags[i]);
+			CPPUNIT_ASSERT_EQUAL((uint16_t)0x0800, meta.h_proto[i]);
+			CPPUNIT_ASSERT_EQUAL((uint16_t)(14 + 4*i), meta.l3_offset[i]);
+			CPPUNIT_ASSERT_EQUAL((uint16_t)(34 + 4*i), meta.l4_offset[i]);
+			CPPUNIT_ASSERT_EQUAL((uint8_t)6, meta.ip_proto[i]);
+			CPPUNIT_ASSERT_EQUAL((uint16_t)80, meta.src_port[i]);
+			CPPUNIT_ASSERT_EQUAL((size_t)471, payload_size_meta(LEVEL_NETWORK, &meta, i));
+			CPPUNIT_ASSERT_EQUAL((size_t)439, payload_size_meta(LEVEL_TRANSPORT, &meta, i));
+		}
+
+		/* both belong to the same connection */
+		const connection_id_t id = connection_id_meta(&meta, 0);
+		CPPUNIT_ASSERT(id != CONNECTION_ID_NONE);
+		CPPUNIT_ASSERT_EQUAL(id, connection_id_meta(&meta, 1));
+		CPPUNIT_ASSERT_EQUAL(id, connection_id(caphead));
+	}
+
+	void test_meta_truncated(){
+		/* headers cut short by caplen must not be classified */
+		char buffer[4][sizeof(struct cap_header) + DATA_SIZE];
+		const uint32_t caplen[4] = {10, 14 + 19, 34 + 3, 34 + 4};
+		cap_head* cp[4];
+		for ( unsigned int i = 0; i < 4; i++ ){
+			cp[i] = (cap_head*)buffer[i];
+			memcpy(cp[i], caphead, sizeof(struct cap_header) + caphead->caplen);
+			cp[i]->caplen = caplen[i];
+		}
+
+		struct packet_meta meta;
+		CPPUNIT_ASSERT_EQUAL((size_t)4, packet_meta_classify(&meta, cp, 4));
+		CPPUNIT_ASSERT_EQUAL((uint16_t)0, meta.flags[0]);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)0, meta.flags[1]);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)PACKET_META_IPV4, meta.flags[2]);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)0, meta.src_port[2]);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)(PACKET_META_IPV4 | PACKET_META_PORTS), meta.flags[3]);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)80, meta.src_port[3]);
+	}
+
+	void test_connection_id(){
+		const uint32_t a = htonl(0x0a000001);
+		const uint32_t b = htonl(0x0a000002);
+		connection_id_reset();
+		connection_id_set_timeout(300, 30);
+
+		/* both directions share id, protocol is part of the tuple */
+		const connection_id_t id = connection_id_ipv4(a, b, IPPROTO_TCP, 1024, 80, TH_SYN, 1000, 0);
+		CPPUNIT_ASSERT_EQUAL((connection_id_t)1, id);
+		CPPUNIT_ASSERT_EQUAL(id, connection_id_ipv4(b, a, IPPROTO_TCP, 80, 1024, TH_SYN|TH_ACK, 5000, 0));
+		CPPUNIT_ASSERT_EQUAL(id, connection_id_ipv4(a, b, IPPROTO_TCP, 1024, 80, TH_SYN, 1000, 1)); /* retransmitted SYN */
+		CPPUNIT_ASSERT(connection_id_ipv4(a, b, IPPROTO_UDP, 1024, 80, 0, 0, 1) != id);
+
+		/* new SYN starts a new connection */
+		const connection_id_t id2 = connection_id_ipv4(a, b, IPPROTO_TCP, 1024, 80, TH_SYN, 2000, 2);
+		CPPUNIT_ASSERT(id2 != id);
+
+		/* closed by FIN in both directions */
+		CPPUNIT_ASSERT_EQUAL(id2, connection_id_ipv4(a, b, IPPROTO_TCP, 1024, 80, TH_FIN|TH_ACK, 2001, 3));
+		CPPUNIT_ASSERT_EQUAL(id2, connection_id_ipv4(b, a, IPPROTO_TCP, 80, 1024, TH_FIN|TH_ACK, 6001, 3));
+		CPPUNIT_ASSERT_EQUAL(id2, connection_id_ipv4(a, b, IPPROTO_TCP, 1024, 80, TH_ACK, 2002, 10));
+		CPPUNIT_ASSERT(connection_id_ipv4(a, b, IPPROTO_TCP, 1024, 80, TH_ACK, 2002, 100) != id2);
+
+		/* idle timeout */
+		const connection_id_t id3 = connection_id_ipv4(a, b, IPPROTO_UDP, 53, 53, 0, 0, 100);
+		CPPUNIT_ASSERT_EQUAL(id3, connection_id_ipv4(b, a, IPPROTO_UDP, 53, 53, 0, 0, 399));
+		CPPUNIT_ASSERT(connection_id_ipv4(a, b, IPPROTO_UDP, 53, 53, 0, 0, 1000) != id3);
+
+		/* ipv6 */
+		const uint8_t a6[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+		const uint8_t b6[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2};
+		const connection_id_t id6 = connection_id_ipv6(a6, b6, IPPROTO_UDP, 1024, 53, 0, 0, 1000);
+		CPPUNIT_ASSERT(id6 != CONNECTION_ID_NONE);
+		CPPUNIT_ASSERT_EQUAL(id6, connection_id_ipv6(b6, a6, IPPROTO_UDP, 53, 1024, 0, 0, 1000));
+
+		/* without timeouts (default) only a new SYN ends a connection */
+		connection_id_set_timeout(0, 0);
+		const connection_id_t id4 = connection_id_ipv4(a, b, IPPROTO_UDP, 123, 123, 0, 0, 2000);
+		CPPUNIT_ASSERT_EQUAL(id4, connection_id_ipv4(a, b, IPPROTO_UDP, 123, 123, 0, 0, 100000));
+		const connection_id_t id5 = connection_id_ipv4(a, b, IPPROTO_TCP, 2048, 80, TH_RST, 3000, 100000);
+		CPPUNIT_ASSERT_EQUAL(id5, connection_id_ipv4(a, b, IPPROTO_TCP, 2048, 80, TH_ACK, 3001, 200000));
+
+		connection_id_reset();
+	}
+
+	void test_columns(){
+		struct column_batch batch;
+		CPPUNIT_ASSERT_EQUAL(0, column_batch_init(&batch, 2));
+		CPPUNIT_ASSERT_EQUAL(0, column_batch_add(&batch, caphead));
+		CPPUNIT_ASSERT_EQUAL(0, column_batch_add(&batch, caphead));
+		CPPUNIT_ASSERT_EQUAL(ENOSPC, column_batch_add(&batch, caphead));
+		column_batch_connection_id(&batch);
+
+		CPPUNIT_ASSERT_EQUAL(caphead->len, batch.len[0]);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)0x0800, batch.ethertype[0]);
+		CPPUNIT_ASSERT_EQUAL((uint8_t)6, batch.ip_proto[0]);
+		CPPUNIT_ASSERT_EQUAL((uint16_t)80, batch.src_port[0]);
+		CPPUNIT_ASSERT_EQUAL(connection_id(caphead), batch.connection_id[1]);
+
+		/* write subset of columns and read it back */
+		const unsigned int columns = (1U << COLUMN_LEN) | (1U << COLUMN_SRC_PORT) | (1U << COLUMN_CONNECTION_ID);
+		FILE* fp = tmpfile();
+		CPPUNIT_ASSERT(fp);
+		CPPUNIT_ASSERT_EQUAL(0, column_write_header(fp, columns));
+		CPPUNIT_ASSERT_EQUAL(0, column_write_batch(fp, &batch, columns));
+		CPPUNIT_ASSERT_EQUAL(0, column_write_end(fp));
+		rewind(fp);
+
+		struct column_batch copy;
+		unsigned int read_columns;
+		CPPUNIT_ASSERT_EQUAL(0, column_batch_init(&copy, 1));
+		CPPUNIT_ASSERT_EQUAL(0, column_read_header(fp, &read_columns));
+		CPPUNIT_ASSERT_EQUAL(columns, read_columns);
+		CPPUNIT_ASSERT_EQUAL(0, column_read_batch(fp, &copy, read_columns));
+		CPPUNIT_ASSERT_EQUAL((size_t)2, copy.num);
+		for ( unsigned int i = 0; i < 2; i++ ){
+			CPPUNIT_ASSERT_EQUAL(batch.len[i], copy.len[i]);
+			CPPUNIT_ASSERT_EQUAL(batch.src_port[i], copy.src_port[i]);
+			CPPUNIT_ASSERT_EQUAL(batch.connection_id[i], copy.connection_id[i]);
+		}
+		CPPUNIT_ASSERT_EQUAL(-1, column_read_batch(fp, &copy, read_columns));
+
+		fclose(fp);
+		column_batch_free(&copy);
+		column_batch_free(&batch);
+	}
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(Test);
@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# the report of a file must not depend on which worker processed it or what it
+# processed before, e.g. an empty file must not show the capture window of the
+# previous file.
+
+srcdir=${srcdir:-.}
+files="$srcdir/tests/traces/t2.cap $srcdir/tests/empty.cap $srcdir/tests/empty.cap"
+
+for threads in 1 3; do
+	for file in $files; do
+		expected=$(./capinfo $file) || exit 1
+		actual=$(./capinfo -t $threads $files | awk -v f="$file" '/^[^ ].*: caputils/ { p = index($0, f ":") == 1 } p') || exit 1
+
+		# the same file is listed more than once so compare the first report only
+		actual=$(echo "$actual" | awk 'NR > 1 && /: caputils/ { exit } { print }')
+		if [[ "$(echo "$expected" | sed '/^$/d')" != "$(echo "$actual" | sed '/^$/d')" ]]; then
+			echo "$file differs with $threads threads:"
+			diff <(echo "$expected") <(echo "$actual")
+			exit 1
+		fi
+	done
+done
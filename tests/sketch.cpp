@@ -0,0 +1,136 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "caputils/sketch.h"
+#include <cerrno>
+
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+class SketchTest: public CppUnit::TestFixture {
+	CPPUNIT_TEST_SUITE(SketchTest);
+	CPPUNIT_TEST(test_quantile);
+	CPPUNIT_TEST(test_quantile_collapse);
+	CPPUNIT_TEST(test_quantile_merge);
+	CPPUNIT_TEST(test_cardinality);
+	CPPUNIT_TEST(test_cardinality_merge);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void test_quantile(){
+		struct quantile_sketch sk;
+		CPPUNIT_ASSERT_EQUAL(EINVAL, quantile_sketch_init(&sk, 0.0, 128));
+		CPPUNIT_ASSERT_EQUAL(0, quantile_sketch_init(&sk, 0.01, 2048));
+		CPPUNIT_ASSERT_EQUAL(0.0, quantile_sketch_quantile(&sk, 0.5));
+
+		/* 1..10000 in scrambled order (7919 is coprime to 10000) */
+		for ( int i = 0; i < 10000; i++ ){
+			quantile_sketch_add(&sk, (i * 7919) % 10000 + 1);
+		}
+		quantile_sketch_add(&sk, 0.0);
+
+		CPPUNIT_ASSERT_EQUAL((uint64_t)10001, sk.count);
+		CPPUNIT_ASSERT_EQUAL(0.0, quantile_sketch_quantile(&sk, 0.0));
+		CPPUNIT_ASSERT_EQUAL(10000.0, quantile_sketch_quantile(&sk, 1.0));
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(5000.0, quantile_sketch_quantile(&sk, 0.5), 5000.0 * 0.01);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(9000.0, quantile_sketch_quantile(&sk, 0.9), 9000.0 * 0.01);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(9900.0, quantile_sketch_quantile(&sk, 0.99), 9900.0 * 0.01);
+
+		quantile_sketch_reset(&sk);
+		CPPUNIT_ASSERT_EQUAL((uint64_t)0, sk.count);
+		quantile_sketch_free(&sk);
+	}
+
+	void test_quantile_collapse(){
+		/* 64 bins at 1% only covers a range of ~3.6x so the low values collapse */
+		struct quantile_sketch sk;
+		CPPUNIT_ASSERT_EQUAL(0, quantile_sketch_init(&sk, 0.01, 64));
+		for ( int i = 1; i <= 1000; i++ ){
+			quantile_sketch_add(&sk, 1001 - i);
+		}
+		CPPUNIT_ASSERT_EQUAL((uint64_t)1000, sk.count);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(990.0, quantile_sketch_quantile(&sk, 0.99), 990.0 * 0.01);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(500.0, quantile_sketch_quantile(&sk, 0.5), 500.0 * 0.5);
+		CPPUNIT_ASSERT_EQUAL(1.0, sk.min);
+		quantile_sketch_free(&sk);
+	}
+
+	void test_quantile_merge(){
+		struct quantile_sketch a, b, c;
+		CPPUNIT_ASSERT_EQUAL(0, quantile_sketch_init(&a, 0.01, 2048));
+		CPPUNIT_ASSERT_EQUAL(0, quantile_sketch_init(&b, 0.01, 2048));
+		CPPUNIT_ASSERT_EQUAL(0, quantile_sketch_init(&c, 0.02, 2048));
+
+		for ( int i = 1; i <= 1000; i++ ){
+			quantile_sketch_add(&a, i);
+			quantile_sketch_add(&b, i * 1000);
+		}
+
+		CPPUNIT_ASSERT_EQUAL(EINVAL, quantile_sketch_merge(&a, &c));
+		CPPUNIT_ASSERT_EQUAL(0, quantile_sketch_merge(&a, &b));
+		CPPUNIT_ASSERT_EQUAL((uint64_t)2000, a.count);
+		CPPUNIT_ASSERT_EQUAL(1.0, a.min);
+		CPPUNIT_ASSERT_EQUAL(1e6, a.max);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(500.0, quantile_sketch_quantile(&a, 0.25), 500.0 * 0.01);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(500e3, quantile_sketch_quantile(&a, 0.75), 500e3 * 0.01);
+
+		quantile_sketch_free(&a);
+		quantile_sketch_free(&b);
+		quantile_sketch_free(&c);
+	}
+
+	void test_cardinality(){
+		struct cardinality_sketch sk;
+		CPPUNIT_ASSERT_EQUAL(EINVAL, cardinality_sketch_init(&sk, 2));
+		CPPUNIT_ASSERT_EQUAL(0, cardinality_sketch_init(&sk, 14));
+		CPPUNIT_ASSERT_EQUAL((uint64_t)0, cardinality_sketch_count(&sk));
+
+		/* each value added twice */
+		for ( uint32_t i = 0; i < 200000; i++ ){
+			cardinality_sketch_add(&sk, &i, sizeof(i));
+			cardinality_sketch_add(&sk, &i, sizeof(i));
+			if ( i == 99 ){
+				CPPUNIT_ASSERT_DOUBLES_EQUAL(100.0, (double)cardinality_sketch_count(&sk), 2.0);
+			}
+		}
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(200000.0, (double)cardinality_sketch_count(&sk), 200000.0 * 0.03);
+
+		cardinality_sketch_reset(&sk);
+		CPPUNIT_ASSERT_EQUAL((uint64_t)0, cardinality_sketch_count(&sk));
+		cardinality_sketch_free(&sk);
+	}
+
+	void test_cardinality_merge(){
+		struct cardinality_sketch a, b;
+		CPPUNIT_ASSERT_EQUAL(0, cardinality_sketch_init(&a, 12));
+		CPPUNIT_ASSERT_EQUAL(0, cardinality_sketch_init(&b, 12));
+
+		/* overlapping ranges, 0..29999 and 20000..49999 */
+		for ( uint32_t i = 0; i < 30000; i++ ){
+			const uint32_t j = i + 20000;
+			cardinality_sketch_add(&a, &i, sizeof(i));
+			cardinality_sketch_add(&b, &j, sizeof(j));
+		}
+		CPPUNIT_ASSERT_EQUAL(0, cardinality_sketch_merge(&a, &b));
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(50000.0, (double)cardinality_sketch_count(&a), 50000.0 * 0.05);
+
+		cardinality_sketch_free(&a);
+		cardinality_sketch_free(&b);
+	}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(SketchTest);
+
+int main(int argc, const char* argv[]){
+	CppUnit::Test *suite = CppUnit::TestFactoryRegistry::getRegistry().makeTest();
+
+	CppUnit::TextUi::TestRunner runner;
+
+	runner.addTest( suite );
+	runner.setOutputter(new CppUnit::CompilerOutputter(&runner.result(), std::cerr ));
+
+	return runner.run() ? 0 : 1;
+}
@@ -5,21 +5,23 @@
 
 #include "src/slist.h"
 #include <string.h>
+#include <string>
 
 class Test: public CppUnit::TestFixture {
 	CPPUNIT_TEST_SUITE(Test);
-	//CPPUNIT_TEST(test_empty);
-	//CPPUNIT_TEST(test_put);
-	//CPPUNIT_TEST(test_get);
+	CPPUNIT_TEST(test_empty);
+	CPPUNIT_TEST(test_put);
+	CPPUNIT_TEST(test_get);
 	CPPUNIT_TEST(test_memory);
-	//CPPUNIT_TEST(test_find);
-	//CPPUNIT_TEST(test_grow);
+	CPPUNIT_TEST(test_find);
+	CPPUNIT_TEST(test_grow);
+	CPPUNIT_TEST(test_clear);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
 	void test_empty(){
 		struct simple_list slist;
-		slist_init(&slist, sizeof(char*), sizeof(char*), 0);
+		slist_init(&slist, 4, sizeof(char*), 0);
 		{
 			CPPUNIT_ASSERT_EQUAL((size_t)0, slist.size);
 			CPPUNIT_ASSERT_EQUAL((size_t)0, slist.capacity);
@@ -29,27 +31,27 @@ public:
 
 	void test_put(){
 		struct simple_list slist;
-		slist_init(&slist, sizeof(char*), sizeof(int), 10);
+		slist_init(&slist, 4, sizeof(int), 10);
 		{
-			int* value = (int*)slist_put(&slist, strdup("foo"));
+			int* value = (int*)slist_put(&slist, "foo");
 			*value = 4711;
 
 			CPPUNIT_ASSERT_EQUAL((size_t)1,  slist.size);
-			CPPUNIT_ASSERT_EQUAL((size_t)10, slist.capacity);
+			CPPUNIT_ASSERT(slist.capacity >= 10);
+			CPPUNIT_ASSERT_EQUAL(std::string("foo"), std::string((const char*)slist_key(&slist, 0)));
 		}
 		slist_free(&slist);
 	}
 
 	void test_get(){
 		struct simple_list slist;
-		slist_init(&slist, sizeof(char*), sizeof(int), 10);
+		slist_init(&slist, 4, sizeof(int), 10);
 		{
-			int* value = (int*)slist_put(&slist, strdup("foo"));
+			int* value = (int*)slist_put(&slist, "foo");
 			*value = 4711;
 
 			int* fetch = (int*)slist_get(&slist, 0);
 			CPPUNIT_ASSERT_EQUAL((size_t)1,  slist.size);
-			CPPUNIT_ASSERT_EQUAL((size_t)10, slist.capacity);
 			CPPUNIT_ASSERT(fetch);
 			CPPUNIT_ASSERT_EQUAL(4711, *(int*)fetch);
 		}
@@ -61,10 +63,10 @@ public:
 		struct foo { int a; int b; int c; int d; };
 		const long element_size = sizeof(struct foo);;
 		struct simple_list slist;
-		slist_init(&slist, sizeof(char*), element_size, 10);
+		slist_init(&slist, 4, element_size, 10);
 		{
-			struct foo* pa = (struct foo*)slist_put(&slist, strdup("foo"));
-			struct foo* pb = (struct foo*)slist_put(&slist, strdup("bar"));
+			struct foo* pa = (struct foo*)slist_put(&slist, "foo");
+			struct foo* pb = (struct foo*)slist_put(&slist, "bar");
 
 			struct foo* ga = (struct foo*)slist_get(&slist, 0);
 			struct foo* gb = (struct foo*)slist_get(&slist, 1);
@@ -79,30 +81,61 @@ public:
 
 	void test_find(){
 		struct simple_list slist;
-		slist_init(&slist, sizeof(char*), sizeof(int), 10);
+		slist_init(&slist, 4, sizeof(int), 10);
 		{
-			int* value = (int*)slist_put(&slist, strdup("foo"));
+			int* value = (int*)slist_put(&slist, "foo");
 			*value = 4711;
+			slist_put(&slist, "bar");
 
 			int* fetch = (int*)slist_find(&slist, "foo", slist_strcmp);
-			CPPUNIT_ASSERT_EQUAL((size_t)1,  slist.size);
-			CPPUNIT_ASSERT_EQUAL((size_t)10, slist.capacity);
+			CPPUNIT_ASSERT_EQUAL((size_t)2,  slist.size);
 			CPPUNIT_ASSERT(fetch);
 			CPPUNIT_ASSERT_EQUAL(4711, *(int*)fetch);
+			CPPUNIT_ASSERT_EQUAL(fetch, (int*)slist_find(&slist, "foo", NULL));
+			CPPUNIT_ASSERT(!slist_find(&slist, "baz", NULL));
 		}
 		slist_free(&slist);
 	}
 
 	void test_grow(){
 		struct simple_list slist;
-		slist_init(&slist, sizeof(char*), sizeof(int), 2);
+		slist_init(&slist, sizeof(int), sizeof(int), 2);
+		{
+			int* first = NULL;
+			for ( int i = 0; i < 100; i++ ){
+				int* value = (int*)slist_put(&slist, &i);
+				*value = i;
+				if ( i == 0 ) first = value;
+			}
+
+			/* elements does not move when growing */
+			CPPUNIT_ASSERT_EQUAL((size_t)100, slist.size);
+			CPPUNIT_ASSERT(slist.capacity >= 100);
+			CPPUNIT_ASSERT_EQUAL(first, (int*)slist_get(&slist, 0));
+			for ( int i = 0; i < 100; i++ ){
+				CPPUNIT_ASSERT_EQUAL(i, *(const int*)slist_key(&slist, i));
+				CPPUNIT_ASSERT_EQUAL(i, *(int*)slist_get(&slist, i));
+				CPPUNIT_ASSERT_EQUAL((int*)slist_get(&slist, i), (int*)slist_find(&slist, &i, NULL));
+			}
+		}
+		slist_free(&slist);
+	}
+
+	void test_clear(){
+		struct simple_list slist;
+		slist_init(&slist, 4, sizeof(int), 10);
 		{
-			slist_put(&slist, strdup("foo"));
-			slist_put(&slist, strdup("bar"));
-			slist_put(&slist, strdup("baz"));
+			int* a = (int*)slist_put(&slist, "foo");
+			slist_put(&slist, "bar");
+			const size_t capacity = slist.capacity;
+			slist_clear(&slist);
 
-			CPPUNIT_ASSERT_EQUAL((size_t)3, slist.size);
-			CPPUNIT_ASSERT_EQUAL((size_t)4, slist.capacity);
+			/* memory is reused */
+			CPPUNIT_ASSERT_EQUAL((size_t)0, slist.size);
+			CPPUNIT_ASSERT_EQUAL(capacity, slist.capacity);
+			CPPUNIT_ASSERT(!slist_find(&slist, "foo", NULL));
+			CPPUNIT_ASSERT_EQUAL(a, (int*)slist_put(&slist, "baz"));
+			CPPUNIT_ASSERT_EQUAL(std::string("baz"), std::string((const char*)slist_key(&slist, 0)));
 		}
 		slist_free(&slist);
 	}
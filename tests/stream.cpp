@@ -6,16 +6,105 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
 
 #include <cppunit/CompilerOutputter.h>
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/ui/text/TestRunner.h>
 #include <cppunit/extensions/HelperMacros.h>
 
+/* count syncs issued by the library (interposes the libc symbol) */
+static int fdatasync_calls = 0;
+extern "C" int fdatasync(int fd){
+	fdatasync_calls++;
+	return fsync(fd);
+}
+
+#define MAX_TRACE_PACKETS 4096
+
+struct trace_copy {
+	unsigned long packets;
+	unsigned long bytes;
+	timepico max;                          /* latest timestamp */
+	timepico ts[MAX_TRACE_PACKETS];        /* timestamps of the first packets */
+};
+
+/**
+ * Copy tests/traces/t2.cap (repeat times) to a new capfile using flags.
+ */
+static struct trace_copy copy_trace(const char* filename, int flags, int repeat = 1){
+	struct trace_copy copy;
+	stream_t src, dst;
+	stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+	cap_head* cp;
+	int ret;
+
+	memset(&copy, 0, sizeof(copy));
+	stream_addr_str(&addr, filename, flags);
+	CPPUNIT_ASSERT_EQUAL(0, stream_create(&dst, &addr, NULL, "test", "test"));
+	for ( int i = 0; i < repeat; i++ ){
+		stream_addr_str(&addr, TOP_SRCDIR "/tests/traces/t2.cap", 0);
+		CPPUNIT_ASSERT_EQUAL(0, stream_open(&src, &addr, NULL, 0));
+		while ( (ret=stream_read(src, &cp, NULL, NULL)) == 0 ){
+			CPPUNIT_ASSERT_EQUAL(0, stream_copy(dst, cp));
+			if ( copy.packets < MAX_TRACE_PACKETS ){
+				copy.ts[copy.packets] = cp->ts;
+			}
+			if ( timecmp(&cp->ts, &copy.max) > 0 ){
+				copy.max = cp->ts;
+			}
+			copy.packets++;
+			copy.bytes += cp->caplen;
+		}
+		CPPUNIT_ASSERT_EQUAL(-1, ret);
+		stream_close(src);
+	}
+	stream_close(dst);
+
+	return copy;
+}
+
+/**
+ * Read capfile and compare with what was written by copy_trace.
+ */
+static void check_copy(const char* filename, const struct trace_copy& expected){
+	stream_t st;
+	stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+	unsigned long packets = 0;
+	unsigned long bytes = 0;
+	cap_head* cp;
+	int ret;
+
+	stream_addr_str(&addr, filename, 0);
+	CPPUNIT_ASSERT_EQUAL(0, stream_open(&st, &addr, NULL, 0));
+	CPPUNIT_ASSERT_EQUAL(std::string("test"), std::string(stream_get_comment(st)));
+	while ( (ret=stream_read(st, &cp, NULL, NULL)) == 0 ){
+		packets++;
+		bytes += cp->caplen;
+	}
+	CPPUNIT_ASSERT_EQUAL(-1, ret);
+	stream_close(st);
+
+	CPPUNIT_ASSERT_EQUAL(expected.packets, packets);
+	CPPUNIT_ASSERT_EQUAL(expected.bytes, bytes);
+}
 
 class Test: public CppUnit::TestFixture {
 	CPPUNIT_TEST_SUITE(Test);
 	CPPUNIT_TEST( test_num_stream_single );
+	CPPUNIT_TEST( test_mmap_equals_pipe );
+	CPPUNIT_TEST( test_read_batch );
+	CPPUNIT_TEST( test_write_direct );
+	CPPUNIT_TEST( test_sync_policy );
+	CPPUNIT_TEST( test_index_window );
+	CPPUNIT_TEST( test_open_split );
+#ifdef HAVE_LZ4
+	CPPUNIT_TEST( test_compressed_lz4 );
+#endif
+#ifdef HAVE_ZSTD
+	CPPUNIT_TEST( test_compressed_zstd );
+#endif
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -29,6 +118,242 @@ public:
 		CPPUNIT_ASSERT_EQUAL(std::string(strerror(0)), std::string(strerror(ret)));
 		CPPUNIT_ASSERT_EQUAL((unsigned int)1, stream_num_address(st));
 	}
+
+	/* regular files are memory-mapped while pipes are read using fread, both
+	 * must yield the same packets */
+	void test_mmap_equals_pipe(){
+		stream_t st;
+		stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+		unsigned long packets[2] = {0, 0};
+		unsigned long bytes[2] = {0, 0};
+
+		FILE* fp = popen("cat " TOP_SRCDIR "/tests/traces/t2.cap", "r");
+		CPPUNIT_ASSERT(fp);
+
+		for ( int i = 0; i < 2; i++ ){
+			if ( i == 0 ){
+				stream_addr_str(&addr, TOP_SRCDIR "/tests/traces/t2.cap", 0);
+			} else {
+				stream_addr_fp(&addr, fp, 0);
+			}
+			int ret = stream_open(&st, &addr, NULL, 0);
+			CPPUNIT_ASSERT_EQUAL(std::string(strerror(0)), std::string(strerror(ret)));
+
+			cap_head* cp;
+			struct timeval tv = {1, 0};
+			while ( (ret=stream_read(st, &cp, NULL, &tv)) == 0 ){
+				packets[i]++;
+				bytes[i] += cp->caplen;
+			}
+			CPPUNIT_ASSERT_EQUAL(-1, ret);
+			stream_close(st);
+		}
+		pclose(fp);
+
+		CPPUNIT_ASSERT(packets[0] > 0);
+		CPPUNIT_ASSERT_EQUAL(packets[1], packets[0]);
+		CPPUNIT_ASSERT_EQUAL(bytes[1], bytes[0]);
+	}
+
+	void test_read_batch(){
+		stream_t st;
+		stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+		unsigned long packets = 0;
+		unsigned long batches = 0;
+		cap_head* cp[7];
+		size_t count;
+
+		/* use a tiny buffer to make sure batches are split at buffer boundaries */
+		FILE* fp = popen("cat " TOP_SRCDIR "/tests/traces/t2.cap", "r");
+		CPPUNIT_ASSERT(fp);
+		stream_addr_fp(&addr, fp, 0);
+		int ret = stream_open(&st, &addr, NULL, 1024);
+		CPPUNIT_ASSERT_EQUAL(std::string(strerror(0)), std::string(strerror(ret)));
+
+		struct timeval tv = {1, 0};
+		while ( (ret=stream_read_batch(st, cp, 7, &count, NULL, &tv)) == 0 ){
+			CPPUNIT_ASSERT(count >= 1 && count <= 7);
+			for ( size_t i = 0; i < count; i++ ){
+				CPPUNIT_ASSERT(cp[i]->caplen <= cp[i]->len);
+			}
+			packets += count;
+			batches++;
+		}
+		CPPUNIT_ASSERT_EQUAL(-1, ret);
+		CPPUNIT_ASSERT_EQUAL((size_t)0, count);
+		CPPUNIT_ASSERT_EQUAL((uint64_t)packets, stream_get_stat(st)->matched);
+		CPPUNIT_ASSERT(batches < packets);
+		stream_close(st);
+		pclose(fp);
+	}
+
+	/* files written with O_DIRECT (padded header) must be readable */
+	void test_write_direct(){
+		stream_t dst;
+		stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+
+		/* combinations which cannot be honoured are rejected */
+		stream_addr_str(&addr, "stream_direct.cap", STREAM_ADDR_DIRECT | STREAM_ADDR_FLUSH);
+		CPPUNIT_ASSERT_EQUAL(EINVAL, stream_create(&dst, &addr, NULL, "direct", "test"));
+		std::string long_comment(70000, 'x');
+		stream_addr_str(&addr, "stream_direct.cap", STREAM_ADDR_DIRECT);
+		CPPUNIT_ASSERT_EQUAL(EINVAL, stream_create(&dst, &addr, NULL, "direct", long_comment.c_str()));
+
+		const struct trace_copy copy = copy_trace("stream_direct.cap", STREAM_ADDR_DIRECT);
+		check_copy("stream_direct.cap", copy);
+		unlink("stream_direct.cap");
+	}
+
+	/* the durability policy must apply to buffered (stdio) writes as well */
+	void test_sync_policy(){
+		stream_t src, dst;
+		stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+		cap_head* cp;
+		int ret;
+
+		FILE* fp = tmpfile();
+		CPPUNIT_ASSERT(fp);
+		stream_addr_fp(&addr, fp, 0);
+		CPPUNIT_ASSERT_EQUAL(0, stream_create(&dst, &addr, NULL, "sync", "test"));
+		CPPUNIT_ASSERT_EQUAL(0, stream_set_sync_policy(dst, 1024, 0));
+
+		fdatasync_calls = 0;
+		stream_addr_str(&addr, TOP_SRCDIR "/tests/traces/t2.cap", 0);
+		CPPUNIT_ASSERT_EQUAL(0, stream_open(&src, &addr, NULL, 0));
+		while ( (ret=stream_read(src, &cp, NULL, NULL)) == 0 ){
+			CPPUNIT_ASSERT_EQUAL(0, stream_copy(dst, cp));
+		}
+		CPPUNIT_ASSERT_EQUAL(-1, ret);
+		stream_close(src);
+		stream_close(dst);
+		fclose(fp);
+
+		CPPUNIT_ASSERT(fdatasync_calls > 0);
+	}
+
+	/* seeking and stopping using the index must not lose any packets within the
+	 * window */
+	void test_index_window(){
+		stream_t src;
+		stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+		cap_head* cp;
+		int ret;
+
+		/* copy trace so the index is newer than the capfile */
+		const struct trace_copy copy = copy_trace("stream_index.cap", 0);
+		CPPUNIT_ASSERT(copy.packets > 8 && copy.packets <= MAX_TRACE_PACKETS);
+		CPPUNIT_ASSERT_EQUAL(0, stream_index_build("stream_index.cap", 4, 1));
+
+		const timepico start = copy.ts[copy.packets / 4];
+		const timepico end = copy.ts[copy.packets / 2];
+		unsigned long expected = 0;
+		for ( unsigned long i = 0; i < copy.packets; i++ ){
+			if ( timecmp(&start, &copy.ts[i]) <= 0 && timecmp(&copy.ts[i], &end) < 0 ) expected++;
+		}
+
+		unsigned long matched = 0;
+		stream_addr_str(&addr, "stream_index.cap", 0);
+		CPPUNIT_ASSERT_EQUAL(0, stream_open(&src, &addr, NULL, 0));
+		CPPUNIT_ASSERT_EQUAL(0, stream_seek_time(src, start));
+		CPPUNIT_ASSERT_EQUAL(0, stream_stop_time(src, end));
+		while ( (ret=stream_read(src, &cp, NULL, NULL)) == 0 ){
+			if ( timecmp(&start, &cp->ts) <= 0 && timecmp(&cp->ts, &end) < 0 ) matched++;
+		}
+		CPPUNIT_ASSERT_EQUAL(-1, ret);
+		CPPUNIT_ASSERT(stream_get_stat(src)->read <= copy.packets);
+		stream_close(src);
+		unlink("stream_index.cap");
+		unlink("stream_index.cap.idx");
+
+		CPPUNIT_ASSERT_EQUAL(expected, matched);
+	}
+
+	/* reading all ranges in order must yield the same packets as a single
+	 * stream, both when resyncing on headers and when using the index */
+	void test_open_split(){
+		stream_t st[8];
+		stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+		cap_head* cp;
+		int ret;
+
+		const struct trace_copy copy = copy_trace("stream_split.cap", 0);
+		CPPUNIT_ASSERT(copy.packets <= MAX_TRACE_PACKETS);
+		stream_addr_str(&addr, "stream_split.cap", 0);
+
+		for ( int pass = 0; pass < 2; pass++ ){
+			if ( pass == 1 ){
+				CPPUNIT_ASSERT_EQUAL(0, stream_index_build("stream_split.cap", 4, 1));
+			}
+
+			size_t num = 8;
+			CPPUNIT_ASSERT_EQUAL(0, stream_open_split(st, &num, &addr, 0));
+			CPPUNIT_ASSERT(num > 1 && num <= 8);
+
+			unsigned long n = 0;
+			for ( size_t i = 0; i < num; i++ ){
+				while ( (ret=stream_read(st[i], &cp, NULL, NULL)) == 0 ){
+					CPPUNIT_ASSERT(n < copy.packets);
+					CPPUNIT_ASSERT_EQUAL(0, timecmp(&copy.ts[n], &cp->ts));
+					n++;
+				}
+				CPPUNIT_ASSERT_EQUAL(-1, ret);
+				stream_close(st[i]);
+			}
+			CPPUNIT_ASSERT_EQUAL(copy.packets, n);
+		}
+
+		unlink("stream_split.cap");
+		unlink("stream_split.cap.idx");
+	}
+
+	void test_compressed_lz4(){
+		compressed_roundtrip(STREAM_ADDR_LZ4);
+	}
+
+	void test_compressed_zstd(){
+		compressed_roundtrip(STREAM_ADDR_ZSTD);
+	}
+
+	/* compressed capfiles must yield the same packets and support seeking using
+	 * the block index */
+	void compressed_roundtrip(int flags){
+		stream_t src;
+		stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+		cap_head* cp;
+		int ret;
+
+		/* write the trace multiple times so it spans multiple blocks */
+		const struct trace_copy copy = copy_trace("stream_compressed.cap", flags, 64);
+		check_copy("stream_compressed.cap", copy);
+
+		/* all packets are older so only the last block is read (skipped packets
+		 * are still counted) */
+		timepico t = copy.max;
+		t.tv_sec++;
+		stream_addr_str(&addr, "stream_compressed.cap", 0);
+		CPPUNIT_ASSERT_EQUAL(0, stream_open(&src, &addr, NULL, 0));
+		CPPUNIT_ASSERT_EQUAL(0, stream_seek_time(src, t));
+		CPPUNIT_ASSERT(stream_get_stat(src)->read > 0);
+		while ( (ret=stream_read(src, &cp, NULL, NULL)) == 0 ){
+			CPPUNIT_ASSERT(timecmp(&cp->ts, &t) < 0);
+		}
+		CPPUNIT_ASSERT_EQUAL(-1, ret);
+		CPPUNIT_ASSERT_EQUAL((uint64_t)copy.packets, stream_get_stat(src)->read);
+		stream_close(src);
+
+		unlink("stream_compressed.cap");
+
+		/* failing to write the final block and index is reported by close */
+		stream_t dst;
+		stream_addr_str(&addr, "/dev/full", flags);
+		CPPUNIT_ASSERT_EQUAL(0, stream_create(&dst, &addr, NULL, "test", "test"));
+		stream_addr_str(&addr, TOP_SRCDIR "/tests/traces/t2.cap", 0);
+		CPPUNIT_ASSERT_EQUAL(0, stream_open(&src, &addr, NULL, 0));
+		CPPUNIT_ASSERT_EQUAL(0, stream_read(src, &cp, NULL, NULL));
+		CPPUNIT_ASSERT_EQUAL(0, stream_copy(dst, cp));
+		stream_close(src);
+		CPPUNIT_ASSERT_EQUAL(ENOSPC, (int)stream_close(dst));
+	}
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(Test);
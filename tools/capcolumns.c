@@ -0,0 +1,380 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "caputils/caputils.h"
+#include "caputils/columns.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#define MAX_THREADS 64
+
+static const char* program_name;
+static const char* output = NULL;
+static unsigned int columns = COLUMN_ALL;
+static size_t batch_size = 65536;
+static unsigned int threads = 1;
+static const char* tmpdir = NULL;
+static int quiet = 0;
+
+static const char* shortopts = "o:c:b:t:T:qh";
+static struct option longopts[] = {
+	{"output",  required_argument, 0, 'o'},
+	{"columns", required_argument, 0, 'c'},
+	{"batch",   required_argument, 0, 'b'},
+	{"threads", required_argument, 0, 't'},
+	{"tmpdir",  required_argument, 0, 'T'},
+	{"quiet",   no_argument,       0, 'q'},
+	{"help",    no_argument,       0, 'h'},
+	{0,0,0,0},
+};
+
+static void show_usage(){
+	printf("capcolumns-%s\n", caputils_version(NULL));
+	printf("usage: %s [OPTIONS..] FILES..\n"
+	       "\n"
+	       "Export packet headers as columns in a binary column file.\n"
+	       "\n"
+	       "  -o, --output=FILE      Write columns to FILE [default: stdout].\n"
+	       "  -c, --columns=LIST     Comma-separated list of columns [default: all].\n"
+	       "  -b, --batch=N          Number of rows per batch [default: 65536].\n"
+	       "  -t, --threads=N        Decode capfiles in N parallel ranges [default: 1].\n"
+	       "  -T, --tmpdir=DIR       Store temporary files in DIR [default: $TMPDIR or /tmp].\n"
+	       "  -q, --quiet            Quiet output.\n"
+	       "  -h, --help             This text.\n"
+	       "\n"
+	       "Columns:\n ",
+	       program_name);
+	for ( unsigned int i = 0; i < COLUMN_NUM; i++ ){
+		printf(" %s", column_name(i));
+	}
+	printf("\n");
+}
+
+static int parse_columns(char* str){
+	columns = 0;
+	char* saveptr;
+	for ( char* name = strtok_r(str, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr) ){
+		if ( strcmp(name, "all") == 0 ){
+			columns = COLUMN_ALL;
+			continue;
+		}
+
+		const int column = column_from_string(name);
+		if ( column < 0 ){
+			fprintf(stderr, "%s: unknown column `%s'.\n", program_name, name);
+			return 0;
+		}
+		columns |= 1U << column;
+	}
+
+	if ( columns == 0 ){
+		fprintf(stderr, "%s: no columns selected.\n", program_name);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Each worker decodes one range of the input. The first range is written
+ * directly to the output (assigning connection ids while decoding) while the
+ * others are written with all columns to temporary files and appended once
+ * all ranges are decoded, as connection ids must be assigned in packet order.
+ */
+struct worker {
+	stream_t st;
+	FILE* fp;
+	unsigned int columns;        /* columns written to fp */
+	int connection_id;           /* assign connection ids before writing */
+	int temporary;               /* fp is a temporary file */
+	struct column_batch batch;
+	pthread_t thread;
+	uint64_t packets;
+	int result;
+};
+
+static int worker_flush(struct worker* worker){
+	if ( worker->connection_id ){
+		column_batch_connection_id(&worker->batch);
+	}
+
+	const int ret = column_write_batch(worker->fp, &worker->batch, worker->columns);
+	worker->batch.num = 0;
+	return ret;
+}
+
+static void* worker_run(void* arg){
+	struct worker* worker = (struct worker*)arg;
+	cap_head* cp;
+	int ret;
+
+	while ( (ret=stream_read(worker->st, &cp, NULL, NULL)) == 0 ){
+		column_batch_add(&worker->batch, cp);
+		worker->packets++;
+
+		if ( worker->batch.num == worker->batch.capacity && (ret=worker_flush(worker)) != 0 ){
+			break;
+		}
+	}
+
+	/* -1 means EOF */
+	if ( ret == -1 ){
+		ret = worker_flush(worker);
+	}
+
+	/* temporary files has no header, end marker is written so it can be read back */
+	if ( ret == 0 && worker->temporary ){
+		ret = column_write_end(worker->fp);
+	}
+
+	worker->result = ret;
+	return NULL;
+}
+
+static FILE* temporary_file(){
+	char filename[PATH_MAX];
+	snprintf(filename, sizeof(filename), "%s/capcolumns.XXXXXX", tmpdir);
+
+	const int fd = mkstemp(filename);
+	if ( fd == -1 ){
+		fprintf(stderr, "%s: failed to create temporary file in `%s': %s\n", program_name, tmpdir, strerror(errno));
+		return NULL;
+	}
+
+	/* removed as soon as it is closed */
+	unlink(filename);
+	return fdopen(fd, "w+");
+}
+
+/**
+ * Read back a range written to a temporary file and append it to output.
+ */
+static int append_range(struct worker* worker, FILE* dst){
+	int ret;
+	rewind(worker->fp);
+	while ( (ret=column_read_batch(worker->fp, &worker->batch, COLUMN_ALL)) == 0 ){
+		if ( columns & (1U << COLUMN_CONNECTION_ID) ){
+			column_batch_connection_id(&worker->batch);
+		}
+		if ( (ret=column_write_batch(dst, &worker->batch, columns)) != 0 ){
+			return ret;
+		}
+	}
+	return ret == -1 ? 0 : ret;
+}
+
+static int process(const char* filename, FILE* dst){
+	stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+	stream_addr_str(&addr, filename, 0);
+
+	stream_t st[MAX_THREADS];
+	size_t num = threads;
+	int ret;
+	if ( threads > 1 && stream_addr_type(&addr) == STREAM_ADDR_CAPFILE ){
+		ret = stream_open_split(st, &num, &addr, 0);
+	} else {
+		num = 1;
+		ret = stream_open(&st[0], &addr, NULL, 0);
+	}
+	if ( ret != 0 ){
+		fprintf(stderr, "%s: failed to open `%s': %s\n", program_name, filename, caputils_error_string(ret));
+		return ret;
+	}
+
+	struct worker worker[MAX_THREADS];
+	memset(worker, 0, sizeof(worker));
+	for ( size_t i = 0; i < num; i++ ){
+		worker[i].st = st[i];
+		worker[i].fp = i == 0 ? dst : temporary_file();
+		worker[i].columns = i == 0 ? columns : COLUMN_ALL;
+		worker[i].connection_id = i == 0 && (columns & (1U << COLUMN_CONNECTION_ID));
+		worker[i].temporary = i > 0;
+		if ( !worker[i].fp ){
+			exit(1);
+		}
+		if ( (ret=column_batch_init(&worker[i].batch, batch_size)) != 0 ){
+			fprintf(stderr, "%s: failed to allocate batch: %s\n", program_name, strerror(ret));
+			exit(1);
+		}
+	}
+
+	/* first range is decoded by this thread */
+	for ( size_t i = 1; i < num; i++ ){
+		if ( (errno=pthread_create(&worker[i].thread, NULL, worker_run, &worker[i])) != 0 ){
+			fprintf(stderr, "%s: pthread_create() failed: %s\n", program_name, strerror(errno));
+			exit(1);
+		}
+	}
+	worker_run(&worker[0]);
+	for ( size_t i = 1; i < num; i++ ){
+		pthread_join(worker[i].thread, NULL);
+	}
+
+	uint64_t packets = 0;
+	ret = 0;
+	for ( size_t i = 0; i < num; i++ ){
+		if ( ret == 0 && (ret=worker[i].result) == 0 && worker[i].temporary ){
+			ret = append_range(&worker[i], dst);
+		}
+		if ( worker[i].temporary ){
+			fclose(worker[i].fp);
+		}
+		packets += worker[i].packets;
+		column_batch_free(&worker[i].batch);
+		stream_close(worker[i].st);
+	}
+
+	if ( ret != 0 ){
+		fprintf(stderr, "%s: failed to export `%s': %s\n", program_name, filename, caputils_error_string(ret));
+		return ret;
+	}
+
+	if ( !quiet ){
+		fprintf(stderr, "%s: %s: %"PRIu64" packets (%zd ranges)\n", program_name, filename, packets, num);
+	}
+
+	return 0;
+}
+
+int main(int argc, char* argv[]){
+	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
+	const char* separator = strrchr(argv[0], '/');
+	if ( separator ){
+		program_name = separator + 1;
+	} else {
+		program_name = argv[0];
+	}
+
+	int op, option_index = -1;
+	while ( (op = getopt_long(argc, argv, shortopts, longopts, &option_index)) != -1 ){
+		switch (op){
+		case 0:   /* long opt */
+		case '?': /* unknown opt */
+			break;
+
+		case 'o': /* --output */
+			output = optarg;
+			break;
+
+		case 'c': /* --columns */
+			if ( !parse_columns(optarg) ){
+				return 1;
+			}
+			break;
+
+		case 'b': /* --batch */
+			{
+				unsigned long n;
+				if ( parse_unsigned(optarg, SIZE_MAX, &n) != 0 ){
+					fprintf(stderr, "%s: invalid value for --batch: `%s'\n", program_name, optarg);
+					return 1;
+				}
+				batch_size = n;
+			}
+			if ( batch_size == 0 ){
+				fprintf(stderr, "%s: batch size must be greater than zero.\n", program_name);
+				return 1;
+			}
+			break;
+
+		case 't': /* --threads */
+			{
+				unsigned long n;
+				if ( parse_unsigned(optarg, MAX_THREADS, &n) != 0 || n < 1 ){
+					fprintf(stderr, "%s: threads must be between 1 and %d.\n", program_name, MAX_THREADS);
+					return 1;
+				}
+				threads = n;
+			}
+			break;
+
+		case 'T': /* --tmpdir */
+			tmpdir = optarg;
+			break;
+
+		case 'q': /* --quiet */
+			quiet = 1;
+			break;
+
+		case 'h': /* --help */
+			show_usage();
+			exit(0);
+
+		default:
+			fprintf(stderr, "%s: argument '-%c' declared but not handled.\n", program_name, op);
+			abort();
+		}
+	}
+
+	if ( optind == argc ){
+		fprintf(stderr, "%s: no input files given.\n", program_name);
+		return 1;
+	}
+
+	if ( !tmpdir ){
+		tmpdir = getenv("TMPDIR");
+	}
+	if ( !tmpdir ){
+		tmpdir = "/tmp";
+	}
+
+	/* cannot output to stdout if it is a terminal */
+	if ( !output && isatty(STDOUT_FILENO) ){
+		fprintf(stderr, "%s: Cannot output to stdout when it is connected to a terminal.\n", program_name);
+		fprintf(stderr, "%s: Either specify another destination with --output, use redirection or pipe to another process.\n", program_name);
+		return 1;
+	}
+
+	FILE* dst = output ? fopen(output, "wb") : stdout;
+	if ( !dst ){
+		fprintf(stderr, "%s: failed to open `%s': %s\n", program_name, output, strerror(errno));
+		return 1;
+	}
+
+	int ret;
+	if ( (ret=column_write_header(dst, columns)) != 0 ){
+		fprintf(stderr, "%s: failed to write header: %s\n", program_name, strerror(ret));
+		return 1;
+	}
+
+	for ( int i = optind; i < argc; i++ ){
+		if ( process(argv[i], dst) != 0 ){
+			return 1;
+		}
+	}
+
+	if ( (ret=column_write_end(dst)) != 0 || fclose(dst) != 0 ){
+		fprintf(stderr, "%s: failed to write output: %s\n", program_name, strerror(ret ? ret : errno));
+		return 1;
+	}
+
+	return 0;
+}
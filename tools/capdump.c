@@ -34,6 +34,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <limits.h>
 #include <libgen.h> /* for dirname */
 #include <sys/stat.h>
 #include <sys/ioctl.h>
@@ -55,6 +56,9 @@ static const size_t PROGRESS_REPORT_DELAY = 60;  /* seconds between progress rep
 static const size_t IRQ_DELAY = 1;               /* seconds between IRQs reports */
 static int signal_count=0;                       /* counter of ALARMS, used to trigger progress_report while at the same time handling terminate markers */
 static int marker_quit=0;                        /* If set to one, the program will exit (gracefully) after receving a terminate marker */
+/* the terminate counters and close_output are shared between the writer thread
+ * and the SIGALRM handler (capture thread) so they are only accessed using
+ * atomic builtins */
 static int marker_terminate=0;                   /* Increments once for each received terminate marker */
 static int marker_terminate_TO=0;                /* Increments once for each received SIGALMR, after a terminate marker been detected */
 static int src_stream_count=0;                   /* The number of source streams present, set after src has been created.*/
@@ -75,6 +79,12 @@ static const struct stream_stat* stream_stat = NULL;
 static char mpid[8];
 static int progress = -1;          /* if >0 progress reports is written to this file descriptor */
 static uint32_t marker_key = 0;    /* Key to look for, 0 means disabled */
+static size_t sync_size = 0;       /* sync output after this many bytes (0 = disabled) */
+static unsigned int sync_interval = 0; /* sync output after this many ms (0 = disabled) */
+static int output_flags = 0;       /* additional flags for output address */
+static size_t ring_size = 32;      /* size of packet ring between capture and writer thread (MB) */
+static int close_output = 0;       /* set when writer thread should close output (terminate marker) */
+static unsigned long written_packets = 0;
 
 /* Added to act as a marker recipient */
 static int use_listen = 0;
@@ -98,6 +108,11 @@ static struct option longopts[]= {
 	{"marker-comment", required_argument, 0, 'C'},
 	{"marker-quit",    no_argument, 0, 'Q'},
 	{"progress",       optional_argument, 0, 's'},
+	{"sync-size",      required_argument, 0, 'S'},
+	{"sync-interval",  required_argument, 0, 'T'},
+	{"direct",         no_argument,       0, 'D'},
+	{"compress",       required_argument, 0, 'Z'},
+	{"ring-size",      required_argument, 0, 'R'},
 	{"help",           no_argument,       0, 'h'},
 	{0, 0, 0, 0} /* sentinel */
 };
@@ -113,6 +128,211 @@ struct packet {
 stream_t dst;
 stream_addr_t output = STREAM_ADDR_INITIALIZER;
 
+/**
+ * Packets are passed from the capture thread to the writer thread using a
+ * single-producer single-consumer ring. Each entry is a ring_entry followed by
+ * the packet (cap_header and payload) padded to 8 bytes. head and tail are
+ * monotonically increasing byte offsets, only the producer updates head and
+ * only the consumer updates tail so no locking is needed unless one side has
+ * to wait for the other.
+ */
+enum RingEntryType {
+	RING_WRAP = 0,            /* no more entries before end of buffer, continue at offset 0 */
+	RING_PACKET,              /* packet from source stream */
+	RING_SERVER_MARKER,       /* marker received via UDP/TCP server */
+};
+
+struct ring_entry {
+	uint32_t size;            /* total size of entry, including this header */
+	uint32_t type;            /* enum RingEntryType */
+};
+
+struct packet_ring {
+	char* data;
+	size_t size;              /* power of two */
+	size_t head;              /* write offset, updated by producer */
+	size_t tail;              /* read offset, updated by consumer */
+	int eof;                  /* producer is done */
+	int closed;               /* consumer is done (e.g. write error) */
+	int producer_waiting;     /* producer is waiting on cond for space */
+	int consumer_waiting;     /* consumer is waiting on cond for packets */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* statistics */
+	size_t high_watermark;    /* max bytes used */
+	uint64_t stalls;          /* number of times producer had to wait for space */
+};
+
+static struct packet_ring ring;
+
+static int ring_init(struct packet_ring* ring, size_t size){
+	memset(ring, 0, sizeof(struct packet_ring));
+
+	/* round up to power of two so offsets can be masked */
+	if ( size > SIZE_MAX / 2 + 1 ){
+		return ENOMEM;
+	}
+	ring->size = 1024 * 1024;
+	while ( ring->size < size ){
+		ring->size <<= 1;
+	}
+
+	if ( !(ring->data = malloc(ring->size)) ){
+		return errno;
+	}
+
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	return 0;
+}
+
+static void ring_free(struct packet_ring* ring){
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->mutex);
+	free(ring->data);
+	ring->data = NULL;
+}
+
+static size_t ring_used(const struct packet_ring* ring){
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Wake the other side if it is waiting. Must be called after updating the
+ * offsets or flags it is waiting on.
+ */
+static void ring_notify(struct packet_ring* ring, int* waiting){
+	if ( __atomic_load_n(waiting, __ATOMIC_SEQ_CST) ){
+		pthread_mutex_lock(&ring->mutex);
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->mutex);
+	}
+}
+
+/**
+ * Block until the producer can write `need` bytes.
+ * @return 0 if there is space or non-zero if the consumer has closed the ring.
+ */
+static int ring_wait_space(struct packet_ring* ring, size_t need){
+	pthread_mutex_lock(&ring->mutex);
+	__atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+	while ( ring->size - ring_used(ring) < need && !__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST) ){
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+	}
+	__atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&ring->mutex);
+	return __atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Copy a packet into the ring, blocks if the ring is full.
+ * @return 0 if successful or non-zero if the consumer has closed the ring.
+ */
+static int ring_push(struct packet_ring* ring, enum RingEntryType type, const struct cap_header* cp){
+	const size_t bytes = sizeof(struct cap_header) + cp->caplen;
+	const size_t need = (sizeof(struct ring_entry) + bytes + 7) & ~(size_t)7;
+	const size_t head = ring->head;
+	const size_t offset = head & (ring->size - 1);
+	const size_t contiguous = ring->size - offset;
+
+	/* entries are never split, if it doesn't fit before the end the rest of the buffer is skipped */
+	const size_t total = need <= contiguous ? need : contiguous + need;
+	if ( ring->size - ring_used(ring) < total ){
+		ring->stalls++;
+		if ( ring_wait_space(ring, total) != 0 ){
+			return 1;
+		}
+	}
+
+	char* ptr = ring->data + offset;
+	if ( need > contiguous ){
+		struct ring_entry* wrap = (struct ring_entry*)ptr;
+		wrap->size = contiguous;
+		wrap->type = RING_WRAP;
+		ptr = ring->data;
+	}
+
+	struct ring_entry* entry = (struct ring_entry*)ptr;
+	entry->size = need;
+	entry->type = type;
+	memcpy(entry + 1, cp, bytes);
+	__atomic_store_n(&ring->head, head + total, __ATOMIC_SEQ_CST);
+
+	const size_t used = ring_used(ring);
+	if ( used > ring->high_watermark ){
+		ring->high_watermark = used;
+	}
+
+	ring_notify(ring, &ring->consumer_waiting);
+	return 0;
+}
+
+/**
+ * Signal that no more packets will be pushed.
+ */
+static void ring_eof(struct packet_ring* ring){
+	__atomic_store_n(&ring->eof, 1, __ATOMIC_SEQ_CST);
+	ring_notify(ring, &ring->consumer_waiting);
+}
+
+/**
+ * Signal that the consumer will not read any more packets.
+ */
+static void ring_close(struct packet_ring* ring){
+	__atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+	ring_notify(ring, &ring->producer_waiting);
+}
+
+/**
+ * Get the next entry without removing it. Waits at most `msec` if the ring is
+ * empty.
+ * @return entry or NULL if ring is empty.
+ */
+static struct ring_entry* ring_peek(struct packet_ring* ring, unsigned int msec){
+	size_t tail = ring->tail;
+
+	if ( __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail ){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += (long)msec * 1000000;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+
+		pthread_mutex_lock(&ring->mutex);
+		__atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+		while ( __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail && !__atomic_load_n(&ring->eof, __ATOMIC_SEQ_CST) ){
+			if ( pthread_cond_timedwait(&ring->cond, &ring->mutex, &ts) == ETIMEDOUT ) break;
+		}
+		__atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&ring->mutex);
+
+		if ( __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail ){
+			return NULL;
+		}
+	}
+
+	struct ring_entry* entry = (struct ring_entry*)(ring->data + (tail & (ring->size - 1)));
+	if ( entry->type == RING_WRAP ){
+		__atomic_store_n(&ring->tail, tail + entry->size, __ATOMIC_SEQ_CST);
+		entry = (struct ring_entry*)ring->data;
+	}
+
+	return entry;
+}
+
+/**
+ * Remove entry returned by ring_peek.
+ */
+static void ring_pop(struct packet_ring* ring, const struct ring_entry* entry){
+	__atomic_store_n(&ring->tail, ring->tail + entry->size, __ATOMIC_SEQ_CST);
+	ring_notify(ring, &ring->producer_waiting);
+}
+
+static int ring_finished(struct packet_ring* ring){
+	return __atomic_load_n(&ring->eof, __ATOMIC_SEQ_CST) && ring_used(ring) == 0;
+}
+
 static void show_usage(void){
 	printf("(C) 2011-2014 David Sveningsson <david.sveningsson@bth.se>, Patrik Arlos <patrik.arlos@bth.se> \n"
 	       "Usage: %s [OPTIONS] [INPUT..] [OUTPUT]\n"
@@ -123,6 +343,13 @@ static void show_usage(void){
 	       "  -c, --comment=TEXT   Set stream comment.\n"
 	       "  -b, --bufsize=BYTES  Use BYTES buffer size [default depends on driver].\n"
 	       "      --progress[=FD]  Write progress report to FD every 60 seconds.\n"
+	       "      --sync-size=MB   Sync output to disk after every MB megabytes.\n"
+	       "      --sync-interval=MS\n"
+	       "                       Sync output to disk at least every MS milliseconds.\n"
+	       "      --direct         Write output using O_DIRECT (bypassing page cache).\n"
+	       "      --compress=METHOD\n"
+	       "                       Compress output capfile using lz4 or zstd.\n"
+	       "      --ring-size=MB   Buffer up to MB megabytes between capture and disk [default: 32].\n"
 	       "  -h, --help           This text.\n"
 	       "\n"
 	       "Markers\n"
@@ -184,34 +411,35 @@ static void progress_report(){
 	const uint64_t pps = delta / PROGRESS_REPORT_DELAY;
 	const float rate = (float)(delta * 8 / PROGRESS_REPORT_DELAY / 1024 / 1024);
 
-	ssize_t bytes = snprintf(buf, 1024, "%s: [%s] progress report: %'"PRIu64" packets read (%"PRIu64" new, %"PRIu64"pkt/s, avg bitrate %.1fMpbs).\n", program_name, timestr, stream_stat->read, delta, pps, rate);
+	const size_t used = ring_used(&ring);
+	const size_t high = ring.high_watermark;
+	ssize_t bytes = snprintf(buf, 1024, "%s: [%s] progress report: %'"PRIu64" packets read (%"PRIu64" new, %"PRIu64"pkt/s, avg bitrate %.1fMpbs).\n"
+	                         "%s: [%s] ring buffer: %zd KiB used (%.1f%%), high watermark %zd KiB (%.1f%%), %"PRIu64" stalls.\n",
+	                         program_name, timestr, stream_stat->read, delta, pps, rate,
+	                         program_name, timestr, used / 1024, 100.0f * used / ring.size, high / 1024, 100.0f * high / ring.size, ring.stalls);
 	if ( write(progress, buf, bytes) == -1 ){
 		fprintf(stderr, "progress report failed: %s\n", strerror(errno));
 	}
 }
 
 static void handle_terminate_signal(){
-	if( (marker_terminate>=src_stream_count) || (marker_terminate_TO>=src_stream_count) ){
-		/* We should terminate something */
-
-		if ( dst ){
-			stream_addr_str(&output, "", STREAM_ADDR_LOCAL);
-			stream_close(dst);
-			dst = NULL;
-		}
+	if( (__atomic_load_n(&marker_terminate, __ATOMIC_SEQ_CST)>=src_stream_count) || (__atomic_load_n(&marker_terminate_TO, __ATOMIC_SEQ_CST)>=src_stream_count) ){
+		/* We should terminate something, the output is owned by the writer thread
+		 * so it closes it before writing any further packets. */
+		__atomic_store_n(&close_output, 1, __ATOMIC_SEQ_CST);
 		if(marker_quit){
 			keep_running=0;
 			fprintf(stderr,"\tReached terminate condition, quitting.\n");
 		} else {
-			marker_terminate=0;
-			marker_terminate_TO=0;
+			__atomic_store_n(&marker_terminate, 0, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&marker_terminate_TO, 0, __ATOMIC_SEQ_CST);
 			fprintf(stderr, "\tReached terminate condition, will not save until next marker arrives.\n");
 		}
 		return;
 	} else {
 		/* We are here as we gotten a SIGALRM, and a marker was received at some stage. */
 		/* The marker_terminate is incr. in the handle_marker, here we incr. the timeout counter. */
-		marker_terminate_TO++;
+		__atomic_add_fetch(&marker_terminate_TO, 1, __ATOMIC_SEQ_CST);
 	}
 }
 
@@ -223,7 +451,7 @@ static void my_signalhandler(int signum){
 		progress_report();
 	}
 
-	if( marker_terminate ) {
+	if( __atomic_load_n(&marker_terminate, __ATOMIC_SEQ_CST) ) {
 		handle_terminate_signal();
 	}
 }
@@ -367,6 +595,15 @@ static const char* generate_filename(const char* fmt, const struct marker* marke
 	return buffer;
 }
 
+static void set_sync_policy(stream_t st){
+	if ( !(sync_size || sync_interval) ) return;
+
+	int ret;
+	if ( (ret=stream_set_sync_policy(st, sync_size, sync_interval)) != 0 ){
+		fprintf(stderr, "%s: output stream does not support --sync-size/--sync-interval: %s\n", program_name, caputils_error_string(ret));
+	}
+}
+
 static int open_next(stream_addr_t* addr, stream_t* st, const struct marker* marker){
 	/* generate next filename */
 	const char* filename = generate_filename(marker_format, marker);
@@ -387,11 +624,12 @@ static int open_next(stream_addr_t* addr, stream_t* st, const struct marker* mar
 	/* open new stream */
 	int ret;
 	stream_addr_reset(addr);
-	stream_addr_str(addr, filename, STREAM_ADDR_DUPLICATE);
+	stream_addr_str(addr, filename, STREAM_ADDR_DUPLICATE | output_flags);
 	if ( (ret=stream_create(st, addr, NULL, mpid, marker_comment ? marker->comment : comment)) != 0 ){
 		fprintf(stderr, "%s: stream_create() failed with code 0x%08X: %s\n", program_name, ret, caputils_error_string(ret));
 		return 1;
 	}
+	set_sync_policy(*st);
 
 	char* abs = realpath(filename, NULL);
 	fprintf(stderr, "\tfilename: `%s'\n", abs ? abs : filename);
@@ -428,7 +666,7 @@ static int handle_marker(const struct marker* mark, stream_addr_t* addr, stream_
 
 	/* termination marker */
 	if ( mark->flags & MARKER_TERMINATE ){
-		marker_terminate++;
+		__atomic_add_fetch(&marker_terminate, 1, __ATOMIC_SEQ_CST);
 		return 0;
 	}
 
@@ -470,7 +708,7 @@ static int write_packet(struct cap_header* cp, stream_t st){
 
 static void set_destination(stream_addr_t* addr, const char* str){
 	stream_addr_reset(addr);
-	stream_addr_aton(addr, str, STREAM_ADDR_GUESS, 0);
+	stream_addr_aton(addr, str, STREAM_ADDR_GUESS, output_flags);
 	free(fmt_basename);
 	fmt_basename = strdup(str);
 	fmt_extension = fmt_basename;
@@ -482,6 +720,28 @@ static void set_destination(stream_addr_t* addr, const char* str){
 	}
 }
 
+static struct packet relay_packet;       /* marker received by tcprelay thread */
+static int relay_pending = 0;            /* set when relay_packet is waiting to be pushed */
+static pthread_mutex_t relay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t relay_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Push marker from tcprelay thread (if any) to the ring.
+ */
+static int handle_relay(void){
+	if ( !__atomic_load_n(&relay_pending, __ATOMIC_SEQ_CST) ){
+		return 0;
+	}
+
+	pthread_mutex_lock(&relay_mutex);
+	int ret = ring_push(&ring, RING_SERVER_MARKER, &relay_packet.cap);
+	__atomic_store_n(&relay_pending, 0, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&relay_cond);
+	pthread_mutex_unlock(&relay_mutex);
+
+	return ret;
+}
+
 static void *tcprelay(void *arg){
 	fprintf(stderr,"TCP thread awaken.\n");
 	int tcpmainsocket;
@@ -557,9 +817,7 @@ static void *tcprelay(void *arg){
 			error("Error in recvfrom .");
 		}
 		fprintf(stderr,"Received marker via server (TCP).\n");
-		if ( handle_marker_server(&buf, &output, &dst) != 0 ){
-			break; /* error already shown */
-		}
+
 		/* Use the 'dummy' packet */
 		/* Give the packet a proper timestamp */
 		packet->cap.ts = timepico_now();
@@ -567,9 +825,14 @@ static void *tcprelay(void *arg){
 		/* Copy the marker message that we got, relay it. */
 		memcpy(&packet->mark_inner,&buf,sockread);
 
-		if ( write_packet(&packet->cap, dst) != 0 ){
-			break; /* error already shown */
+		/* the ring only has a single producer so the marker is passed to the capture thread */
+		pthread_mutex_lock(&relay_mutex);
+		relay_packet = *packet;
+		__atomic_store_n(&relay_pending, 1, __ATOMIC_SEQ_CST);
+		while ( __atomic_load_n(&relay_pending, __ATOMIC_SEQ_CST) && keep_running ){
+			pthread_cond_wait(&relay_cond, &relay_mutex);
 		}
+		pthread_mutex_unlock(&relay_mutex);
 		fprintf(stderr,"Close connection.\n");
 		close(tcpchildsocket);
 	}
@@ -669,9 +932,6 @@ static int handle_udp(struct packet* packet){
 		error("Error in recvfrom .");
 	}
 	fprintf(stderr,"Received marker via server.\n");
-	if ( handle_marker_server(&buf, &output, &dst) != 0 ){
-		return 1;
-	}
 
 	/* Use the 'dummy' packet */
 	/* Give the packet a proper timestamp */
@@ -680,11 +940,60 @@ static int handle_udp(struct packet* packet){
 	/* Copy the marker message that we got, relay it. */
 	memcpy(&packet->mark_inner,&buf, bytes);
 
-	if ( write_packet(&packet->cap, dst) != 0 ){
-		return 1;
+	return ring_push(&ring, RING_SERVER_MARKER, &packet->cap);
+}
+
+static void close_terminated_output(void){
+	if ( !__atomic_exchange_n(&close_output, 0, __ATOMIC_SEQ_CST) ){
+		return;
 	}
 
-	return 0;
+	if ( dst ){
+		stream_addr_str(&output, "", STREAM_ADDR_LOCAL);
+		stream_close(dst);
+		dst = NULL;
+	}
+}
+
+/**
+ * Writer thread: consumes packets from the ring, handles markers (which may
+ * rotate the output file) and writes to output. Runs until the capture thread
+ * signals EOF and the ring is drained.
+ */
+static void* writer_main(void* arg){
+	while ( !ring_finished(&ring) ){
+		close_terminated_output();
+
+		struct ring_entry* entry = ring_peek(&ring, 100);
+		if ( !entry ){
+			continue;
+		}
+
+		/* as when the output was closed directly by the signal handler no
+		 * packets are written once the terminate condition is reached, even if
+		 * it happened while waiting for this packet */
+		close_terminated_output();
+
+		struct cap_header* cp = (struct cap_header*)(entry + 1);
+		int ret;
+		if ( entry->type == RING_SERVER_MARKER ){
+			ret = handle_marker_server(&((struct packet*)cp)->mark_inner, &output, &dst);
+		} else {
+			ret = handle_marker_caphead(cp, &output, &dst);
+		}
+
+		if ( ret != 0 || write_packet(cp, dst) != 0 ){
+			/* error already shown */
+			keep_running = 0;
+			ring_close(&ring);
+			break;
+		}
+
+		written_packets++;
+		ring_pop(&ring, entry);
+	}
+
+	return NULL;
 }
 
 int main(int argc, char **argv){
@@ -699,10 +1008,11 @@ int main(int argc, char **argv){
 	}
 
 	char* iface = NULL;
+	const char* output_filename = NULL;
 	size_t buffer_size = 0;
 	unsigned int max_packets = 0;
-	unsigned long written_packets = 0;
 	pthread_t child;
+	pthread_t writer;
 	struct packet* udp_dummy = (struct packet*)malloc(sizeof(struct packet));
 
 	int op, option_index = -1;
@@ -713,7 +1023,7 @@ int main(int argc, char **argv){
 			break;
 
 		case 'o':
-			set_destination(&output, optarg);
+			output_filename = optarg;
 			break;
 
 		case 'p':
@@ -778,6 +1088,58 @@ int main(int argc, char **argv){
 			}
 			break;
 
+		case 'S': /* --sync-size */
+			{
+				unsigned long mb;
+				if ( parse_unsigned(optarg, SIZE_MAX / (1024 * 1024), &mb) != 0 ){
+					fprintf(stderr, "%s: invalid value for --sync-size: `%s'\n", program_name, optarg);
+					return 1;
+				}
+				sync_size = (size_t)mb * 1024 * 1024;
+			}
+			break;
+
+		case 'T': /* --sync-interval */
+			{
+				unsigned long msec;
+				if ( parse_unsigned(optarg, UINT_MAX, &msec) != 0 ){
+					fprintf(stderr, "%s: invalid value for --sync-interval: `%s'\n", program_name, optarg);
+					return 1;
+				}
+				sync_interval = (unsigned int)msec;
+			}
+			break;
+
+		case 'D': /* --direct */
+			output_flags |= STREAM_ADDR_DIRECT;
+			break;
+
+		case 'Z': /* --compress */
+			if ( strcasecmp(optarg, "lz4") == 0 ){
+				output_flags |= STREAM_ADDR_LZ4;
+			} else if ( strcasecmp(optarg, "zstd") == 0 ){
+				output_flags |= STREAM_ADDR_ZSTD;
+			} else {
+				fprintf(stderr, "%s: unknown compression method `%s', use lz4 or zstd.\n", program_name, optarg);
+				return 1;
+			}
+			break;
+
+		case 'R': /* --ring-size */
+			{
+				unsigned long mb;
+				if ( parse_unsigned(optarg, SIZE_MAX / (1024 * 1024), &mb) != 0 ){
+					fprintf(stderr, "%s: invalid value for --ring-size: `%s'\n", program_name, optarg);
+					return 1;
+				}
+				if ( mb == 0 ){
+					fprintf(stderr, "%s: --ring-size must be at least 1 MB.\n", program_name);
+					return 1;
+				}
+				ring_size = mb;
+			}
+			break;
+
 		case 'h':
 			show_usage();
 			exit(0);
@@ -794,13 +1156,23 @@ int main(int argc, char **argv){
 		option_index = -1;
 	}
 
+	if ( (output_flags & STREAM_ADDR_DIRECT) && (output_flags & (STREAM_ADDR_LZ4 | STREAM_ADDR_ZSTD)) ){
+		fprintf(stderr, "%s: --direct cannot be combined with --compress.\n", program_name);
+		return 1;
+	}
+
 	stream_t src;
 
 	long ret;
 
+	/* output is set after parsing all arguments so flags can be applied */
+	if ( output_filename ){
+		set_destination(&output, output_filename);
+	}
+
 	/* use stdout as default output if connected stdout is redirected */
 	if ( !(stream_addr_is_set(&output) || isatty(STDOUT_FILENO)) ){
-		stream_addr_str(&output, "/dev/stdout", 0);
+		stream_addr_str(&output, "/dev/stdout", output_flags & (STREAM_ADDR_LZ4 | STREAM_ADDR_ZSTD));
 	}
 
 	/* if no output was given using -o or redirection grab the last positional argument */
@@ -833,9 +1205,28 @@ int main(int argc, char **argv){
 		fprintf(stderr, "stream_create() failed with code 0x%08lX: %s\n", ret, caputils_error_string(ret));
 		return 1;
 	}
+	set_sync_policy(dst);
 	stream_stat = stream_get_stat(src);
 	src_stream_count = stream_num_address(src);
 
+	/* start writer thread, signals are blocked so they are delivered to the capture thread */
+	if ( (ret=ring_init(&ring, ring_size * 1024 * 1024)) != 0 ){
+		fprintf(stderr, "%s: failed to allocate ring buffer: %s\n", program_name, strerror(ret));
+		return 1;
+	}
+	sigset_t sigmask, oldmask;
+	sigfillset(&sigmask);
+	pthread_sigmask(SIG_BLOCK, &sigmask, &oldmask);
+	ret = pthread_create(&writer, NULL, writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	if ( ret != 0 ){
+		fprintf(stderr, "%s: failed to start writer thread: %s\n", program_name, strerror(ret));
+		ring_free(&ring);
+		stream_close(src);
+		stream_close(dst);
+		return 1;
+	}
+
 	/* progress report */
 	struct itimerval tv = {
 		{IRQ_DELAY, 0},
@@ -865,6 +1256,7 @@ int main(int argc, char **argv){
 
 	while( keep_running ){
 		if ( handle_udp(udp_dummy) != 0 ) break;
+		if ( handle_relay() != 0 ) break;
 
 		/* Read the next packet */
 		cap_head* cp;
@@ -882,23 +1274,29 @@ int main(int argc, char **argv){
 			abort();
 		}
 
-		if ( handle_marker_caphead(cp, &output, &dst) != 0 ){
-			break; /* error already shown */
+		/* markers are handled by writer thread */
+		if ( ring_push(&ring, RING_PACKET, cp) != 0 ){
+			break; /* writer failed, error already shown */
 		}
 
-		if ( write_packet(cp, dst) != 0 ){
-			break; /* error already shown */
-		}
-
-		written_packets++;
 		if ( max_packets > 0 && stream_stat->read >= max_packets ){
 			break;
 		}
 	}
 
+	/* let writer flush all buffered packets */
+	ring_eof(&ring);
+	pthread_join(writer, NULL);
+
+	/* wake tcprelay if it is waiting for a marker to be pushed */
+	pthread_mutex_lock(&relay_mutex);
+	pthread_cond_signal(&relay_cond);
+	pthread_mutex_unlock(&relay_mutex);
+
 	fprintf(stderr, "%s: There was a total of %'"PRIu64" packets recv.\n", program_name, stream_stat->recv);
 	fprintf(stderr, "%s: There was a total of %'"PRIu64" packets read.\n", program_name, stream_stat->read);
 	fprintf(stderr, "%s: There was a total of %'ld packets writen.\n", program_name, written_packets);
+	fprintf(stderr, "%s: Ring buffer high watermark was %zd KiB of %zd KiB (%"PRIu64" stalls).\n", program_name, ring.high_watermark / 1024, ring.size / 1024, ring.stalls);
 
 	close(sockfd);
 
@@ -907,6 +1305,7 @@ int main(int argc, char **argv){
 	stream_addr_reset(&output);
 	free(fmt_basename);
 	free(udp_dummy);
+	ring_free(&ring);
 
 	return 0;
 }
@@ -24,6 +24,7 @@
 #include <caputils/stream.h>
 #include <caputils/filter.h>
 #include <caputils/capture.h>
+#include <caputils/packet.h>
 #include <caputils/utils.h>
 #include <caputils/version.h>
 #include <stdio.h>
@@ -34,6 +35,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <pthread.h>
+
+#define MAX_THREADS 64
 
 static inline int min(int a, int b){
 	return a<b?a:b;
@@ -48,14 +52,22 @@ static int invert = 0;
 static int quiet = 0;
 static unsigned int max_read = 0;
 static unsigned int max_matched = 0;
-
-static const char* shortopts = "p:m:i:o:r:vqh";
+static unsigned int num_threads = 1;
+static stream_t dst = NULL;
+static stream_t rej = NULL;
+static uint64_t matched = 0;
+static uint64_t num_read = 0;
+static int output_flags = 0;
+
+static const char* shortopts = "p:m:i:o:r:t:z:vqh";
 static struct option longopts[] = {
 	{"packets", required_argument, 0, 'p'},
 	{"matched", required_argument, 0, 'm'},
 	{"input",   required_argument, 0, 'i'},
 	{"output",  required_argument, 0, 'o'},
 	{"rejects", required_argument, 0, 'r'},
+	{"threads", required_argument, 0, 't'},
+	{"compress", required_argument, 0, 'z'},
 	{"invert",  no_argument,       0, 'v'},
 	{"quiet",   no_argument,       0, 'q'},
 	{"help",    no_argument,       0, 'h'},
@@ -71,6 +83,8 @@ static void show_usage(){
 	       "  -i, --input=FILE            read from FILE [default stdin].\n"
 	       "  -o, --output=FILE           write to FILE [default stdout].\n"
 	       "  -r, --rejects=FILE          write packets not matching to FILE.\n"
+	       "  -t, --threads=N             filter using N threads [default 1].\n"
+	       "  -z, --compress=METHOD       compress output using lz4 or zstd.\n"
 	       "  -v, --invert                invert filter.\n"
 	       "  -q, --quiet                 suppress output.\n"
 	       "  -h, --help                  help (this text).\n"
@@ -88,6 +102,330 @@ static void handle_sigint(int signum){
 	}
 }
 
+/**
+ * Write packet to output (or rejects) and update counters. Packets must be
+ * passed in the order they were read.
+ * @return 0 if successful or error code (processing should stop).
+ */
+static int write_packet(caphead_t cp, int match, unsigned int caplen){
+	num_read++;
+
+	/* decide what to do with the packet */
+	stream_t target = 0;
+	const int post_match = invert ? (1-match) : match;
+	if ( post_match ){
+		target = dst;
+		matched++;
+	} else if ( rej ){
+		target = rej;
+	}
+
+	/* truncate if requested */
+	if ( caplen != (unsigned int)-1 ){
+		cp->caplen = min(caplen, cp->caplen);
+	}
+
+	/* copy packet */
+	int ret;
+	if ( target && (ret=stream_copy(target, cp)) != 0 ){
+		fprintf(stderr, "%s: stream_copy() returned %d: %s\n", program_name, ret, caputils_error_string(ret));
+		keep_running = 0;
+		return ret;
+	}
+
+	if ( (max_read > 0 && num_read >= max_read) || (max_matched > 0 && matched >= max_matched) ){
+		/* Read enough pkts lets break. */
+		keep_running = 0;
+	}
+
+	return 0;
+}
+
+static int run_sequential(stream_t src, struct filter* filter){
+	int ret = 0;
+	struct packet_meta meta;
+	while ( keep_running ){
+		caphead_t batch[PACKET_META_MAX];
+		size_t count;
+		struct timeval tv = {1,0};
+		switch ( (ret=stream_read_batch(src, batch, PACKET_META_MAX, &count, NULL, &tv)) ){
+		case EAGAIN: /* timeout */
+			continue;
+
+		case 0: /* success */
+			break;
+
+		default: /* error */
+			keep_running = 0;
+			continue;
+		}
+
+		/* headers are parsed once for the whole batch */
+		packet_meta_classify(&meta, batch, count);
+
+		for ( size_t i = 0; i < count && keep_running; i++ ){
+			const int match = filter_match_meta(filter, &meta, i);
+			ret = write_packet(batch[i], match, filter->caplen);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Parallel filtering.
+ *
+ * The main thread copies packets from the input into chunks which are
+ * filtered by the workers, each using a private copy of the filter. Chunks are
+ * kept in a ring and written by the main thread in the same order as they were
+ * read, before the slot is reused.
+ */
+
+#define CHUNK_PACKETS 4096
+#define CHUNK_SIZE (4*1024*1024)
+
+enum ChunkState {
+	CHUNK_FREE = 0,  /* unused or already written */
+	CHUNK_FILLED,    /* waiting for a worker */
+	CHUNK_BUSY,      /* being filtered */
+	CHUNK_DONE,      /* filtered, waiting to be written */
+};
+
+struct chunk {
+	enum ChunkState state;
+	uint64_t seq;
+	char* data;
+	size_t size;                     /* bytes used */
+	size_t capacity;                 /* bytes allocated */
+	size_t num;                      /* number of packets */
+	size_t offset[CHUNK_PACKETS];    /* offset of each packet in data */
+	uint8_t match[CHUNK_PACKETS];    /* filter result for each packet */
+};
+
+static struct chunk* chunk = NULL;
+static size_t num_chunks = 0;
+static int finished = 0;
+static pthread_mutex_t chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunk_cond = PTHREAD_COND_INITIALIZER;
+
+/* packets read from input but not yet copied to a chunk */
+static caphead_t pending[PACKET_META_MAX];
+static size_t pending_pos = 0;
+static size_t pending_count = 0;
+static uint64_t pending_read = 0;
+
+static void filter_chunk(struct filter* filter, struct chunk* c){
+	struct packet_meta meta;
+	for ( size_t i = 0; i < c->num; i += PACKET_META_MAX ){
+		const size_t n = min(PACKET_META_MAX, c->num - i);
+		caphead_t cp[PACKET_META_MAX];
+		for ( size_t j = 0; j < n; j++ ){
+			cp[j] = (caphead_t)(c->data + c->offset[i+j]);
+		}
+
+		packet_meta_classify(&meta, cp, n);
+		for ( size_t j = 0; j < n; j++ ){
+			c->match[i+j] = filter_match_meta(filter, &meta, j);
+		}
+	}
+}
+
+static void* worker_main(void* ptr){
+	struct filter filter = *(const struct filter*)ptr; /* private state */
+
+	pthread_mutex_lock(&chunk_mutex);
+	for (;;){
+		/* oldest chunk first so the writer isn't stalled */
+		struct chunk* work = NULL;
+		for ( size_t i = 0; i < num_chunks; i++ ){
+			if ( chunk[i].state == CHUNK_FILLED && (!work || chunk[i].seq < work->seq) ){
+				work = &chunk[i];
+			}
+		}
+
+		if ( !work ){
+			if ( finished ) break;
+			pthread_cond_wait(&chunk_cond, &chunk_mutex);
+			continue;
+		}
+
+		work->state = CHUNK_BUSY;
+		pthread_mutex_unlock(&chunk_mutex);
+		filter_chunk(&filter, work);
+		pthread_mutex_lock(&chunk_mutex);
+		work->state = CHUNK_DONE;
+		pthread_cond_broadcast(&chunk_cond);
+	}
+	pthread_mutex_unlock(&chunk_mutex);
+
+	return NULL;
+}
+
+/**
+ * Copy packets from input into chunk until it is full.
+ * @return 0 if more packets may follow, -1 when input is finished or error code.
+ */
+static int fill_chunk(stream_t src, struct chunk* c){
+	c->num = 0;
+	c->size = 0;
+
+	while ( c->num < CHUNK_PACKETS && keep_running ){
+		if ( max_read > 0 && pending_read >= max_read ){
+			return -1;
+		}
+
+		if ( pending_pos == pending_count ){
+			struct timeval tv = {1,0};
+			const int ret = stream_read_batch(src, pending, PACKET_META_MAX, &pending_count, NULL, &tv);
+			pending_pos = 0;
+			if ( ret == EAGAIN ){
+				if ( c->num > 0 ) return 0; /* dispatch what we got so far */
+				continue;
+			} else if ( ret != 0 ){
+				return ret;
+			}
+		}
+
+		const caphead_t cp = pending[pending_pos];
+		const size_t bytes = sizeof(struct cap_header) + cp->caplen;
+		if ( c->size + bytes > c->capacity ){
+			if ( c->num > 0 ) return 0; /* packet is kept for the next chunk */
+
+			char* tmp = realloc(c->data, bytes);
+			if ( !tmp ) return errno;
+			c->data = tmp;
+			c->capacity = bytes;
+		}
+
+		memcpy(c->data + c->size, cp, bytes);
+		c->offset[c->num++] = c->size;
+		c->size += bytes;
+		pending_pos++;
+		pending_read++;
+	}
+
+	return 0;
+}
+
+/**
+ * Wait until chunk is filtered and write its packets.
+ */
+static int flush_chunk(struct chunk* c, unsigned int caplen){
+	pthread_mutex_lock(&chunk_mutex);
+	while ( c->state != CHUNK_DONE ){
+		pthread_cond_wait(&chunk_cond, &chunk_mutex);
+	}
+	pthread_mutex_unlock(&chunk_mutex);
+
+	int ret = 0;
+	for ( size_t i = 0; i < c->num && keep_running && ret == 0; i++ ){
+		ret = write_packet((caphead_t)(c->data + c->offset[i]), c->match[i], caplen);
+	}
+
+	pthread_mutex_lock(&chunk_mutex);
+	c->state = CHUNK_FREE;
+	pthread_mutex_unlock(&chunk_mutex);
+
+	return ret;
+}
+
+/**
+ * Stop and join workers (discarding chunks not yet filtered) and release all
+ * chunks.
+ */
+static void stop_workers(pthread_t* worker, unsigned int num_workers){
+	pthread_mutex_lock(&chunk_mutex);
+	for ( size_t i = 0; chunk && i < num_chunks; i++ ){
+		if ( chunk[i].state == CHUNK_FILLED ) chunk[i].state = CHUNK_FREE;
+	}
+	finished = 1;
+	pthread_cond_broadcast(&chunk_cond);
+	pthread_mutex_unlock(&chunk_mutex);
+
+	for ( unsigned int i = 0; i < num_workers; i++ ){
+		pthread_join(worker[i], NULL);
+	}
+
+	free(worker);
+	for ( size_t i = 0; chunk && i < num_chunks; i++ ){
+		free(chunk[i].data);
+	}
+	free(chunk);
+	chunk = NULL;
+	num_chunks = 0;
+}
+
+static int run_parallel(stream_t src, struct filter* filter){
+	/* nothing has been read yet so any failure falls back to sequential filtering */
+	num_chunks = 2 * num_threads;
+	chunk = calloc(num_chunks, sizeof(struct chunk));
+	pthread_t* worker = calloc(num_threads, sizeof(pthread_t));
+	int ok = chunk && worker;
+	for ( size_t i = 0; ok && i < num_chunks; i++ ){
+		chunk[i].capacity = CHUNK_SIZE;
+		ok = (chunk[i].data = malloc(CHUNK_SIZE)) != NULL;
+	}
+
+	unsigned int num_workers = 0;
+	while ( ok && num_workers < num_threads ){
+		int err;
+		if ( (err=pthread_create(&worker[num_workers], NULL, worker_main, filter)) != 0 ){
+			if ( !quiet ){
+				fprintf(stderr, "%s: pthread_create() failed: %s\n", program_name, strerror(err));
+			}
+			ok = 0;
+			break;
+		}
+		num_workers++;
+	}
+
+	if ( !ok ){
+		if ( !quiet ){
+			fprintf(stderr, "%s: failed to setup threads, filtering sequentially.\n", program_name);
+		}
+		stop_workers(worker, num_workers);
+		finished = 0;
+		return run_sequential(src, filter);
+	}
+
+	uint64_t seq = 0;   /* next chunk to fill */
+	uint64_t next = 0;  /* next chunk to write */
+	int ret = 0;
+	int read_ret = 0;
+	while ( keep_running && read_ret == 0 && ret == 0 ){
+		struct chunk* c = &chunk[seq % num_chunks];
+
+		/* slot is still in use by the chunk read num_chunks ago */
+		if ( next < seq && &chunk[next % num_chunks] == c ){
+			ret = flush_chunk(c, filter->caplen);
+			next++;
+			continue;
+		}
+
+		read_ret = fill_chunk(src, c);
+		if ( c->num == 0 ){
+			continue;
+		}
+
+		pthread_mutex_lock(&chunk_mutex);
+		c->seq = seq++;
+		c->state = CHUNK_FILLED;
+		pthread_cond_broadcast(&chunk_cond);
+		pthread_mutex_unlock(&chunk_mutex);
+	}
+
+	/* write remaining chunks in order */
+	while ( next < seq && keep_running && ret == 0 ){
+		ret = flush_chunk(&chunk[next % num_chunks], filter->caplen);
+		next++;
+	}
+
+	/* stop workers, chunks not yet filtered are discarded */
+	stop_workers(worker, num_workers);
+
+	return ret != 0 ? ret : read_ret;
+}
+
 int main(int argc, char* argv[]){
 	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
 	const char* separator = strrchr(argv[0], '/');
@@ -127,6 +465,28 @@ int main(int argc, char* argv[]){
 			rej_filename = optarg;
 			break;
 
+		case 't': /* --threads */
+			{
+				unsigned long n;
+				if ( parse_unsigned(optarg, MAX_THREADS, &n) != 0 || n < 1 ){
+					fprintf(stderr, "%s: --threads must be between 1 and %d.\n", program_name, MAX_THREADS);
+					exit(1);
+				}
+				num_threads = n;
+			}
+			break;
+
+		case 'z': /* --compress */
+			if ( strcasecmp(optarg, "lz4") == 0 ){
+				output_flags = STREAM_ADDR_LZ4;
+			} else if ( strcasecmp(optarg, "zstd") == 0 ){
+				output_flags = STREAM_ADDR_ZSTD;
+			} else {
+				fprintf(stderr, "%s: unknown compression method `%s', use lz4 or zstd.\n", program_name, optarg);
+				exit(1);
+			}
+			break;
+
 		case 'v': /* --invert */
 			invert = 1;
 			break;
@@ -158,8 +518,6 @@ int main(int argc, char* argv[]){
 	int ret;
 	stream_addr_t addr = STREAM_ADDR_INITIALIZER;
 	stream_t src = NULL;
-	stream_t dst = NULL;
-	stream_t rej = NULL;
 
 	/* ensure not reading/writing capfiles from terminal */
 	if ( src_filename == NULL && isatty(STDIN_FILENO) ){
@@ -185,7 +543,7 @@ int main(int argc, char* argv[]){
 	}
 
 	/* open destination */
-	stream_addr_str(&addr, dst_filename, 0);
+	stream_addr_str(&addr, dst_filename, output_flags);
 	if ( (ret=stream_create(&dst, &addr, NULL, "CONV", "capfilter" VERSION " filtered stream")) != 0 ){
 		fprintf(stderr, "%s: failed to open output `%s': %s\n", program_name, dst_filename, caputils_error_string(ret));
 		return 1;
@@ -193,63 +551,49 @@ int main(int argc, char* argv[]){
 
 	/* open rejects */
 	if ( rej_filename ){
-		stream_addr_str(&addr, rej_filename, 0);
+		stream_addr_str(&addr, rej_filename, output_flags);
 		if ( (ret=stream_create(&rej, &addr, NULL, "CONV", "capfilter" VERSION " filtered stream")) != 0 ){
 			fprintf(stderr, "%s: failed to open rejects `%s': %s\n", program_name, rej_filename, caputils_error_string(ret));
 			return 1;
 		}
 	}
 
-	/* handle signals */
-	signal(SIGINT, handle_sigint);
-
-	uint64_t matched = 0;
-	const struct stream_stat* stats = stream_get_stat(src);
-	while ( keep_running ){
-		caphead_t cp;
-		struct timeval tv = {1,0};
-		switch ( (ret=stream_read(src, &cp, NULL, &tv)) ){
-		case EAGAIN: /* timeout */
-			continue;
-
-		case 0: /* success */
-			break;
-
-		default: /* error */
-			keep_running = 0;
-			continue;
+	/* limit reading to the start and end time if the capfile is indexed, unless
+	 * all packets are needed (rejects, invert or --packets) */
+	timepico start, end;
+	const int window = !(rej || invert || max_read) ? filter_time_window(&filter, &start, &end) : 0;
+	if ( window & FILTER_START_TIME ){
+		if ( (ret=stream_seek_time(src, start)) == 0 ){
+			num_read = stream_get_stat(src)->read; /* skipped packets */
+		} else if ( ret != ENOENT && !quiet ){
+			fprintf(stderr, "%s: ignoring capfile index: %s\n", program_name, caputils_error_string(ret));
 		}
-
-		/* decide what to do with the packet */
-		stream_t target = 0;
-		const int match = filter_match(&filter, cp->payload, cp);
-		const int post_match = invert ? (1-match) : match;
-		if ( post_match ){
-			target = dst;
-			matched++;
-		} else if ( rej ){
-			target = rej;
+	}
+	if ( window & FILTER_END_TIME ){
+		if ( (ret=stream_stop_time(src, end)) != 0 && ret != ENOENT && !quiet ){
+			fprintf(stderr, "%s: ignoring capfile index: %s\n", program_name, caputils_error_string(ret));
 		}
+	}
 
-		/* truncate if requested */
-		if ( filter.caplen != (unsigned int)-1 ){
-			cp->caplen = min(filter.caplen, cp->caplen);
-		}
+	/* handle signals */
+	signal(SIGINT, handle_sigint);
 
-		/* copy packet */
-		if ( target && (ret=stream_copy(target, cp)) != 0 ){
-			fprintf(stderr, "%s: stream_copy() returned %d: %s\n", program_name, ret, caputils_error_string(ret));
-			keep_running = 0;
+	/* frame-num and frame-max-dt depends on previous packets */
+	if ( num_threads > 1 && (filter.index & (FILTER_FRAME_NUM | FILTER_FRAME_MAX_DT)) ){
+		if ( !quiet ){
+			fprintf(stderr, "%s: --frame-num and --frame-max-dt requires sequential filtering, ignoring --threads.\n", program_name);
 		}
+		num_threads = 1;
+	}
 
-		if ( (max_read > 0 && stats->read >= max_read) || (max_matched > 0 && matched >= max_matched) ){
-			/* Read enough pkts lets break. */
-			break;
-		}
+	if ( num_threads > 1 ){
+		ret = run_parallel(src, &filter);
+	} else {
+		ret = run_sequential(src, &filter);
 	}
 
 	if ( !quiet ){
-		fprintf(stderr, "%s: There was a total of %'"PRIu64" packets read.\n", program_name, stats->read);
+		fprintf(stderr, "%s: There was a total of %'"PRIu64" packets read.\n", program_name, num_read);
 		fprintf(stderr, "%s: There was a total of %'"PRIu64" packets matched.\n", program_name, matched);
 	}
 
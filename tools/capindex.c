@@ -0,0 +1,131 @@
+/**
+ * libcap_utils - DPMI capture utilities
+ * Copyright (C) 2003-2013 (see AUTHORS)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "caputils/caputils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+
+static const char* program_name;
+static unsigned int packets = 0;
+static unsigned int seconds = 0;
+static int quiet = 0;
+
+static const char* shortopts = "p:s:qh";
+static struct option longopts[] = {
+	{"packets", required_argument, 0, 'p'},
+	{"seconds", required_argument, 0, 's'},
+	{"quiet",   no_argument,       0, 'q'},
+	{"help",    no_argument,       0, 'h'},
+	{0,0,0,0},
+};
+
+static void show_usage(){
+	printf("capindex-%s\n", caputils_version(NULL));
+	printf("usage: %s [OPTIONS..] FILES..\n"
+	       "\n"
+	       "Build timestamp index (FILE.idx) used to seek directly to the start time\n"
+	       "and stop at the end time when filtering.\n"
+	       "\n"
+	       "  -p, --packets=N      Index every N packets [default: 1024].\n"
+	       "  -s, --seconds=N      Index at least every N seconds [default: 1].\n"
+	       "  -q, --quiet          Quiet output.\n"
+	       "  -h, --help           This text.\n",
+	       program_name);
+}
+
+int main(int argc, char* argv[]){
+	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
+	const char* separator = strrchr(argv[0], '/');
+	if ( separator ){
+		program_name = separator + 1;
+	} else {
+		program_name = argv[0];
+	}
+
+	int op, option_index = -1;
+	while ( (op = getopt_long(argc, argv, shortopts, longopts, &option_index)) != -1 ){
+		switch (op){
+		case 0:   /* long opt */
+		case '?': /* unknown opt */
+			break;
+
+		case 'p': /* --packets */
+			{
+				unsigned long n;
+				if ( parse_unsigned(optarg, UINT_MAX, &n) != 0 ){
+					fprintf(stderr, "%s: invalid value for --packets: `%s'\n", program_name, optarg);
+					return 1;
+				}
+				packets = n;
+			}
+			break;
+
+		case 's': /* --seconds */
+			{
+				unsigned long n;
+				if ( parse_unsigned(optarg, UINT_MAX, &n) != 0 ){
+					fprintf(stderr, "%s: invalid value for --seconds: `%s'\n", program_name, optarg);
+					return 1;
+				}
+				seconds = n;
+			}
+			break;
+
+		case 'q': /* --quiet */
+			quiet = 1;
+			break;
+
+		case 'h': /* --help */
+			show_usage();
+			exit(0);
+
+		default:
+			fprintf(stderr, "%s: argument '-%c' declared but not handled.\n", program_name, op);
+			abort();
+		}
+	}
+
+	if ( optind == argc ){
+		fprintf(stderr, "%s: no input files given.\n", program_name);
+		return 1;
+	}
+
+	int status = 0;
+	for ( int i = optind; i < argc; i++ ){
+		int ret;
+		if ( (ret=stream_index_build(argv[i], packets, seconds)) != 0 ){
+			fprintf(stderr, "%s: failed to index `%s': %s\n", program_name, argv[i], caputils_error_string(ret));
+			status = 1;
+			continue;
+		}
+
+		if ( !quiet ){
+			fprintf(stderr, "%s: wrote %s.idx\n", program_name, argv[i]);
+		}
+	}
+
+	return status;
+}
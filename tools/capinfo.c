@@ -25,6 +25,8 @@
 
 #include "caputils/caputils.h"
 #include "caputils/marker.h"
+#include "caputils/packet.h"
+#include "caputils/sketch.h"
 #include "src/slist.h"
 #include <unistd.h>
 #include <getopt.h>
@@ -34,12 +36,26 @@
 #include <arpa/inet.h>
 #include <netinet/ip.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TOP_PORTS 10
+#define MAX_THREADS 64
+#define QUANTILE_ACCURACY 0.01
+#define QUANTILE_BINS 2048
+#define CARDINALITY_PRECISION 14
 
 struct count {
 	uint64_t packets;
 	uint64_t bytes;
 };
 
+struct proto_count {
+	uint16_t proto;
+	struct count count;
+};
+
 struct stats {
 	unsigned long int packets;             /* total number of packets */
 	unsigned long int bytes;               /* sum of all bytes */
@@ -47,19 +63,107 @@ struct stats {
 	timepico first, last;                  /* timestamp of first/last packet */
 	int marker_present;                    /* zero if no marker was detected or port number it was found at */
 
-	struct count transport[UINT16_MAX];    /* packet summary for transport layer */
+	/* packet summary for transport layer, sorted by protocol. Only a handful
+	 * of protocols is seen so it is allocated on first use. */
+	struct proto_count* transport;
+	unsigned int num_transport;
+	unsigned int transport_size;
+};
+
+/* key of location table (mpid and CI tables uses the fields as keys). Names are
+ * zero-padded so the keys can be compared and hashed bytewise. */
+struct location_key {
+	char mampid[8];
+	char nic[CAPHEAD_NICLEN];
+};
+
+/* key of port table */
+struct port_key {
+	uint8_t proto;
+	uint8_t reserved;                      /* must be zero */
+	uint16_t port;
+};
+
+struct connection {
+	uint64_t packets;
+	uint64_t bytes;
+	uint8_t proto;
+};
+
+/* key of flow cardinality, endpoints in canonical order so both directions
+ * yields the same key */
+struct flow_key {
+	uint32_t addr[2];
+	uint16_t port[2];
+	uint8_t proto;
+	uint8_t reserved[3];                   /* must be zero */
+};
+
+enum {
+	DISTINCT_SRC = 0,
+	DISTINCT_DST,
+	DISTINCT_FLOWS,
+	DISTINCT_PORTS,
+	DISTINCT_MAX,
+};
+
+/**
+ * Statistics for one or more streams. Everything is mergeable (see
+ * info_merge) so files are processed independently (in parallel) and
+ * combined afterwards.
+ */
+struct info {
+	struct stats global;
+	struct count ipproto[UINT8_MAX+1];     /* protocol is defined as 1 octet */
+	struct simple_list mpid;
+	struct simple_list CI;
+	struct simple_list location;
+	struct simple_list ports;
+	struct slab connections;               /* indexed by connection id (appended when merged) */
+	struct quantile_sketch packet_size;
+	struct quantile_sketch iat;            /* inter-arrival time (seconds) */
+	struct cardinality_sketch distinct[DISTINCT_MAX];
+	struct file_version version;
+	char* comment;                         /* NULL if unset */
+	int multiple_comments;                 /* merged streams had different comments */
+	unsigned int files;                    /* number of streams */
+
+	/* most packets comes from the same location as the previous one */
+	struct location_key last_key;
+	struct stats* last_stats[3];
+};
+
+/**
+ * Files are processed by a pool of workers and reports are printed in
+ * argument order as they complete.
+ */
+struct job {
+	const char* filename;
+	char* report;                          /* NULL if --total */
+	size_t report_size;
+	int status;
+	int done;
+};
+
+struct worker {
+	pthread_t thread;
+	struct info info;                      /* current file */
+	struct info total;                     /* all files processed by this worker (--total) */
 };
 
-static struct stats global;
-static stream_t st = NULL;
-static struct count ipproto[UINT8_MAX]; /* protocol is defined as 1 octet */
-static struct simple_list mpid = {NULL, NULL, 0, 0};
-static struct simple_list CI = {NULL, NULL, 0, 0};
-static struct simple_list location = {NULL, NULL, 0, 0};
+static int total = 0;
+static unsigned int threads = 1;
+static struct job* jobs = NULL;
+static size_t num_jobs = 0;
+static size_t next_job = 0;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
 
-static const char* shortopts = "h";
+static const char* shortopts = "t:Th";
 static struct option longopts[] = {
-	{"help",    no_argument, 0, 'h'},
+	{"threads", required_argument, 0, 't'},
+	{"total",   no_argument,       0, 'T'},
+	{"help",    no_argument,       0, 'h'},
 	{0, 0, 0, 0}, /* sentinel */
 };
 
@@ -68,6 +172,8 @@ static void show_usage(void){
 	printf("(c) 2011 David Sveningsson\n\n");
 	printf("Open a capstream and show information about it.\n");
 	printf("Usage: capinfo [OPTIONS] FILENAME..\n\n");
+	printf("  -t, --threads=N            Process N files in parallel [default: 1].\n");
+	printf("  -T, --total                Show a single report for all files.\n");
 	printf("  -h, --help                 Show this help.\n");
 	printf("\n");
 	printf("Hint: use `capfilter | capinfo` need to run capinfo on a filtered trace.\n");
@@ -81,6 +187,11 @@ static unsigned int max(unsigned int a, unsigned int b){
 	return (a>b) ? a : b;
 }
 
+static void out_of_memory(){
+	fprintf(stderr, "capinfo: out of memory\n");
+	exit(1);
+}
+
 static void reset_stats(struct stats* stat){
 	if ( !stat ) return;
 
@@ -88,13 +199,75 @@ static void reset_stats(struct stats* stat){
 	stat->bytes = 0;
 	stat->byte_min = UINT16_MAX;
 	stat->byte_max = 0;
+	stat->first.tv_sec = stat->first.tv_psec = 0;
+	stat->last.tv_sec = stat->last.tv_psec = 0;
 	stat->marker_present = 0;
+	stat->num_transport = 0; /* storage is kept */
+}
+
+static void init_stats(struct stats* stat){
+	stat->transport = NULL;
+	stat->transport_size = 0;
+	reset_stats(stat);
+}
 
-	/* reset transport protocols */
-	for ( unsigned int i = 0; i < UINT16_MAX; i++ ){
-		stat->transport[i].packets = 0;
-		stat->transport[i].bytes = 0;
+static void free_stats(struct stats* stat){
+	free(stat->transport);
+	stat->transport = NULL;
+	stat->num_transport = 0;
+	stat->transport_size = 0;
+}
+
+static unsigned int transport_lower_bound(const struct stats* stat, uint16_t proto){
+	unsigned int lo = 0;
+	unsigned int hi = stat->num_transport;
+	while ( lo < hi ){
+		const unsigned int mid = (lo + hi) / 2;
+		if ( stat->transport[mid].proto < proto ){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
+	return lo;
+}
+
+/**
+ * Find counter for protocol or NULL if no packets was seen.
+ */
+static const struct count* find_transport(const struct stats* stat, uint16_t proto){
+	const unsigned int i = transport_lower_bound(stat, proto);
+	if ( i < stat->num_transport && stat->transport[i].proto == proto ){
+		return &stat->transport[i].count;
+	}
+	return NULL;
+}
+
+/**
+ * Find or insert counter for protocol.
+ */
+static struct count* store_transport(struct stats* stat, uint16_t proto){
+	const unsigned int i = transport_lower_bound(stat, proto);
+	if ( i < stat->num_transport && stat->transport[i].proto == proto ){
+		return &stat->transport[i].count;
+	}
+
+	if ( stat->num_transport == stat->transport_size ){
+		const unsigned int size = stat->transport_size > 0 ? stat->transport_size * 2 : 8;
+		struct proto_count* tmp = realloc(stat->transport, size * sizeof(struct proto_count));
+		if ( !tmp ){
+			out_of_memory();
+		}
+		stat->transport = tmp;
+		stat->transport_size = size;
+	}
+
+	memmove(&stat->transport[i+1], &stat->transport[i], (stat->num_transport - i) * sizeof(struct proto_count));
+	stat->transport[i].proto = proto;
+	stat->transport[i].count.packets = 0;
+	stat->transport[i].count.bytes = 0;
+	stat->num_transport++;
+	return &stat->transport[i].count;
 }
 
 static void store_stats(struct stats* stat, struct cap_header* cp){
@@ -109,18 +282,108 @@ static void store_stats(struct stats* stat, struct cap_header* cp){
 	stat->byte_max = max(stat->byte_max, cp->len);
 }
 
-static void reset(){
-	reset_stats(&global);
-	for ( int i = 0; i < UINT8_MAX; i++ ){
-		ipproto[i].packets = 0;
-		ipproto[i].bytes = 0;
+static void merge_stats(struct stats* dst, const struct stats* src){
+	if ( src->packets == 0 ){
+		return;
+	}
+
+	if ( dst->packets == 0 || timecmp(&src->first, &dst->first) < 0 ){
+		dst->first = src->first;
+	}
+	if ( dst->packets == 0 || timecmp(&src->last, &dst->last) > 0 ){
+		dst->last = src->last;
+	}
+	dst->packets += src->packets;
+	dst->bytes += src->bytes;
+	dst->byte_min = min(dst->byte_min, src->byte_min);
+	dst->byte_max = max(dst->byte_max, src->byte_max);
+	if ( !dst->marker_present ){
+		dst->marker_present = src->marker_present;
+	}
+
+	for ( unsigned int i = 0; i < src->num_transport; i++ ){
+		struct count* count = store_transport(dst, src->transport[i].proto);
+		count->packets += src->transport[i].count.packets;
+		count->bytes += src->transport[i].count.bytes;
 	}
+}
+
+/**
+ * Release the stats held in a list (before the list is cleared).
+ */
+static void free_list_stats(struct simple_list* slist){
+	for ( size_t i = 0; i < slist->size; i++ ){
+		free_stats((struct stats*)slist_get(slist, i));
+	}
+}
+
+static void info_init(struct info* info){
+	const size_t initial_size = 64;
+	slist_init(&info->mpid, sizeof(info->last_key.mampid), sizeof(struct stats), initial_size);
+	slist_init(&info->CI, sizeof(info->last_key.nic), sizeof(struct stats), initial_size);
+	slist_init(&info->location, sizeof(struct location_key), sizeof(struct stats), initial_size);
+	slist_init(&info->ports, sizeof(struct port_key), sizeof(struct count), initial_size);
+	slab_init(&info->connections, sizeof(struct connection), 4096);
+	init_stats(&info->global);
+	if ( quantile_sketch_init(&info->packet_size, QUANTILE_ACCURACY, QUANTILE_BINS) != 0 ||
+	     quantile_sketch_init(&info->iat, QUANTILE_ACCURACY, QUANTILE_BINS) != 0 ){
+		out_of_memory();
+	}
+	for ( int i = 0; i < DISTINCT_MAX; i++ ){
+		if ( cardinality_sketch_init(&info->distinct[i], CARDINALITY_PRECISION) != 0 ){
+			out_of_memory();
+		}
+	}
+	info->comment = NULL;
+}
+
+/**
+ * Clear all statistics (storage is kept for the next file).
+ */
+static void info_reset(struct info* info){
+	reset_stats(&info->global);
+	for ( int i = 0; i <= UINT8_MAX; i++ ){
+		info->ipproto[i].packets = 0;
+		info->ipproto[i].bytes = 0;
+	}
+
+	free_list_stats(&info->mpid);
+	free_list_stats(&info->CI);
+	free_list_stats(&info->location);
+	slist_clear(&info->mpid);
+	slist_clear(&info->CI);
+	slist_clear(&info->location);
+	slist_clear(&info->ports);
+	slab_reset(&info->connections);
+	quantile_sketch_reset(&info->packet_size);
+	quantile_sketch_reset(&info->iat);
+	for ( int i = 0; i < DISTINCT_MAX; i++ ){
+		cardinality_sketch_reset(&info->distinct[i]);
+	}
+	memset(&info->version, 0, sizeof(struct file_version));
+	free(info->comment);
+	info->comment = NULL;
+	info->multiple_comments = 0;
+	info->files = 0;
+	info->last_stats[0] = info->last_stats[1] = info->last_stats[2] = NULL;
+}
 
-	/* reset storage (must be done for each iteration so the results is
-	 * only for the current file.) */
-	slist_clear(&mpid);
-	slist_clear(&CI);
-	slist_clear(&location);
+static void info_free(struct info* info){
+	free_stats(&info->global);
+	free_list_stats(&info->mpid);
+	free_list_stats(&info->CI);
+	free_list_stats(&info->location);
+	slist_free(&info->mpid);
+	slist_free(&info->CI);
+	slist_free(&info->location);
+	slist_free(&info->ports);
+	slab_free(&info->connections);
+	quantile_sketch_free(&info->packet_size);
+	quantile_sketch_free(&info->iat);
+	for ( int i = 0; i < DISTINCT_MAX; i++ ){
+		cardinality_sketch_free(&info->distinct[i]);
+	}
+	free(info->comment);
 }
 
 static void format_bytes(char* dst, size_t size, uint64_t bytes){
@@ -169,187 +432,407 @@ static void format_seconds(char* dst, size_t size, timepico first, timepico last
 	snprintf(dst, size, "%02d:%02d:%04.1f", h, m, s > 0 ? (float)s/10 : 0);
 }
 
-static const char* array_join(char* dst, const char* src[], size_t n, const char* delimiter){
-	char* cur = dst;
-	for ( unsigned int i = 0; i < n; i++ ){
-		cur += sprintf(cur, "%s%s", (i>0?delimiter:""), src[i]);
-	}
-	return dst;
+struct key_entry {
+	const void* key;
+	size_t key_size;
+	unsigned int index;
+};
+
+static int cmp_key(const void* a, const void* b){
+	const struct key_entry* x = (const struct key_entry*)a;
+	const struct key_entry* y = (const struct key_entry*)b;
+	return memcmp(x->key, y->key, x->key_size);
 }
 
-static const char* get_mampid_list(const char* delimiter){
-	static char buffer[2048];
-	return array_join(buffer, (const char**)mpid.key, mpid.size, delimiter);
+/**
+ * Get element indices of list, either in insertion order or sorted by key.
+ * Caller must free the array.
+ */
+static unsigned int* list_order(const struct simple_list* list, int sorted){
+	unsigned int* order = malloc((list->size + 1) * sizeof(unsigned int));
+	struct key_entry* entry = malloc((list->size + 1) * sizeof(struct key_entry));
+	if ( !order || !entry ){
+		out_of_memory();
+	}
+
+	for ( unsigned int i = 0; i < list->size; i++ ){
+		entry[i].key = slist_key(list, i);
+		entry[i].key_size = list->key_size;
+		entry[i].index = i;
+	}
+	if ( sorted ){
+		qsort(entry, list->size, sizeof(struct key_entry), cmp_key);
+	}
+	for ( unsigned int i = 0; i < list->size; i++ ){
+		order[i] = entry[i].index;
+	}
+
+	free(entry);
+	return order;
 }
 
-static const char* get_CI_list(const char* delimiter){
-	static char buffer[2048];
-	return array_join(buffer, (const char**)CI.key, CI.size, delimiter);
+static void print_list(FILE* fp, const struct simple_list* src, int sorted, const char* delimiter){
+	unsigned int* order = list_order(src, sorted);
+	for ( unsigned int i = 0; i < src->size; i++ ){
+		fprintf(fp, "%s%.*s", (i>0?delimiter:""), (int)src->key_size, (const char*)slist_key(src, order[i]));
+	}
+	free(order);
 }
 
-static const char* get_comment(stream_t st){
-	const char* comment = stream_get_comment(st);
-	return comment ? comment : "(unset)";
+static const char* get_comment(const struct info* info){
+	if ( info->multiple_comments ){
+		return "(multiple)";
+	}
+	return info->comment ? info->comment : "(unset)";
 }
 
-static void print_overview(){
+static void print_overview(FILE* fp, const struct info* info, int sorted){
+	const struct stats* global = &info->global;
 	char byte_str[128];
 	char rate_str[128];
 	char first_str[128];
 	char last_str[128];
 	char sec_str[128];
 	char marker_str[128] = "no";
-	if ( global.marker_present ){
-		sprintf(marker_str, "present on port %d", global.marker_present);
+	if ( global->marker_present ){
+		sprintf(marker_str, "present on port %d", global->marker_present);
 	}
-	const timepico time_diff = timepico_sub(global.last, global.first);
+	const timepico time_diff = timepico_sub(global->last, global->first);
 	uint64_t hseconds = time_diff.tv_sec * 10 + time_diff.tv_psec / (PICODIVIDER / 10);
-	timepico_to_string_r(&global.first, first_str, 128, "%F %T");
-	timepico_to_string_r(&global.last,  last_str,  128, "%F %T");
-	format_bytes(byte_str, 128, global.bytes);
-	format_rate(rate_str, 128, global.bytes, hseconds/10);
-	format_seconds(sec_str, 128, global.first, global.last);
-	const int local_byte_min = global.packets > 0 ? global.byte_min : 0;
-	const int local_byte_max = global.packets > 0 ? global.byte_max : 0;
-	const int local_byte_avg = global.packets > 0 ? global.bytes / global.packets : 0;
-
-	printf("Overview\n"
-	       "--------\n");
-	printf("       CI: %s\n", get_CI_list(", "));
-	printf("     mpid: %s\n", get_mampid_list(", "));
-	printf("  comment: %s\n", get_comment(st));
-	printf(" captured: %s to %s\n", first_str, last_str);
-	printf("  markers: %s\n", marker_str);
-	printf(" duration: %s (%.1f seconds)\n", sec_str, (float)hseconds/10);
-	printf("  packets: %ld\n", global.packets);
-	printf("    bytes: %s\n", byte_str);
-	printf(" pkt size: min/avg/max = %d/%d/%d\n", local_byte_min, local_byte_avg, local_byte_max);
-	printf(" avg rate: %s\n", rate_str);
-	printf("\n");
-
-	printf("Locations\n"
-	       "---------\n");
-	for ( size_t i = 0; i < location.size; i++ ){
-		const struct stats* s = (const struct stats*)slist_get(&location, i);
+	timepico_to_string_r(&global->first, first_str, 128, "%F %T");
+	timepico_to_string_r(&global->last,  last_str,  128, "%F %T");
+	format_bytes(byte_str, 128, global->bytes);
+	format_rate(rate_str, 128, global->bytes, hseconds/10);
+	format_seconds(sec_str, 128, global->first, global->last);
+	const int local_byte_min = global->packets > 0 ? global->byte_min : 0;
+	const int local_byte_max = global->packets > 0 ? global->byte_max : 0;
+	const int local_byte_avg = global->packets > 0 ? global->bytes / global->packets : 0;
+
+	fprintf(fp, "Overview\n"
+	            "--------\n");
+	fprintf(fp, "       CI: "); print_list(fp, &info->CI, sorted, ", "); fputc('\n', fp);
+	fprintf(fp, "     mpid: "); print_list(fp, &info->mpid, sorted, ", "); fputc('\n', fp);
+	fprintf(fp, "  comment: %s\n", get_comment(info));
+	fprintf(fp, " captured: %s to %s\n", first_str, last_str);
+	fprintf(fp, "  markers: %s\n", marker_str);
+	fprintf(fp, " duration: %s (%.1f seconds)\n", sec_str, (float)hseconds/10);
+	fprintf(fp, "  packets: %ld\n", global->packets);
+	fprintf(fp, "    bytes: %s\n", byte_str);
+	fprintf(fp, " pkt size: min/avg/max = %d/%d/%d\n", local_byte_min, local_byte_avg, local_byte_max);
+	fprintf(fp, " avg rate: %s\n", rate_str);
+	fprintf(fp, "\n");
+
+	fprintf(fp, "Locations\n"
+	            "---------\n");
+	unsigned int* order = list_order(&info->location, sorted);
+	for ( size_t i = 0; i < info->location.size; i++ ){
+		const struct stats* s = (const struct stats*)slist_get(&info->location, order[i]);
 		const timepico time_diff = timepico_sub(s->last, s->first);
 		uint64_t hseconds = time_diff.tv_sec * 10 + time_diff.tv_psec / (PICODIVIDER / 10);
-		format_seconds(sec_str, 128, global.first, global.last);
-		printf("  location:%s %.1f seconds, %ld packets, %ld bytes\n", (const char *)location.key[i], (float)hseconds/10, s->packets, s->bytes);
+		const struct location_key* key = (const struct location_key*)slist_key(&info->location, order[i]);
+		fprintf(fp, "  location:%.8s:%.8s %.1f seconds, %ld packets, %ld bytes\n", key->mampid, key->nic, (float)hseconds/10, s->packets, s->bytes);
 	}
-	printf("\n");
+	free(order);
+	fprintf(fp, "\n");
 }
 
-static void print_distribution(){
-	printf("Network protocols\n"
-	       "-----------------\n");
+static void print_distribution(FILE* fp, const struct info* info){
+	const struct stats* global = &info->global;
+
+	fprintf(fp, "Network protocols\n"
+	            "-----------------\n");
 
-	for ( unsigned int i = 0; i < UINT16_MAX; i++ ){
-		if ( global.transport[i].packets == 0 ) continue;
-		const struct ethertype* ethertype = ethertype_by_number(i);
+	for ( unsigned int i = 0; i < global->num_transport; i++ ){
+		const uint16_t proto = global->transport[i].proto;
+		const struct count* count = &global->transport[i].count;
+		const struct ethertype* ethertype = ethertype_by_number(proto);
 		if ( ethertype ){
-			printf("%9s: ", ethertype->name);
+			fprintf(fp, "%9s: ", ethertype->name);
 		} else {
-			printf("   0x%04X: ", i);
+			fprintf(fp, "   0x%04X: ", proto);
 		}
-		printf("%"PRIu64" packets, %"PRIu64" bytes\n", global.transport[i].packets, global.transport[i].bytes);
+		fprintf(fp, "%"PRIu64" packets, %"PRIu64" bytes\n", count->packets, count->bytes);
 	}
 
-	printf("\nTransport protocols\n"
-	       "-------------------\n");
+	fprintf(fp, "\nTransport protocols\n"
+	            "-------------------\n");
 
-	if ( global.transport[ETHERTYPE_IP].packets > 0 || global.transport[ETHERTYPE_IPV6].packets > 0 ){
+	if ( find_transport(global, ETHERTYPE_IP) || find_transport(global, ETHERTYPE_IPV6) ){
 		struct count ipother = {0, 0};
-		for ( int i = 0; i < UINT8_MAX; i++ ){
-			if ( ipproto[i].packets == 0 ){
+		for ( int i = 0; i <= UINT8_MAX; i++ ){
+			const struct count* ipproto = &info->ipproto[i];
+			if ( ipproto->packets == 0 ){
 				continue;
 			}
 
-			struct protoent* protoent = getprotobynumber(i);
+			/* reports are written by multiple threads */
+			struct protoent protoent_buf, *protoent = NULL;
+			char buf[1024];
+			getprotobynumber_r(i, &protoent_buf, buf, sizeof(buf), &protoent);
 
 			if ( !protoent ){
-				ipother.packets += ipproto[i].packets;
-				ipother.bytes   += ipproto[i].bytes;
+				ipother.packets += ipproto->packets;
+				ipother.bytes   += ipproto->bytes;
 				continue;
 			}
 
-			printf("%9s: %"PRIu64" packets, %"PRIu64" bytes\n", protoent->p_name, ipproto[i].packets, ipproto[i].bytes);
+			fprintf(fp, "%9s: %"PRIu64" packets, %"PRIu64" bytes\n", protoent->p_name, ipproto->packets, ipproto->bytes);
 		}
 		if ( ipother.packets > 0 ){
-			printf("    other: %"PRIu64" packets, %"PRIu64" bytes\n", ipother.packets, ipother.bytes);
+			fprintf(fp, "    other: %"PRIu64" packets, %"PRIu64" bytes\n", ipother.packets, ipother.bytes);
 		}
 	}
 }
 
-/**
- * Get location for this packet.
- * Returns pointer to internal buffer that will be overwritten by successive calls.
- */
-static const char* get_location(struct cap_header* cp){
-  static char buffer[17];
-  snprintf(buffer, sizeof(buffer), "%.8s:%.8s", cp->mampid, cp->nic);
-  return buffer;
+struct port_entry {
+	const struct port_key* key;
+	const struct count* count;
+};
+
+static int cmp_port(const void* a, const void* b){
+	const struct port_entry* x = (const struct port_entry*)a;
+	const struct port_entry* y = (const struct port_entry*)b;
+	if ( x->count->packets != y->count->packets ){
+		return x->count->packets < y->count->packets ? 1 : -1;
+	}
+	if ( x->key->proto != y->key->proto ){
+		return x->key->proto - y->key->proto;
+	}
+	return x->key->port - y->key->port;
 }
 
-struct cmp_data { const char* str; size_t maxlen; };
+static void print_ports(FILE* fp, const struct info* info){
+	const struct simple_list* ports = &info->ports;
 
-static int cmp(const void* cur, const void* key){
-	const struct cmp_data* data = (const struct cmp_data*)key;
-	return strncmp((const char*)cur, data->str, data->maxlen);
+	fprintf(fp, "\nPorts\n"
+	            "-----\n");
+
+	struct port_entry* order = malloc(ports->size * sizeof(struct port_entry));
+	if ( !order ) return;
+	for ( unsigned int i = 0; i < ports->size; i++ ){
+		order[i].key = (const struct port_key*)slist_key(ports, i);
+		order[i].count = (const struct count*)slist_get(ports, i);
+	}
+	qsort(order, ports->size, sizeof(struct port_entry), cmp_port);
+
+	/* only the busiest ports is shown */
+	for ( unsigned int i = 0; i < ports->size && i < TOP_PORTS; i++ ){
+		const struct port_key* key = order[i].key;
+		const struct count* count = order[i].count;
+		const char* proto = key->proto == IPPROTO_TCP ? "tcp" : "udp";
+
+		/* reports are written by multiple threads */
+		struct servent servent_buf, *servent = NULL;
+		char buf[1024];
+		getservbyport_r(htons(key->port), proto, &servent_buf, buf, sizeof(buf), &servent);
+
+		char name[16];
+		snprintf(name, sizeof(name), "%s/%d", proto, key->port);
+		fprintf(fp, "%9s: %"PRIu64" packets, %"PRIu64" bytes", name, count->packets, count->bytes);
+		if ( servent ){
+			fprintf(fp, " (%s)", servent->s_name);
+		}
+		fputc('\n', fp);
+	}
+
+	free(order);
 }
 
-static struct stats* store_unique(struct simple_list* slist, const char* key, size_t maxlen){
-	/* try to locate an existing string */
-	struct cmp_data cmp_data = {key, maxlen};
-	struct stats* existing = slist_find(slist, &cmp_data, cmp);
-	if ( existing ){
-		return existing;
+static void print_connections(FILE* fp, const struct info* info){
+	fprintf(fp, "\nConnections\n"
+	            "-----------\n");
+
+	uint64_t tcp = 0, udp = 0;
+	uint64_t packets = 0, packet_min = 0, packet_max = 0;
+	uint64_t bytes = 0, byte_min = 0, byte_max = 0;
+	for ( uint32_t id = 1; id <= info->connections.size; id++ ){
+		const struct connection* conn = (const struct connection*)slab_get(&info->connections, id);
+		if ( conn->packets == 0 ) continue; /* id not seen */
+
+		if ( conn->proto == IPPROTO_TCP ) tcp++;
+		if ( conn->proto == IPPROTO_UDP ) udp++;
+
+		if ( packets == 0 || conn->packets < packet_min ) packet_min = conn->packets;
+		if ( packets == 0 || conn->bytes < byte_min ) byte_min = conn->bytes;
+		if ( conn->packets > packet_max ) packet_max = conn->packets;
+		if ( conn->bytes > byte_max ) byte_max = conn->bytes;
+		packets += conn->packets;
+		bytes += conn->bytes;
 	}
 
-	struct stats* stats = slist_put(slist, strndup(key, maxlen));
-	reset_stats(stats);
-	return stats;
+	const uint64_t num = tcp + udp;
+	fprintf(fp, "      tcp: %"PRIu64" connections\n", tcp);
+	fprintf(fp, "      udp: %"PRIu64" connections\n", udp);
+	fprintf(fp, "  packets: min/avg/max = %"PRIu64"/%"PRIu64"/%"PRIu64" per connection\n", packet_min, num > 0 ? packets / num : 0, packet_max);
+	fprintf(fp, "    bytes: min/avg/max = %"PRIu64"/%"PRIu64"/%"PRIu64" per connection\n", byte_min, num > 0 ? bytes / num : 0, byte_max);
 }
 
-static void store_mampid(struct cap_header* cp){
-	struct stats* stats = store_unique(&mpid, cp->mampid, 8);
-	store_stats(stats, cp);
+static void print_sketches(FILE* fp, const struct info* info){
+	static const double q[3] = {0.5, 0.9, 0.99};
+	double size[3], iat[3];
+	for ( int i = 0; i < 3; i++ ){
+		size[i] = quantile_sketch_quantile(&info->packet_size, q[i]);
+		iat[i] = quantile_sketch_quantile(&info->iat, q[i]) * 1e6;
+	}
+
+	fprintf(fp, "\nQuantiles (estimated)\n"
+	            "---------------------\n");
+	fprintf(fp, " pkt size: p50/p90/p99 = %.0f/%.0f/%.0f\n", size[0], size[1], size[2]);
+	fprintf(fp, "      iat: p50/p90/p99 = %.1f/%.1f/%.1f us\n", iat[0], iat[1], iat[2]);
+
+	fprintf(fp, "\nDistinct (estimated)\n"
+	            "--------------------\n");
+	fprintf(fp, " src addr: %"PRIu64"\n", cardinality_sketch_count(&info->distinct[DISTINCT_SRC]));
+	fprintf(fp, " dst addr: %"PRIu64"\n", cardinality_sketch_count(&info->distinct[DISTINCT_DST]));
+	fprintf(fp, "    flows: %"PRIu64"\n", cardinality_sketch_count(&info->distinct[DISTINCT_FLOWS]));
+	fprintf(fp, "    ports: %"PRIu64"\n", cardinality_sketch_count(&info->distinct[DISTINCT_PORTS]));
 }
 
-static void store_CI(struct cap_header* cp){
-	struct stats* stats = store_unique(&CI, cp->nic, CAPHEAD_NICLEN);
-	store_stats(stats, cp);
+static void print_report(FILE* fp, const struct info* info, const char* title){
+	int n;
+	if ( title ){
+		n = fprintf(fp, "%s: caputils %d.%d stream\n", title, info->version.major, info->version.minor);
+	} else {
+		n = fprintf(fp, "total: %u streams\n", info->files);
+	}
+	while ( n-- ){ fputc('=', fp); } fputs("\n\n", fp);
+
+	/* merged keys are in no particular order */
+	print_overview(fp, info, title == NULL);
+	print_distribution(fp, info);
+	print_ports(fp, info);
+	print_connections(fp, info);
+	print_sketches(fp, info);
 }
 
-static void store_location(struct cap_header* cp){
-	struct stats* stats = store_unique(&location, get_location(cp), 17);
-	store_stats(stats, cp);
+/**
+ * Copy name and zero-pad it so names with garbage following the terminator
+ * yields the same key.
+ */
+static void copy_name(char* dst, const char* src, size_t size){
+	const size_t len = strnlen(src, size);
+	memcpy(dst, src, len);
+	memset(dst + len, 0, size - len);
 }
 
-static void parse_ethernetII(const struct cap_header* cp){
-	const struct ethhdr* eth = cp->ethhdr;
-	const uint16_t h_proto = ntohs(eth->h_proto);
-	global.transport[h_proto].packets++;
-	global.transport[h_proto].bytes += cp->len;
+static struct stats* store_unique(struct simple_list* slist, const void* key){
+	struct stats* stats = slist_find(slist, key, NULL);
+	if ( stats ){
+		return stats;
+	}
 
-	const struct iphdr* ip = NULL;
-	switch ( h_proto ){
-	case ETHERTYPE_VLAN:
-		ip = (const struct iphdr*)(cp->payload + sizeof(struct ether_vlan_header));
-		/** @todo handle h_proto */
-		/* fallthrough */
+	if ( !(stats=slist_put(slist, key)) ){
+		out_of_memory();
+	}
+	init_stats(stats);
+	return stats;
+}
+
+/**
+ * Store stats for mpid, CI and location of this packet.
+ */
+static void store_location(struct info* info, struct cap_header* cp){
+	struct location_key key;
+	copy_name(key.mampid, cp->mampid, sizeof(key.mampid));
+	copy_name(key.nic, cp->nic, sizeof(key.nic));
+
+	/* stats are never moved so pointers can be reused until reset */
+	if ( !info->last_stats[0] || memcmp(&key, &info->last_key, sizeof(struct location_key)) != 0 ){
+		info->last_stats[0] = store_unique(&info->mpid, key.mampid);
+		info->last_stats[1] = store_unique(&info->CI, key.nic);
+		info->last_stats[2] = store_unique(&info->location, &key);
+		info->last_key = key;
+	}
+
+	for ( int i = 0; i < 3; i++ ){
+		store_stats(info->last_stats[i], cp);
+	}
+}
+
+static struct count* store_port(struct info* info, const struct port_key* key){
+	struct count* count = slist_find(&info->ports, key, NULL);
+	if ( !count ){
+		if ( !(count=slist_put(&info->ports, key)) ){
+			out_of_memory();
+		}
+		count->packets = 0;
+		count->bytes = 0;
+	}
+	return count;
+}
 
-	case ETHERTYPE_IP:
-		if ( !ip ){
-			ip = (const struct iphdr*)(cp->payload + sizeof(struct ethhdr));
+static struct connection* store_connection(struct info* info, connection_id_t id, uint8_t proto){
+	/* ids are assigned sequentially so new ids are always at the end */
+	while ( info->connections.size < id ){
+		const uint32_t index = slab_alloc(&info->connections);
+		if ( !index ){
+			out_of_memory();
 		}
+		struct connection* conn = (struct connection*)slab_get(&info->connections, index);
+		conn->packets = 0;
+		conn->bytes = 0;
+		conn->proto = proto;
+	}
 
-		ipproto[ip->protocol].packets++;
-		ipproto[ip->protocol].bytes += cp->len;
-		break;
+	return (struct connection*)slab_get(&info->connections, id);
+}
 
-	case ETHERTYPE_IPV6:
-		/** @todo handle ipproto */
-		break;
+/**
+ * Tally network, transport, port and connection for a classified packet.
+ */
+static void parse_ethernetII(struct info* info, const struct packet_meta* meta, size_t i){
+	const struct cap_header* cp = meta->cp[i];
+	const uint16_t h_proto = ntohs(cp->ethhdr->h_proto);
+	struct count* transport = store_transport(&info->global, h_proto);
+	transport->packets++;
+	transport->bytes += cp->len;
+
+	/** @todo handle ipproto for IPv6 */
+	if ( !(meta->flags[i] & PACKET_META_IPV4) ){
+		return;
+	}
+
+	const uint8_t proto = meta->ip_proto[i];
+	info->ipproto[proto].packets++;
+	info->ipproto[proto].bytes += cp->len;
+
+	const uint32_t saddr = meta->ip_src[i];
+	const uint32_t daddr = meta->ip_dst[i];
+	cardinality_sketch_add(&info->distinct[DISTINCT_SRC], &saddr, sizeof(uint32_t));
+	cardinality_sketch_add(&info->distinct[DISTINCT_DST], &daddr, sizeof(uint32_t));
+
+	const int have_ports = meta->flags[i] & PACKET_META_PORTS;
+	const uint16_t sport = have_ports ? meta->src_port[i] : 0;
+	const uint16_t dport = have_ports ? meta->dst_port[i] : 0;
+
+	/* flows without ports (e.g. icmp) is identified by addresses and protocol */
+	const int swap = saddr > daddr || (saddr == daddr && sport > dport);
+	const struct flow_key flow = {
+		{swap ? daddr : saddr, swap ? saddr : daddr},
+		{swap ? dport : sport, swap ? sport : dport},
+		proto, {0, 0, 0}};
+	cardinality_sketch_add(&info->distinct[DISTINCT_FLOWS], &flow, sizeof(struct flow_key));
+
+	if ( !have_ports ){
+		return;
+	}
+
+	const struct port_key src_key = {proto, 0, sport};
+	const struct port_key dst_key = {proto, 0, dport};
+	cardinality_sketch_add(&info->distinct[DISTINCT_PORTS], &src_key, sizeof(struct port_key));
+	cardinality_sketch_add(&info->distinct[DISTINCT_PORTS], &dst_key, sizeof(struct port_key));
+
+	/* the lower port is assumed to be the service */
+	const struct port_key key = {proto, 0, sport < dport ? sport : dport};
+	struct count* count = store_port(info, &key);
+	count->packets++;
+	count->bytes += cp->len;
+
+	const connection_id_t id = connection_id_meta(meta, i);
+	if ( id != CONNECTION_ID_NONE ){
+		struct connection* conn = store_connection(info, id, proto);
+		conn->packets++;
+		conn->bytes += cp->len;
 	}
 }
 
@@ -357,9 +840,63 @@ static void parse_llc(const struct cap_header* cp){
 
 }
 
-static int show_info(const char* filename){
+/**
+ * Add statistics from src to dst.
+ */
+static void info_merge(struct info* dst, const struct info* src){
+	if ( src->files == 0 ){
+		return;
+	}
+
+	merge_stats(&dst->global, &src->global);
+	for ( int i = 0; i <= UINT8_MAX; i++ ){
+		dst->ipproto[i].packets += src->ipproto[i].packets;
+		dst->ipproto[i].bytes += src->ipproto[i].bytes;
+	}
+
+	const struct simple_list* list[3] = {&src->mpid, &src->CI, &src->location};
+	struct simple_list* dst_list[3] = {&dst->mpid, &dst->CI, &dst->location};
+	for ( int j = 0; j < 3; j++ ){
+		for ( size_t i = 0; i < list[j]->size; i++ ){
+			struct stats* stats = store_unique(dst_list[j], slist_key(list[j], i));
+			merge_stats(stats, (const struct stats*)slist_get(list[j], i));
+		}
+	}
+
+	for ( size_t i = 0; i < src->ports.size; i++ ){
+		const struct count* src_count = (const struct count*)slist_get(&src->ports, i);
+		struct count* count = store_port(dst, (const struct port_key*)slist_key(&src->ports, i));
+		count->packets += src_count->packets;
+		count->bytes += src_count->bytes;
+	}
+
+	quantile_sketch_merge(&dst->packet_size, &src->packet_size);
+	quantile_sketch_merge(&dst->iat, &src->iat);
+	for ( int i = 0; i < DISTINCT_MAX; i++ ){
+		cardinality_sketch_merge(&dst->distinct[i], &src->distinct[i]);
+	}
+
+	/* connections from different streams are different connections */
+	for ( uint32_t id = 1; id <= src->connections.size; id++ ){
+		const struct connection* conn = (const struct connection*)slab_get(&src->connections, id);
+		if ( conn->packets == 0 ) continue;
+		*store_connection(dst, dst->connections.size + 1, conn->proto) = *conn;
+	}
+
+	if ( dst->files == 0 ){
+		dst->version = src->version;
+		dst->comment = src->comment ? strdup(src->comment) : NULL;
+	} else if ( (dst->comment && src->comment) ? strcmp(dst->comment, src->comment) != 0 : dst->comment != src->comment ){
+		dst->multiple_comments = 1;
+	}
+	dst->multiple_comments |= src->multiple_comments;
+	dst->files += src->files;
+}
+
+static int show_info(struct info* info, const char* filename){
 	stream_addr_t addr = STREAM_ADDR_INITIALIZER;
 	stream_addr_str(&addr, filename, 0);
+	stream_t st;
 	long ret = 0;
 
 	if ( (ret=stream_open(&st, &addr, NULL, 0)) != 0 ){
@@ -367,49 +904,94 @@ static int show_info(const char* filename){
 		return ret;
 	}
 
-	struct cap_header* cp;
-	while ( (ret=stream_read(st, &cp, NULL, NULL)) == 0 ){
-		if ( !global.marker_present ){
-			global.marker_present = is_marker(cp, NULL, 0);
-		}
+	/* connection ids are only tracked within each file */
+	connection_id_reset();
+
+	/* headers are classified once per batch and all statistics are gathered
+	 * in the same pass */
+	struct packet_meta meta;
+	caphead_t batch[PACKET_META_MAX];
+	size_t count;
+	while ( (ret=stream_read_batch(st, batch, PACKET_META_MAX, &count, NULL, NULL)) == 0 ){
+		packet_meta_classify(&meta, batch, count);
+
+		for ( size_t i = 0; i < count; i++ ){
+			struct cap_header* cp = batch[i];
+			if ( !info->global.marker_present ){
+				info->global.marker_present = is_marker(cp, NULL, 0);
+			}
 
-		store_stats(&global, cp);
-		store_mampid(cp);
-		store_CI(cp);
-		store_location(cp);
-
-		/* this is not a fool-proof test since ethertypes can be < 0x05dc and
-		 * jumboframes exist. 0x05dc refers to the MTU. */
-		const int have_llc = ntohs(cp->ethhdr->h_proto) <= 0x05DC;
-		if ( have_llc ){
-			parse_llc(cp);
-			continue;
-		}
+			/* packets out of order is not counted for inter-arrival time */
+			if ( info->global.packets > 0 && timecmp(&cp->ts, &info->global.last) >= 0 ){
+				const timepico dt = timepico_sub(cp->ts, info->global.last);
+				quantile_sketch_add(&info->iat, dt.tv_sec + (double)dt.tv_psec / PICODIVIDER);
+			}
+			quantile_sketch_add(&info->packet_size, cp->len);
 
-		parse_ethernetII(cp);
+			store_stats(&info->global, cp);
+			store_location(info, cp);
+
+			/* this is not a fool-proof test since ethertypes can be < 0x05dc and
+			 * jumboframes exist. 0x05dc refers to the MTU. */
+			const int have_llc = ntohs(cp->ethhdr->h_proto) <= 0x05DC;
+			if ( have_llc ){
+				parse_llc(cp);
+				continue;
+			}
+
+			parse_ethernetII(info, &meta, i);
+		}
 	}
 
 	if ( ret > 0 ){
 		fprintf(stderr, "stream_read() returned 0x%08lx: %s\n", ret, caputils_error_string(ret));
 	}
 
-	/* write header */
-	struct file_version version;
-	stream_get_version(st, &version);
-	int n = printf("%s: caputils %d.%d stream\n", filename, version.major, version.minor);
-	while ( n-- ){ putchar('='); } puts("\n");
-
-	print_overview();
-	print_distribution();
+	const char* comment = stream_get_comment(st);
+	info->comment = comment ? strdup(comment) : NULL;
+	stream_get_version(st, &info->version);
+	info->files = 1;
 
 	stream_close(st);
 	stream_addr_reset(&addr);
 	return 0;
 }
 
-static int process(const char* filename){
-	reset();
-	return show_info(filename);
+static void* worker_run(void* arg){
+	struct worker* worker = (struct worker*)arg;
+
+	for (;;){
+		pthread_mutex_lock(&job_lock);
+		struct job* job = next_job < num_jobs ? &jobs[next_job++] : NULL;
+		pthread_mutex_unlock(&job_lock);
+		if ( !job ) break;
+
+		info_reset(&worker->info);
+		job->status = show_info(&worker->info, job->filename);
+
+		if ( job->status == 0 ){
+			if ( total ){
+				info_merge(&worker->total, &worker->info);
+			} else {
+				FILE* fp = open_memstream(&job->report, &job->report_size);
+				if ( !fp ){
+					out_of_memory();
+				}
+				print_report(fp, &worker->info, job->filename);
+				fclose(fp);
+			}
+		}
+
+		pthread_mutex_lock(&job_lock);
+		job->done = 1;
+		pthread_cond_broadcast(&job_done);
+		pthread_mutex_unlock(&job_lock);
+	}
+
+	/* release connection tracking state of this thread */
+	connection_id_reset();
+
+	return NULL;
 }
 
 int main(int argc, char* argv[]){
@@ -420,39 +1002,104 @@ int main(int argc, char* argv[]){
 	/* parse arguments */
 	while ( (op=getopt_long(argc, argv, shortopts, longopts, &option_index)) != -1 ){
 		switch ( op ){
+		case 't': /* --threads */
+			{
+				unsigned long n;
+				if ( parse_unsigned(optarg, MAX_THREADS, &n) != 0 || n < 1 ){
+					fprintf(stderr, "capinfo: threads must be between 1 and %d.\n", MAX_THREADS);
+					return 1;
+				}
+				threads = n;
+			}
+			break;
+
+		case 'T': /* --total */
+			total = 1;
+			break;
+
 		case 'h':
 			show_usage();
 			return 0;
+
+		default:
+			return 1;
 		}
 	}
 
-	/* initial storage */
-	const size_t initial_size = 80;
-	slist_init(&mpid, sizeof(char*), sizeof(struct stats), initial_size);
-	slist_init(&CI, sizeof(char*), sizeof(struct stats), initial_size);
-	slist_init(&location, sizeof(char*), sizeof(struct stats), initial_size);
-
 	/* no positional arguments, try to process stdin */
-	if ( optind == argc ){
+	static const char* const stdin_filename = "/dev/stdin";
+	const char* const* filenames = (const char* const*)&argv[optind];
+	num_jobs = argc - optind;
+	if ( num_jobs == 0 ){
 		if ( isatty(STDIN_FILENO) ){
 			show_usage();
-		} else {
-			status = process("/dev/stdin");
+			return 0;
 		}
+		filenames = &stdin_filename;
+		num_jobs = 1;
+	}
+
+	jobs = calloc(num_jobs, sizeof(struct job));
+	if ( !jobs ){
+		out_of_memory();
+	}
+	for ( size_t i = 0; i < num_jobs; i++ ){
+		jobs[i].filename = filenames[i];
 	}
 
 	/* visit all targets */
-	while ( optind < argc ){
-		status |= process(argv[optind++]);
-		if ( optind < argc ){
+	const size_t num_workers = threads < num_jobs ? threads : num_jobs;
+	struct worker* worker = calloc(num_workers, sizeof(struct worker));
+	if ( !worker ){
+		out_of_memory();
+	}
+	for ( size_t i = 0; i < num_workers; i++ ){
+		info_init(&worker[i].info);
+		info_init(&worker[i].total);
+		info_reset(&worker[i].total);
+		if ( (errno=pthread_create(&worker[i].thread, NULL, worker_run, &worker[i])) != 0 ){
+			fprintf(stderr, "capinfo: pthread_create() failed: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	/* reports are written in argument order */
+	for ( size_t i = 0; i < num_jobs; i++ ){
+		pthread_mutex_lock(&job_lock);
+		while ( !jobs[i].done ){
+			pthread_cond_wait(&job_done, &job_lock);
+		}
+		pthread_mutex_unlock(&job_lock);
+
+		status |= jobs[i].status;
+		if ( i > 0 && !total ){
 			putchar('\n');
 		}
+		if ( jobs[i].report ){
+			fwrite(jobs[i].report, 1, jobs[i].report_size, stdout);
+			free(jobs[i].report);
+		}
+	}
+
+	for ( size_t i = 0; i < num_workers; i++ ){
+		pthread_join(worker[i].thread, NULL);
+	}
+
+	/* reduce */
+	if ( total ){
+		for ( size_t i = 1; i < num_workers; i++ ){
+			info_merge(&worker[0].total, &worker[i].total);
+		}
+		print_report(stdout, &worker[0].total, NULL);
 	}
 
 	/* release resources */
-	slist_free(&mpid);
-	slist_free(&CI);
-	slist_free(&location);
+	for ( size_t i = 0; i < num_workers; i++ ){
+		info_free(&worker[i].info);
+		info_free(&worker[i].total);
+	}
+	free(worker);
+	free(jobs);
 
 	return status == 0 ? 0 : 1;
 }
@@ -23,22 +23,32 @@
 
 #include "caputils/caputils.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
 
 static const char* program_name;
-static FILE* sort = NULL;
+static int sort = 0;
+static size_t sort_memory = 256;        /* memory used for sorting (MB) */
+static unsigned int sort_threads = 1;   /* threads sorting runs */
+static const char* tmpdir = NULL;
 static int quiet = 0;
 
-static const char* shortopts = "o:c:sqh";
+static const char* shortopts = "o:c:sm:t:T:qh";
 static struct option longopts[] = {
-	{"output",     required_argument, 0, 'o'},
-	{"comment",    required_argument, 0, 'c'},
-	{"sort",       no_argument,       0, 's'},
-	{"quiet",      no_argument,       0, 'q'},
-	{"help",       no_argument,       0, 'h'},
+	{"output",      required_argument, 0, 'o'},
+	{"comment",     required_argument, 0, 'c'},
+	{"sort",        no_argument,       0, 's'},
+	{"sort-memory", required_argument, 0, 'm'},
+	{"threads",     required_argument, 0, 't'},
+	{"tmpdir",      required_argument, 0, 'T'},
+	{"quiet",       no_argument,       0, 'q'},
+	{"help",        no_argument,       0, 'h'},
 	{0,0,0,0},
 };
 
@@ -46,11 +56,15 @@ static void show_usage(){
 	printf("capmerge-%s\n", caputils_version(NULL));
 	printf("usage: %s [OPTIONS..] -o OUTPUT FILES..\n"
 	       "\n"
-	       "  -o, --output=FILE    Write merged file to FILE.\n"
-	       "  -c, --comment=STRING Set stream comment.\n"
-	       "  -s, --sort           Sort out-of-order packets based on timestamp.\n"
-	       "  -q, --quiet          Quiet output (no progressbar)\n"
-	       "  -h, --help           This text.\n",
+	       "  -o, --output=FILE      Write merged file to FILE.\n"
+	       "  -c, --comment=STRING   Set stream comment.\n"
+	       "  -s, --sort             Sort out-of-order packets based on timestamp.\n"
+	       "  -m, --sort-memory=MB   Memory used for sorting, larger traces are sorted\n"
+	       "                         in runs stored in temporary files [default: 256].\n"
+	       "  -t, --threads=N        Sort runs using N threads [default: 1].\n"
+	       "  -T, --tmpdir=DIR       Store temporary files in DIR [default: $TMPDIR or /tmp].\n"
+	       "  -q, --quiet            Quiet output (no progressbar)\n"
+	       "  -h, --help             This text.\n",
 	       program_name);
 }
 
@@ -58,10 +72,393 @@ static size_t min(size_t a, size_t b){
 	return (a<b)?a:b;
 }
 
+/**
+ * Input stream and the timestamp of its next packet. Sources with a packet
+ * available are kept in a min-heap ordered by timestamp so only the stream
+ * which was just consumed has to be peeked again. Ties are broken by position
+ * on the command-line.
+ */
+struct source {
+	stream_t st;
+	int index;
+	timepico ts;
+};
+
+static int source_less(const struct source* a, const struct source* b){
+	const int c = timecmp(&a->ts, &b->ts);
+	return c < 0 || (c == 0 && a->index < b->index);
+}
+
+static void heap_sift_up(struct source* heap, size_t i){
+	while ( i > 0 ){
+		const size_t parent = (i - 1) / 2;
+		if ( !source_less(&heap[i], &heap[parent]) ) break;
+		struct source tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+static void heap_sift_down(struct source* heap, size_t n, size_t i){
+	for (;;){
+		const size_t left = 2 * i + 1;
+		const size_t right = left + 1;
+		size_t smallest = i;
+		if ( left  < n && source_less(&heap[left],  &heap[smallest]) ) smallest = left;
+		if ( right < n && source_less(&heap[right], &heap[smallest]) ) smallest = right;
+		if ( smallest == i ) break;
+		struct source tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+/**
+ * Peek at next packet in source.
+ * @return 1 if a packet is available (ts is updated), 0 if no packet is
+ *         available yet and -1 if stream is closed.
+ */
+static int source_peek(struct source* src){
+	struct cap_header* cp;
+	int ret;
+	switch ( (ret=stream_peek(src->st, &cp, NULL)) ){
+	case 0:
+		src->ts = cp->ts;
+		return 1;
+
+	case EAGAIN:
+		return 0;
+
+	default:
+		stream_close(src->st);
+		if ( ret != -1 ){
+			fprintf(stderr, "%s: stream_peek(..) returned %d: %s\n", program_name, ret, caputils_error_string(ret));
+		}
+		return -1;
+	}
+}
+
+typedef void (*packet_func)(void* context, struct cap_header* cp);
+
+/**
+ * Merge packets from all sources in timestamp order, passing each packet to func.
+ * All sources are closed when finished.
+ * @return Number of packets.
+ */
+static unsigned long merge(struct source* pending, size_t num_pending, packet_func func, void* context){
+	struct source heap[num_pending];
+	size_t num_heap = 0;
+	unsigned long packets = 0;
+
+	while ( num_heap + num_pending > 0 ){
+		/* retry streams which had no packet available */
+		for ( size_t i = 0; i < num_pending; ){
+			switch ( source_peek(&pending[i]) ){
+			case 1:
+				heap[num_heap] = pending[i];
+				heap_sift_up(heap, num_heap++);
+				/* fallthrough */
+			case -1:
+				pending[i] = pending[--num_pending];
+				break;
+			default:
+				i++;
+			}
+		}
+
+		/* no packet was found */
+		if ( num_heap == 0 ){
+			continue;
+		}
+
+		/* oldest packet is at the top of the heap */
+		struct source* top = &heap[0];
+		struct cap_header* cp;
+		stream_read(top->st, &cp, NULL, NULL);
+
+		packets++;
+		cp->caplen = min(cp->caplen, cp->len); /* truncate when caplen > len */
+		func(context, cp);
+
+		/* only the consumed stream has to be peeked again */
+		switch ( source_peek(top) ){
+		case 1:
+			heap_sift_down(heap, num_heap, 0);
+			break;
+
+		case 0:
+			pending[num_pending++] = *top;
+			/* fallthrough */
+		case -1:
+			heap[0] = heap[--num_heap];
+			heap_sift_down(heap, num_heap, 0);
+			break;
+		}
+	}
+
+	return packets;
+}
+
+static void write_packet(void* context, struct cap_header* cp){
+	stream_t dst = (stream_t)context;
+	int ret;
+	if ( (ret=stream_write(dst, cp, sizeof(struct cap_header) + cp->caplen)) != 0 ){
+		fprintf(stderr, "%s: stream_write(..) returned %d: %s\n", program_name, ret, caputils_error_string(ret));
+		stream_close(dst);
+		exit(1);
+	}
+}
+
+/**
+ * External sort: packets are buffered until the sort memory is exhausted,
+ * then the buffer is sorted and written to a temporary capfile (a run) by a
+ * separate thread while the next buffer is filled. When all packets are read
+ * the runs are merged using the same heap merge as the input files. If all
+ * packets fits in the first buffer it is written directly to the output.
+ *
+ * Packets with identical timestamps keep their relative order, within a run
+ * by buffer position and between runs by run number.
+ */
+struct sort_entry {
+	timepico ts;
+	const struct cap_header* cp;
+};
+
+struct run {
+	char* data;
+	size_t size;                 /* capacity of data (including index) */
+	size_t used;
+	struct sort_entry* index;    /* first entry (valid after sorting) */
+	struct sort_entry* index_end;
+	size_t num_packets;
+
+	unsigned int id;
+	pthread_t thread;
+	int running;
+	int result;
+};
+
+struct sorter {
+	struct run* run;             /* one buffer per thread */
+	unsigned int cur;
+	unsigned int num_runs;       /* runs written to disk */
+};
+
+static char run_dir[PATH_MAX - 32] = {0,};
+static unsigned int num_run_files = 0;
+
+static void run_filename(char* dst, size_t size, unsigned int id){
+	snprintf(dst, size, "%s/run-%05u.cap", run_dir, id);
+}
+
+/* remove temporary files, also called at exit */
+static void run_cleanup(void){
+	if ( run_dir[0] == 0 ) return;
+
+	for ( unsigned int i = 0; i < num_run_files; i++ ){
+		char filename[PATH_MAX];
+		run_filename(filename, sizeof(filename), i);
+		unlink(filename);
+	}
+
+	rmdir(run_dir);
+	run_dir[0] = 0;
+}
+
+static int sort_entry_cmp(const void* a, const void* b){
+	const struct sort_entry* x = (const struct sort_entry*)a;
+	const struct sort_entry* y = (const struct sort_entry*)b;
+	const int c = timecmp(&x->ts, &y->ts);
+	if ( c != 0 ) return c;
+	return (x->cp > y->cp) - (x->cp < y->cp); /* stable: buffer position */
+}
+
+static void run_sort(struct run* run){
+	run->index = run->index_end - run->num_packets;
+	qsort(run->index, run->num_packets, sizeof(struct sort_entry), sort_entry_cmp);
+}
+
+static int run_write(const struct run* run, stream_t st){
+	int ret;
+	for ( size_t i = 0; i < run->num_packets; i++ ){
+		const struct cap_header* cp = run->index[i].cp;
+		if ( (ret=stream_write(st, cp, sizeof(struct cap_header) + cp->caplen)) != 0 ){
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static void* run_spill(void* arg){
+	struct run* run = (struct run*)arg;
+	char filename[PATH_MAX];
+	run_filename(filename, sizeof(filename), run->id);
+	run_sort(run);
+
+	stream_t st;
+	stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+	stream_addr_str(&addr, filename, 0);
+	if ( (run->result=stream_create(&st, &addr, NULL, "CONV", "capmerge sort run")) != 0 ){
+		return NULL;
+	}
+
+	run->result = run_write(run, st);
+	stream_close(st);
+	return NULL;
+}
+
+static void run_join(struct run* run){
+	if ( !run->running ) return;
+
+	pthread_join(run->thread, NULL);
+	run->running = 0;
+	run->used = 0;
+	run->num_packets = 0;
+
+	if ( run->result != 0 ){
+		char filename[PATH_MAX];
+		run_filename(filename, sizeof(filename), run->id);
+		fprintf(stderr, "%s: failed to write sort run `%s': %s\n", program_name, filename, caputils_error_string(run->result));
+		exit(1);
+	}
+}
+
+/**
+ * Write current buffer as a new run (in background) and switch to next buffer.
+ */
+static void sorter_flush(struct sorter* sorter){
+	struct run* run = &sorter->run[sorter->cur];
+
+	/* temporary directory is created when the first run is written */
+	if ( run_dir[0] == 0 ){
+		snprintf(run_dir, sizeof(run_dir), "%s/capmerge.XXXXXX", tmpdir);
+		if ( !mkdtemp(run_dir) ){
+			fprintf(stderr, "%s: failed to create temporary directory in `%s': %s\n", program_name, tmpdir, strerror(errno));
+			run_dir[0] = 0;
+			exit(1);
+		}
+	}
+
+	if ( !quiet ){
+		fprintf(stderr, "%s: writing sort run %u (%zd packets)\n", program_name, sorter->num_runs, run->num_packets);
+	}
+
+	run->id = sorter->num_runs++;
+	num_run_files = sorter->num_runs;
+	run->running = 1;
+	if ( (errno=pthread_create(&run->thread, NULL, run_spill, run)) != 0 ){
+		fprintf(stderr, "%s: pthread_create() failed: %s\n", program_name, strerror(errno));
+		exit(1);
+	}
+
+	/* wait for next buffer to be available */
+	sorter->cur = (sorter->cur + 1) % sort_threads;
+	run_join(&sorter->run[sorter->cur]);
+}
+
+static void sort_packet(void* context, struct cap_header* cp){
+	struct sorter* sorter = (struct sorter*)context;
+	const size_t bytes = sizeof(struct cap_header) + cp->caplen;
+	struct run* run = &sorter->run[sorter->cur];
+
+	/* the index is stored at the end of the buffer, growing downwards */
+	const size_t index_size = (run->num_packets + 1) * sizeof(struct sort_entry);
+	if ( run->used + bytes + index_size > run->size ){
+		if ( run->num_packets == 0 ){
+			fprintf(stderr, "%s: packet of %zd bytes does not fit in sort memory.\n", program_name, bytes);
+			exit(1);
+		}
+		sorter_flush(sorter);
+		run = &sorter->run[sorter->cur];
+	}
+
+	struct cap_header* dst = (struct cap_header*)(run->data + run->used);
+	memcpy(dst, cp, bytes);
+	run->used += bytes;
+
+	struct sort_entry* entry = run->index_end - ++run->num_packets;
+	entry->ts = cp->ts;
+	entry->cp = dst;
+}
+
+static void sorter_init(struct sorter* sorter){
+	const size_t size = sort_memory * 1024 * 1024 / sort_threads;
+
+	sorter->cur = 0;
+	sorter->num_runs = 0;
+	sorter->run = calloc(sort_threads, sizeof(struct run));
+	for ( unsigned int i = 0; i < sort_threads; i++ ){
+		struct run* run = &sorter->run[i];
+		if ( !(run->data = malloc(size)) ){
+			fprintf(stderr, "%s: failed to allocate %zd bytes of sort memory.\n", program_name, size);
+			exit(1);
+		}
+		/* index is aligned at end of buffer */
+		run->size = size - size % sizeof(struct sort_entry);
+		run->index_end = (struct sort_entry*)(run->data + run->size);
+	}
+}
+
+static void sorter_free(struct sorter* sorter){
+	for ( unsigned int i = 0; i < sort_threads; i++ ){
+		free(sorter->run[i].data);
+	}
+	free(sorter->run);
+}
+
+/**
+ * Write sorted packets to output, either directly from memory or by merging
+ * the runs written to disk.
+ */
+static void sorter_finish(struct sorter* sorter, stream_t dst){
+	struct run* run = &sorter->run[sorter->cur];
+
+	/* all packets fits in memory */
+	if ( sorter->num_runs == 0 ){
+		run_sort(run);
+
+		int ret;
+		if ( (ret=run_write(run, dst)) != 0 ){
+			fprintf(stderr, "%s: stream_write(..) returned %d: %s\n", program_name, ret, caputils_error_string(ret));
+			exit(1);
+		}
+		return;
+	}
+
+	if ( run->num_packets > 0 ){
+		sorter_flush(sorter);
+	}
+	for ( unsigned int i = 0; i < sort_threads; i++ ){
+		run_join(&sorter->run[i]);
+	}
+
+	if ( !quiet ){
+		fprintf(stderr, "%s: merging %u sort runs\n", program_name, sorter->num_runs);
+	}
+
+	struct source src[sorter->num_runs];
+	for ( unsigned int i = 0; i < sorter->num_runs; i++ ){
+		char filename[PATH_MAX];
+		run_filename(filename, sizeof(filename), i);
+
+		stream_addr_t addr = STREAM_ADDR_INITIALIZER;
+		stream_addr_str(&addr, filename, 0);
+
+		int ret;
+		src[i].index = i;
+		if ( (ret=stream_open(&src[i].st, &addr, NULL, 0)) != 0 ){
+			fprintf(stderr, "%s: failed to open sort run `%s': %s\n", program_name, filename, caputils_error_string(ret));
+			exit(1);
+		}
+	}
+
+	merge(src, sorter->num_runs, write_packet, dst);
+}
+
 int main(int argc, char* argv[]){
 	const char* comment = "capmerge-" VERSION " stream";
-	char* sort_buffer = NULL;
-	size_t sort_size = 0;
 	stream_addr_t output = STREAM_ADDR_INITIALIZER;
 	stream_addr_str(&output, "/dev/stdout", 0);
 
@@ -89,7 +486,41 @@ int main(int argc, char* argv[]){
 			break;
 
 		case 's': /* --sort */
-			sort = open_memstream(&sort_buffer, &sort_size);
+			sort = 1;
+			break;
+
+		case 'm': /* --sort-memory */
+			{
+				unsigned long mb;
+				if ( parse_unsigned(optarg, SIZE_MAX / (1024 * 1024), &mb) != 0 ){
+					fprintf(stderr, "%s: invalid value for --sort-memory: `%s'\n", program_name, optarg);
+					exit(1);
+				}
+				if ( mb < 1 ){
+					fprintf(stderr, "%s: --sort-memory must be at least 1 MB.\n", program_name);
+					exit(1);
+				}
+				sort_memory = mb;
+			}
+			break;
+
+		case 't': /* --threads */
+			{
+				unsigned long n;
+				if ( parse_unsigned(optarg, UINT_MAX, &n) != 0 ){
+					fprintf(stderr, "%s: invalid value for --threads: `%s'\n", program_name, optarg);
+					exit(1);
+				}
+				if ( n < 1 ){
+					fprintf(stderr, "%s: --threads must be at least 1.\n", program_name);
+					exit(1);
+				}
+				sort_threads = n;
+			}
+			break;
+
+		case 'T': /* --tmpdir */
+			tmpdir = optarg;
 			break;
 
 		case 'q': /* --quiet */
@@ -106,6 +537,13 @@ int main(int argc, char* argv[]){
 		}
 	}
 
+	if ( !tmpdir ){
+		tmpdir = getenv("TMPDIR");
+	}
+	if ( !tmpdir ){
+		tmpdir = "/tmp";
+	}
+
 	int ret;
 
 	/* cannot output to stdout if it is a terminal */
@@ -119,22 +557,21 @@ int main(int argc, char* argv[]){
 
 	/* open output stream */
 	stream_t dst;
-	stream_addr_t real_addr = output;
-	if ( sort ) stream_addr_fp(&real_addr, sort, STREAM_ADDR_FCLOSE);
-	if ( (ret=stream_create(&dst, &real_addr, NULL, "CONV", comment)) != 0 ){
+	if ( (ret=stream_create(&dst, &output, NULL, "CONV", comment)) != 0 ){
 		fprintf(stderr, "stream_create() failed with code 0x%08X: %s\n", ret, caputils_error_string(ret));
 		return 1;
 	}
 
-	/* open input streams */
+	/* open input streams, all starts as pending (not peeked yet) */
 	const size_t files = argc - optind;
-	stream_t st[files];
+	struct source src[files];
 	for ( int i = optind, n = 0; i < argc; i++, n++ ){
 		stream_addr_t addr = STREAM_ADDR_INITIALIZER;
 		stream_addr_str(&addr, argv[i], 0);
 
+		src[n].index = n;
 		int ret;
-		if ( (ret=stream_open(&st[n], &addr, NULL, 0)) != 0 ){
+		if ( (ret=stream_open(&src[n].st, &addr, NULL, 0)) != 0 ){
 			fprintf(stderr, "%s: when opening `%s':\n", program_name, argv[i]);
 			fprintf(stderr, "%s:   stream_open(..) returned %d: %s\n", program_name, ret, caputils_error_string(ret));
 			exit(1);
@@ -142,124 +579,18 @@ int main(int argc, char* argv[]){
 	}
 
 	/* read packets */
-	unsigned int streams = files;
-	unsigned long packets = 0;
-	while ( streams > 0 ){
-		struct cap_header* pkt[streams];
-
-		/* take a peek at all open streams */
-		for ( unsigned int i = 0; i < streams; i++ ){
-			int ret;
-			switch ( (ret=stream_peek(st[i], &pkt[i], NULL)) ){
-			case 0:
-				break;
-
-			case EAGAIN:
-				pkt[i] = NULL;
-				break;
-
-			default:
-				pkt[i] = NULL;
-				stream_close(st[i]);
-				st[i] = st[streams-1];
-				streams--;
-				if ( ret != -1 ){
-					fprintf(stderr, "%s: stream_peek(..) returned %d: %s\n", program_name, ret, caputils_error_string(ret));
-				}
-			}
-		}
-
-		/* find newest packet */
-		int oldest = -1;
-		timepico cur = {-1, -1};
-		for ( unsigned int i = 0; i < streams; i++ ){
-			if ( pkt[i] && timecmp(&pkt[i]->ts, &cur) < 0 ){
-				oldest = i;
-				cur = pkt[i]->ts;
-			}
-		}
-
-		/* no packet was found */
-		if ( oldest < 0 ){
-			continue;
-		}
-
-		struct cap_header* cp;
-		stream_read(st[oldest], &cp, NULL, NULL);
-
-		packets++;
-		cp->caplen = min(cp->caplen, cp->len); /* truncate when caplen > len */
-		if ( (ret=stream_write(dst, cp, sizeof(struct cap_header) + cp->caplen)) != 0 ){
-			fprintf(stderr, "%s: stream_write(..) returned %d: %s\n", program_name, ret, caputils_error_string(ret));
-			stream_close(dst);
-			exit(1);
-		}
+	if ( !sort ){
+		merge(src, files, write_packet, dst);
+	} else {
+		struct sorter sorter;
+		atexit(run_cleanup);
+		sorter_init(&sorter);
+		merge(src, files, sort_packet, &sorter);
+		sorter_finish(&sorter, dst);
+		sorter_free(&sorter);
+		run_cleanup();
 	}
 
-	for ( unsigned int i = 0; i < streams; i++ ){
-		stream_close(st[i]);
-	}
 	stream_close(dst);
-
-	if ( sort ){
-		if ( !quiet ){
-			fprintf(stderr, "%s starting sort of %zd bytes\n", program_name, sort_size);
-		}
-
-		if ( (ret=stream_create(&dst, &output, NULL, "CONV", comment)) != 0 ){
-			fprintf(stderr, "stream_create() failed with code 0x%08X: %s\n", ret, caputils_error_string(ret));
-			return 1;
-		}
-
-		struct file_header_t* fh = (struct file_header_t*)sort_buffer;
-		char* begin = sort_buffer + fh->header_offset + fh->comment_size;
-		char* end = sort_buffer + sort_size;
-
-		unsigned long int written = 0;
-		do {
-			struct cap_header* pkt = NULL;
-			timepico cur = {-1, -1};
-
-			/* recalculate begin pointer */
-			do {
-				struct cap_header* cp = (struct cap_header*)begin;
-				if ( cp->len > 0 ) break;
-				begin += cp->caplen + sizeof(struct cap_header);
-			} while ( begin < end );
-
-			/* find "smallest" packet, i.e. packet will smallest timestamp */
-			char* ptr = begin;
-			while ( ptr < end ){
-				struct cap_header* cp = (struct cap_header*)ptr;
-				if ( cp->len > 0 && timecmp(&cur, &cp->ts) > 0 ){
-					pkt = cp;
-					cur = cp->ts;
-				}
-
-				ptr += cp->caplen + sizeof(struct cap_header);
-			}
-
-			/* stop if there is no more packets */
-			if ( !pkt ) break;
-
-			/* copy */
-			written++;
-			stream_copy(dst, pkt);
-			pkt->len = 0;
-
-			if ( !quiet && (written % 250 == 0) ){
-				fprintf(stderr, "\r%lu / %lu (%p - %p)", written, packets, begin, end);
-				fflush(stderr);
-			}
-		} while ( 1 );
-
-		if ( !quiet ){
-			fprintf(stderr, "\r%lu / %lu (%p - %p)\n", written, packets, begin, end);
-			fflush(stderr);
-		}
-		stream_close(dst);
-		free(sort_buffer);
-	}
-
 	return 0;
 }
@@ -215,6 +215,28 @@ int main(int argc, char **argv){
 	struct format format;
 	format_setup(&format, flags);
 
+	/* limit reading to start and end time if the capfile is indexed. Relative
+	 * timestamps and packet numbers still refers to the beginning of the
+	 * trace. */
+	timepico start, end;
+	cap_head* first;
+	const int window = max_packets == 0 ? filter_time_window(&filter, &start, &end) : 0;
+	if ( (window & FILTER_START_TIME) && stream_peek(stream, &first, NULL) == 0 ){
+		const timepico ref = first->ts;
+		if ( (ret=stream_seek_time(stream, start)) == 0 ){
+			format.ref = ref;
+			format.first = 0;
+			format.pktcount = stat->read;
+		} else if ( ret != ENOENT ){
+			fprintf(stderr, "%s: ignoring capfile index: %s\n", program_name, caputils_error_string(ret));
+		}
+	}
+	if ( window & FILTER_END_TIME ){
+		if ( (ret=stream_stop_time(stream, end)) != 0 && ret != ENOENT ){
+			fprintf(stderr, "%s: ignoring capfile index: %s\n", program_name, caputils_error_string(ret));
+		}
+	}
+
 	uint64_t matched = 0;
 	while ( keep_running ) {
 		/* A short timeout is used to allow the application to "breathe", i.e